@@ -0,0 +1,85 @@
+# Runs the workloads of rvfs_load through an RVFS mount, through a
+# mount with versioning off (RVFS_PASSTHROUGH=1) and on a bare
+# directory, then compares them with compare.py.
+#
+# Run from benchmarking/ as an ordinary user, vfs refuses root. VFS and
+# LOAD name the binaries, ../src/vfs and ../src/rvfs_load by default.
+# The results are in scratch_dir/results, a <mode>.json for each mode,
+# one line per workload, and rvfs.stats, the stats of the RVFS mount.
+
+SCRATCH_DIR=$1
+VFS=`readlink -f ${VFS:-../src/vfs}`
+LOAD=`readlink -f ${LOAD:-../src/rvfs_load}`
+USAGE="script scratch_dir"
+
+if [ -z $SCRATCH_DIR ]
+then
+	echo $USAGE
+	exit 1
+fi
+
+mkdir -p $SCRATCH_DIR
+SCRATCH_DIR=`readlink -f $SCRATCH_DIR`
+RESULTS_DIR=$SCRATCH_DIR/results
+rm -Rf $RESULTS_DIR
+mkdir $RESULTS_DIR
+
+# workloads MODE DIR ROOT_DIR: the same for every mode, then the space
+# the files and versions in ROOT_DIR take
+workloads()
+{
+	OUT=$RESULTS_DIR/$1.json
+	echo "Running the workloads on "$2" as "$1
+	$LOAD -l $1 -w commit -n 1000 -f 50 -b 4096 $2 >> $OUT
+	$LOAD -l $1 -w seqwrite -n 1024 -b 65536 $2 >> $OUT
+	$LOAD -l $1 -w seqread -n 1024 -s 67108864 -b 65536 $2 >> $OUT
+	$LOAD -l $1 -w randread -n 4096 -s 67108864 -b 4096 $2 >> $OUT
+	$LOAD -l $1 -w randwrite -n 4096 -s 67108864 -b 4096 $2 >> $OUT
+	$LOAD -l $1 -w readdir -n 200 -f 1000 $2 >> $OUT
+	$LOAD -l $1 -w replay -i INDEX -D data $2 >> $OUT
+	echo "Space taken (in bytes): "`du -sb $3 | cut -f 1`
+}
+
+# mounted MODE [VAR=value]: a fresh root mounted, with VAR in the
+# environment of vfs, and the workloads run through it
+mounted()
+{
+	ROOT_DIR=$SCRATCH_DIR/$1-root
+	MOUNT_DIR=$SCRATCH_DIR/$1-mnt
+	rm -Rf $ROOT_DIR $MOUNT_DIR
+	mkdir $ROOT_DIR $MOUNT_DIR
+
+	echo "Mounting "$ROOT_DIR" to "$MOUNT_DIR
+	# vfs writes vfs.log and vfs.stats in the directory it starts from
+	(cd $SCRATCH_DIR && env $2 $VFS $ROOT_DIR $MOUNT_DIR)
+	for i in `seq 50`
+	do
+		mountpoint -q $MOUNT_DIR && break
+		sleep 0.1
+	done
+	if ! mountpoint -q $MOUNT_DIR
+	then
+		echo "Cannot mount "$MOUNT_DIR
+		exit 1
+	fi
+
+	workloads $1 $MOUNT_DIR $ROOT_DIR
+
+	# vfs finishes the queued commits and writes vfs.stats, then exits
+	fusermount -u $MOUNT_DIR
+	while pgrep -f "$VFS $ROOT_DIR" > /dev/null
+	do
+		sleep 0.1
+	done
+}
+
+mounted rvfs
+mv $SCRATCH_DIR/vfs.stats $RESULTS_DIR/rvfs.stats
+mounted passthrough RVFS_PASSTHROUGH=1
+
+BARE_DIR=$SCRATCH_DIR/bare
+rm -Rf $BARE_DIR
+mkdir $BARE_DIR
+workloads bare $BARE_DIR $BARE_DIR
+
+python compare.py $RESULTS_DIR/bare.json $RESULTS_DIR/passthrough.json $RESULTS_DIR/rvfs.json
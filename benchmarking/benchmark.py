@@ -1,5 +1,6 @@
 import random
 import os
+import sys
 import time
 # Benchmarks the files
 
@@ -37,9 +38,10 @@ S_DIFF = 0
 M_DIFF = 1
 L_DIFF = 2
 
-# Prefix for the work to be done
+# Prefix for the work to be done: the mount directory, from the first
+# argument or RVFS_MOUNTDIR
 
-PREFIX = '/home/prashant/Downloads/timeline/testing/mountdir/'
+PREFIX = os.path.join(os.environ.get('RVFS_MOUNTDIR', 'mountdir'), '')
 
 # Total nodes in any tree
 
@@ -304,6 +306,8 @@ class FileHandle:
 				stck.append(c)
 
 if __name__=='__main__':
+	if len(sys.argv) > 1:
+		PREFIX = os.path.join(sys.argv[1], '')
 	random.seed(time.time())	
 	# t = Tree('TestTree', S_BR, 250)
 	# root = t.construct()
@@ -0,0 +1,66 @@
+import json
+import sys
+# Compares the results of rvfs_load, one file of JSON lines per mode,
+# against the first one given:
+#
+#	python compare.py bare.json passthrough.json rvfs.json
+#
+# or, given the results of rvfs_bench -g, RVFS and git side by side:
+#
+#	python compare.py results.json
+
+def load(path):
+	runs = {}
+	for line in open(path):
+		line = line.strip()
+		if line:
+			r = json.loads(line)
+			runs[r['workload']] = r
+	return runs
+
+def ratio(x, base):
+	if base == 0:
+		return '-'
+	return '%.2fx' % (x / float(base))
+
+def side_by_side(r):
+	git = r['git']
+	sys.stdout.write('%-22s %14s %14s %10s\n' % ('', 'rvfs', 'git', 'git/rvfs'))
+	for op in ['commit', 'checkout', 'revert', 'clean']:
+		for c in ['p50_us', 'p99_us', 'mean_us']:
+			x, y = r['ops'][op][c], git['ops'][op][c]
+			sys.stdout.write('%-22s %14.1f %14.1f %10s\n' % (op + ' ' + c, x, y, ratio(y, x)))
+	for c in ['file_bytes', 'version_bytes', 'version_bytes_cleaned']:
+		x, y = r['storage'][c], git['storage'][c]
+		sys.stdout.write('%-22s %14d %14d %10s\n' % (c, x, y, ratio(y, x)))
+	for c in ['failures', 'mismatches']:
+		sys.stdout.write('%-22s %14d %14d\n' % (c, r[c], git[c]))
+
+if __name__=='__main__':
+	if len(sys.argv) < 2:
+		sys.stderr.write('Usage: compare.py base.json [other.json ...] | compare.py results.json\n')
+		sys.exit(1)
+	if len(sys.argv) == 2:
+		try:
+			r = json.load(open(sys.argv[1]))
+		except ValueError:
+			r = {}
+		if 'git' in r:
+			side_by_side(r)
+			sys.exit(0)
+	modes = [load(p) for p in sys.argv[1:]]
+	base = modes[0]
+	workloads = [w for w in ['commit', 'seqwrite', 'seqread', 'randread', 'randwrite', 'readdir', 'replay'] if w in base]
+	workloads += sorted(w for w in base if w not in workloads)
+
+	# the last column is the median latency over that of the first mode
+	sys.stdout.write('%-10s %-12s %12s %10s %10s %10s %10s %10s %10s\n' % ('workload', 'mode', 'ops/s', 'MB/s',
+		'p50_us', 'p99_us', 'p99.9_us', 'errors', 'p50/base'))
+	for w in workloads:
+		for m in modes:
+			if w not in m:
+				continue
+			r = m[w]
+			sys.stdout.write('%-10s %-12s %12.1f %10.2f %10.1f %10.1f %10.1f %10d %10s\n' % (w, r['label'],
+				r['ops_per_s'], r['mb_per_s'], r['p50_us'], r['p99_us'], r['p99.9_us'], r['errors'],
+				ratio(r['p50_us'], base[w]['p50_us'])))
@@ -1,20 +1,34 @@
 RVFS_ROOT_DIR=$1
 RVFS_MOUNT_DIR=$2
 DATA_DIR=$3
+VFS=${VFS:-../src/vfs}
 
 echo "Using "$RVFS_ROOT_DIR" as the Rvfs root directory and "\
 $DATA_DIR" as the data directory to populate"
+USAGE="sript rvfs_root_dir mount_dir data_dir"
+
+if [ -z $RVFS_ROOT_DIR ] || [ -z $RVFS_MOUNT_DIR ] || [ -z $DATA_DIR ]
+then
+	echo $USAGE
+	exit 1
+fi
 
 if [ -d $RVFS_ROOT_DIR ]
 then
 	echo "RVFS root dir "$RVFS_ROOT_DIR"  exist. Deleting ...."
-	rm -Rf $RVFS_DIR
+	rm -Rf $RVFS_ROOT_DIR
 fi
 echo "Creating RVFS root dir"
 mkdir $RVFS_ROOT_DIR
 
 echo "Mounting RVFS root to mount dir"
 # mount the ROOT dir to the MOUNT dir
+$VFS $RVFS_ROOT_DIR $RVFS_MOUNT_DIR
+for i in `seq 50`
+do
+	mountpoint -q $RVFS_MOUNT_DIR && break
+	sleep 0.1
+done
 
 OPS=`cat INDEX`
 
@@ -27,12 +41,30 @@ do
 	# tell what you are about to do
 	echo $OP" the file "$FILE
 
+	# every close of a file on the mount is a commit
 	case $OP in
 	"add")
+		cp $DATA_DIR/$FILE $RVFS_MOUNT_DIR/$FILE
 		;;
 	"commit")
+		FILE_PART=`echo $FILE| cut -d \. -f 1`.base
+		cp $DATA_DIR/$FILE $RVFS_MOUNT_DIR/$FILE_PART
 		;;
 	esac
 done
 
+# vfs finishes the queued commits on unmount, then exits
+fusermount -u $RVFS_MOUNT_DIR
+while pgrep -f "$VFS $RVFS_ROOT_DIR" > /dev/null
+do
+	sleep 0.1
+done
+
 # find the efficiency of the system
+
+TOTAL_USAGE=`du -c $RVFS_ROOT_DIR | tail -n 1 | cut -f 1`
+
+USEFUL_USAGE=`du -c $RVFS_ROOT_DIR --exclude=*\.ver* | tail -n 1 | cut -f 1`
+
+echo "The total usage is( in bytes ): "$TOTAL_USAGE
+echo "The useful usage is( in bytes ): "$USEFUL_USAGE
@@ -0,0 +1,636 @@
+/* bench.c
+ * Benchmark of the versioning core, run without FUSE
+ *
+ * Usage: rvfs_bench [-s S|M|L] [-b S|M|L] [-d S|M|L] [-n <versions>]
+ *		[-r <runs>] [-c <checkouts>] [-S <seed>] [-g]
+ *		[-o <results.json>] </path/to/scratchdir/>
+ *
+ * Every run builds the version tree of one text file in a fresh root
+ * directory below the scratch directory, as benchmarking/benchmark.py
+ * does through a mount: -s is the size class of the file, -b how often
+ * a version branches off an older one, -d how much of the file every
+ * version appends, with the bounds of benchmark.py.  The tree is walked
+ * depth first; a version that does not extend the last one checks its
+ * parent out first.  Then <checkouts> random versions are checked out,
+ * each after a branch head below it, the newest version is reverted to
+ * its grandparent and the file is cleaned down to a ratio of 0.5.
+ *
+ * The calls are those the mount makes: commit_version() as
+ * report_release() does, but with a timestamp of its own so versions
+ * made within a second stay apart, report_checkout(),
+ * revert_to_version() and cleanFile().  Every version checked out is
+ * compared with what was committed.  The same seed gives the same
+ * trees and contents.
+ *
+ * -g replays the same versions into a git repository next to each root,
+ * the git command line as a git-backed alternative would run it: a
+ * commit is git add and git commit, a checkout git checkout of the
+ * commit, the revert git reset --hard and the cleanup git gc.  Its
+ * results go under "git", beside those of RVFS.
+ *
+ * The results are written as JSON, to stdout without -o: the count,
+ * bytes, throughput and latency percentiles of every kind of call, the
+ * stages of stats.c under them, and the space taken by the versions.
+ * vfs.log is written to the scratch directory.
+ */
+
+#define _GNU_SOURCE
+#include "params.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "vfs.h"
+#include "log.h"
+
+#define BENCH_FILE "bench.txt"
+#define BENCH_TIMESTAMP 1300000000	/* of the first version */
+#define BENCH_CLEAN_RATIO 0.5
+
+#define OP_COMMIT 0
+#define OP_CHECKOUT 1
+#define OP_REVERT 2
+#define OP_CLEAN 3
+#define OP_COUNT 4
+
+static const char *op_names[OP_COUNT] = {"commit", "checkout", "revert", "clean"};
+
+/* Bounds of benchmark.py, for the S, M and L classes */
+static const long size_bounds[3][2] = {{20*1024, 1024*1024}, {1024*1024, 1024*1024}, {1024*1024, 2*1024*1024}};
+static const int branch_bounds[3][2] = {{3, 5}, {25, 35}, {10, 100}};
+static const int diff_bounds[3][2] = {{1, 10}, {10, 30}, {30, 60}};
+
+typedef struct _bench_node{
+
+	int parent;		/* index, -1 for the root */
+	int *children;
+	int n_children;
+	int timestamp;
+	char hash[HASH_SHA1];	/* of the contents committed */
+	char commit[HASH_SHA1];	/* on git, with -g */
+}BenchNode;
+
+typedef struct _samples{
+
+	long long *ns;
+	int n, size;
+	long long bytes;
+}Samples;
+
+/* What the versions took on RVFS, or on git */
+typedef struct _engine{
+
+	Samples samples[OP_COUNT];
+	long long file_bytes, version_bytes, cleaned_bytes;
+	int failures, mismatches;
+}Engine;
+
+struct vfs_state *vfs_global;
+static struct vfs_state state;
+static unsigned long long rng;
+static Engine on_rvfs, on_git;
+static int with_git;
+static long long tree_total;
+
+/* xorshift64*, the same sequence on any libc */
+static unsigned long long next_random(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 0x2545f4914f6cdd1dULL;
+}
+
+/* Random number from lo to hi, both included, as random.randint() */
+static long randint(long lo, long hi)
+{
+	return lo + (long)(next_random() % (unsigned long long)(hi - lo + 1));
+}
+
+static void sample(Engine *e, int op, long long start, long long bytes)
+{
+	Samples *s = &e->samples[op];
+
+	if(s->n == s->size)
+	{
+		s->size = s->size ? 2*s->size : 64;
+		s->ns = (long long *)realloc(s->ns, s->size*sizeof(long long));
+	}
+	s->ns[s->n++] = stats_now() - start;
+	s->bytes += bytes;
+}
+
+static int class_of(const char *arg)
+{
+	if(strcmp(arg, "S") == 0)
+		return 0;
+	if(strcmp(arg, "M") == 0)
+		return 1;
+	if(strcmp(arg, "L") == 0)
+		return 2;
+	return -1;
+}
+
+/* Appends lines of 20 random capitals, n bytes of them, to f */
+static void random_lines(FILE *f, long n)
+{
+	long i = 0;
+	int j;
+
+	while(i < n)
+	{
+		for(j = 0; j < 20; j++, i++)
+			fputc('A' + randint(1, 25), f);
+		fputc('\n', f);
+	}
+}
+
+static void add_child(BenchNode *nodes, int parent, int child)
+{
+	BenchNode *p = &nodes[parent];
+
+	p->children = (int *)realloc(p->children, (p->n_children + 1)*sizeof(int));
+	p->children[p->n_children++] = child;
+	nodes[child].parent = parent;
+	nodes[child].children = NULL;
+	nodes[child].n_children = 0;
+}
+
+/* The tree of Tree.construct() of benchmark.py, n versions past the root
+ * Returns the number of nodes
+ */
+static int build_tree(BenchNode *nodes, int n, int branching)
+{
+	int *heads = (int *)malloc((n + 1)*sizeof(int));
+	int *others = (int *)malloc((n + 1)*sizeof(int));
+	int count = 1, n_heads = 1, n_others, i, j, h;
+
+	nodes[0].parent = -1;
+	nodes[0].children = NULL;
+	nodes[0].n_children = 0;
+	heads[0] = 0;
+	while(count <= n)
+	{
+		if(randint(1, 100) < branch_bounds[branching][1])
+		{
+			// off a version that is not a head
+			for(i = 0, n_others = 0; i < count; i++)
+			{
+				for(j = 0; j < n_heads && heads[j] != i; j++)
+					;
+				if(j == n_heads)
+					others[n_others++] = i;
+			}
+			if(n_others == 0)
+				continue;
+			add_child(nodes, others[randint(0, n_others - 1)], count);
+			heads[n_heads++] = count++;
+		}
+		else
+		{
+			h = randint(0, n_heads - 1);
+			add_child(nodes, heads[h], count);
+			heads[h] = count++;
+		}
+	}
+	free(heads);
+	free(others);
+	return count;
+}
+
+static int make_root(const char *root)
+{
+	const char *dirs[] = {"", "/" VER_DIR, "/" VER_DIR STORE_FOLDER, "/" VER_DIR TREES_FOLDER,
+		"/" VER_DIR HEADS_FOLDER, "/" VER_DIR MD_DATA_FOLDER};
+	char path[PATH_MAX];
+	unsigned int i;
+
+	// a root left by an earlier run would mix its versions in
+	for(i = 0; i < sizeof(dirs)/sizeof(dirs[0]); i++)
+	{
+		snprintf(path, PATH_MAX, "%s%s", root, dirs[i]);
+		if(mkdir(path, 0755) != 0)
+		{
+			perror(path);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static long long size_of(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+/* Runs git in dir with the arguments, NULL ended, its output dropped
+ * Returns 1 if it succeeded
+ */
+static int run_git(const char *dir, ...)
+{
+	char *args[16] = {"git", "-C", (char *)dir, "-c", "gc.auto=0", "-c", "commit.gpgsign=false"};
+	int n = 7, status, fd;
+	va_list ap;
+	pid_t pid;
+
+	va_start(ap, dir);
+	while(n < 15 && (args[n] = va_arg(ap, char *)) != NULL)
+		n++;
+	va_end(ap);
+	args[n] = NULL;
+	if((pid = fork()) == 0)
+	{
+		fd = open("/dev/null", O_WRONLY);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		execvp("git", args);
+		_exit(127);
+	}
+	return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* The commit git is at in dir, in id */
+static void git_head(const char *dir, char *id)
+{
+	char command[PATH_MAX + 32];
+	FILE *p;
+
+	id[0] = '\0';
+	snprintf(command, sizeof(command), "git -C '%s' rev-parse HEAD", dir);
+	if((p = popen(command, "r")) == NULL)
+		return;
+	if(fscanf(p, "%40s", id) != 1)
+		id[0] = '\0';
+	pclose(p);
+}
+
+static int add_size(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	if(flag == FTW_F)
+		tree_total += st->st_size;
+	return 0;
+}
+
+/* Bytes of the files below dir */
+static long long tree_size(const char *dir)
+{
+	tree_total = 0;
+	nftw(dir, add_size, 16, FTW_PHYS);
+	return tree_total;
+}
+
+/* Compares the file of git with what node committed */
+static void git_compare(const char *gdir, BenchNode *node)
+{
+	char gpath[PATH_MAX], hash[HASH_SHA1];
+
+	snprintf(gpath, PATH_MAX, "%s/%s", gdir, BENCH_FILE);
+	find_SHA(gpath, hash);
+	if(strcmp(hash, node->hash) != 0)
+		on_git.mismatches++;
+}
+
+/* Commits to git, in gdir, what was committed to RVFS at fpath */
+static void commit(char *fpath, const char *gdir, BenchNode *node)
+{
+	char gpath[PATH_MAX], date[32];
+	long long start = stats_now();
+
+	commit_version(fpath, fpath, NULL, node->timestamp);
+	sample(&on_rvfs, OP_COMMIT, start, size_of(fpath));
+	find_SHA(fpath, node->hash);
+	if(gdir == NULL)
+		return;
+
+	// the same dates make the same commits from the same seed
+	snprintf(gpath, PATH_MAX, "%s/%s", gdir, BENCH_FILE);
+	copy(fpath, gpath);
+	snprintf(date, sizeof(date), "@%d +0000", node->timestamp);
+	setenv("GIT_AUTHOR_DATE", date, 1);
+	setenv("GIT_COMMITTER_DATE", date, 1);
+	start = stats_now();
+	if(!run_git(gdir, "add", BENCH_FILE, NULL) || !run_git(gdir, "commit", "-q", "--allow-empty", "-m", date, NULL))
+		on_git.failures++;
+	sample(&on_git, OP_COMMIT, start, size_of(gpath));
+	git_head(gdir, node->commit);
+}
+
+/* Checks node out and compares it with what was committed */
+static void checkout(char *fpath, const char *gdir, BenchNode *node)
+{
+	char hash[HASH_SHA1], gpath[PATH_MAX];
+	long long start = stats_now();
+
+	if(!report_checkout(fpath, node->timestamp))
+		on_rvfs.failures++;
+	sample(&on_rvfs, OP_CHECKOUT, start, size_of(fpath));
+	find_SHA(fpath, hash);
+	if(strcmp(hash, node->hash) != 0)
+		on_rvfs.mismatches++;
+	if(gdir == NULL)
+		return;
+
+	snprintf(gpath, PATH_MAX, "%s/%s", gdir, BENCH_FILE);
+	start = stats_now();
+	if(!run_git(gdir, "checkout", "-q", node->commit, NULL))
+		on_git.failures++;
+	sample(&on_git, OP_CHECKOUT, start, size_of(gpath));
+	git_compare(gdir, node);
+}
+
+static void run(const char *scratch, int k, int size, int branching, int diff, int n, int checkouts)
+{
+	char root[PATH_MAX], fpath[PATH_MAX], hash[HASH_SHA1], *gdir = NULL;
+	char git_dir[PATH_MAX], git_file[PATH_MAX], git_store[PATH_MAX];
+	BenchNode *nodes = (BenchNode *)calloc(n + 1, sizeof(BenchNode));
+	int *stack = (int *)malloc((n + 1)*sizeof(int));
+	int count, top, last = -1, depth = 0, i, newest = 0, target;
+	long file_size, saved;
+	long long start, before, after;
+	file_data file;
+	FILE *f;
+
+	snprintf(root, PATH_MAX, "%s/run-%d", scratch, k);
+	snprintf(fpath, PATH_MAX, "%s/%s", root, BENCH_FILE);
+	if(!make_root(root))
+		exit(1);
+	if(with_git)
+	{
+		gdir = git_dir;
+		snprintf(gdir, PATH_MAX, "%s/run-%d-git", scratch, k);
+		snprintf(git_file, PATH_MAX, "%s/%s", gdir, BENCH_FILE);
+		snprintf(git_store, PATH_MAX, "%s/.git", gdir);
+		if(mkdir(gdir, 0755) != 0 || !run_git(gdir, "init", "-q", NULL))
+		{
+			perror(gdir);
+			exit(1);
+		}
+	}
+	state.rootdir = root;
+	wal_start();
+
+	file_size = randint(size_bounds[size][0], size_bounds[size][1]);
+	f = fopen(fpath, "w");
+	random_lines(f, file_size);
+	fclose(f);
+
+	count = build_tree(nodes, n, branching);
+	for(i = 0; i < count; i++)
+		nodes[i].timestamp = BENCH_TIMESTAMP + i;
+
+	// depth first as genFile() of benchmark.py
+	stack[depth++] = 0;
+	while(depth > 0)
+	{
+		top = stack[--depth];
+		if(last >= 0 && nodes[top].parent != last)
+			checkout(fpath, gdir, &nodes[nodes[top].parent]);
+		f = fopen(fpath, "a");
+		random_lines(f, randint(diff_bounds[diff][0], diff_bounds[diff][1])*file_size/100);
+		fclose(f);
+		commit(fpath, gdir, &nodes[top]);
+		newest = top;
+		last = top;
+		for(i = 0; i < nodes[top].n_children; i++)
+			stack[depth++] = nodes[top].children[i];
+	}
+
+	// only a head or a version above the current one can be checked
+	// out: a leaf below the version goes first
+	for(i = 0; i < checkouts; i++)
+	{
+		target = randint(0, count - 1);
+		for(top = target; nodes[top].n_children > 0; )
+			top = nodes[top].children[randint(0, nodes[top].n_children - 1)];
+		checkout(fpath, gdir, &nodes[top]);
+		if(top != target)
+			checkout(fpath, gdir, &nodes[target]);
+	}
+
+	// the newest version back to its grandparent
+	checkout(fpath, gdir, &nodes[newest]);
+	target = nodes[newest].parent >= 0 && nodes[nodes[newest].parent].parent >= 0 ?
+		nodes[nodes[newest].parent].parent : nodes[newest].parent;
+	if(target >= 0)
+	{
+		start = stats_now();
+		if(!revert_to_version(fpath, nodes[target].timestamp))
+			on_rvfs.failures++;
+		sample(&on_rvfs, OP_REVERT, start, size_of(fpath));
+		find_SHA(fpath, hash);
+		if(strcmp(hash, nodes[target].hash) != 0)
+			on_rvfs.mismatches++;
+	}
+	if(target >= 0 && gdir != NULL)
+	{
+		// the versions past the target are dropped, as revert_to_version() does
+		start = stats_now();
+		if(!run_git(gdir, "reset", "-q", "--hard", nodes[target].commit, NULL))
+			on_git.failures++;
+		sample(&on_git, OP_REVERT, start, size_of(git_file));
+		git_compare(gdir, &nodes[target]);
+	}
+
+	meta_paths(fpath, &file);
+	on_rvfs.file_bytes += size_of(fpath);
+	on_rvfs.version_bytes += calc_md_size(&file);
+	start = stats_now();
+	if(cleanFile(fpath, BENCH_CLEAN_RATIO, 0, &saved) < 0)
+		on_rvfs.failures++;
+	sample(&on_rvfs, OP_CLEAN, start, saved > 0 ? saved : 0);
+	on_rvfs.cleaned_bytes += calc_md_size(&file);
+	if(gdir != NULL)
+	{
+		// git packs its loose objects, the nearest it has to a cleanup
+		on_git.file_bytes += size_of(git_file);
+		before = tree_size(git_store);
+		on_git.version_bytes += before;
+		start = stats_now();
+		if(!run_git(gdir, "gc", "-q", "--prune=now", NULL))
+			on_git.failures++;
+		sample(&on_git, OP_CLEAN, start, 0);
+		after = tree_size(git_store);
+		on_git.samples[OP_CLEAN].bytes += MAX(before - after, 0);
+		on_git.cleaned_bytes += after;
+	}
+
+	wal_stop();
+	for(i = 0; i < count; i++)
+		free(nodes[i].children);
+	free(nodes);
+	free(stack);
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct(Samples *s, double q)
+{
+	int i = (int)(q*s->n + 0.5) - 1;
+
+	if(i < 0)
+		i = 0;
+	if(i >= s->n)
+		i = s->n - 1;
+	return s->ns[i]/1000.0;
+}
+
+/* The calls of e, then its storage, indented */
+static void report_engine(FILE *out, Engine *e, const char *indent, int runs)
+{
+	double total;
+	int i, j;
+	Samples *s;
+
+	fprintf(out, "%s\"ops\": {\n", indent);
+	for(i = 0; i < OP_COUNT; i++)
+	{
+		s = &e->samples[i];
+		qsort(s->ns, s->n, sizeof(long long), cmp_ll);
+		for(j = 0, total = 0; j < s->n; j++)
+			total += s->ns[j];
+		fprintf(out, "%s  \"%s\": {\"count\": %d, \"bytes\": %lld, \"seconds\": %.6f, \"mb_per_s\": %.3f, "
+			"\"ops_per_s\": %.3f, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, "
+			"\"max_us\": %.1f}%s\n", indent, op_names[i], s->n, s->bytes, total/1e9,
+			total > 0 ? s->bytes/(total/1e9)/(1024*1024) : 0, total > 0 ? s->n/(total/1e9) : 0,
+			s->n ? total/s->n/1000 : 0, s->n ? pct(s, 0.5) : 0, s->n ? pct(s, 0.9) : 0,
+			s->n ? pct(s, 0.99) : 0, s->n ? s->ns[s->n - 1]/1000.0 : 0, i < OP_COUNT - 1 ? "," : "");
+	}
+	fprintf(out, "%s},\n", indent);
+	fprintf(out, "%s\"storage\": {\"file_bytes\": %lld, \"version_bytes\": %lld, \"version_bytes_cleaned\": %lld},\n",
+		indent, e->file_bytes/runs, e->version_bytes/runs, e->cleaned_bytes/runs);
+	fprintf(out, "%s\"failures\": %d,\n%s\"mismatches\": %d", indent, e->failures, indent, e->mismatches);
+}
+
+static void report(FILE *out, const char *size, const char *branching, const char *diff, int n, int runs,
+		int checkouts, unsigned long long seed)
+{
+	char *stages, *line, *save = NULL;
+	double mean, p50, p90, p99, p999, max;
+	unsigned long count, errors;
+	unsigned long long bytes;
+	char name[32];
+	size_t len;
+	int first = 1;
+
+	fprintf(out, "{\n  \"benchmark\": \"rvfs_core\",\n");
+	fprintf(out, "  \"params\": {\"size\": \"%s\", \"branching\": \"%s\", \"diff\": \"%s\", \"versions\": %d, "
+		"\"runs\": %d, \"checkouts\": %d, \"seed\": %llu, \"git\": %s},\n", size, branching, diff, n, runs,
+		checkouts, seed, with_git ? "true" : "false");
+	fprintf(out, "  \"stages\": {\n");
+	// the table of stats.c, past its header line
+	stages = stats_text(&len);
+	for(line = strtok_r(stages, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save))
+	{
+		if(line[0] == '#' || sscanf(line, "%31s %lu %lu %llu %lf %lf %lf %lf %lf %lf", name, &count, &errors,
+			&bytes, &mean, &p50, &p90, &p99, &p999, &max) != 10)
+			continue;
+		fprintf(out, "%s    \"%s\": {\"count\": %lu, \"errors\": %lu, \"bytes\": %llu, \"mean_us\": %.1f, "
+			"\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}", first ? "" : ",\n",
+			name, count, errors, bytes, mean, p50, p90, p99, max);
+		first = 0;
+	}
+	free(stages);
+	fprintf(out, "%s  },\n", first ? "" : "\n");
+	report_engine(out, &on_rvfs, "  ", runs);
+	// the same versions on git, side by side
+	if(with_git)
+	{
+		fprintf(out, ",\n  \"git\": {\n");
+		report_engine(out, &on_git, "    ", runs);
+		fprintf(out, "\n  }");
+	}
+	fprintf(out, "\n}\n");
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: rvfs_bench [-s S|M|L] [-b S|M|L] [-d S|M|L] [-n <versions>] [-r <runs>]\n"
+		"\t[-c <checkouts>] [-S <seed>] [-g] [-o <results.json>] </path/to/scratchdir/>\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *size = "M", *branching = "S", *diff = "S", *out_path = NULL;
+	int n = 20, runs = 3, checkouts = 10, opt, k;
+	unsigned long long seed = 1;
+	char scratch[PATH_MAX];
+	FILE *out = stdout;
+
+	while((opt = getopt(argc, argv, "s:b:d:n:r:c:S:go:")) != -1)
+	{
+		switch(opt)
+		{
+		case 's': size = optarg; break;
+		case 'b': branching = optarg; break;
+		case 'd': diff = optarg; break;
+		case 'n': n = atoi(optarg); break;
+		case 'r': runs = atoi(optarg); break;
+		case 'c': checkouts = atoi(optarg); break;
+		case 'S': seed = strtoull(optarg, NULL, 10); break;
+		case 'g': with_git = 1; break;
+		case 'o': out_path = optarg; break;
+		default: usage();
+		}
+	}
+	if(optind != argc - 1 || class_of(size) < 0 || class_of(branching) < 0 || class_of(diff) < 0
+		|| n < 1 || runs < 1 || checkouts < 0)
+		usage();
+	if(realpath(argv[optind], scratch) == NULL)
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+
+	vfs_global = &state;
+	state.keyframe_interval = KEYFRAME_INTERVAL;
+	state.keyframe_bytes = KEYFRAME_BYTES;
+	state.chunk_file_bytes = CHUNK_FILE_BYTES;
+	state.text_globs = TEXT_GLOBS;
+	state.binary_globs = BINARY_GLOBS;
+	if(out_path != NULL && (out = fopen(out_path, "w")) == NULL)
+	{
+		perror(out_path);
+		return 1;
+	}
+	// vfs.log goes to the scratch directory
+	if(chdir(scratch) != 0)
+	{
+		perror(scratch);
+		return 1;
+	}
+	state.logfile = log_open();
+	log_start();
+	if(with_git)
+	{
+		setenv("GIT_AUTHOR_NAME", "rvfs_bench", 1);
+		setenv("GIT_AUTHOR_EMAIL", "rvfs_bench@localhost", 1);
+		setenv("GIT_COMMITTER_NAME", "rvfs_bench", 1);
+		setenv("GIT_COMMITTER_EMAIL", "rvfs_bench@localhost", 1);
+	}
+
+	rng = seed ? seed : 1;
+	for(k = 0; k < runs; k++)
+		run(scratch, k, class_of(size), class_of(branching), class_of(diff), n, checkouts);
+	report(out, size, branching, diff, n, runs, checkouts, seed);
+
+	log_stop();
+	if(out != stdout)
+		fclose(out);
+	return on_rvfs.failures + on_rvfs.mismatches + on_git.failures + on_git.mismatches != 0;
+}
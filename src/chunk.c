@@ -0,0 +1,376 @@
+/* chunk.c
+ * Content defined chunking of binary and large files
+ *
+ * Such a file is not diffed but cut into chunks where a rolling gear
+ * hash of its bytes matches a mask (FastCDC), so an edit only moves
+ * the cut points next to it.  Every chunk is an object of the store
+ * named by its hash, and a version is a chunk list:
+ *
+ *	RVC1 <size> <chunks>
+ *	<hash> <length>			one line per chunk, in order
+ *
+ * stored under the name of the version, the hash of the list, in place
+ * of a full object.  load_object() and load_object_mem() put the chunks
+ * back together, so a chunked version reads like any loose object, and
+ * versions of a file share the chunks they have in common with each
+ * other and with any other file.
+ *
+ * A new version only reads the bytes around the ranges written since
+ * its parent: the chunks of the parent ending before the first write
+ * are kept as they are, and past the last write the chunks of the
+ * parent are taken again from the first cut that falls on one of
+ * theirs.  The mount sees every write, so the rest is known to match.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "vfs.h"
+#include "log.h"
+
+#define CDC_MIN_SIZE (16*1024)	/* no cut before */
+#define CDC_AVG_BITS 16		/* 64 KB on average */
+#define CDC_MAX_SIZE (256*1024)	/* cut there whatever the hash */
+
+/* Normalized chunking: a harder mask below the average size and an
+ * easier one above it keep most chunks close to the average.  The bits
+ * are the high ones of the hash, which depend on the last 64 bytes.
+ */
+#define CDC_MASK(bits) (((1ULL << (bits)) - 1) << (64 - (bits)))
+#define CDC_MASK_S CDC_MASK(CDC_AVG_BITS + 2)
+#define CDC_MASK_L CDC_MASK(CDC_AVG_BITS - 2)
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* The table must never change, or the chunks of old versions would no
+ * longer line up: it is drawn from a fixed seed
+ */
+static void init_gear(void)
+{
+	uint64_t x = 0x5256465343444331ULL, z;
+	int i;
+
+	for(i = 0; i < 256; i++)
+	{
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+/* Length of the chunk starting at p, n bytes being left in the file.
+ * A cut found before the end of the file only depends on the bytes of
+ * the chunk.
+ */
+static size_t cut_point(const unsigned char *p, size_t n)
+{
+	size_t i, normal = (size_t)1 << CDC_AVG_BITS, limit = CDC_MAX_SIZE;
+	uint64_t fp = 0;
+
+	if(n <= CDC_MIN_SIZE)
+		return n;
+	if(limit > n)
+		limit = n;
+	if(normal > limit)
+		normal = limit;
+	for(i = CDC_MIN_SIZE; i < normal; i++)
+	{
+		fp = (fp << 1) + gear[p[i]];
+		if(!(fp & CDC_MASK_S))
+			return i + 1;
+	}
+	for(; i < limit; i++)
+	{
+		fp = (fp << 1) + gear[p[i]];
+		if(!(fp & CDC_MASK_L))
+			return i + 1;
+	}
+	return limit;
+}
+
+static void add_chunk(ChunkList *l, long long offset, int len, const char *hash)
+{
+	Chunk *c;
+
+	if(l->n == l->size)
+	{
+		l->size = l->size ? 2*l->size : 64;
+		l->c = (Chunk *)realloc(l->c, l->size*sizeof(Chunk));
+	}
+	c = &l->c[l->n++];
+	c->offset = offset;
+	c->len = len;
+	strcpy(c->hash, hash);
+}
+
+/* Index of the chunk of l starting at offset, or -1 */
+static int chunk_at(const ChunkList *l, long long offset)
+{
+	int lo = 0, hi = l->n - 1, mid;
+
+	while(lo <= hi)
+	{
+		mid = (lo + hi)/2;
+		if(l->c[mid].offset == offset)
+			return mid;
+		if(l->c[mid].offset < offset)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return -1;
+}
+
+/* Cuts the file at path into chunks, into l.  parent, if not NULL, is
+ * the chunk list of the version it was written from, dirty the ranges
+ * written since (see the top of the file).
+ * Returns 1 for success and 0 for failure
+ */
+int chunk_file(const char *path, const ChunkList *parent, const DirtyMap *dirty, ChunkList *l)
+{
+	long long first = 0, last = DIRTY_EOF, pos = 0, hashed = 0, start = stats_now();
+	int i, k, tail = 0;
+	char hash[HASH_SHA1];
+	GChecksum *cs;
+	size_t size, len;
+	char *data;
+
+	pthread_once(&gear_once, init_gear);
+	memset(l, 0, sizeof(ChunkList));
+	data = map_file(path, &size);
+	if(data == NULL)
+	{
+		stats_add(STAT_CHUNK, start, 0, 1);
+		return 0;
+	}
+	l->total = size;
+
+	if(parent != NULL && dirty != NULL)
+	{
+		first = dirty->n > 0 ? dirty->r[0].start : (long long)size;
+		last = dirty->n > 0 ? dirty->r[dirty->n - 1].end : 0;
+		// the last chunk was cut by the end of the file, not its bytes
+		for(i = 0; i < parent->n - 1; i++)
+		{
+			pos = parent->c[i].offset + parent->c[i].len;
+			if(pos > first || pos > (long long)size)
+				break;
+			add_chunk(l, parent->c[i].offset, parent->c[i].len, parent->c[i].hash);
+		}
+		pos = l->n > 0 ? l->c[l->n - 1].offset + l->c[l->n - 1].len : 0;
+		tail = parent->total == (long long)size;
+	}
+
+	while(pos < (long long)size)
+	{
+		if(tail && pos >= last && (k = chunk_at(parent, pos)) >= 0)
+		{
+			for(; k < parent->n; k++)
+				add_chunk(l, parent->c[k].offset, parent->c[k].len, parent->c[k].hash);
+			break;
+		}
+		len = cut_point((const unsigned char *)data + pos, size - pos);
+		cs = hash_new();
+		g_checksum_update(cs, (const guchar *)data + pos, len);
+		hash_string(cs, hash);
+		g_checksum_free(cs);
+		add_chunk(l, pos, len, hash);
+		pos += len;
+		hashed += len;
+	}
+	unmap_file(data, size);
+	stats_add(STAT_CHUNK, start, hashed, 0);
+	log_msg("chunk_file: %s, %lu bytes in %d chunks, %lld bytes read\n", path, (unsigned long)size, l->n, hashed);
+	return 1;
+}
+
+void chunk_list_free(ChunkList *l)
+{
+	free(l->c);
+	memset(l, 0, sizeof(ChunkList));
+}
+
+static GString *list_text(const ChunkList *l)
+{
+	GString *s = g_string_new(NULL);
+	int i;
+
+	g_string_append_printf(s, "%s %lld %d\n", CHUNK_MAGIC, l->total, l->n);
+	for(i = 0; i < l->n; i++)
+		g_string_append_printf(s, "%s %d\n", l->c[i].hash, l->c[i].len);
+	return s;
+}
+
+/* Name of the version held by l.  It is not the hash of the stored
+ * list itself, which a file holding those very bytes would have.
+ */
+void chunk_list_hash(const ChunkList *l, char hash[HASH_SHA1])
+{
+	GString *s = list_text(l);
+	GChecksum *cs = hash_new();
+
+	g_checksum_update(cs, (const guchar *)"chunks\n", 7);
+	g_checksum_update(cs, (const guchar *)s->str, s->len);
+	hash_string(cs, hash);
+	g_checksum_free(cs);
+	g_string_free(s, TRUE);
+}
+
+/* Writes l to path, through a temporary file and a rename
+ * Returns 1 for success and 0 for failure
+ */
+int chunk_list_write(const char *path, const ChunkList *l)
+{
+	GString *s = list_text(l);
+	int ret = write_file(path, s->str, s->len);
+
+	g_string_free(s, TRUE);
+	return ret;
+}
+
+/* Reads the chunk list stored at path into l
+ * Returns 1 for success, 0 if path holds no chunk list
+ */
+int chunk_list_read(const char *path, ChunkList *l)
+{
+	char line[128], magic[8], hash[HASH_SHA1];
+	long long total, offset = 0;
+	int n, len;
+	FILE *f;
+
+	memset(l, 0, sizeof(ChunkList));
+	f = fopen(path, "r");
+	if(f == NULL)
+		return 0;
+	if(fgets(line, sizeof(line), f) == NULL || sscanf(line, "%7s %lld %d", magic, &total, &n) != 3
+		|| strcmp(magic, CHUNK_MAGIC) != 0)
+	{
+		fclose(f);
+		return 0;
+	}
+	while(fgets(line, sizeof(line), f) != NULL && sscanf(line, "%40s %d", hash, &len) == 2)
+	{
+		add_chunk(l, offset, len, hash);
+		offset += len;
+	}
+	fclose(f);
+	if(l->n != n || offset != total)
+	{
+		log_error("chunk_list_read: %s is truncated, %d of %d chunks\n", path, l->n, n);
+		chunk_list_free(l);
+		return 0;
+	}
+	l->total = total;
+	return 1;
+}
+
+/* Tells whether the object at obj_file is a chunk list */
+int is_chunk_list(const char *obj_file)
+{
+	char magic[4];
+	FILE *f = fopen(obj_file, "rb");
+	int ret;
+
+	if(f == NULL)
+		return 0;
+	ret = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, CHUNK_MAGIC, sizeof(magic)) == 0;
+	fclose(f);
+	return ret;
+}
+
+/* Path of chunk c of the list at obj_file, which sits next to it */
+void chunk_path(char *path, const char *obj_file, const Chunk *c)
+{
+	const char *slash = strrchr(obj_file, '/');
+	int dir_len = slash ? (int)(slash - obj_file) + 1 : 0;
+
+	snprintf(path, PATH_MAX, "%.*s%s", dir_len, obj_file, c->hash);
+}
+
+static char *load_chunk(const char *obj_file, const Chunk *c)
+{
+	char path[PATH_MAX];
+	size_t len;
+	char *data;
+
+	chunk_path(path, obj_file, c);
+	data = load_object_mem(path, &len);
+	if(data != NULL && len != (size_t)c->len)
+	{
+		log_error("load_chunk: %s holds %lu bytes, %d expected\n", path, (unsigned long)len, c->len);
+		free(data);
+		data = NULL;
+	}
+	return data;
+}
+
+/* Puts the chunks listed at obj_file together in memory, NUL terminated
+ * as load_object_mem() does
+ * Returns NULL on failure
+ */
+char *chunk_load_mem(const char *obj_file, size_t *size)
+{
+	ChunkList l;
+	char *data, *chunk;
+	int i;
+
+	if(!chunk_list_read(obj_file, &l))
+		return NULL;
+	data = (char *)malloc(l.total + 1);
+	for(i = 0; data != NULL && i < l.n; i++)
+	{
+		chunk = load_chunk(obj_file, &l.c[i]);
+		if(chunk == NULL)
+		{
+			free(data);
+			data = NULL;
+			break;
+		}
+		memcpy(data + l.c[i].offset, chunk, l.c[i].len);
+		free(chunk);
+	}
+	if(data != NULL)
+	{
+		data[l.total] = '\0';
+		*size = l.total;
+	}
+	chunk_list_free(&l);
+	return data;
+}
+
+/* Writes the chunks listed at obj_file to dest_path one after the other
+ * Returns 1 for success and 0 for failure
+ */
+int chunk_load(const char *obj_file, const char *dest_path)
+{
+	ChunkList l;
+	char *chunk;
+	FILE *f;
+	int i, ret = 1;
+
+	if(!chunk_list_read(obj_file, &l))
+		return 0;
+	f = fopen(dest_path, "wb");
+	if(f == NULL)
+	{
+		chunk_list_free(&l);
+		return 0;
+	}
+	for(i = 0; ret && i < l.n; i++)
+	{
+		chunk = load_chunk(obj_file, &l.c[i]);
+		if(chunk == NULL || fwrite(chunk, 1, l.c[i].len, f) != (size_t)l.c[i].len)
+			ret = 0;
+		free(chunk);
+	}
+	if(fclose(f) != 0)
+		ret = 0;
+	chunk_list_free(&l);
+	return ret;
+}
@@ -1,3 +1,23 @@
+/* cleanup.c
+ * Frees the space taken by the versions of a file, down to a ratio of
+ * the size of the file to that of the file and its versions
+ *
+ * A version can go once it is an untagged patch (PO) with one child,
+ * which takes the parent of the version as its own.  A parent that is
+ * a patch against the version is patched against the child instead
+ * (merge), else the patch of the version is just dropped (delete).
+ * A version of a binary or large file is a full object, a chunk list
+ * (see chunk.c), and no patch is taken against it: it can go the same
+ * way unless its parent is a patch against it.
+ *
+ * The tree is read once into a plan: the versions that can go wait in
+ * a heap by their diff per second to their child, and removing one
+ * only changes its child and its parent, which are put back in place.
+ * A dry run goes through the same plan without touching the tree or
+ * the store, taking a merged patch to be as large as the larger of the
+ * two it replaces, and tells what the cleanup would save.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,9 +30,6 @@
 #include "vfs.h"
 #include "fuse_wrapper.h"
 
-#define HASH_PATH 1
-#define HASH 0
-
 // calculates size of given file and returns as int
 
 int calc_file_size(char *fpath)
@@ -28,32 +45,28 @@ int calc_file_size(char *fpath)
 }
 
 //Given a tree file, calculates the total size of all objects in that tree
+//An object shared with other versions or files counts for its share only
 
 int calc_obj_size(file_data * file)
 {
 	
-	FILE *fp;
-	int tmp,size=0;
-	char *str = (char *)malloc(300*sizeof(char));
-	char *hash = (char *)malloc(50*sizeof(char));
-	char fpath[PATH_MAX];
+	TreeMap *t;
+	TreeMd *child;
+	int i,size=0;
 	
-	fp = fopen(file->tree_file_path,"r");
+	t = tree_open(file->tree_file_path,0);
+	if(t == NULL)
+		return 0;
 	
-	while(fscanf(fp,"%s",str) != EOF)
+	for(i=0; i<tree_count(t); i++)
 	{
-		fscanf(fp,"%d",&tmp);
-		fscanf(fp,"%d",&tmp);
-		fscanf(fp,"%s",hash);
-		strcpy(fpath,file->objects_dir_path);
-		size += calc_file_size(strcat(fpath,hash));
- 		fscanf(fp,"%s",str);		
-		fscanf(fp,"%s",str);		
-		fscanf(fp,"%s",str);		
-		
+		if(!t->rec[i].valid)
+			continue;
+		child = t->rec[i].file_type == PO ? tree_patch_child(t,TREE_OFFSET(i)) : NULL;
+		size += store_share(file,t->rec[i].obj_hash,child != NULL ? child->obj_hash : NULL);
 	}	
 	
-	fclose(fp);
+	tree_close(t);
 	return size;
 }
 
@@ -77,921 +90,374 @@ int calc_md_size(file_data * file)
 	return total;
 }
 
-/* Returns the type based on the following format 
- * 1 = PO + untagged
- * 2 = PO + tagged
- * 3 = LO + untagged
- * 4 = LO + tagged
- */
-
-int type(int lopo, int tagged)
+typedef struct _clean_plan{
+
+	const file_data *file;
+	TreeMd *rec;		/* copy of the tree, changed as versions go */
+	int n;
+	int *children;		/* valid children of each record */
+	int *patch_child;	/* first child, the one its patch is against, or -1 */
+	int *lo;		/* loose object a record is rebuilt from, or -1 */
+	char *chunked;		/* stored as a chunk list */
+	long *share;		/* what the object of a record costs it */
+	float *cost;		/* diff per second to its child */
+	int *heap;		/* candidates, cheapest first */
+	int *pos;		/* index of a record in heap, or -1 */
+	int queued;
+	int dry_run;
+}CleanPlan;
+
+/* Index of the record at offset, or -1 */
+static int record_index(const CleanPlan *p, int offset)
 {
-	if( (lopo) && (!tagged))
-		return 1;
-	else if( (lopo) && (tagged))
-		return 2;
-	else if( (!lopo) && (!tagged))
-		return 3;
-	else return 4;
-} 
-
-/* Iterator to print out a linked list consisting of node_mergedata struct */
-
-void print_iterator(gpointer item) {
-
-	log_msg("current offset %d child offset %d current tp %d child tp %d current_type %d parent_type %d mergedata %f nearest lo %d\n",((node_mergedata*)item)->current_offset,((node_mergedata*)item)->child_offset,((node_mergedata*)item)->current_timestamp,((node_mergedata*)item)->child_timestamp,((node_mergedata*)item)->current_type,((node_mergedata*)item)->parent_type,((node_mergedata*)item)->mergedata,((node_mergedata*)item)->nearest_lo_offset);
- 
-}
-
-/* Function to compare node_mergedata based on timestamp (to check if equal) */
-
-gint compare_node_mergedata(gconstpointer item1, gconstpointer item2) {
-		
-		if(((node_mergedata*)item1)->current_timestamp == ((node_mergedata*)item2)->current_timestamp && ((node_mergedata*)item1)->child_timestamp == ((node_mergedata*)item2)->child_timestamp)
-			return 1;
-		else 
-			return 0;		 
-}
-
-gint sort_node_mergedata(gconstpointer item1, gconstpointer item2) {
-		
-		if(((node_mergedata*)item1)->mergedata < ((node_mergedata*)item2)->mergedata)
-			return 0;
-		else 
-			return 1;		 
-}
-
-/* Function that generates the linked list of nodes that might be deleted/merged.
-*	Should not return root as it should never be deleted
-*/
-
-GSList *generate_ll(file_data *file,GSList* node_list)
-{
-	FILE *fp_tree, *fp_head;
-	fp_tree=fopen(file->tree_file_path,"r");
-	fp_head=fopen(file->heads_file_path,"r");
-	
-	int current_timestamp, child_timestamp=-1;
-	int parent_offset,child_offset,tmp_int,no_diff,current_type=-1,tagged=-1,current_newtype,nearest_lo_offset;
-	
 	int i;
-	
-	//list *head_list = newlist();
-	//list *lo_list = newlist();
-	
-	guint n;
-	
-	GSList *head_list = NULL; 
-	GSList *lo_list = NULL;
-	GSList *iterator = NULL;
-	GSList *iterator1 = NULL;
-
-
-    if(fp_tree==NULL || fp_head==NULL) //do check if file exists.
-	   {
-	   	printf("ERROR: tree or head file does not exist");
-	   }
-	   
-	//log_msg("\nfp_head and fp_tree are not null\n"); 
-	
-	int current_offset = 0;
-	   
-	char *tp = (char *)malloc(15*sizeof(char));
-	   
-	   //fseek(fp_head,0,SEEK_SET);
-	   
-	fscanf(fp_head,"%s %d",tp, &current_offset);
-	   
-	//log_msg("\nScanned first line of .head file\n");
-	
-	g_slist_foreach(head_list, (GFunc)print_head_iterator, NULL);
-	
-	//log_msg("end of head list\n");
-	
-	int c=0;
-	
-	while(fscanf(fp_head,"%s %d",tp,&current_offset) != EOF)
-	{
-		c++;
-		//log_msg("%d: current_timestamp %s current_offset %d\n",c,tp,current_offset);
-		head_list = g_slist_prepend(head_list, current_offset);
-		//add(head_list,current_offset);
-		//log_msg("vinay %d",*(&current_offset));
-	}
-	
-	
-	
-	//log_msg("\nhead_list:\n");
-	
-/*	for (iterator = head_list; iterator; iterator = iterator->next) {*/
-/*	  		log_msg("Current offset is '%d'\n", *((int*)iterator));*/
-/*	  		*/
-/* 		}*/
-
-	//g_slist_foreach(head_list, (GFunc)print_head_iterator, NULL);
-	
-	//log_msg("vinayvinay\n");
-	
-	//printlist(head_list);
-	
-	//return NULL;
-	
-	//log_msg("\nhead_list:\n");
-	//g_slist_foreach(head_list, (GFunc)print_head_iterator, NULL);
-	//g_slist_foreach(head_list, (GFunc)move_to_lo_iterator,NULL);
-	
-	node_head_list *headnode = NULL;
-	
-	int v =0;
-	
-	while(head_list != NULL )
-	{
-		//log_msg("\nchecked if head_list == NULL\n");
-		
-		v++;
-		
-	  	//log_msg("Current offset is '%d'\n", *((int*)(iterator)));
-	  		
-	  	//return NULL;
-	  		
-	  	//node_list = move_to_lo_iterator(*((int*)(iterator)),fp_tree,node_list,lo_list);
-	  	
-	  	current_offset = *((int*)(head_list));
-	  		
-	  	nearest_lo_offset = current_offset;
-	
-		node_mergedata *node = NULL;
-	
-		char *tmp_char=(char *)malloc(255*sizeof(char));
-		char *tag = (char *)malloc(256*sizeof(char));
-	
-		do{				
-			// log_msg("Moving to tree file\n");
-		
-			fseek(fp_tree,current_offset,SEEK_SET);
-		
-			fscanf(fp_tree,"%d", &tmp_int);											// Valid,tmp_int
-			fscanf(fp_tree,"%d", &current_timestamp);								// Epoch
-			fscanf(fp_tree,"%d", &current_type);									// LO/PO
-			fscanf(fp_tree,"%s", tmp_char);											// Hash
-			fscanf(fp_tree,"%s", tag);												// Tag
-			fscanf(fp_tree,"%d", &no_diff);											// #diff
-			fscanf(fp_tree,"%d", &parent_offset);									// Parent offset
-				
-			if(strcmp(tag,"_")==0)
-				tagged = 0;
-			else tagged = 1;
-			
-			
-				
-			current_newtype = type(current_type,tagged);
-			
-			if(current_offset == 0)
-				current_newtype =-1;
-			
-			if(node != NULL)
-			{
-				//log_msg("\n Node is not NULL, hence need to set parent_type as %d\n",current_newtype);
-				
-				node->parent_type = current_newtype;
-				node = NULL;
-			}
-				
-			if(current_type == LO && current_offset != nearest_lo_offset)
-			{
-				//log_msg("\nEncountered LO\n");
-				headnode = (node_head_list*)malloc(sizeof(node_head_list));
-				headnode -> offset = current_offset;
-	
-				if(g_slist_find(head_list, current_offset) == NULL )
-				{
-				
-					head_list = g_slist_append((head_list),current_offset);
-					//log_msg("Added item to headlist %d\n",current_offset);
-					
-				}
-				else{	
-					//log_msg("LO already present in list\n");
-					}
-				break;
-				
-			}
-					
-				
-			
-				
-			if((child_timestamp!=-1) && current_newtype == 1 && current_offset != 0)
-			{
-				
-				//log_msg("Creating a node to add to the linked list\n");
-				
-				node = (node_mergedata *)malloc(sizeof(node_mergedata));
-					
-				node->current_offset = current_offset;
-				node->child_offset = child_offset;	
-				node->current_timestamp = current_timestamp;
-				node->child_timestamp = child_timestamp;		
-				node->current_type = current_newtype;
-				node->mergedata = (float)no_diff/(child_timestamp - current_timestamp);	
-				node->nearest_lo_offset = nearest_lo_offset;
-				
-					
-				//log_msg("\nAdding node to node list\n");
-				node_list = g_slist_prepend(node_list, node);
-				//print_iterator(node);
-					
-			}
-			
-			//log_msg("Now move from current %d -> parent  %d\n",current_offset,parent_offset);
-			
-			child_timestamp = current_timestamp;		// Store current timestamp before moving to parent	
-			child_offset = current_offset;
-			current_offset = parent_offset;		  			// move to the parent
-				
-			
-					
-				
-		}while(parent_offset != -1);
-			
-		
-		head_list = g_slist_remove_link (head_list,(g_slist_nth (head_list,0)));
-		  		
-	}
-	   	
-	fclose(fp_tree);
-	fclose(fp_head);
-	
-	return node_list;
-	
-}
 
-void print_head_iterator(gpointer item) {
-	log_msg("%d\n", item);
+	if(offset < TREE_FIRST_OFFSET || (offset - TREE_FIRST_OFFSET) % sizeof(TreeMd))
+		return -1;
+	i = (offset - TREE_FIRST_OFFSET) / (int)sizeof(TreeMd);
+	return i < p->n ? i : -1;
 }
 
-/* Function that gains control from cleandisc() in vfs.c */
-
-void cleanFile(char *filepath, double ratio)
+/* Tells whether version i can go: an untagged patch or chunk list with
+ * one child.  A parent patched against a patch is patched against that
+ * child instead, which then has to be its only one; a parent patched
+ * against a chunk list keeps it.
+ */
+static int can_remove(const CleanPlan *p, int i)
 {
-	log_msg("Reached to clean file ratio = %f\n",ratio);
-	
-	file_data * file = construct_file_data(filepath);
-	
-	cleanupfile(file,ratio);
-	
+	const TreeMd *r = &p->rec[i];
+	int up;
+
+	if(!r->valid || (r->file_type != PO && !p->chunked[i]) || strcmp(r->tag, "_") != 0 || p->children[i] != 1)
+		return 0;
+	up = record_index(p, r->parent);
+	if(up < 0 || !p->rec[up].valid)
+		return 0;
+	if(p->rec[up].file_type == PO && p->patch_child[up] == i)
+		return !p->chunked[i] && p->children[up] == 1 && p->lo[p->patch_child[i]] >= 0;
+	return 1;
 }
 
-/* Function that does the actual cleaning up of the file specified */
-
-void cleanupfile(file_data *file,float required_ratio)
+static float removal_cost(const CleanPlan *p, int i)
 {
+	int dt = p->rec[p->patch_child[i]].timestamp - p->rec[i].timestamp;
 
-	int act_file_size;
-	float ratio;
-	
-	//log_msg("vinay %f\n",ratio);
-	
-	int md_size;
-	GSList *node_list = NULL;
-	
-	//log_msg("%f\n",reqdratio);
-	
-	
-	node_list = generate_ll(file,node_list);
-	   	
-	node_list = g_slist_sort(node_list, (GCompareFunc)sort_node_mergedata);
-	
-	g_slist_foreach(node_list, (GFunc)print_iterator, NULL);
-		
-	FILE *file_r;
-	
-	file_r=fopen(file->md_data_file_path,"r");
-	
-	int tmp; 
-	while(fscanf(file_r,"%d",&tmp) != EOF)
-	{
-		fscanf(file_r,"%d",&tmp);
-		fscanf(file_r,"%d",&tmp);
-		fscanf(file_r,"%f",&ratio);
-		log_msg("Ratio:::::%f",ratio);
-	}
-	fclose(file_r);
-	
-	//g_slist_foreach(node_list, (GFunc)g_free, NULL);
-	log_msg("\nbefore while loop ratio=%f  rewuired ratio=%f",ratio,required_ratio);
-	
-	//while(node_list != NULL)//some criterea is satisfied.
-	if(ratio<required_ratio)
-	{
-		while(ratio<required_ratio && node_list->next!=NULL)
-		{
-	
-			//check if diff is to be merged.
-			if(((node_mergedata*)(g_slist_nth_data (node_list,0)))->parent_type==1 || (((node_mergedata*)(g_slist_nth_data (node_list,0)))->parent_type==2 ))
-			{ 
-		
-				log_msg("\n entering merge_diff	\n");	
-				if(node_list == NULL)
-				{
-					log_msg("\n node_list is null \n");
-					break;
-				}
-				node_list = merge_diff(((node_mergedata*)(g_slist_nth_data (node_list,0))),file,node_list);
-				log_msg("\n exiting merge_diff \n");
-
-				//calculae the size of the new diff 
-			}
-			else
-			{	
-				log_msg("\n entering delete_diff	\n");	
-				//node_list=node_list->next;		
-				node_list=delete_diff(((node_mergedata*)(g_slist_nth_data (node_list,0))),file,node_list);
-				log_msg("\n exiting delete_diff \n");
-				//simplly subtract the size of the diff
-
-				//update the linked list	
-
-			}
-			node_list=NULL;
-			
-			node_list = generate_ll(file,node_list);
-	   	
-			node_list = g_slist_sort(node_list, (GCompareFunc)sort_node_mergedata);
-	
-			g_slist_foreach(node_list, (GFunc)print_iterator, NULL);
-		
-			if(node_list==NULL)
-			{
-			log_msg("\nfile cannot be cleaned further\n");
-			break;
-			}
-		
-	
-	
-	
-			log_msg("\nentering the last\n ");
-			md_size=calc_md_size(file);
-			log_msg("\nentering the last 1\n ");
-			//get the actual file size,read from heads file.
-			//char *head=(char *)malloc(PATH_MAX*sizeof(char));
-	
-			//strcpy(file->heads_file_path,head);
-			//FILE *head_file;
-			//int offset;
-			//head_file=fopen(file->heads_file_path,"r");
-			//fscanf(head_file,"%s",head);
-			//fscanf(head_file,"%d",&offset);
-			//fclose(head_file);
-			//log_msg("\nentering the last 2\n ");
-	
-	
-			//getFileHashPath(offset,head,file); //head here will after this function call store the hash
-	
-			log_msg("\nentering the last 3\n ");
-			act_file_size=calc_file_size(file->path); //calculating current heads size.
-			//update ratio
-			ratio=(float)act_file_size/(md_size+act_file_size);
-	
-			log_msg("\nentering the last 1 %f \n ",ratio);
-	
-		} 
-		FILE *md_file;
-		//strcpy(file->md_data_file_path,head);
-		md_file=fopen(file->md_data_file_path,"a");
-		int t=(int)time(NULL);
-		fprintf(md_file,"%d ",t);
-		fprintf(md_file,"%d ",act_file_size);
-		fprintf(md_file,"%d ",md_size);
-		fprintf(md_file,"%f\n",ratio);
-		// Send list to fuddi
-		//g_slist_foreach(node_list, (GFunc)g_free, NULL);
-	
-		fclose(md_file);
-	
-		if(node_list!=NULL)
-		{
-
-		g_slist_free(node_list);
-		}
-	}
+	return (float)p->rec[i].diff_count / (dt > 0 ? dt : 1);
 }
 
+static void heap_swap(CleanPlan *p, int a, int b)
+{
+	int t = p->heap[a];
 
-//this makes full_hash_path refer to thehash apth of the correstponding offset and also returns the parent offset
+	p->heap[a] = p->heap[b];
+	p->heap[b] = t;
+	p->pos[p->heap[a]] = a;
+	p->pos[p->heap[b]] = b;
+}
 
-int getFileHashPath(int offset, char *full_hash_path, file_data *f1,int return_mode)
+static void heap_up(CleanPlan *p, int k)
 {
-	FILE *f;
-	f=fopen(f1->tree_file_path,"r");
-	fseek(f,offset,SEEK_SET);
-	
-	
-	//get file hash
-	int valid, tp, lp, diff_ct, p_off;
-	char* hash=(char *)malloc(50*sizeof(char));
-	char* tag=(char *)malloc(255*sizeof(char));
-	fscanf(f,"%d",&valid);
-	if(valid==0)
+	while(k > 0 && p->cost[p->heap[k]] < p->cost[p->heap[(k - 1)/2]])
 	{
-		printf("ERROR: NOT IMPOSSIBLE\n");
-		return -1;
+		heap_swap(p, k, (k - 1)/2);
+		k = (k - 1)/2;
 	}
-	fscanf(f,"%d %d %s %s %d %d",&tp, &lp, hash, tag, &diff_ct, &p_off);
-	fclose(f);
-	if(return_mode ==0)
-	strcpy(full_hash_path,hash);
-	//calculate absolute path of the hash file.
-	else
-	{	strcpy(full_hash_path, f1->objects_dir_path);
-	
-	//now append objects and the file name to full_hash_path
-		log_msg("\n getr hash file parent offset %d %d %d %s %s %d %d \n",valid,tp,lp,hash,tag,diff_ct,p_off);
-	strcat(full_hash_path,hash);
-	
-	}
-	return p_off;
-	
-		
 }
 
-
-
-
-//function to merge two diffs.takes offset of the current and it's parent as parameter.
-// f is the pointer to the tree file.
-GSList *merge_diff(node_mergedata *node,file_data *f,GSList *node_list)
+static void heap_down(CleanPlan *p, int k)
 {
-	if(node_list->next == NULL)
-	{
-	log_msg("\n\nfurther cleaning not possible\n\n");
-	return NULL;
-	}
-	
-	log_msg("\nentering merge\n");
-
-	log_msg(" current offset %d",node->current_offset);
-
-	//log_msg(" \n 121212 %d \n ",((node_mergedata *)node_list)->current_offset);
-
-	//log_msg("current_offset %d",(node_mergedata(g_slist_nth_data (node_list,0)))->current_offset);
-
-	log_msg("\n current offset %d child offset %d current tp %d child tp %d current_type %d parent_type %d mergedata %f nearest lo %d\n",((node_mergedata*)(g_slist_nth_data (node_list,0)))->current_offset,((node_mergedata*)(g_slist_nth_data (node_list,0)))->child_offset,((node_mergedata*)(g_slist_nth_data (node_list,0)))->current_timestamp,((node_mergedata*)(g_slist_nth_data (node_list,0)))->child_timestamp,((node_mergedata*)(g_slist_nth_data (node_list,0)))->current_type,((node_mergedata*)(g_slist_nth_data (node_list,0)))->parent_type,((node_mergedata*)(g_slist_nth_data (node_list,0)))->mergedata,((node_mergedata*)(g_slist_nth_data (node_list,0)))->nearest_lo_offset);
-
-
-	int nearest_offset=node->nearest_lo_offset;
-	int current_offset=node->current_offset;
-	
-	
-	char *tree_path=(char *)malloc(PATH_MAX*sizeof(char));
-	char *object_path=(char *)malloc(PATH_MAX*sizeof(char));
-	strcpy(object_path, f->objects_dir_path);
-	strcpy(tree_path, f->tree_file_path);
-	
-	
-	log_msg("\n tree_file_path %s \n",f->tree_file_path);
-	
-	log_msg("\n object_path %s \n",f->objects_dir_path );
-	
-	log_msg("\n nearest_offset %d \n current_offset %d \n",nearest_offset,current_offset);
-
-	int c_off = create_file_fromlo_cleanup(tree_path,current_offset,nearest_offset,object_path,1);
-	
-	log_msg("\n cheild %d\n ",c_off);
-	
-	char *tmp_filepath=(char *)malloc(PATH_MAX*sizeof(char));
-	char *tmp_filepath2=(char *)malloc(PATH_MAX*sizeof(char));
-	char *tmp_filepath3=(char *)malloc(PATH_MAX*sizeof(char));
-	strcpy(tmp_filepath, "/tmp/rvfs/switchC");
-	strcpy(tmp_filepath2, "/tmp/rvfs/switchP");
-	strcpy(tmp_filepath3, "/tmp/rvfs/switchdiff");
-	//now create the diff at the temp place
-		
-	
-	log_msg("\nstage 1\n");
-	//now calculate the diff and even edits the tree and OBJ_MD file
-	diff(tmp_filepath,tmp_filepath2,tmp_filepath3);
-
-	
-	char * a = (char *)malloc(50*sizeof(char));
-	find_SHA(tmp_filepath3, a);
-	strcpy(tmp_filepath, object_path);
-
-	
-	strcat(tmp_filepath,a);
-	//write a to the tree file.
-	
-	log_msg("\nstage 2\n");
-	
-	copy(tmp_filepath3,tmp_filepath);
+	int c;
 
-	compress(tmp_filepath);
-	
-	char * rem_obj = (char *)malloc(PATH_MAX*sizeof(char));
-	
-	
-	
-	int parent_offset = getFileHashPath(current_offset, rem_obj, f,1);
-	delete(rem_obj);
-	getFileHashPath(current_offset, rem_obj, f,0);
-	update_objmd_file(rem_obj,f->OBJ_MD_file_path,1);
-	
-	
-	
-	getFileHashPath(parent_offset,rem_obj,f,1);
-	
-	log_msg(" \n path of rem_onj \n %s",rem_obj);
-	
-	delete(rem_obj);
-	getFileHashPath(parent_offset,rem_obj,f,0);
-	update_objmd_file(rem_obj,f->OBJ_MD_file_path,1);
-	
-	log_msg("\n parent offset %d \n",parent_offset);
-	FILE *f_new;
-	f_new=fopen(f->tree_file_path,"r+");
-	
-	if(parent_offset==-1)
+	while((c = 2*k + 1) < p->queued)
 	{
-		printf("error: you cannot go above that.\n");
-		return NULL;
+		if(c + 1 < p->queued && p->cost[p->heap[c + 1]] < p->cost[p->heap[c]])
+			c++;
+		if(p->cost[p->heap[c]] >= p->cost[p->heap[k]])
+			break;
+		heap_swap(p, k, c);
+		k = c;
 	}
+}
 
-	fseek(f_new,parent_offset,SEEK_SET);
-	//now write to the tree file the name of the hash
-	int valid, tp, lp, p_off;
-	char* hash=(char *)malloc(50*sizeof(char));
-	char* tag=(char *)malloc(255*sizeof(char));
-	char* diff_ct=(char *)malloc(15*sizeof(char));
+/* Puts record i back in place in the heap, or takes it out, after a
+ * change of i or of its neighbours
+ */
+static void requeue(CleanPlan *p, int i)
+{
+	int k = p->pos[i];
 
-	log_msg("\nstage 3\n");
-	fscanf(f_new,"%d",&valid);
-	if(valid==0)
+	if(!can_remove(p, i))
 	{
-		printf("ERROR: NOT IMPOSSIBLE\n");
-		return NULL;
-	}
-	
-	log_msg("\n new hash %s \n",a);
-	
-	fscanf(f_new,"%d %d",&tp, &lp);
-	fprintf(f_new," %s",a);
-	
-	
-	fseek(f_new, c_off, SEEK_SET);
-	fscanf(f_new,"%d",&valid);
-	if(valid==0)
-	{
-		printf("ERROR: NOT IMPOSSIBLE\n");
-		return NULL;
-	}
-	fscanf(f_new,"%d %d %s %s %s",&tp, &lp, hash, tag, diff_ct);
-	
-	log_msg("\n %d %d %d %s %s %s \n",valid, tp, lp,hash, tag, diff_ct);
-	
-	fseek(f_new,10 - strlen(diff_ct),SEEK_CUR);
-	char * p_offstr = (char *)malloc(12*sizeof(char));
-	
-	log_msg("\n %d parent offset \n",parent_offset);
-	
-	itoa(parent_offset, p_offstr);
-	
-	log_msg("\n %s parent offset \n",p_offstr);
-	
-	fprintf(f_new, " %s", addspaces(p_offstr, 10));
-	
-	
-	fseek(f_new,current_offset,SEEK_SET);
-	fprintf(f_new,"0");
-	fclose(f_new);
-	
-	log_msg("invalidates the entry");
-	
-
-	char *tmp_char=(char *)malloc(PATH_MAX*sizeof(char));
-		//if tagged then donot updata the merge data
-		if(node->parent_type==1 && node->parent_type!=-1 )
+		if(k < 0)
+			return;
+		p->pos[i] = -1;
+		if(k != --p->queued)
 		{
-			GSList *tmp_list;
-			tmp_list=node_list; //tmp points to the same place as node
-			
-		/*	log_msg("\n %d current offset \n",((node_mergedata*)(g_slist_nth_data (node_list,0)))->current_offset);
-			
-			//log_msg("\n   11111  forward \n tmp_list current_offset %d:\n",((node_mergedata *)node_list)->current_offset);
-			node_list=node_list->next;
-			
-			log_msg("\n %d current offset \n",((node_mergedata*)(g_slist_nth_data (node_list,0)))->current_offset);
-			
-			//node_mergedata *tmp;
-			*/
-			
-			
-			log_msg("\n entered this function\n");
-			//find node with offset=parent_offset;
-			while(tmp_list!=NULL)
-			{
-				tmp_list=tmp_list->next;
-				
-				//tmp=(node_mergedata *)tmp_list;	
-				
-				//log_msg("\n moving forward \n tmp_list current_offset %d:\n",tmp->current_offset);
-				
-				//tmp=(node_mergedata *)tmp_list;
-				if(tmp_list == NULL )
-				{
-				break;
-				}
-				else
-				{
-				log_msg("\n moving forward \n tmp_list current_offset %d:\n",((node_mergedata*)(g_slist_nth_data (tmp_list,0)))->current_offset);
-				
-				if(((node_mergedata*)(g_slist_nth_data (tmp_list,0)))->current_offset == parent_offset)
-					{
-					log_msg("\n entering \n \n");
-					((node_mergedata*)(g_slist_nth_data (tmp_list,0)))->child_timestamp=node->child_timestamp;
-					getFileHashPath(((node_mergedata*)(g_slist_nth_data (tmp_list,0)))->current_offset,tmp_char,f,1);
-	
-					//calculate size of the new metadeta and update mergedata.
-					int time=-((((node_mergedata*)(g_slist_nth_data (tmp_list,0)))->current_timestamp)-(node->child_timestamp));
-					((node_mergedata*)(g_slist_nth_data (tmp_list,0)))->mergedata=(float)calc_file_size(tmp_char)/time;
-				
-					int counter=0;
-					log_msg("\n time = %d \n ", time );
-					scanf("%d",&counter);
-				
-					log_msg("\n getting out from while loop\n");
-					break;
-					}
-				}
-			}
-			
-				
+			p->heap[k] = p->heap[p->queued];
+			p->pos[p->heap[k]] = k;
+			heap_up(p, k);
+			heap_down(p, k);
 		}
-		
-		log_msg("\n deleting\n");
-		
-		node_list=g_slist_delete_link(node_list,(g_slist_nth (node_list,0)));
-		log_msg("\n deleted\n");
-		
-		node_list=g_slist_sort(node_list,(GCompareFunc)sort_node_mergedata);	
-		node=(node_mergedata *)node_list;
-		
-		log_msg("\n printing linked list \n");
-		
-		g_slist_foreach(node_list, (GFunc)print_iterator, NULL);
-		return node_list;
-		
-}
-
-
-
-
-// d;etes diff, takes offset of the current node as parameter.
-GSList *delete_diff(node_mergedata *node,file_data *file,GSList *node_list)
-{ 
-	if(node_list->next == NULL)
-		{
-		log_msg("\n\nfurther cleaning not possible\n\n");
-		return NULL;
-		}	
-	
-	int tmp_offset=node->current_offset;
-	char *hash_path=(char *)malloc(PATH_MAX*sizeof(char));
-	int p_off=getFileHashPath(tmp_offset, hash_path, file,1);
-	
-	delete(hash_path);
-    p_off=getFileHashPath(tmp_offset, hash_path, file,0);
-	update_objmd_file(hash_path,file->OBJ_MD_file_path, 1);
-	
-	
-	int valid, tp, lp, p1_off;
-	
-	int nearest_offset=node->nearest_lo_offset;
-	int current_offset=node->current_offset;
-	
-	char* hash=(char *)malloc(50*sizeof(char));
-	char* tag=(char *)malloc(255*sizeof(char));
-	char* diff_ct=(char *)malloc(15*sizeof(char));
-	
-	
-	
-	char *tree_path=(char *)malloc(PATH_MAX*sizeof(char));
-	char *diff_str=(char *)malloc(15*sizeof(char));
-	char *object_path=(char *)malloc(PATH_MAX*sizeof(char));
-	strcpy(object_path, file->objects_dir_path);
-	strcpy( tree_path, file->tree_file_path);
-	
-	int c_off = create_file_fromlo_cleanup(tree_path,current_offset,nearest_offset,object_path,2);
-	
-	log_msg("\n child offset %d \n",c_off);
-	log_msg("\nparent offset %d\n",p_off);
-	
-	
-	FILE *f;
-	f=fopen(tree_path,"r+");
-	fseek(f,c_off,SEEK_SET);
-	
-	fscanf(f,"%d",&valid);
-	if(valid==0)
-	{
-		printf("ERROR: NOT IMPOSSIBLE\n");
-		return NULL;
-	}
-	fscanf(f,"%d %d %s %s %s",&tp, &lp, hash, tag, diff_ct);
-	fseek(f,10 - strlen(diff_ct),SEEK_CUR);
-	sprintf(diff_str,"%d",p_off);
-	fprintf(f, " %s", addspaces(diff_str,10));
-	
-	
-	
-	fseek(f,tmp_offset,SEEK_SET);
-	fprintf(f,"0");
-	
-//	fseek(f,c_off,SEEK_SET);
-	
-	fclose(f);
-	
-	
-	node_list=g_slist_delete_link(node_list,node_list);
-	
-	
-	if(node_list != NULL)
-	{
-	g_slist_foreach(node_list, (GFunc)print_iterator, NULL);
+		return;
 	}
-	else
+	p->cost[i] = removal_cost(p, i);
+	if(k < 0)
 	{
-	log_msg("\n node list is null \n");
+		k = p->queued++;
+		p->heap[k] = i;
+		p->pos[i] = k;
 	}
-	//remove the hashfile
-
-	//invalidate the entry in the tree file
-	return node_list;
-	//remove the corresponding entry in the OBJ_MD file
+	heap_up(p, k);
+	heap_down(p, p->pos[i]);
 }
 
-/*
-
-
-int cleanupfile(file_data *file)
+static void plan_close(CleanPlan *p)
 {
+	free(p->rec);
+	free(p->children);
+	free(p->patch_child);
+	free(p->lo);
+	free(p->chunked);
+	free(p->share);
+	free(p->cost);
+	free(p->heap);
+	free(p->pos);
+}
 
-	GSList *node_list;
-	node = generate_ll(file,node);
-	
-	
-	
-	
-
-	while(node != NULL)//some criterea is satisfied.
+/* Reads the tree of file into p and queues the versions that can go
+ * Returns 1 for success and 0 for failure
+ */
+static int plan_open(CleanPlan *p, const file_data *file, int dry_run)
+{
+	TreeMap *t = tree_open(file->tree_file_path, 0);
+	char path[PATH_MAX];
+	TreeMd *r;
+	int i, up, n;
+
+	memset(p, 0, sizeof(CleanPlan));
+	if(t == NULL)
+		return 0;
+	n = tree_count(t);
+	for(i = 0; i < n; i++)
 	{
-		//check if diff is to be merged.
-		if(node->parent_type==1 || node->parent_type==2 )
+		if(tree_at(t, TREE_OFFSET(i)) == NULL)
 		{
-			merge_diff(node,file);
-
-			//calculae the size of the new diff 
+			log_warn("cleanupfile: record %d of %s is damaged, not cleaning\n", i, file->tree_file_path);
+			tree_close(t);
+			return 0;
 		}
+	}
+	p->file = file;
+	p->n = n;
+	p->dry_run = dry_run;
+	p->rec = (TreeMd *)malloc((n + 1)*sizeof(TreeMd));
+	memcpy(p->rec, t->rec, n*sizeof(TreeMd));
+	tree_close(t);
+
+	p->children = (int *)calloc(n + 1, sizeof(int));
+	p->patch_child = (int *)malloc((n + 1)*sizeof(int));
+	p->lo = (int *)malloc((n + 1)*sizeof(int));
+	p->chunked = (char *)calloc(n + 1, sizeof(char));
+	p->share = (long *)calloc(n + 1, sizeof(long));
+	p->cost = (float *)calloc(n + 1, sizeof(float));
+	p->heap = (int *)malloc((n + 1)*sizeof(int));
+	p->pos = (int *)malloc((n + 1)*sizeof(int));
+	for(i = 0; i < n; i++)
+		p->patch_child[i] = p->pos[i] = -1;
+
+	/* children are always appended after their parent */
+	for(i = 0; i < n; i++)
+	{
+		if(!p->rec[i].valid || (up = record_index(p, p->rec[i].parent)) < 0 || up >= i)
+			continue;
+		p->children[up]++;
+		if(p->patch_child[up] < 0)
+			p->patch_child[up] = i;
+	}
+	for(i = n - 1; i >= 0; i--)
+	{
+		r = &p->rec[i];
+		if(!r->valid)
+			p->lo[i] = -1;
+		else if(r->file_type == LO)
+			p->lo[i] = i;
 		else
+			p->lo[i] = p->patch_child[i] >= 0 ? p->lo[p->patch_child[i]] : -1;
+		if(r->valid && r->file_type == PO && p->patch_child[i] >= 0)
+			p->share[i] = store_share(file, r->obj_hash, p->rec[p->patch_child[i]].obj_hash);
+		else if(r->valid && r->file_type == LO)
 		{
-			delete_diff(node,file);
-
-			//simplly subtract the size of the diff
-
-			//update the linked list	
-
+			store_path(path, file, r->obj_hash, NULL);
+			p->chunked[i] = is_chunk_list(path);
+			if(p->chunked[i])
+				p->share[i] = store_share(file, r->obj_hash, NULL);
 		}
-		
-	
-	int md_size=calc_md_size(file);
-	//get the actual file size,read from heads file.
-	char *head=(char *)malloc(PATH_MAX*sizeof(char));
-	strcpy(file->heads_file_path,head);
-	FILE *head_file;
-	int offset;
-	head_file=fopen(head,"r");
-	fscanf(head_file,"%s",head);
-	fscanf(head_file,"%d",&offset);
-	fclose(head_file);
-	
-	
-	getFileHashPath(offset,head,file); //head here will after this function call store the hash
-	int act_file_size=calc_file_size(head); //calculating current heads size.
-	//update ratio
-	float ratio=(float)md_size/act_file_size;
-	
-	FILE *md_file;
-	strcpy(file->md_data_file_path,head);
-	md_file=fopen(head,"r+");
-	int tmp;
-	fscanf(md_file,"%d",&tmp);
-	fprintf(md_file,"%d",act_file_size);
-	fprintf(md_file,"%d",md_size);
-	fprintf(md_file,"%f",ratio);
-
-	} 
+	}
+	for(i = 0; i < n; i++)
+		requeue(p, i);
+	return 1;
 }
-*/
 
-
-int create_file_fromlo_cleanup(char * file_tree_path, int d_off, int lo_off, char * obj_dir_path, int mode)         // returns -1 for no success and offset of child for success
+/* Patches version up against version d, the child of the version
+ * between them, and stores the patch
+ * Returns 1 for success and 0 for failure
+ */
+static int repatch(CleanPlan *p, int up, int d, int *diff_count, long *share)
 {
-	FILE * fp = fopen(file_tree_path, "r");
-	fseek(fp, lo_off, SEEK_SET);
-	int valid, off = lo_off;
-	fscanf(fp, "%d", &valid);
-	if(valid==0)
+	const file_data *file = p->file;
+	TreeMap *t = tree_open(file->tree_file_path, 0);
+	char *child, *parent = NULL, *delta = NULL;
+	size_t child_len, parent_len, delta_len;
+	char scratch[PATH_MAX];
+	int ops, ret = 0;
+
+	child = build_version_mem(t, file, TREE_OFFSET(p->lo[d]), TREE_OFFSET(d), &child_len);
+	if(child != NULL)
+		parent = build_version_mem(t, file, TREE_OFFSET(p->lo[d]), TREE_OFFSET(up), &parent_len);
+	tree_close(t);
+	if(parent != NULL)
+		delta = delta_create_mem(child, child_len, parent, parent_len, &delta_len, &ops);
+	if(delta != NULL && make_scratch(scratch, file->objects_dir_path, "merge"))
 	{
-		printf("ERROR: NOT POSSIBLE.\n");
-		return -1;
+		ret = write_file(scratch, delta, delta_len) && store_put(file, scratch, p->rec[up].obj_hash, p->rec[d].obj_hash);
+		unlink(scratch);
 	}
-	
-	int tp, lp, diff_ct, p_off;
-	char * hash = (char *)malloc(50*sizeof(char));
-	char * tag = (char *)malloc(255*sizeof(char));
-	
-	fscanf(fp, "%d %d %s %s %d %d", &tp, &lp, hash, tag, &diff_ct, &p_off);
-	
-	char * temp_file = (char *)malloc(PATH_MAX*sizeof(char));
-	mkdir("/tmp/rvfs", (mode_t)0755);
-	strcpy(temp_file, "/tmp/rvfs/switchC");                                    // switchC stores the file of the child
-	char * curr_file = (char *)malloc(PATH_MAX*sizeof(char));
-	strcpy(curr_file, obj_dir_path);
-	
-	strcat(curr_file, hash);
-	
-	if(mode==1)
+	if(ret)
 	{
-		decompress(curr_file);
-		copy(curr_file, temp_file);
-		compress(curr_file);
+		*diff_count = delta_len;
+		*share = store_share(file, p->rec[up].obj_hash, p->rec[d].obj_hash);
 	}
-	
-	while(p_off!=d_off)
+	free(child);
+	free(parent);
+	free(delta);
+	return ret;
+}
+
+/* Removes version c, from the tree and the store or, in a dry run,
+ * from the plan only.  Its child takes its parent as its own, and a
+ * parent patched against it is patched against the child (merge).
+ * Returns the bytes saved or -1 on failure
+ */
+static long plan_remove(CleanPlan *p, int c)
+{
+	int d = p->patch_child[c], up = record_index(p, p->rec[c].parent);
+	int merge = p->rec[up].file_type == PO && p->patch_child[up] == c;
+	int diff_count = p->rec[up].diff_count;
+	long saved = p->share[c], share = 0;
+	const char *path = p->file->tree_file_path;
+
+	if(merge)
 	{
-		off = p_off;
-		fseek(fp, off, SEEK_SET);
-		fscanf(fp, "%d", &valid);
-		if(valid==0)
+		saved += p->share[up];
+		if(p->dry_run)
 		{
-			printf("ERROR: NOT POSSIBLE.\n");
-			return -1;
+			/* the merged patch is taken to be as large as the larger one */
+			share = MAX(p->share[up], p->share[c]);
+			diff_count = MAX(p->rec[up].diff_count, p->rec[c].diff_count);
 		}
-		
-		fscanf(fp, "%d %d %s %s %d %d", &tp, &lp, hash, tag, &diff_ct, &p_off);
-		int i = strlen(curr_file);
-		while(curr_file[i]!='/')
-			i--;
-		curr_file[i+1] = '\0';
-		strcat(curr_file, hash);
-		
-		if(mode==1)
+		else if(!repatch(p, up, d, &diff_count, &share))
 		{
-			decompress(curr_file);
-			if(lp==0)
-				copy(curr_file, temp_file);
-			else
-				patch(temp_file, curr_file);
-			compress(curr_file);
+			log_warn("cleanupfile: cannot patch %d against %d\n", TREE_OFFSET(up), TREE_OFFSET(d));
+			return -1;
 		}
 	}
-	char * temp_file1 = (char *)malloc(PATH_MAX*sizeof(char));
-	strcpy(temp_file1, "/tmp/rvfs/switchP");
-	if(mode==1)
-		copy(temp_file, temp_file1);
-	
-	int j;
-	for(j=0; j<2; j++)
+
+	p->rec[d].parent = p->rec[c].parent;
+	p->rec[c].valid = 0;
+	p->rec[up].diff_count = diff_count;
+	if(!p->dry_run)
 	{
-		fseek(fp, p_off, SEEK_SET);
-		fscanf(fp, "%d", &valid);
-		if(valid==0)
+		/* the patches through c go once the tree stops using them */
+		wal_begin();
+		if(merge)
+			tree_write(path, TREE_OFFSET(up), &p->rec[up]);
+		tree_write(path, TREE_OFFSET(d), &p->rec[d]);
+		tree_write(path, TREE_OFFSET(c), &p->rec[c]);
+		store_drop(p->file, p->rec[c].obj_hash, p->chunked[c] ? NULL : p->rec[d].obj_hash);
+		if(merge)
+			store_drop(p->file, p->rec[up].obj_hash, p->rec[c].obj_hash);
+		if(!wal_commit())
 		{
-			printf("ERROR: NOT POSSIBLE.\n");
+			log_warn("cleanupfile: cannot remove %d from %s\n", TREE_OFFSET(c), path);
 			return -1;
 		}
-		fscanf(fp, "%d %d %s %s %d %d", &tp, &lp, hash, tag, &diff_ct, &p_off);
-		int i = strlen(curr_file);
-		while(curr_file[i]!='/')
-			i--;
-		curr_file[i+1] = '\0';
-		strcat(curr_file, hash);
-		
-		if(mode==1)
-		{
-			decompress(curr_file);
-			if(lp==0)
-				copy(curr_file, temp_file1);
-			else
-				patch(temp_file1, curr_file);
-			compress(curr_file);
-		}	
 	}
-	
-	fclose(fp);
-	return off;
+
+	if(merge)
+		p->share[up] = share;
+	if(p->patch_child[up] == c)
+		p->patch_child[up] = d;
+	p->children[c] = 0;
+	p->share[c] = 0;
+	requeue(p, c);
+	requeue(p, d);
+	requeue(p, up);
+	log_msg("cleanupfile: %s %d, %ld bytes\n", merge ? "merged" : "deleted", TREE_OFFSET(c), saved - share);
+	return saved - share;
 }
 
+/* Removes versions of file, the one with the least diff per second to
+ * its child first, until the file takes at least required_ratio of the
+ * space of itself and its versions, or limit versions are gone if limit
+ * is not 0, or go_on, if not NULL, returns 0 before a removal.  A dry
+ * run only works out which.
+ * Returns the number of versions removed, the bytes saved in *saved if
+ * not NULL, or -1 if the tree cannot be read
+ */
+int cleanupfile(file_data *file, float required_ratio, int limit, int (*go_on)(void), int dry_run, long *saved)
+{
+	long md_size, file_size, step, total = 0;
+	int removed = 0;
+	CleanPlan p;
+	float ratio;
+	FILE *md_file;
 
+	if(!plan_open(&p, file, dry_run))
+		return -1;
+	file_size = calc_file_size((char *)file->path);
+	md_size = calc_md_size(file);
+	ratio = (float)file_size/(md_size + file_size);
+	log_msg("cleanupfile: %s, ratio %f, %f required, %d versions can go\n", file->path, ratio, required_ratio, p.queued);
 
+	while(ratio < required_ratio && p.queued > 0 && (limit == 0 || removed < limit))
+	{
+		if(go_on != NULL && !go_on())
+			break;
+		step = plan_remove(&p, p.heap[0]);
+		if(step < 0)
+			break;
+		removed++;
+		total += step;
+		md_size -= step;
+		ratio = (float)file_size/(md_size + file_size);
+	}
+	plan_close(&p);
 
+	if(!dry_run && removed > 0)
+	{
+		md_size = calc_md_size(file);
+		ratio = (float)file_size/(md_size + file_size);
+		md_file = fopen(file->md_data_file_path, "a");
+		if(md_file != NULL)
+		{
+			fprintf(md_file, "%d %ld %ld %f\n", (int)time(NULL), file_size, md_size, ratio);
+			fclose(md_file);
+		}
+	}
+	log_msg("cleanupfile: %s, %d versions %s, %ld bytes, ratio %f\n", file->path, removed, dry_run ? "would go" : "removed", total, ratio);
+	if(saved != NULL)
+		*saved = total;
+	return removed;
+}
 
+/* Cleans up the file at filepath, see cleanupfile() */
+int cleanFile(char *filepath, double ratio, int dry_run, long *saved)
+{
+	file_data *file = construct_file_data(filepath);
+	int ret;
 
+	log_msg("Reached to clean file ratio = %f\n",ratio);
+	ret = cleanupfile(file,ratio,0,NULL,dry_run,saved);
+	free(file);
+	return ret;
+}
@@ -0,0 +1,244 @@
+/* commit_queue.c
+ * Versioning off the FUSE release path
+ *
+ * vfs_release() only snapshots the written file into the spool folder
+ * of the root .ver (a reflink where the underlying file system supports
+ * it, a copy otherwise) and queues it, so close() does not wait for
+ * hashing, diffing and compressing.  COMMIT_WORKERS threads then run
+ * commit_version() on the snapshots.
+ *
+ * Jobs are sharded by the directory of the file.  One worker owns a
+ * directory, so the commits of a file stay in release order and the
+ * .ver metadata of a directory is never written by two workers at once.
+ *
+ * commit_flush() waits until every queued commit is done.  Commands that
+ * read or rewrite version metadata (lsver, checkout, unlink, ...) call
+ * it first so they see consistent heads.
+ */
+
+#include "params.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <fuse.h>
+#include <glib.h>
+
+#include "vfs.h"
+#include "log.h"
+
+#define COPY_CHUNK (64*1024)
+
+typedef struct _commit_job {
+
+	char path[PATH_MAX];	/* file that was released */
+	char snap[PATH_MAX];	/* its contents at release time */
+	FileChanges changes;	/* since the previous release */
+	int timestamp;		/* time of the release, stamped on the version */
+}CommitJob;
+
+static GAsyncQueue *queues[COMMIT_WORKERS];
+static pthread_t workers[COMMIT_WORKERS];
+static CommitJob stop_job;
+static char spool_dir[PATH_MAX];
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_done = PTHREAD_COND_INITIALIZER;
+static int pending, started;
+static long spool_seq;
+
+/* Copies src_path to snap_path, sharing the blocks when possible
+ * Returns 1 for success and 0 for failure
+ */
+static int snapshot(const char *src_path, const char *snap_path)
+{
+	char buf[COPY_CHUNK];
+	ssize_t n;
+	int in, out, ret = 1;
+
+	in = open(src_path, O_RDONLY);
+	if(in < 0)
+		return 0;
+	out = open(snap_path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if(out < 0)
+	{
+		close(in);
+		return 0;
+	}
+#ifdef FICLONE
+	if(ioctl(out, FICLONE, in) == 0)
+	{
+		close(in);
+		return close(out) == 0;
+	}
+#endif
+	while((n = read(in, buf, sizeof(buf))) > 0)
+	{
+		if(write(out, buf, n) != n)
+		{
+			ret = 0;
+			break;
+		}
+	}
+	if(n < 0)
+		ret = 0;
+	close(in);
+	if(close(out) != 0)
+		ret = 0;
+	if(!ret)
+		unlink(snap_path);
+	return ret;
+}
+
+/* Worker owning the directory of fpath */
+static int shard(const char *fpath)
+{
+	const char *end = strrchr(fpath, '/');
+	unsigned int h = 5381;
+
+	if(end == NULL)
+		end = fpath + strlen(fpath);
+	for(; fpath < end; fpath++)
+		h = h*33 + (unsigned char)*fpath;
+	return h % COMMIT_WORKERS;
+}
+
+static void *commit_worker(void *arg)
+{
+	GAsyncQueue *q = (GAsyncQueue *)arg;
+	CommitJob *job;
+
+	for(;;)
+	{
+		job = (CommitJob *)g_async_queue_pop(q);
+		if(job == &stop_job)
+			break;
+		commit_version(job->path, job->snap, &job->changes, job->timestamp);
+		unlink(job->snap);
+		dirty_free(&job->changes.dirty);
+		free(job);
+
+		pthread_mutex_lock(&pending_lock);
+		if(--pending == 0)
+			pthread_cond_broadcast(&pending_done);
+		pthread_mutex_unlock(&pending_lock);
+	}
+	return NULL;
+}
+
+/* Starts the workers, called from vfs_init() once FUSE has forked.
+ * Snapshots left in the spool by a crash are dropped, their file is
+ * unknown.
+ */
+void commit_start(void)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+	int i;
+
+	snprintf(spool_dir, PATH_MAX, "%s/%s%s", BB_DATA->rootdir, VER_DIR, SPOOL_FOLDER);
+	mkdir(spool_dir, (mode_t)0755);
+	d = opendir(spool_dir);
+	if(d != NULL)
+	{
+		while((de = readdir(d)) != NULL)
+		{
+			if(de->d_name[0] == '.')
+				continue;
+			snprintf(path, PATH_MAX, "%s%s", spool_dir, de->d_name);
+			log_info("commit_start: dropping stale snapshot %s\n", path);
+			unlink(path);
+		}
+		closedir(d);
+	}
+
+	for(i = 0; i < COMMIT_WORKERS; i++)
+	{
+		queues[i] = g_async_queue_new();
+		if(pthread_create(&workers[i], NULL, commit_worker, queues[i]) != 0)
+		{
+			log_warn("commit_start: cannot start worker %d, versioning synchronously\n", i);
+			for(i--; i >= 0; i--)
+			{
+				g_async_queue_push(queues[i], &stop_job);
+				pthread_join(workers[i], NULL);
+			}
+			return;
+		}
+	}
+	started = 1;
+}
+
+/* Queues a new version of fpath, called on release of a written file
+ * with its lock held.  changes tells what was written, the job takes
+ * over its ranges and the verdict on the file, so the worker need not
+ * sniff it again.  Versions in place when the workers are not running.
+ */
+void commit_release(const char *fpath, FileChanges *changes)
+{
+	char why[PATH_MAX + 32];
+	CommitJob *job;
+
+	changes->sniff = classify_file(fpath, changes->sniff, &changes->dirty, why, sizeof(why)) ? SNIFF_TEXT : SNIFF_BINARY;
+	log_msg("commit_release: %s is %s\n", fpath, why);
+	if(!started)
+	{
+		commit_version(fpath, fpath, changes, (int) time(NULL));
+		return;
+	}
+
+	job = (CommitJob *)malloc(sizeof(CommitJob));
+	strcpy(job->path, fpath);
+	job->timestamp = (int) time(NULL);
+	pthread_mutex_lock(&pending_lock);
+	snprintf(job->snap, PATH_MAX, "%s%ld", spool_dir, spool_seq++);
+	pthread_mutex_unlock(&pending_lock);
+
+	if(!snapshot(fpath, job->snap))
+	{
+		log_warn("commit_release: cannot snapshot %s, versioning in place\n", fpath);
+		free(job);
+		commit_flush();
+		commit_version(fpath, fpath, changes, (int) time(NULL));
+		return;
+	}
+
+	job->changes = *changes;
+	memset(&changes->dirty, 0, sizeof(DirtyMap));
+	pthread_mutex_lock(&pending_lock);
+	pending++;
+	pthread_mutex_unlock(&pending_lock);
+	g_async_queue_push(queues[shard(fpath)], job);
+}
+
+/* Waits until every queued commit is done */
+void commit_flush(void)
+{
+	pthread_mutex_lock(&pending_lock);
+	while(pending > 0)
+		pthread_cond_wait(&pending_done, &pending_lock);
+	pthread_mutex_unlock(&pending_lock);
+}
+
+/* Finishes the queued commits and stops the workers, from vfs_destroy() */
+void commit_stop(void)
+{
+	int i;
+
+	if(!started)
+		return;
+	commit_flush();
+	for(i = 0; i < COMMIT_WORKERS; i++)
+		g_async_queue_push(queues[i], &stop_job);
+	for(i = 0; i < COMMIT_WORKERS; i++)
+		pthread_join(workers[i], NULL);
+	started = 0;
+}
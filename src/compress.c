@@ -0,0 +1,386 @@
+/* compress.c
+ * In-process storage of version objects in .ver/objects
+ *
+ * Every object is written exactly once as an ObjHeader followed by a
+ * zlib stream of its contents.  Readers inflate straight into the
+ * destination (or into memory), so a decompressed copy is never
+ * written back into the objects folder.
+ *
+ * Objects written by the old tar/gzip based compress() are still
+ * readable: they are recognised by the missing header magic.  A
+ * version cut into chunks is a chunk list instead (see chunk.c), which
+ * the loaders put back together.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "vfs.h"
+#include "log.h"
+
+#define CHUNK_SIZE (64*1024)
+#define TAR_BLOCK 512
+
+static int is_obj_header(ObjHeader *hdr)
+{
+	return memcmp(hdr->magic, OBJ_MAGIC, sizeof(hdr->magic)) == 0;
+}
+
+/* Compresses src_path into obj_file.
+ * The object is assembled in a temporary file next to obj_file and
+ * renamed over it, so readers never see a half written object.
+ * Returns 1 for success and 0 for failure
+ */
+int store_object(const char *src_path, const char *obj_file)
+{
+	long long start = stats_now();
+	unsigned char in[CHUNK_SIZE], out[CHUNK_SIZE];
+	char tmp_path[PATH_MAX];
+	ObjHeader hdr;
+	z_stream strm;
+	FILE *src, *dst;
+	int flush, ret = 0;
+	size_t n;
+
+	src = fopen(src_path, "rb");
+	if(src == NULL)
+	{
+		log_error("store_object: cannot open %s\n", src_path);
+		return 0;
+	}
+	snprintf(tmp_path, PATH_MAX, "%s.tmp", obj_file);
+	dst = fopen(tmp_path, "wb");
+	if(dst == NULL)
+	{
+		log_error("store_object: cannot create %s\n", tmp_path);
+		fclose(src);
+		return 0;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, OBJ_MAGIC, sizeof(hdr.magic));
+	hdr.version = OBJ_FORMAT_VERSION;
+	fwrite(&hdr, sizeof(hdr), 1, dst);
+
+	memset(&strm, 0, sizeof(strm));
+	if(deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK)
+		goto out;
+
+	do {
+		n = fread(in, 1, CHUNK_SIZE, src);
+		hdr.raw_size += n;
+		flush = feof(src) ? Z_FINISH : Z_NO_FLUSH;
+		strm.next_in = in;
+		strm.avail_in = n;
+		do {
+			strm.next_out = out;
+			strm.avail_out = CHUNK_SIZE;
+			deflate(&strm, flush);
+			n = CHUNK_SIZE - strm.avail_out;
+			if(fwrite(out, 1, n, dst) != n)
+			{
+				deflateEnd(&strm);
+				goto out;
+			}
+			hdr.stored_size += n;
+		} while(strm.avail_out == 0);
+	} while(flush != Z_FINISH && !ferror(src));
+	deflateEnd(&strm);
+
+	if(ferror(src))
+		goto out;
+
+	/* Now that the sizes are known fill in the header */
+	fseek(dst, 0, SEEK_SET);
+	fwrite(&hdr, sizeof(hdr), 1, dst);
+	ret = 1;
+out:
+	fclose(src);
+	if(fclose(dst) != 0)
+		ret = 0;
+	if(ret && rename(tmp_path, obj_file) != 0)
+		ret = 0;
+	if(!ret)
+	{
+		unlink(tmp_path);
+		log_error("store_object: failed to store %s\n", obj_file);
+		stats_add(STAT_COMPRESS, start, 0, 1);
+		return 0;
+	}
+
+	stats_add(STAT_COMPRESS, start, hdr.raw_size, 0);
+	log_msg("Stored object %s: %lld -> %lld bytes (%.1f%%) in %lld us\n", obj_file,
+		hdr.raw_size, hdr.stored_size,
+		hdr.raw_size ? 100.0*hdr.stored_size/hdr.raw_size : 100.0,
+		(stats_now() - start)/1000);
+	return 1;
+}
+
+/* Compresses the len bytes at data into obj_file, as store_object()
+ * Returns 1 for success and 0 for failure
+ */
+int store_object_mem(const char *data, size_t len, const char *obj_file)
+{
+	long long start = stats_now();
+	char tmp_path[PATH_MAX];
+	ObjHeader hdr;
+	uLongf stored = compressBound(len);
+	unsigned char *out = (unsigned char *)malloc(stored);
+	FILE *dst;
+	int ret = 0;
+
+	snprintf(tmp_path, PATH_MAX, "%s.tmp", obj_file);
+	if(out == NULL || compress2(out, &stored, (const Bytef *)data, len, Z_DEFAULT_COMPRESSION) != Z_OK
+		|| (dst = fopen(tmp_path, "wb")) == NULL)
+	{
+		log_error("store_object_mem: cannot store %s\n", obj_file);
+		free(out);
+		stats_add(STAT_COMPRESS, start, 0, 1);
+		return 0;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, OBJ_MAGIC, sizeof(hdr.magic));
+	hdr.version = OBJ_FORMAT_VERSION;
+	hdr.raw_size = len;
+	hdr.stored_size = stored;
+	if(fwrite(&hdr, sizeof(hdr), 1, dst) == 1 && fwrite(out, 1, stored, dst) == stored)
+		ret = 1;
+	if(fclose(dst) != 0)
+		ret = 0;
+	free(out);
+	if(ret && rename(tmp_path, obj_file) != 0)
+		ret = 0;
+	if(!ret)
+		unlink(tmp_path);
+	stats_add(STAT_COMPRESS, start, ret ? len : 0, !ret);
+	return ret;
+}
+
+/* Reads the raw contents of an object written by the old
+ * "tar -czvf" based compress(): a gzipped tar holding one member.
+ */
+static char *load_legacy_object(const char *obj_file, size_t *size)
+{
+	char block[TAR_BLOCK];
+	char *data;
+	size_t len;
+	gzFile gz;
+
+	gz = gzopen(obj_file, "rb");
+	if(gz == NULL)
+		return NULL;
+	if(gzread(gz, block, TAR_BLOCK) != TAR_BLOCK)
+	{
+		gzclose(gz);
+		return NULL;
+	}
+	/* member size is an octal string at offset 124 of the tar header */
+	len = strtoul(block + 124, NULL, 8);
+	data = (char *)malloc(len + 1);
+	if(data == NULL || gzread(gz, data, len) != (int)len)
+	{
+		free(data);
+		gzclose(gz);
+		return NULL;
+	}
+	gzclose(gz);
+	data[len] = '\0';
+	*size = len;
+	return data;
+}
+
+/* Inflates an object into a freshly malloc'd buffer.
+ * The buffer is NUL terminated (not counted in *size) so that
+ * text objects can be handled as strings.
+ * Returns NULL on failure
+ */
+char *load_object_mem(const char *obj_file, size_t *size)
+{
+	long long start;
+	unsigned char in[CHUNK_SIZE];
+	ObjHeader hdr;
+	z_stream strm;
+	char *data;
+	FILE *f;
+	size_t n;
+	int ret = Z_OK;
+
+	start = stats_now();
+	f = fopen(obj_file, "rb");
+	if(f == NULL)
+	{
+		log_error("load_object: cannot open %s\n", obj_file);
+		return NULL;
+	}
+	n = fread(&hdr, 1, sizeof(hdr), f);
+	if(n >= sizeof(hdr.magic) && memcmp(hdr.magic, CHUNK_MAGIC, sizeof(hdr.magic)) == 0)
+	{
+		fclose(f);
+		return chunk_load_mem(obj_file, size);
+	}
+	if(n != sizeof(hdr) || !is_obj_header(&hdr))
+	{
+		fclose(f);
+		return load_legacy_object(obj_file, size);
+	}
+
+	data = (char *)malloc(hdr.raw_size + 1);
+	if(data == NULL)
+	{
+		fclose(f);
+		return NULL;
+	}
+	memset(&strm, 0, sizeof(strm));
+	if(inflateInit(&strm) != Z_OK)
+	{
+		free(data);
+		fclose(f);
+		return NULL;
+	}
+	strm.next_out = (unsigned char *)data;
+	strm.avail_out = hdr.raw_size;
+	while(ret != Z_STREAM_END && (n = fread(in, 1, CHUNK_SIZE, f)) > 0)
+	{
+		strm.next_in = in;
+		strm.avail_in = n;
+		ret = inflate(&strm, Z_NO_FLUSH);
+		if(ret != Z_OK && ret != Z_STREAM_END)
+			break;
+	}
+	inflateEnd(&strm);
+	fclose(f);
+	if(ret != Z_STREAM_END || strm.total_out != (uLong)hdr.raw_size)
+	{
+		log_error("load_object: corrupt object %s\n", obj_file);
+		free(data);
+		stats_add(STAT_DECOMPRESS, start, 0, 1);
+		return NULL;
+	}
+	data[hdr.raw_size] = '\0';
+	*size = hdr.raw_size;
+	// counted here only, the chunks of a list are counted one by one
+	stats_add(STAT_DECOMPRESS, start, hdr.raw_size, 0);
+	log_msg("Loaded object %s: %lld bytes in %lld us\n", obj_file, hdr.raw_size, (stats_now() - start)/1000);
+	return data;
+}
+
+/* Inflates an object into dest_path
+ * Returns 1 for success and 0 for failure
+ */
+int load_object(const char *obj_file, const char *dest_path)
+{
+	size_t size;
+	char *data;
+	FILE *f;
+	int ret = 1;
+
+	// written chunk by chunk rather than put together in memory
+	if(is_chunk_list(obj_file))
+		return chunk_load(obj_file, dest_path);
+	data = load_object_mem(obj_file, &size);
+	if(data == NULL)
+		return 0;
+	f = fopen(dest_path, "wb");
+	if(f == NULL)
+	{
+		free(data);
+		return 0;
+	}
+	if(fwrite(data, 1, size, f) != size)
+		ret = 0;
+	if(fclose(f) != 0)
+		ret = 0;
+	free(data);
+	return ret;
+}
+
+/* Brings the version in base, of size *size, to the one held by
+ * obj_file, in memory.  base is consumed: it is freed or returned.
+ * Returns the new version, its size in *size, or NULL on failure
+ */
+char *restore_object_mem(const char *obj_file, char *base, size_t *size, int file_type)
+{
+	char target[PATH_MAX], delta_path[PATH_MAX];
+	size_t len, map_len;
+	char *data, *result, *map;
+
+	data = load_object_mem(obj_file, &len);
+	if(data == NULL || file_type == LO)
+	{
+		free(base);
+		if(data != NULL)
+			*size = len;
+		return data;
+	}
+	if(is_delta(data, len))
+	{
+		result = delta_apply_mem(base, *size, data, len, size);
+		free(data);
+		free(base);
+		return result;
+	}
+
+	/* a unified diff from before the native delta engine */
+	result = NULL;
+	if(make_scratch(target, "/tmp/", "rvfs_patch") && write_file(target, base, *size))
+	{
+		snprintf(delta_path, PATH_MAX, "%s.delta", target);
+		if(write_file(delta_path, data, len))
+		{
+			patch(target, delta_path);
+			map = map_file(target, &map_len);
+			if(map != NULL)
+			{
+				result = (char *)malloc(map_len + 1);
+				memcpy(result, map, map_len);
+				result[map_len] = '\0';
+				*size = map_len;
+				unmap_file(map, map_len);
+			}
+		}
+		unlink(delta_path);
+		unlink(target);
+	}
+	free(data);
+	free(base);
+	return result;
+}
+
+/* Brings the file at target to the version held by obj_file.
+ * A loose object (LO) replaces target, a patch object (PO) is a
+ * delta which is applied on top of it in memory.
+ * Returns 1 for success and 0 for failure
+ */
+int restore_object(const char *obj_file, const char *target, int file_type)
+{
+	char delta_path[PATH_MAX];
+	size_t size;
+	char *data;
+	int ret;
+
+	if(file_type == LO)
+		return load_object(obj_file, target);
+
+	data = load_object_mem(obj_file, &size);
+	if(data == NULL)
+		return 0;
+	if(is_delta(data, size))
+	{
+		ret = delta_apply_file(target, data, size);
+		free(data);
+		return ret;
+	}
+
+	/* a unified diff from before the native delta engine */
+	snprintf(delta_path, PATH_MAX, "%s.delta", target);
+	ret = write_file(delta_path, data, size);
+	free(data);
+	if(!ret)
+		return 0;
+	patch(target, delta_path);
+	unlink(delta_path);
+	return 1;
+}
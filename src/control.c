@@ -0,0 +1,246 @@
+/* control.c
+ * The control directory /.rvfs of the mount
+ *
+ * /.rvfs is not listed in the root directory and holds:
+ *
+ *	ctl	commands written one per line, their replies read back
+ *		from the same open file:
+ *
+ *		snapshot <dir>		snapshot the files below <dir>,
+ *					replies with the id of the snapshot
+ *		checkout <dir> <id>	check out snapshot <id> of <dir>,
+ *					replies with the number of files
+ *		clean <file> <ratio> [dry]
+ *					remove versions of <file> until it
+ *					takes <ratio> of the space of itself
+ *					and its versions, replies with the
+ *					number of versions and bytes freed,
+ *					or that would be with "dry"
+ *
+ *		stats reset		zero the counters of stats below,
+ *					replies 0
+ *
+ *		<dir> is a path in the mount, "/" for all of it.  A
+ *		failed command replies "error <reason>".
+ *
+ *	stats	read only, the latency histograms and counters of the
+ *		operations of the mount as they were when it was opened
+ *		(see stats.c)
+ *
+ *	exec 3<>/mnt/.rvfs/ctl; echo "snapshot /src" >&3; cat <&3
+ */
+
+#include "params.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "vfs.h"
+#include "log.h"
+
+#define CONTROL_LINE_MAX (PATH_MAX + 64)
+
+typedef struct _control_handle{
+
+	char in[CONTROL_LINE_MAX];	/* command not ended by a newline yet */
+	size_t in_len;
+	char *out;			/* replies */
+	size_t out_len;
+}ControlHandle;
+
+/* Tells whether path, in the mount, is CONTROL_DIR, CONTROL_CTL or
+ * CONTROL_NONE
+ */
+int control_path(const char *path)
+{
+	if(strcmp(path, CONTROL_DIR_PATH) == 0)
+		return CONTROL_DIR;
+	if(strcmp(path, CONTROL_DIR_PATH "/ctl") == 0)
+		return CONTROL_CTL;
+	if(strcmp(path, CONTROL_DIR_PATH "/stats") == 0)
+		return CONTROL_STATS;
+	return CONTROL_NONE;
+}
+
+/* Attributes of the control directory and its files, those of the root
+ * directory with the mode changed
+ * Returns 0 for success or -errno
+ */
+int control_stat(const char *path, struct stat *st)
+{
+	int kind = control_path(path);
+
+	if(kind == CONTROL_NONE || lstat(BB_DATA->rootdir, st) != 0)
+		return -ENOENT;
+	if(kind == CONTROL_DIR)
+	{
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2;
+	}
+	else
+	{
+		st->st_mode = S_IFREG | (kind == CONTROL_STATS ? 0444 : 0600);
+		st->st_nlink = 1;
+		st->st_size = 0;
+	}
+	return 0;
+}
+
+void *control_open(void)
+{
+	return calloc(1, sizeof(ControlHandle));
+}
+
+/* A handle on the stats, read from what they were now */
+void *control_open_stats(void)
+{
+	ControlHandle *h = (ControlHandle *)calloc(1, sizeof(ControlHandle));
+
+	if(h != NULL)
+		h->out = stats_text(&h->out_len);
+	return h;
+}
+
+void control_release(void *handle)
+{
+	ControlHandle *h = (ControlHandle *)handle;
+
+	free(h->out);
+	free(h);
+}
+
+static void reply(ControlHandle *h, const char *fmt, ...)
+{
+	char line[CONTROL_LINE_MAX];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if(len < 0)
+		return;
+	if(len >= (int)sizeof(line))
+		len = sizeof(line) - 1;
+	h->out = (char *)realloc(h->out, h->out_len + len);
+	memcpy(h->out + h->out_len, line, len);
+	h->out_len += len;
+}
+
+/* Puts in dir the path below the root of arg, a path of the mount
+ * Returns 0 if arg is not absolute or leads out of the root, through
+ * .. or a symlink
+ */
+static int root_path(char *dir, const char *arg)
+{
+	size_t len = strlen(BB_DATA->rootdir);
+	char real[PATH_MAX];
+	const char *p;
+
+	if(arg[0] != '/')
+		return 0;
+	for(p = arg; (p = strstr(p, "..")) != NULL; p += 2)
+		if(p[-1] == '/' && (p[2] == '/' || p[2] == '\0'))
+			return 0;
+	snprintf(dir, PATH_MAX, "%s%s", BB_DATA->rootdir, strcmp(arg, "/") == 0 ? "" : arg);
+	if(realpath(dir, real) != NULL
+		&& (strncmp(real, BB_DATA->rootdir, len) != 0 || (real[len] != '/' && real[len] != '\0')))
+		return 0;
+	return 1;
+}
+
+static void run(ControlHandle *h, const char *cmd)
+{
+	char arg[PATH_MAX], dir[PATH_MAX], mode[8];
+	PathLock *vlock;
+	float ratio;
+	long saved;
+	int id, ret, n;
+
+	log_msg("control: %s\n", cmd);
+	if(sscanf(cmd, "snapshot %4095s", arg) == 1)
+	{
+		if(!root_path(dir, arg))
+			reply(h, "error %s\n", strerror(EINVAL));
+		else if((ret = snapshot_create(dir)) < 0)
+			reply(h, "error %s\n", strerror(-ret));
+		else
+			reply(h, "%d\n", ret);
+	}
+	else if(sscanf(cmd, "checkout %4095s %d", arg, &id) == 2)
+	{
+		if(!root_path(dir, arg))
+			reply(h, "error %s\n", strerror(EINVAL));
+		else if((ret = snapshot_checkout(dir, id)) < 0)
+			reply(h, "error %s\n", strerror(-ret));
+		else
+			reply(h, "%d\n", ret);
+	}
+	else if((n = sscanf(cmd, "clean %4095s %f %7s", arg, &ratio, mode)) >= 2)
+	{
+		if(n == 3 && strcmp(mode, "dry") != 0)
+			reply(h, "error unknown command\n");
+		else if(!root_path(dir, arg))
+			reply(h, "error %s\n", strerror(EINVAL));
+		else if(access(dir, F_OK) != 0)
+			reply(h, "error %s\n", strerror(ENOENT));
+		else
+		{
+			commit_flush();
+			vlock = dir_lock(dir);
+			ret = cleanFile(dir, ratio, n == 3, &saved);
+			path_unlock(vlock);
+			if(ret < 0)
+				reply(h, "error %s\n", strerror(ENOENT));
+			else
+				reply(h, "%d %ld\n", ret, saved);
+		}
+	}
+	else if(strcmp(cmd, "stats reset") == 0)
+	{
+		stats_reset();
+		reply(h, "0\n");
+	}
+	else if(cmd[0] != '\0')
+		reply(h, "error unknown command\n");
+}
+
+/* Runs the commands ended in buf, keeps the rest for the next write
+ * Returns size
+ */
+int control_write(void *handle, const char *buf, size_t size)
+{
+	ControlHandle *h = (ControlHandle *)handle;
+	size_t i;
+
+	for(i = 0; i < size; i++)
+	{
+		if(buf[i] == '\n')
+		{
+			h->in[h->in_len] = '\0';
+			run(h, h->in);
+			h->in_len = 0;
+		}
+		else if(h->in_len < sizeof(h->in) - 1)
+			h->in[h->in_len++] = buf[i];
+	}
+	return size;
+}
+
+/* Reads the replies of the commands run so far */
+int control_read(void *handle, char *buf, size_t size, off_t offset)
+{
+	ControlHandle *h = (ControlHandle *)handle;
+
+	if((size_t)offset >= h->out_len)
+		return 0;
+	if(size > h->out_len - offset)
+		size = h->out_len - offset;
+	memcpy(buf, h->out + offset, size);
+	return size;
+}
@@ -0,0 +1,598 @@
+/* delta.c
+ * Native delta engine used in place of "diff -u" / "patch"
+ *
+ * A delta turns a base file into a target file.  It is a DeltaHeader
+ * followed by a list of operations, all integers being varints:
+ *
+ *	DELTA_COPY   <base offset> <length>	copy bytes from the base
+ *	DELTA_INSERT <length> <bytes>		literal bytes
+ *
+ * Text files are matched line by line: every line start of the base
+ * is indexed and each line of the target is looked up and extended.
+ * Binary files (or files without sensible line structure) are matched
+ * with a rolling hash over fixed size blocks instead.
+ *
+ * When the ranges written between the two files are known, only those
+ * are encoded and the bytes around them are copied at the same offset.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vfs.h"
+#include "log.h"
+
+#define DELTA_COPY 1
+#define DELTA_INSERT 2
+
+#define MIN_COPY 8		/* shorter matches are cheaper as literals */
+#define MAX_PROBES 16		/* candidates tried per hash bucket */
+#define BLOCK_SIZE 16		/* window of the rolling hash in byte mode */
+#define SNIFF_SIZE 8192
+#define MAX_TEXT_LINE 1024	/* longer average lines switch to byte mode */
+#define ROLL_PRIME 16777619U
+
+typedef struct _delta_buf{
+
+	unsigned char *data;
+	size_t len;
+	size_t size;
+	int ops;
+	size_t shift;		/* added to copy offsets, for a window of the base */
+}DeltaBuf;
+
+/* Index of anchors (line starts or block starts) in the base */
+typedef struct _delta_index{
+
+	unsigned int *head;	/* bucket -> first anchor + 1, 0 when empty */
+	unsigned int *next;	/* anchor -> next anchor in bucket + 1 */
+	size_t *anchor;		/* anchor -> offset in the base */
+	unsigned int mask;
+}DeltaIndex;
+
+/* ----- Output buffer ----- */
+
+static void buf_reserve(DeltaBuf *b, size_t n)
+{
+	if(b->len + n <= b->size)
+		return;
+	while(b->len + n > b->size)
+		b->size = b->size ? 2*b->size : 4096;
+	b->data = (unsigned char *)realloc(b->data, b->size);
+}
+
+static void buf_varint(DeltaBuf *b, unsigned long long v)
+{
+	buf_reserve(b, 10);
+	while(v >= 0x80)
+	{
+		b->data[b->len++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	b->data[b->len++] = v;
+}
+
+static void emit_copy(DeltaBuf *b, size_t off, size_t len)
+{
+	buf_reserve(b, 1);
+	b->data[b->len++] = DELTA_COPY;
+	buf_varint(b, off + b->shift);
+	buf_varint(b, len);
+	b->ops++;
+}
+
+static void emit_insert(DeltaBuf *b, const char *data, size_t len)
+{
+	if(len == 0)
+		return;
+	buf_reserve(b, 1);
+	b->data[b->len++] = DELTA_INSERT;
+	buf_varint(b, len);
+	buf_reserve(b, len);
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	b->ops++;
+}
+
+static int read_varint(const unsigned char **p, const unsigned char *end, unsigned long long *v)
+{
+	int shift = 0;
+	*v = 0;
+	while(*p < end && shift < 64)
+	{
+		unsigned char c = *(*p)++;
+		*v |= (unsigned long long)(c & 0x7f) << shift;
+		if(!(c & 0x80))
+			return 1;
+		shift += 7;
+	}
+	return 0;
+}
+
+/* ----- Hashing and indexing ----- */
+
+static unsigned int hash_bytes(const char *s, size_t len)
+{
+	unsigned int h = 2166136261U;
+	size_t i;
+	for(i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * ROLL_PRIME;
+	return h;
+}
+
+static unsigned int roll_hash(const char *s)
+{
+	unsigned int h = 0;
+	int i;
+	for(i = 0; i < BLOCK_SIZE; i++)
+		h = h*ROLL_PRIME + (unsigned char)s[i];
+	return h;
+}
+
+static void index_init(DeltaIndex *idx, size_t anchors)
+{
+	unsigned int buckets = 64;
+	while(buckets < 2*anchors)
+		buckets <<= 1;
+	idx->mask = buckets - 1;
+	idx->head = (unsigned int *)calloc(buckets, sizeof(unsigned int));
+	idx->next = (unsigned int *)calloc(anchors + 1, sizeof(unsigned int));
+	idx->anchor = (size_t *)calloc(anchors + 1, sizeof(size_t));
+}
+
+static void index_add(DeltaIndex *idx, unsigned int n, size_t off, unsigned int h)
+{
+	idx->anchor[n] = off;
+	idx->next[n] = idx->head[h & idx->mask];
+	idx->head[h & idx->mask] = n + 1;
+}
+
+static void index_free(DeltaIndex *idx)
+{
+	free(idx->head);
+	free(idx->next);
+	free(idx->anchor);
+}
+
+static size_t match_forward(const char *base, size_t base_len, size_t b,
+			const char *target, size_t target_len, size_t t)
+{
+	size_t l = 0;
+	while(b + l < base_len && t + l < target_len && base[b+l] == target[t+l])
+		l++;
+	return l;
+}
+
+static const char *line_end(const char *s, size_t pos, size_t len)
+{
+	const char *e = memchr(s + pos, '\n', len - pos);
+	return e ? e + 1 : s + len;
+}
+
+/* Decides whether two buffers are better matched by lines or bytes */
+static int is_text(const char *base, size_t base_len, const char *target, size_t target_len)
+{
+	size_t n = target_len < SNIFF_SIZE ? target_len : SNIFF_SIZE;
+	size_t m = base_len < SNIFF_SIZE ? base_len : SNIFF_SIZE;
+	size_t i, lines = 0;
+
+	if(memchr(target, '\0', n) || memchr(base, '\0', m))
+		return 0;
+	for(i = 0; i < n; i++)
+		if(target[i] == '\n')
+			lines++;
+	return n < MAX_TEXT_LINE || n/(lines + 1) < MAX_TEXT_LINE;
+}
+
+/* ----- Encoders ----- */
+
+static void encode_lines(const char *base, size_t base_len, const char *target, size_t target_len, DeltaBuf *out)
+{
+	DeltaIndex idx;
+	size_t nlines = 0, pos, t = 0, ins = 0, expect = 0;
+	unsigned int n = 0;
+
+	for(pos = 0; pos < base_len; pos = line_end(base, pos, base_len) - base)
+		nlines++;
+	index_init(&idx, nlines);
+	for(pos = 0; pos < base_len; n++)
+	{
+		size_t e = line_end(base, pos, base_len) - base;
+		index_add(&idx, n, pos, hash_bytes(base + pos, e - pos));
+		pos = e;
+	}
+
+	while(t < target_len)
+	{
+		size_t e = line_end(target, t, target_len) - target;
+		size_t best_len = 0, best_off = 0, l;
+		unsigned int c;
+		int probes = 0;
+
+		/* the line following the previous copy is the likeliest match */
+		if(expect < base_len)
+		{
+			best_len = match_forward(base, base_len, expect, target, target_len, t);
+			best_off = expect;
+		}
+		if(best_len < e - t)
+		{
+			for(c = idx.head[hash_bytes(target + t, e - t) & idx.mask]; c && probes < MAX_PROBES; c = idx.next[c-1], probes++)
+			{
+				l = match_forward(base, base_len, idx.anchor[c-1], target, target_len, t);
+				if(l > best_len)
+				{
+					best_len = l;
+					best_off = idx.anchor[c-1];
+				}
+			}
+		}
+		if(best_len >= MIN_COPY || (best_len >= e - t && best_len > 0 && ins == t))
+		{
+			emit_insert(out, target + ins, t - ins);
+			emit_copy(out, best_off, best_len);
+			t += best_len;
+			ins = t;
+			expect = best_off + best_len;
+		}
+		else
+			t = e;
+	}
+	emit_insert(out, target + ins, target_len - ins);
+	index_free(&idx);
+}
+
+static void encode_blocks(const char *base, size_t base_len, const char *target, size_t target_len, DeltaBuf *out)
+{
+	DeltaIndex idx;
+	size_t pos, t = 0, ins = 0;
+	unsigned int n, h = 0, top = 1;
+	int i;
+
+	index_init(&idx, base_len/BLOCK_SIZE);
+	for(n = 0, pos = 0; pos + BLOCK_SIZE <= base_len; pos += BLOCK_SIZE, n++)
+		index_add(&idx, n, pos, roll_hash(base + pos));
+	for(i = 1; i < BLOCK_SIZE; i++)
+		top *= ROLL_PRIME;
+
+	if(target_len >= BLOCK_SIZE)
+		h = roll_hash(target);
+	while(t + BLOCK_SIZE <= target_len)
+	{
+		size_t best_len = 0, best_off = 0, l;
+		unsigned int c;
+		int probes = 0;
+
+		for(c = idx.head[h & idx.mask]; c && probes < MAX_PROBES; c = idx.next[c-1], probes++)
+		{
+			l = match_forward(base, base_len, idx.anchor[c-1], target, target_len, t);
+			if(l > best_len)
+			{
+				best_len = l;
+				best_off = idx.anchor[c-1];
+			}
+		}
+		if(best_len >= BLOCK_SIZE)
+		{
+			/* grow the match backwards into the pending literals */
+			while(t > ins && best_off > 0 && base[best_off-1] == target[t-1])
+			{
+				t--;
+				best_off--;
+				best_len++;
+			}
+			emit_insert(out, target + ins, t - ins);
+			emit_copy(out, best_off, best_len);
+			t += best_len;
+			ins = t;
+			if(t + BLOCK_SIZE <= target_len)
+				h = roll_hash(target + t);
+			continue;
+		}
+		if(t + BLOCK_SIZE < target_len)
+			h = (h - top*(unsigned char)target[t])*ROLL_PRIME + (unsigned char)target[t+BLOCK_SIZE];
+		t++;
+	}
+	emit_insert(out, target + ins, target_len - ins);
+	index_free(&idx);
+}
+
+static void delta_begin(DeltaBuf *out, size_t base_len, size_t target_len)
+{
+	DeltaHeader hdr;
+
+	memset(out, 0, sizeof(*out));
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic));
+	hdr.version = DELTA_FORMAT_VERSION;
+	hdr.base_size = base_len;
+	hdr.result_size = target_len;
+	buf_reserve(out, sizeof(hdr));
+	memcpy(out->data, &hdr, sizeof(hdr));
+	out->len = sizeof(hdr);
+}
+
+static char *delta_end(DeltaBuf *out, size_t *delta_len, int *ops)
+{
+	((DeltaHeader *)out->data)->op_count = out->ops;
+	*delta_len = out->len;
+	if(ops != NULL)
+		*ops = out->ops;
+	return (char *)out->data;
+}
+
+static void encode(const char *base, size_t base_len, const char *target, size_t target_len, DeltaBuf *out)
+{
+	if(base_len == 0)
+		emit_insert(out, target, target_len);
+	else if(is_text(base, base_len, target, target_len))
+		encode_lines(base, base_len, target, target_len, out);
+	else
+		encode_blocks(base, base_len, target, target_len, out);
+}
+
+/* Computes the delta turning base into target.
+ * Returns a malloc'd buffer holding the encoded delta
+ */
+char *delta_create_mem(const char *base, size_t base_len, const char *target, size_t target_len, size_t *delta_len, int *ops)
+{
+	long long start = stats_now();
+	DeltaBuf out;
+	char *delta;
+
+	delta_begin(&out, base_len, target_len);
+	encode(base, base_len, target, target_len, &out);
+	delta = delta_end(&out, delta_len, ops);
+	stats_add(STAT_DIFF, start, target_len, 0);
+	return delta;
+}
+
+/* Same as delta_create_mem() for a target that is the base with the n
+ * ranges r rewritten.  Only the ranges are encoded, against the same
+ * window of the base.  The bytes around them are checked to be equal in
+ * both and copied.
+ * Returns NULL if they differ, the ranges then missed a change
+ */
+static char *create_ranges(const char *base, size_t base_len, const char *target, size_t target_len,
+			const DirtyRange *r, int n, size_t *delta_len, int *ops)
+{
+	DeltaBuf out;
+	size_t pos = 0, s, e, be;
+	int i;
+
+	delta_begin(&out, base_len, target_len);
+	for(i = 0; i <= n && pos < target_len; i++)
+	{
+		s = i < n && r[i].start < (long long)target_len ? r[i].start : target_len;
+		if(s > pos)
+		{
+			if(s > base_len || memcmp(base + pos, target + pos, s - pos) != 0)
+			{
+				free(out.data);
+				return NULL;
+			}
+			emit_copy(&out, pos, s - pos);
+		}
+		if(i == n)
+			break;
+		e = r[i].end < (long long)target_len ? r[i].end : target_len;
+		be = r[i].end < (long long)base_len ? r[i].end : base_len;
+		if(e > s)
+		{
+			out.shift = s;
+			encode(base + s, be > s ? be - s : 0, target + s, e - s, &out);
+			out.shift = 0;
+		}
+		pos = s > e ? s : e;
+	}
+	return delta_end(&out, delta_len, ops);
+}
+
+char *delta_create_ranges_mem(const char *base, size_t base_len, const char *target, size_t target_len,
+			const DirtyRange *r, int n, size_t *delta_len, int *ops)
+{
+	long long start = stats_now();
+	char *delta = create_ranges(base, base_len, target, target_len, r, n, delta_len, ops);
+
+	// a miss is counted as failed, the whole files are compared next
+	stats_add(STAT_DIFF, start, target_len, delta == NULL);
+	return delta;
+}
+
+/* Applies a delta to base.
+ * Returns a malloc'd, NUL terminated buffer holding the result or
+ * NULL if the delta is corrupt or was made against another base
+ */
+static char *apply(const char *base, size_t base_len, const char *delta, size_t delta_len, size_t *result_len)
+{
+	const unsigned char *p = (const unsigned char *)delta + sizeof(DeltaHeader);
+	const unsigned char *end = (const unsigned char *)delta + delta_len;
+	unsigned long long off, len;
+	DeltaHeader hdr;
+	size_t r = 0;
+	char *result;
+
+	if(!is_delta(delta, delta_len))
+		return NULL;
+	memcpy(&hdr, delta, sizeof(hdr));
+	if((size_t)hdr.base_size != base_len)
+	{
+		log_msg("delta_apply: delta expects a base of %lld bytes, got %lu\n", hdr.base_size, (unsigned long)base_len);
+		return NULL;
+	}
+	result = (char *)malloc(hdr.result_size + 1);
+	if(result == NULL)
+		return NULL;
+
+	// r never passes result_size, the bounds below are written so that
+	// huge varints cannot wrap them around
+	while(p < end)
+	{
+		int op = *p++;
+		if(op == DELTA_COPY)
+		{
+			if(!read_varint(&p, end, &off) || !read_varint(&p, end, &len)
+				|| len > base_len || off > base_len - len || len > (size_t)hdr.result_size - r)
+				goto corrupt;
+			memcpy(result + r, base + off, len);
+		}
+		else if(op == DELTA_INSERT)
+		{
+			if(!read_varint(&p, end, &len) || len > (size_t)(end - p)
+				|| len > (size_t)hdr.result_size - r)
+				goto corrupt;
+			memcpy(result + r, p, len);
+			p += len;
+		}
+		else
+			goto corrupt;
+		r += len;
+	}
+	if(r != (size_t)hdr.result_size)
+		goto corrupt;
+	result[r] = '\0';
+	*result_len = r;
+	return result;
+
+corrupt:
+	log_error("delta_apply: corrupt delta\n");
+	free(result);
+	return NULL;
+}
+
+char *delta_apply_mem(const char *base, size_t base_len, const char *delta, size_t delta_len, size_t *result_len)
+{
+	long long start = stats_now();
+	char *result = apply(base, base_len, delta, delta_len, result_len);
+
+	stats_add(STAT_PATCH, start, result != NULL ? *result_len : 0, result == NULL);
+	return result;
+}
+
+int is_delta(const char *data, size_t len)
+{
+	return len >= sizeof(DeltaHeader) && memcmp(data, DELTA_MAGIC, 4) == 0;
+}
+
+/* ----- File level helpers ----- */
+
+/* Maps a whole file read only.  Empty files map to an empty string. */
+char *map_file(const char *path, size_t *len)
+{
+	struct stat st;
+	char *data;
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) < 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	*len = st.st_size;
+	if(st.st_size == 0)
+	{
+		close(fd);
+		return "";
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	return data == MAP_FAILED ? NULL : data;
+}
+
+void unmap_file(char *data, size_t len)
+{
+	if(len > 0)
+		munmap(data, len);
+}
+
+/* Writes len bytes to path through a temporary file and a rename */
+int write_file(const char *path, const char *data, size_t len)
+{
+	char tmp_path[PATH_MAX];
+	FILE *f;
+	int ret = 1;
+
+	snprintf(tmp_path, PATH_MAX, "%s.tmp", path);
+	f = fopen(tmp_path, "wb");
+	if(f == NULL)
+		return 0;
+	if(fwrite(data, 1, len, f) != len)
+		ret = 0;
+	if(fclose(f) != 0)
+		ret = 0;
+	if(ret && rename(tmp_path, path) != 0)
+		ret = 0;
+	if(!ret)
+		unlink(tmp_path);
+	return ret;
+}
+
+/* Writes the delta turning base_path into target_path to delta_path
+ * Returns the number of delta operations or -1 on failure
+ */
+int delta_create(const char *base_path, const char *target_path, const char *delta_path)
+{
+	return delta_create_ranges(base_path, target_path, delta_path, NULL, 0);
+}
+
+/* Same as delta_create() when only the n ranges r may differ between
+ * the two files.  Falls back to comparing the whole files when they
+ * differ elsewhere.
+ */
+int delta_create_ranges(const char *base_path, const char *target_path, const char *delta_path, const DirtyRange *r, int n)
+{
+	size_t base_len, target_len, delta_len;
+	char *base, *target, *delta = NULL;
+	int ops = -1;
+
+	base = map_file(base_path, &base_len);
+	target = map_file(target_path, &target_len);
+	if(base != NULL && target != NULL)
+	{
+		if(r != NULL)
+		{
+			delta = delta_create_ranges_mem(base, base_len, target, target_len, r, n, &delta_len, &ops);
+			if(delta == NULL)
+				log_msg("delta %s -> %s: changed outside the written ranges, comparing all\n", base_path, target_path);
+		}
+		if(delta == NULL)
+			delta = delta_create_mem(base, base_len, target, target_len, &delta_len, &ops);
+		if(!write_file(delta_path, delta, delta_len))
+			ops = -1;
+		log_msg("delta %s -> %s: %d ops, %lu bytes\n", base_path, target_path, ops, (unsigned long)delta_len);
+		free(delta);
+	}
+	if(base != NULL)
+		unmap_file(base, base_len);
+	if(target != NULL)
+		unmap_file(target, target_len);
+	return ops;
+}
+
+/* Applies the delta held in memory to the file at target_path in place
+ * Returns 1 for success and 0 for failure
+ */
+int delta_apply_file(const char *target_path, const char *delta, size_t delta_len)
+{
+	size_t base_len, result_len;
+	char *base, *result;
+	int ret;
+
+	base = map_file(target_path, &base_len);
+	if(base == NULL)
+		return 0;
+	result = delta_apply_mem(base, base_len, delta, delta_len, &result_len);
+	unmap_file(base, base_len);
+	if(result == NULL)
+		return 0;
+	ret = write_file(target_path, result, result_len);
+	free(result);
+	return ret;
+}
@@ -0,0 +1,60 @@
+#ifndef _DELTA_H_
+#define _DELTA_H_
+#include <stddef.h>
+#include <limits.h>
+
+#define DELTA_MAGIC "RVD1"
+#define DELTA_FORMAT_VERSION 1
+
+// Header of a delta produced by delta_create(), followed by the operations
+
+typedef struct _delta_header{
+	
+	char magic[4];
+	int version;
+	int op_count;
+	int reserved;
+	long long base_size;	/* Size of the file the delta applies to */
+	long long result_size;	/* Size of the file it produces */
+}DeltaHeader;
+
+// Byte ranges of a file written since it was last versioned, sorted
+// and disjoint (see dirty_add())
+
+#define DIRTY_EOF LLONG_MAX
+
+typedef struct _dirty_range{
+	
+	long long start;
+	long long end;		/* Exclusive, DIRTY_EOF when up to the end */
+}DirtyRange;
+
+typedef struct _dirty_map{
+	
+	DirtyRange *r;
+	int n;
+	int size;
+}DirtyMap;
+
+char *delta_create_mem(const char *base, size_t base_len, const char *target, size_t target_len, size_t *delta_len, int *ops);
+
+char *delta_create_ranges_mem(const char *base, size_t base_len, const char *target, size_t target_len,
+			const DirtyRange *r, int n, size_t *delta_len, int *ops);
+
+char *delta_apply_mem(const char *base, size_t base_len, const char *delta, size_t delta_len, size_t *result_len);
+
+int is_delta(const char *data, size_t len);
+
+int delta_create(const char *base_path, const char *target_path, const char *delta_path);
+
+int delta_create_ranges(const char *base_path, const char *target_path, const char *delta_path, const DirtyRange *r, int n);
+
+int delta_apply_file(const char *target_path, const char *delta, size_t delta_len);
+
+char *map_file(const char *path, size_t *len);
+
+void unmap_file(char *data, size_t len);
+
+int write_file(const char *path, const char *data, size_t len);
+
+#endif
@@ -0,0 +1,280 @@
+/* file_lock.c
+ * Per-path state for multithreaded FUSE
+ *
+ * FUSE runs the operations of different files on different threads.
+ * Reads go straight to the file descriptor and need nothing from here.
+ * What versioning shares lives in a table keyed by full path:
+ *
+ * - a mutex per directory, held by whatever reads or rewrites the .ver
+ *   of that directory (a commit, a checkout, a revert, an unlink...).
+ *   The objects shared by every file are locked by store.c.
+ * - the byte ranges of a file written or truncated away, taken on
+ *   release: a file with none needs no new version, and the delta of
+ *   one that has them only compares those ranges
+ * - the verdict of sniff.c on the first block written to a file
+ * - the running object hash of a file rewritten from offset 0 in order,
+ *   the usual way a file is saved, so release does not read it again.
+ *   A write anywhere else drops it and the commit hashes the snapshot.
+ *   Writes and the release of a file hold its lock, which keeps the hash
+ *   in step with the contents.
+ *
+ * Entries are created on first use and freed once nobody holds or
+ * waits for them and no write is pending.  The per-file state is only
+ * touched with the lock of the file held, and follows a file renamed
+ * while written (file_renamed()).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "params.h"
+#include "vfs.h"
+#include "log.h"
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *table;
+
+/* Entry for path, created if needed.  Called with table_lock held. */
+static PathLock *lookup(const char *path)
+{
+	PathLock *l;
+
+	if(table == NULL)
+		table = g_hash_table_new(g_str_hash, g_str_equal);
+	l = (PathLock *)g_hash_table_lookup(table, path);
+	if(l == NULL)
+	{
+		l = (PathLock *)calloc(1, sizeof(PathLock));
+		strncpy(l->path, path, PATH_MAX - 1);
+		pthread_mutex_init(&l->lock, NULL);
+		g_hash_table_insert(table, l->path, l);
+	}
+	return l;
+}
+
+/* Frees an entry nobody needs.  Called with table_lock held. */
+static void release(PathLock *l)
+{
+	if(l->users > 0 || l->dirty.n > 0 || l->stream != NULL)
+		return;
+	g_hash_table_remove(table, l->path);
+	pthread_mutex_destroy(&l->lock);
+	free(l);
+}
+
+/* Locks path, waiting for the current holder */
+PathLock *path_lock(const char *path)
+{
+	PathLock *l;
+
+	pthread_mutex_lock(&table_lock);
+	l = lookup(path);
+	l->users++;
+	pthread_mutex_unlock(&table_lock);
+	pthread_mutex_lock(&l->lock);
+	return l;
+}
+
+void path_unlock(PathLock *l)
+{
+	if(l == NULL)
+		return;
+	pthread_mutex_unlock(&l->lock);
+	pthread_mutex_lock(&table_lock);
+	l->users--;
+	release(l);
+	pthread_mutex_unlock(&table_lock);
+}
+
+static void dir_of(char *dir, const char *fpath)
+{
+	const char *end = strrchr(fpath, '/');
+	int len = end ? end - fpath : 0;
+
+	snprintf(dir, PATH_MAX, "%.*s", len, fpath);
+}
+
+/* Locks the directory holding fpath, i.e. its .ver */
+PathLock *dir_lock(const char *fpath)
+{
+	char dir[PATH_MAX];
+
+	dir_of(dir, fpath);
+	return path_lock(dir);
+}
+
+/* Locks the directories of two files in a fixed order, for a rename.
+ * *lb is NULL when both are in the same directory.
+ */
+void dir_lock_pair(const char *fpath_a, const char *fpath_b, PathLock **la, PathLock **lb)
+{
+	char a[PATH_MAX], b[PATH_MAX];
+	int cmp;
+
+	dir_of(a, fpath_a);
+	dir_of(b, fpath_b);
+	cmp = strcmp(a, b);
+	*lb = NULL;
+	if(cmp == 0)
+		*la = path_lock(a);
+	else if(cmp < 0)
+	{
+		*la = path_lock(a);
+		*lb = path_lock(b);
+	}
+	else
+	{
+		*lb = path_lock(b);
+		*la = path_lock(a);
+	}
+}
+
+static void drop_stream(PathLock *l)
+{
+	if(l->stream != NULL)
+		g_checksum_free(l->stream);
+	l->stream = NULL;
+}
+
+/* Records a write of size bytes at offset, with the lock of the file
+ * held.  Restarts the hash on a write at 0, extends it on a write where
+ * the previous one ended, and drops it on any other.  buf may be NULL
+ * when file_needs_data() said so.
+ */
+void file_wrote(PathLock *l, const char *buf, size_t size, off_t offset)
+{
+	l->sniff = sniff_write(l->sniff, buf, size, offset, l->stream != NULL && offset == l->stream_next);
+	if(offset == 0)
+	{
+		drop_stream(l);
+		l->stream = hash_new();
+		l->stream_next = 0;
+	}
+	if(l->stream != NULL && offset == l->stream_next)
+	{
+		g_checksum_update(l->stream, (const guchar *)buf, size);
+		l->stream_next += size;
+	}
+	else
+		drop_stream(l);
+	dirty_add(&l->dirty, offset, offset + size);
+}
+
+/* Tells whether file_wrote() needs the bytes of a write at offset to
+ * the file of l, locked, or only its size
+ */
+int file_needs_data(PathLock *l, off_t offset)
+{
+	return offset < SNIFF_BYTES || (l->stream != NULL && offset == l->stream_next);
+}
+
+/* The file was truncated to size: the bytes from there on changed, and
+ * its running hash and maybe its first block no longer match
+ */
+void file_truncated(const char *fpath, off_t size)
+{
+	PathLock *l = path_lock(fpath);
+
+	drop_stream(l);
+	dirty_add(&l->dirty, size, DIRTY_EOF);
+	if(size < SNIFF_BYTES)
+		l->sniff = SNIFF_UNKNOWN;
+	path_unlock(l);
+}
+
+/* Tells whether the file of l, locked, was written since the last call,
+ * and moves what changed to changes: its object hash when the writes
+ * covered the whole file (else empty), the written ranges, and the
+ * verdict on the first block written.
+ */
+int file_take_written(PathLock *l, FileChanges *changes)
+{
+	struct stat st;
+
+	changes->hash[0] = '\0';
+	if(l->stream != NULL && stat(l->path, &st) == 0 && st.st_size == l->stream_next)
+		hash_string(l->stream, changes->hash);
+	drop_stream(l);
+
+	changes->dirty = l->dirty;
+	memset(&l->dirty, 0, sizeof(DirtyMap));
+	changes->sniff = l->sniff;
+	l->sniff = SNIFF_UNKNOWN;
+	return changes->dirty.n > 0;
+}
+
+/* Moves what is pending for the file at from to the file at to, taking
+ * one lock at a time: a release holds the lock of its file while it
+ * waits for others.  A write that reached to first is kept.
+ */
+static void move_state(const char *from, const char *to)
+{
+	DirtyMap dirty;
+	GChecksum *stream;
+	off_t stream_next;
+	PathLock *l;
+	int i, sniff, fresh;
+
+	l = path_lock(from);
+	dirty = l->dirty;
+	memset(&l->dirty, 0, sizeof(DirtyMap));
+	stream = l->stream;
+	stream_next = l->stream_next;
+	l->stream = NULL;
+	sniff = l->sniff;
+	l->sniff = SNIFF_UNKNOWN;
+	path_unlock(l);
+	if(dirty.n == 0 && stream == NULL)
+		return;
+
+	l = path_lock(to);
+	fresh = l->dirty.n == 0 && l->stream == NULL;
+	for(i = 0; i < dirty.n; i++)
+		dirty_add(&l->dirty, dirty.r[i].start, dirty.r[i].end);
+	dirty_free(&dirty);
+	if(fresh)
+	{
+		l->stream = stream;
+		l->stream_next = stream_next;
+	}
+	else if(stream != NULL)
+		g_checksum_free(stream);
+	if(l->sniff == SNIFF_UNKNOWN)
+		l->sniff = sniff;
+	path_unlock(l);
+}
+
+/* The file or directory at from was renamed to to: the writes pending
+ * for it, or for the files below it, are released at their new path
+ */
+void file_renamed(const char *from, const char *to)
+{
+	char path[PATH_MAX];
+	size_t len = strlen(from);
+	GHashTableIter it;
+	gpointer key, value;
+	GSList *below = NULL, *e;
+
+	pthread_mutex_lock(&table_lock);
+	if(table != NULL)
+	{
+		g_hash_table_iter_init(&it, table);
+		while(g_hash_table_iter_next(&it, &key, &value))
+			if(strncmp((char *)key, from, len) == 0 && ((char *)key)[len] == '/')
+				below = g_slist_prepend(below, strdup((char *)key));
+	}
+	pthread_mutex_unlock(&table_lock);
+
+	move_state(from, to);
+	for(e = below; e != NULL; e = e->next)
+	{
+		snprintf(path, PATH_MAX, "%s%s", to, (char *)e->data + len);
+		move_state((char *)e->data, path);
+		free(e->data);
+	}
+	g_slist_free(below);
+}
@@ -26,52 +26,52 @@ void add_normal_time(int tp, char * pr)
 
 void print_full_branch(char * tree_file_path, int off)
 {
-	FILE * fpt = fopen(tree_file_path, "r");
+	TreeMap * t = tree_open(tree_file_path, 0);
+	TreeMd * rec;
 	FILE *fout = fopen("/tmp/rvfs/templist","a");
 	log_msg("\n New branch starts here:\n");
-	fseek(fpt, off, SEEK_SET);
-	int valid, tp, lp, diff_ct, p_off;
-	char * hash = (char *)malloc(50*sizeof(char));
-	char * tag = (char *)malloc(255*sizeof(char));
+	char tag[MAX_TAG];
 	
 	char * pr = (char *)malloc(10000*sizeof(char));
 	
 	int flag=0;
 	while(off!=-1)
 	{
-		fscanf(fpt, "%d", &valid);
-		if(valid==0)
+		rec = tree_at(t, off);
+		if(rec==NULL || rec->valid==0)
 		{
 			log_msg("ERROR: no record of parent head in tree.");
+			tree_close(t);
+			fclose(fout);
 			return ;
 		}
-		fscanf(fpt, "%d %d %s %s %d %d", &tp, &lp, hash, tag, &diff_ct, &p_off);
 		
 		char * dummy = (char *)malloc(20*sizeof(char));
-		itoa(tp,dummy);
+		itoa(rec->timestamp,dummy);
 		if(flag==0)
 			strcpy(pr, dummy);
 		else
 			strcat(pr, dummy);
 		flag++;
 		strcat(pr, " ");
-		add_normal_time(tp, pr);
-		if(tag[0]=='_')
+		add_normal_time(rec->timestamp, pr);
+		if(rec->tag[0]=='_')
 			strcat(pr, "\n");
 		else
 		{
+			strcpy(tag, rec->tag);
 			tag[5] = '\0';
 			strcat(pr, tag);
 			strcat(pr, "\n");
 		}
-		off=p_off;
-		fseek(fpt, off, SEEK_SET);
+		off=rec->parent;
 	}
 	log_msg("%s\n",pr);
 	fprintf(fout,"New Branch starts here\n");
 	fprintf(fout,"%s\n", pr);
 	
 	
+	tree_close(t);
 	fclose(fout);
 	return;
 }
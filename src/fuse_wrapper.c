@@ -10,6 +10,7 @@
 #define printf log_msg
 
 #include "fuse_wrapper.h"
+#include "delta.h"
 
 int delete (const char *filepath) {
 	printf("Entered Delete function\n");
@@ -27,7 +28,23 @@ int delete (const char *filepath) {
 	return 1;
 }
 
+/* Applies the delta in diff_filepath to orig_filepath in place.
+ * Deltas made by "diff -u" before the native delta engine existed
+ * are still handed over to patch.
+ */
 void patch(const char * orig_filepath, const char * diff_filepath) {
+	size_t len;
+	char * delta = map_file(diff_filepath, &len);
+	
+	if(delta != NULL && is_delta(delta, len)) {
+		if(!delta_apply_file(orig_filepath, delta, len))
+			printf("\n\nPatching %s with %s failed\n\n",orig_filepath,diff_filepath);
+		unmap_file(delta, len);
+		return;
+	}
+	if(delta != NULL)
+		unmap_file(delta, len);
+	
 	char * command = (char *) malloc(1000*sizeof(char));
 	strcpy(command,"patch ");
 	strcat(command,orig_filepath);
@@ -36,6 +53,7 @@ void patch(const char * orig_filepath, const char * diff_filepath) {
 	printf("\n\nPatching command : %s\n\n",command);
 	
 	system(command);
+	free(command);
 }
 
 int makedir (const char *dirpath) {
@@ -98,17 +116,11 @@ int move(const char * source, const char * dest) {
 	return 1;
 }
 
+/* Writes the delta turning filepath1 into filepath2 to diff_filepath */
 void diff(const char * filepath1, const char * filepath2, const char * diff_filepath ) {
-	char * command = (char *) malloc(1000*sizeof(char));
-	strcpy(command,"diff -u ");
-	strcat(command,filepath1);
-	strcat(command," ");
-	strcat(command,filepath2);
-	strcat(command," >");
-	strcat(command,diff_filepath);
-	printf("\n\ndiff: %s\n\n",command);
+	int ops = delta_create(filepath1,filepath2,diff_filepath);
 	
-	system(command);
+	printf("\n\ndiff: %s %s > %s (%d ops)\n\n",filepath1,filepath2,diff_filepath,ops);
 }
 
 void rem(const char * filepath) {
@@ -0,0 +1,392 @@
+/* gc.c
+ * Reclaiming space in the background
+ *
+ * Versions are only thinned when asked for (see cleanup.c) unless the
+ * mount is given budgets: RVFS_GC_FILE_RATIO, the least share of the
+ * space of a file and its versions the file itself should take, and
+ * RVFS_GC_DIR_BYTES, the most bytes the versions of the files of one
+ * directory should take.  Sizes are taken from the last line of the
+ * md_data history of each file (see update_sizemd_file()), so finding
+ * what is over budget costs a short read per file.
+ *
+ * A thread wakes every GC_PERIOD seconds and, once no request came for
+ * GC_IDLE_SECONDS, goes over the directories of the mount.  It cleans
+ * the files under their ratio, then the files taking the most of a
+ * directory over its budget, GC_BATCH versions at a time with the lock
+ * of the directory held, stopping short of the next merge when a request
+ * comes in, and then sweeps the object store of what
+ * crashes left (see store_sweep()).  Its I/O is paced to
+ * RVFS_GC_RATE_BYTES a second, and the pass is given up as soon as a
+ * request comes in, to start over at the next idle time.
+ *
+ * getfattr -n user.rvfs.gc on any path reads its counters.
+ */
+
+#include "params.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "vfs.h"
+#include "log.h"
+
+#define GC_PERIOD 60		/* seconds between two passes */
+#define GC_BATCH 32		/* versions removed per hold of a directory lock */
+#define GC_SWEEP_BATCH 256	/* objects looked at between two pacing waits */
+#define GC_SWEEP_GRACE 3600	/* age of an unreferenced object before it goes */
+
+typedef struct _gc_file{
+
+	char path[PATH_MAX];
+	long file_size;
+	long md_size;		/* bytes of its versions */
+}GcFile;
+
+typedef struct _gc_stats{
+
+	long passes;		/* finished */
+	long yielded;		/* given up for a request */
+	long files;		/* cleaned for being over budget */
+	long versions;		/* removed */
+	long long freed;	/* bytes, versions and swept objects */
+	long swept;		/* objects and scratch files removed */
+	int running;
+}GcStats;
+
+static pthread_t gc_thread;
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_wake = PTHREAD_COND_INITIALIZER;
+static int started, stopping;
+static volatile time_t last_request;
+static GcStats stats;
+
+/* Notes a request of the mount, so the collector keeps out of its way */
+void gc_touch(void)
+{
+	last_request = time(NULL);
+}
+
+static int idle(void)
+{
+	return !stopping && time(NULL) - last_request >= GC_IDLE_SECONDS;
+}
+
+/* Waits for ns nanoseconds, or less if the collector is stopped
+ * Returns 0 once it is stopped
+ */
+static int gc_sleep(long long ns)
+{
+	struct timespec until;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += ns / 1000000000LL;
+	until.tv_nsec += ns % 1000000000LL;
+	if(until.tv_nsec >= 1000000000L)
+	{
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&gc_lock);
+	while(!stopping && pthread_cond_timedwait(&gc_wake, &gc_lock, &until) != ETIMEDOUT)
+		;
+	pthread_mutex_unlock(&gc_lock);
+	return !stopping;
+}
+
+/* Waits as long as io bytes take at the rate of the collector
+ * Returns 1 if it can go on
+ */
+static int pace(long long io)
+{
+	if(BB_DATA->gc_rate_bytes > 0 && io > 0 && !gc_sleep(io * 1000000000LL / BB_DATA->gc_rate_bytes))
+		return 0;
+	return idle();
+}
+
+/* Reads the sizes last recorded in md_path into f
+ * Returns 1 for success and 0 for failure
+ */
+static int last_sizes(const char *md_path, GcFile *f)
+{
+	char buf[256], *line, *next;
+	long file_size, md_size;
+	int timestamp, ret = 0;
+	size_t n;
+	float ratio;
+	FILE *md;
+
+	md = fopen(md_path, "r");
+	if(md == NULL)
+		return 0;
+	if(fseek(md, -(long)(sizeof(buf) - 1), SEEK_END) != 0)
+		rewind(md);
+	n = fread(buf, 1, sizeof(buf) - 1, md);
+	fclose(md);
+	buf[n] = '\0';
+	for(line = buf; line != NULL; line = next)
+	{
+		next = strchr(line, '\n');
+		if(next != NULL)
+			*next++ = '\0';
+		if(sscanf(line, "%d %ld %ld %f", &timestamp, &file_size, &md_size, &ratio) == 4)
+		{
+			f->file_size = file_size;
+			f->md_size = md_size;
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
+/* Removes versions of f until it takes ratio of the space of itself and
+ * its versions, batch by batch
+ * Returns 0 if a request came in meanwhile
+ */
+static int clean(GcFile *f, float ratio)
+{
+	char md_path[PATH_MAX];
+	file_data *file;
+	PathLock *vlock;
+	long saved;
+	int n;
+
+	do
+	{
+		if(!idle())
+			return 0;
+		vlock = dir_lock(f->path);
+		file = construct_file_data(f->path);
+		snprintf(md_path, PATH_MAX, "%s", file->md_data_file_path);
+		// idle() is asked again before each merge, not only between batches
+		n = cleanupfile(file, ratio, GC_BATCH, idle, 0, &saved);
+		free(file);
+		path_unlock(vlock);
+		if(n <= 0)
+			break;
+		pthread_mutex_lock(&gc_lock);
+		stats.versions += n;
+		stats.freed += saved;
+		pthread_mutex_unlock(&gc_lock);
+		// a merge rebuilds two versions of the file
+		if(!pace((long long)n * 2 * f->file_size))
+			return 0;
+	}while(n == GC_BATCH);
+	last_sizes(md_path, f);
+	return 1;
+}
+
+static int cmp_md_size(const void *a, const void *b)
+{
+	long x = ((const GcFile *)a)->md_size, y = ((const GcFile *)b)->md_size;
+
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Brings the versioned files of dir within their budgets
+ * Returns 0 if a request came in meanwhile
+ */
+static int clean_dir(const char *dir)
+{
+	char md_dir[PATH_MAX], md_path[PATH_MAX];
+	GcFile *files = NULL, *f;
+	long long total = 0, target;
+	int n = 0, size = 0, i, ret = 1;
+	struct dirent *de;
+	size_t len;
+	DIR *d;
+
+	snprintf(md_dir, PATH_MAX, "%s/%s%s", dir, VER_DIR, MD_DATA_FOLDER);
+	d = opendir(md_dir);
+	if(d == NULL)
+		return 1;
+	while((de = readdir(d)) != NULL)
+	{
+		len = strlen(de->d_name);
+		if(len <= 3 || strcmp(de->d_name + len - 3, ".md") != 0)
+			continue;
+		if(n == size)
+		{
+			size = size ? 2*size : 16;
+			files = (GcFile *)realloc(files, size*sizeof(GcFile));
+		}
+		f = &files[n];
+		snprintf(f->path, PATH_MAX, "%s/%.*s", dir, (int)(len - 3), de->d_name);
+		snprintf(md_path, PATH_MAX, "%s%s", md_dir, de->d_name);
+		if(access(f->path, F_OK) == 0 && last_sizes(md_path, f))
+			n++;
+	}
+	closedir(d);
+
+	for(i = 0; ret && i < n; i++)
+	{
+		f = &files[i];
+		if(BB_DATA->gc_file_ratio > 0 && f->md_size > 0
+			&& (float)f->file_size/(f->file_size + f->md_size) < BB_DATA->gc_file_ratio)
+		{
+			ret = clean(f, BB_DATA->gc_file_ratio);
+			pthread_mutex_lock(&gc_lock);
+			stats.files++;
+			pthread_mutex_unlock(&gc_lock);
+		}
+		total += f->md_size;
+	}
+
+	// the files with the most versions give back what the directory is over by
+	qsort(files, n, sizeof(GcFile), cmp_md_size);
+	for(i = 0; ret && BB_DATA->gc_dir_bytes > 0 && total > BB_DATA->gc_dir_bytes && i < n; i++)
+	{
+		f = &files[i];
+		target = f->md_size - (total - BB_DATA->gc_dir_bytes);
+		if(f->md_size == 0)
+			break;
+		total -= f->md_size;
+		ret = clean(f, target > 0 ? (float)f->file_size/(f->file_size + target) : 1.0);
+		total += f->md_size;
+		pthread_mutex_lock(&gc_lock);
+		stats.files++;
+		pthread_mutex_unlock(&gc_lock);
+	}
+	free(files);
+	return ret;
+}
+
+/* Goes over dir and the directories below it
+ * Returns 0 if a request came in meanwhile
+ */
+static int clean_tree(const char *dir)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	int ret;
+
+	if(!idle() || !clean_dir(dir))
+		return 0;
+	d = opendir(dir);
+	if(d == NULL)
+		return 1;
+	ret = 1;
+	while(ret && (de = readdir(d)) != NULL)
+	{
+		// the versions themselves are not looked into
+		if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0
+			|| (strlen(de->d_name) == strlen(VER_DIR) - 1 && strncmp(de->d_name, VER_DIR, strlen(de->d_name)) == 0))
+			continue;
+		snprintf(path, PATH_MAX, "%s/%s", dir, de->d_name);
+		if(lstat(path, &st) == 0 && S_ISDIR(st.st_mode))
+			ret = clean_tree(path);
+	}
+	closedir(d);
+	return ret;
+}
+
+/* Removes what crashes left in the object store
+ * Returns 0 if a request came in meanwhile
+ */
+static int sweep(void)
+{
+	char objects_dir_path[PATH_MAX];
+	struct dirent *de;
+	long bytes;
+	int n = 0, ret = 1;
+	DIR *d;
+
+	snprintf(objects_dir_path, PATH_MAX, "%s/%s%s", BB_DATA->rootdir, VER_DIR, STORE_FOLDER);
+	d = opendir(objects_dir_path);
+	if(d == NULL)
+		return 1;
+	while(ret && (de = readdir(d)) != NULL)
+	{
+		if(de->d_name[0] == '.')
+			continue;
+		bytes = store_sweep(de->d_name, GC_SWEEP_GRACE);
+		if(bytes > 0)
+		{
+			pthread_mutex_lock(&gc_lock);
+			stats.swept++;
+			stats.freed += bytes;
+			pthread_mutex_unlock(&gc_lock);
+		}
+		if(++n % GC_SWEEP_BATCH == 0)
+			ret = pace((long long)GC_SWEEP_BATCH * sizeof(struct stat));
+	}
+	closedir(d);
+	return ret;
+}
+
+static void *gc_worker(void *arg)
+{
+	int done;
+
+	while(gc_sleep(GC_PERIOD * 1000000000LL))
+	{
+		if(!idle())
+			continue;
+		pthread_mutex_lock(&gc_lock);
+		stats.running = 1;
+		pthread_mutex_unlock(&gc_lock);
+		log_msg("gc: pass %ld starts\n", stats.passes + 1);
+
+		done = clean_tree(BB_DATA->rootdir) && sweep();
+
+		pthread_mutex_lock(&gc_lock);
+		stats.running = 0;
+		if(done)
+			stats.passes++;
+		else
+			stats.yielded++;
+		pthread_mutex_unlock(&gc_lock);
+		log_info("gc: pass %s, %ld versions removed, %lld bytes freed so far\n",
+			done ? "done" : "given up", stats.versions, stats.freed);
+	}
+	return NULL;
+}
+
+/* Starts the collector, called from vfs_init() */
+void gc_start(void)
+{
+	gc_touch();
+	stopping = 0;
+	if(pthread_create(&gc_thread, NULL, gc_worker, NULL) != 0)
+	{
+		log_warn("gc_start: cannot start the collector\n");
+		return;
+	}
+	started = 1;
+}
+
+/* Stops the collector, between two batches, from vfs_destroy() */
+void gc_stop(void)
+{
+	if(!started)
+		return;
+	pthread_mutex_lock(&gc_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&gc_wake);
+	pthread_mutex_unlock(&gc_lock);
+	pthread_join(gc_thread, NULL);
+	started = 0;
+}
+
+/* Writes the counters as "passes <n> yielded <n> running <0/1> files
+ * <n> versions <n> swept <n> freed <bytes>"
+ * Returns the length of the string
+ */
+int gc_stats(char *buf, size_t size)
+{
+	GcStats s;
+
+	pthread_mutex_lock(&gc_lock);
+	s = stats;
+	pthread_mutex_unlock(&gc_lock);
+	return snprintf(buf, size, "passes %ld yielded %ld running %d files %ld versions %ld swept %ld freed %lld",
+		s.passes, s.yielded, s.running, s.files, s.versions, s.swept, s.freed);
+}
@@ -0,0 +1,405 @@
+/* load.c
+ * Workloads run against a directory, timed as an application sees them
+ *
+ * Usage: rvfs_load -w <workload> [-n <ops>] [-s <file size>]
+ *		[-b <block size>] [-f <files>] [-S <seed>] [-i <INDEX>]
+ *		[-D <data dir>] [-l <label>] </path/to/dir/>
+ *
+ * Meant to be run on an RVFS mount and on a baseline, see
+ * benchmarking/bench_mount.sh.  The workloads:
+ *
+ *	commit		<ops> times opens one of <files> text files, appends a
+ *			block and closes it, each close a version on RVFS
+ *	seqwrite	<ops> blocks written one after the other
+ *	randwrite	<ops> blocks written at random offsets of a file of
+ *			<file size>
+ *	seqread		<ops> blocks read one after the other, from the start
+ *			again past <file size>
+ *	randread	<ops> blocks read at random offsets
+ *	readdir		<ops> listings of the directory, with <files> files
+ *	replay		the ops of an INDEX file of benchmarking/: <file>:add
+ *			copies <data dir>/<file> in, <file>:commit copies it
+ *			over <name>.base, as pop_git.sh does
+ *
+ * A sample is an open, write and close for commit and replay, a listing
+ * for readdir, a read or write call for the others.  The files the
+ * workloads need are made first, untimed.
+ *
+ * Prints one line of JSON: the label and workload, the count, bytes,
+ * seconds and throughput, and latency percentiles in microseconds.
+ */
+
+#define _GNU_SOURCE
+#include "params.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define LOAD_TEXT "load-%d.txt"
+#define LOAD_DATA "load.bin"
+
+typedef struct _samples{
+
+	long long *ns;
+	int n, size;
+	long long bytes;
+}Samples;
+
+static unsigned long long rng;
+static Samples samples;
+static long long began;
+static int errors;
+
+static long long now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long next_random(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 0x2545f4914f6cdd1dULL;
+}
+
+static void sample(long long start, long long bytes)
+{
+	Samples *s = &samples;
+
+	if(s->n == s->size)
+	{
+		s->size = s->size ? 2*s->size : 64;
+		s->ns = (long long *)realloc(s->ns, s->size*sizeof(long long));
+	}
+	s->ns[s->n++] = now() - start;
+	s->bytes += bytes;
+}
+
+static void fail(const char *what, const char *path)
+{
+	fprintf(stderr, "rvfs_load: %s %s: %s\n", what, path, strerror(errno));
+	errors++;
+}
+
+/* Fills buf with lines of 20 random capitals, a text file for RVFS */
+static void text_block(char *buf, long n)
+{
+	long i;
+
+	for(i = 0; i < n; i++)
+		buf[i] = i%21 == 20 ? '\n' : 'A' + next_random()%26;
+}
+
+static void random_block(char *buf, long n)
+{
+	long i;
+
+	for(i = 0; i < n; i++)
+		buf[i] = next_random();
+}
+
+/* Makes path a file of size random bytes, unless it is one already */
+static int prepare(const char *path, long size, char *buf, long block)
+{
+	struct stat st;
+	long done;
+	int fd;
+
+	if(stat(path, &st) == 0 && st.st_size >= size)
+		return 1;
+	if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+	{
+		fail("open", path);
+		return 0;
+	}
+	for(done = 0; done < size; done += block)
+	{
+		random_block(buf, block);
+		if(write(fd, buf, size - done < block ? size - done : block) < 0)
+		{
+			fail("write", path);
+			break;
+		}
+	}
+	close(fd);
+	return done >= size;
+}
+
+static void commit(const char *dir, int n, int files, char *buf, long block)
+{
+	char path[PATH_MAX];
+	long long start;
+	int i, fd;
+
+	began = now();
+	for(i = 0; i < n; i++)
+	{
+		snprintf(path, PATH_MAX, "%s/" LOAD_TEXT, dir, i%files);
+		text_block(buf, block);
+		start = now();
+		if((fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+		{
+			fail("open", path);
+			continue;
+		}
+		if(write(fd, buf, block) != block)
+			fail("write", path);
+		if(close(fd) != 0)
+			fail("close", path);
+		sample(start, block);
+	}
+}
+
+/* The read and write workloads, on one file kept open */
+static void rw(const char *dir, int n, long size, char *buf, long block, int writing, int random)
+{
+	char path[PATH_MAX];
+	long blocks = size/block;
+	long long start;
+	off_t off;
+	ssize_t ret;
+	int i, fd;
+
+	snprintf(path, PATH_MAX, "%s/" LOAD_DATA, dir);
+	if(blocks < 1)
+		blocks = 1;
+	// a sequential write starts the file over, the others need it whole
+	if(writing && !random)
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	else if(prepare(path, blocks*block, buf, block))
+		fd = open(path, writing ? O_WRONLY : O_RDONLY);
+	else
+		return;
+	if(fd < 0)
+	{
+		fail("open", path);
+		return;
+	}
+	random_block(buf, block);
+	began = now();
+	for(i = 0; i < n; i++)
+	{
+		if(writing && !random)
+			off = (off_t)i*block;
+		else
+			off = (off_t)(random ? next_random()%blocks : i%blocks)*block;
+		start = now();
+		ret = writing ? pwrite(fd, buf, block, off) : pread(fd, buf, block, off);
+		if(ret < 0)
+			fail(writing ? "write" : "read", path);
+		sample(start, ret > 0 ? ret : 0);
+	}
+	if(close(fd) != 0)
+		fail("close", path);
+}
+
+static void list(const char *dir, int n, int files, char *buf, long block)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	long long start;
+	int i, fd;
+	DIR *d;
+
+	for(i = 0; i < files; i++)
+	{
+		snprintf(path, PATH_MAX, "%s/" LOAD_TEXT, dir, i);
+		if(access(path, F_OK) == 0)
+			continue;
+		text_block(buf, block);
+		if((fd = open(path, O_WRONLY | O_CREAT, 0644)) < 0 || write(fd, buf, block) != block)
+			fail("create", path);
+		if(fd >= 0)
+			close(fd);
+	}
+	began = now();
+	for(i = 0; i < n; i++)
+	{
+		start = now();
+		if((d = opendir(dir)) == NULL)
+		{
+			fail("opendir", dir);
+			return;
+		}
+		while((de = readdir(d)) != NULL)
+			;
+		closedir(d);
+		sample(start, 0);
+	}
+}
+
+/* Copies src to dst as an application saving it would */
+static void copy_in(const char *src, const char *dst, char *buf, long block)
+{
+	long long start = now(), bytes = 0;
+	int in, out;
+	ssize_t n;
+
+	if((in = open(src, O_RDONLY)) < 0)
+	{
+		fail("open", src);
+		return;
+	}
+	if((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+	{
+		fail("open", dst);
+		close(in);
+		return;
+	}
+	while((n = read(in, buf, block)) > 0)
+	{
+		if(write(out, buf, n) != n)
+		{
+			fail("write", dst);
+			break;
+		}
+		bytes += n;
+	}
+	close(in);
+	if(close(out) != 0)
+		fail("close", dst);
+	sample(start, bytes);
+}
+
+static void replay(const char *dir, const char *index, const char *data, char *buf, long block)
+{
+	char line[PATH_MAX + 8], src[PATH_MAX], dst[PATH_MAX], *op, *dot;
+	FILE *f = fopen(index, "r");
+
+	if(f == NULL)
+	{
+		fail("open", index);
+		return;
+	}
+	began = now();
+	// room left after the name for .base
+	while(fgets(line, PATH_MAX, f) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if((op = strchr(line, ':')) == NULL)
+			continue;
+		*op++ = '\0';
+		if(strcmp(op, "add") != 0 && strcmp(op, "commit") != 0)
+		{
+			fprintf(stderr, "rvfs_load: %s: unknown op %s\n", index, op);
+			continue;
+		}
+		if(snprintf(src, PATH_MAX, "%s/%s", data, line) >= PATH_MAX)
+			continue;
+		// a commit is written over the base of the file
+		if(strcmp(op, "commit") == 0 && (dot = strchr(line, '.')) != NULL)
+			strcpy(dot, ".base");
+		if(snprintf(dst, PATH_MAX, "%s/%s", dir, line) >= PATH_MAX)
+			continue;
+		copy_in(src, dst, buf, block);
+	}
+	fclose(f);
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct(Samples *s, double q)
+{
+	int i = (int)(q*s->n + 0.5) - 1;
+
+	if(s->n == 0)
+		return 0;
+	if(i < 0)
+		i = 0;
+	if(i >= s->n)
+		i = s->n - 1;
+	return s->ns[i]/1000.0;
+}
+
+static void report(const char *label, const char *workload, long long elapsed)
+{
+	Samples *s = &samples;
+	double total = 0, secs = elapsed/1e9;
+	int i;
+
+	qsort(s->ns, s->n, sizeof(long long), cmp_ll);
+	for(i = 0; i < s->n; i++)
+		total += s->ns[i];
+	printf("{\"label\": \"%s\", \"workload\": \"%s\", \"count\": %d, \"errors\": %d, \"bytes\": %lld, "
+		"\"seconds\": %.6f, \"mb_per_s\": %.3f, \"ops_per_s\": %.3f, \"mean_us\": %.1f, \"p50_us\": %.1f, "
+		"\"p90_us\": %.1f, \"p99_us\": %.1f, \"p99.9_us\": %.1f, \"max_us\": %.1f}\n", label, workload,
+		s->n, errors, s->bytes, secs, secs > 0 ? s->bytes/secs/(1024*1024) : 0, secs > 0 ? s->n/secs : 0,
+		s->n ? total/s->n/1000 : 0, pct(s, 0.5), pct(s, 0.9), pct(s, 0.99), pct(s, 0.999),
+		s->n ? s->ns[s->n - 1]/1000.0 : 0);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: rvfs_load -w commit|seqwrite|randwrite|seqread|randread|readdir|replay [-n <ops>]\n"
+		"\t[-s <file size>] [-b <block size>] [-f <files>] [-S <seed>] [-i <INDEX>] [-D <data dir>]\n"
+		"\t[-l <label>] </path/to/dir/>\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *workload = NULL, *label = "", *index = "INDEX", *data = "data", *dir;
+	long size = 64*1024*1024, block = 4096;
+	int n = 1000, files = 100, opt;
+	unsigned long long seed = 1;
+	char *buf;
+
+	while((opt = getopt(argc, argv, "w:n:s:b:f:S:i:D:l:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'w': workload = optarg; break;
+		case 'n': n = atoi(optarg); break;
+		case 's': size = atol(optarg); break;
+		case 'b': block = atol(optarg); break;
+		case 'f': files = atoi(optarg); break;
+		case 'S': seed = strtoull(optarg, NULL, 10); break;
+		case 'i': index = optarg; break;
+		case 'D': data = optarg; break;
+		case 'l': label = optarg; break;
+		default: usage();
+		}
+	}
+	if(workload == NULL || optind != argc - 1 || n < 0 || size < 1 || block < 1 || files < 1)
+		usage();
+	dir = argv[optind];
+	rng = seed ? seed : 1;
+	buf = (char *)malloc(block);
+
+	began = now();
+	if(strcmp(workload, "commit") == 0)
+		commit(dir, n, files, buf, block);
+	else if(strcmp(workload, "seqwrite") == 0)
+		rw(dir, n, size, buf, block, 1, 0);
+	else if(strcmp(workload, "randwrite") == 0)
+		rw(dir, n, size, buf, block, 1, 1);
+	else if(strcmp(workload, "seqread") == 0)
+		rw(dir, n, size, buf, block, 0, 0);
+	else if(strcmp(workload, "randread") == 0)
+		rw(dir, n, size, buf, block, 0, 1);
+	else if(strcmp(workload, "readdir") == 0)
+		list(dir, n, files, buf, block);
+	else if(strcmp(workload, "replay") == 0)
+		replay(dir, index, data, buf, block);
+	else
+		usage();
+	report(label, workload, now() - began);
+	free(buf);
+	return errors != 0;
+}
@@ -2,52 +2,425 @@
 // datastructures, I want to see *everything* that happens related to
 // its data structures.  This file contains macros and functions to
 // accomplish this.
+//
+// Messages do not go through stdio on the calling thread.  log_write()
+// packs the address of the format and the raw arguments into a slot of
+// a ring shared by all threads, without taking a lock, and a flusher
+// thread writes the slots out to vfs.log as binary records (see log.h).
+// A message that finds the ring full is counted and dropped rather than
+// waited for.  log_decode renders the file as text.  Below the level of
+// the mount a message costs one comparison, its arguments are not even
+// evaluated.
 
+#define _GNU_SOURCE
 #include "params.h"
 
 #include <fuse.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <glib.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include "log.h"
 
+#define LOG_SLOTS 4096		/* a power of 2 */
+#define LOG_SLOT_SIZE 512
+#define LOG_ARGS_MAX (LOG_SLOT_SIZE - sizeof(unsigned long) - sizeof(LogEntry))
+#define LOG_STRING_MAX 256	/* longer string arguments are cut */
+#define LOG_FLUSH_MS 50
+
+/* A slot is free for the message number pos when its sequence is pos,
+ * holds that message once its sequence is pos + 1 and is free again for
+ * pos + LOG_SLOTS after the flusher is done with it.  The sequence is
+ * kept less the index of the slot, so that the zeroed ring starts with
+ * every slot free.
+ */
+typedef struct _log_slot{
+
+	unsigned long seq;
+	LogEntry e;
+	char args[LOG_ARGS_MAX];
+}LogSlot;
+
+int log_level = LOG_LEVEL_DEFAULT;
+
+static LogSlot ring[LOG_SLOTS];
+static unsigned long ring_head;		/* next message to write */
+static unsigned long ring_tail;		/* next message to flush */
+static unsigned long dropped;
+
+static FILE *logfile;
+static pthread_t flusher;
+static int flusher_running, flusher_stop;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+static GHashTable *formats;		/* formats already in the file */
+
+#define SLOT_SEQ(i) (__atomic_load_n(&ring[i].seq, __ATOMIC_ACQUIRE) + (i))
+#define SLOT_SET(i, s) __atomic_store_n(&ring[i].seq, (s) - (i), __ATOMIC_RELEASE)
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+/* Level named by s, a name or a number
+ * Returns -1 if s names none
+ */
+int log_level_parse(const char *s)
+{
+	int i;
+
+	for(i = 0; i <= LOG_DEBUG; i++)
+		if(strcmp(s, level_names[i]) == 0)
+			return i;
+	if(s[0] >= '0' && s[0] <= '0' + LOG_DEBUG && s[1] == '\0')
+		return s[0] - '0';
+	return -1;
+}
+
 FILE *log_open()
 {
-    FILE *logfile;
-    
-    // very first thing, open up the logfile and mark that we got in
-    // here.  If we can't open the logfile, we're dead.
-    logfile = fopen("vfs.log", "w");
-    if (logfile == NULL) {
-	perror("logfile");
-	exit(EXIT_FAILURE);
-    }
-    
-    // set logfile to line buffering
-    setvbuf(logfile, NULL, _IOLBF, 0);
-
-    return logfile;
+	char *level = getenv("RVFS_LOG_LEVEL");
+
+	if(level != NULL && log_level_parse(level) >= 0)
+		log_level = log_level_parse(level);
+
+	// very first thing, open up the logfile and mark that we got in
+	// here.  If we can't open the logfile, we're dead.
+	logfile = fopen("vfs.log", "w");
+	if(logfile == NULL)
+	{
+		perror("logfile");
+		exit(EXIT_FAILURE);
+	}
+	// out before FUSE forks, or both processes would write it
+	fwrite(LOG_MAGIC, 1, 4, logfile);
+	fflush(logfile);
+	return logfile;
+}
+
+/* Parses the conversion of a printf format starting at p, just past its
+ * '%': *stars is the number of int arguments the '*' width and
+ * precision take, *cls the class of its own argument.
+ * Returns the address past the conversion
+ */
+const char *log_spec(const char *p, int *stars, int *cls)
+{
+	int l = 0, L = 0, z = 0;
+
+	*stars = 0;
+	*cls = LOG_ARG_NONE;
+	while(*p != '\0' && strchr("-+ #0'", *p) != NULL)
+		p++;
+	if(*p == '*')
+	{
+		(*stars)++;
+		p++;
+	}
+	while(*p >= '0' && *p <= '9')
+		p++;
+	if(*p == '.')
+	{
+		p++;
+		if(*p == '*')
+		{
+			(*stars)++;
+			p++;
+		}
+		while(*p >= '0' && *p <= '9')
+			p++;
+	}
+	for(;; p++)
+	{
+		if(*p == 'h')
+			continue;
+		if(*p == 'l')
+			l++;
+		else if(*p == 'L' || *p == 'q' || *p == 'j')
+			L++;
+		else if(*p == 'z' || *p == 't')
+			z++;
+		else
+			break;
+	}
+	switch(*p)
+	{
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+		*cls = L || l > 1 ? LOG_ARG_LLONG : l ? LOG_ARG_LONG : z ? LOG_ARG_SIZE : LOG_ARG_INT;
+		break;
+	case 'c':
+		*cls = LOG_ARG_INT;
+		break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+		*cls = L ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+		break;
+	case 's':
+		*cls = l ? LOG_ARG_PTR : LOG_ARG_STRING;
+		break;
+	case 'p': case 'n':
+		*cls = LOG_ARG_PTR;
+		break;
+	case '\0':
+		return p;
+	}
+	return p + 1;
 }
 
-void log_msg(const char *format, ...)
+static int put(char *out, unsigned int *n, const void *v, unsigned int len)
 {
-    va_list ap;
-    va_start(ap, format);
+	if(*n + len > LOG_ARGS_MAX)
+		return 0;
+	memcpy(out + *n, v, len);
+	*n += len;
+	return 1;
+}
+
+/* Packs the arguments of format into out: an int as 4 bytes, any other
+ * integer as 8, floating point as a double, a string as its 2 byte
+ * length and its bytes, a pointer as 8 bytes
+ * Returns the number of bytes used
+ */
+static unsigned int pack(char *out, const char *format, va_list ap, unsigned char *flags)
+{
+	const char *p = format, *s;
+	unsigned int n = 0;
+	unsigned short len;
+	unsigned long long u;
+	int stars, cls, i, ok = 1;
+	double d;
 
-    vfprintf(BB_DATA->logfile, format, ap);
+	while(ok && (p = strchr(p, '%')) != NULL)
+	{
+		p++;
+		if(*p == '%')
+		{
+			p++;
+			continue;
+		}
+		p = log_spec(p, &stars, &cls);
+		for(i = 0; ok && i < stars; i++)
+		{
+			int w = va_arg(ap, int);
+			ok = put(out, &n, &w, sizeof(w));
+		}
+		if(!ok)
+			break;
+		switch(cls)
+		{
+		case LOG_ARG_INT:
+			i = va_arg(ap, int);
+			ok = put(out, &n, &i, sizeof(i));
+			break;
+		case LOG_ARG_LONG:
+			u = va_arg(ap, unsigned long);
+			ok = put(out, &n, &u, sizeof(u));
+			break;
+		case LOG_ARG_LLONG:
+			u = va_arg(ap, unsigned long long);
+			ok = put(out, &n, &u, sizeof(u));
+			break;
+		case LOG_ARG_SIZE:
+			u = va_arg(ap, size_t);
+			ok = put(out, &n, &u, sizeof(u));
+			break;
+		case LOG_ARG_DOUBLE:
+			d = va_arg(ap, double);
+			ok = put(out, &n, &d, sizeof(d));
+			break;
+		case LOG_ARG_LDOUBLE:
+			d = va_arg(ap, long double);
+			ok = put(out, &n, &d, sizeof(d));
+			break;
+		case LOG_ARG_STRING:
+			s = va_arg(ap, const char *);
+			if(s == NULL)
+				s = "(null)";
+			len = strnlen(s, LOG_STRING_MAX);
+			if(len == LOG_STRING_MAX && s[len] != '\0')
+				*flags |= LOG_FLAG_TRUNCATED;
+			if(n + sizeof(len) + len > LOG_ARGS_MAX)
+			{
+				*flags |= LOG_FLAG_TRUNCATED;
+				len = n + sizeof(len) < LOG_ARGS_MAX ? LOG_ARGS_MAX - n - sizeof(len) : 0;
+			}
+			ok = put(out, &n, &len, sizeof(len)) && put(out, &n, s, len);
+			break;
+		case LOG_ARG_PTR:
+			u = (unsigned long)va_arg(ap, void *);
+			ok = put(out, &n, &u, sizeof(u));
+			break;
+		}
+	}
+	if(!ok)
+		*flags |= LOG_FLAG_TRUNCATED;
+	return n;
 }
-    
+
+void log_write(int level, const char *format, ...)
+{
+	static __thread int tid;
+	unsigned long pos, seq, i;
+	struct timespec ts;
+	LogSlot *slot;
+	va_list ap;
+
+	pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	for(;;)
+	{
+		i = pos & (LOG_SLOTS - 1);
+		seq = SLOT_SEQ(i);
+		if(seq == pos)
+		{
+			if(__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if((long)(seq - pos) < 0)
+		{
+			// full, the flusher is behind
+			__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else
+			pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	}
+
+	if(tid == 0)
+		tid = syscall(SYS_gettid);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	slot = &ring[i];
+	slot->e.type = LOG_REC_EVENT;
+	slot->e.level = level;
+	slot->e.flags = 0;
+	slot->e.tid = tid;
+	slot->e.ns = ts.tv_sec*1000000000LL + ts.tv_nsec;
+	slot->e.id = (unsigned long)format;
+	va_start(ap, format);
+	slot->e.len = pack(slot->args, format, ap, &slot->e.flags);
+	va_end(ap);
+	SLOT_SET(i, pos + 1);
+	// a burst wakes the flusher early, only the message halfway pays
+	if(pos - __atomic_load_n(&ring_tail, __ATOMIC_RELAXED) == LOG_SLOTS/2)
+		pthread_cond_signal(&flusher_wake);
+}
+
+static void write_entry(LogEntry *e, const void *payload)
+{
+	fwrite(e, sizeof(LogEntry), 1, logfile);
+	if(e->len > 0)
+		fwrite(payload, 1, e->len, logfile);
+}
+
+/* Writes out the messages in the ring, on the flusher thread only */
+static void drain(void)
+{
+	unsigned long i, n;
+	const char *format;
+	LogEntry f;
+
+	for(;; __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELAXED))
+	{
+		i = ring_tail & (LOG_SLOTS - 1);
+		if(SLOT_SEQ(i) != ring_tail + 1)
+			break;
+		format = (const char *)(unsigned long)ring[i].e.id;
+		if(!g_hash_table_contains(formats, format))
+		{
+			memset(&f, 0, sizeof(f));
+			f.type = LOG_REC_FORMAT;
+			f.len = strlen(format);
+			f.id = ring[i].e.id;
+			write_entry(&f, format);
+			g_hash_table_add(formats, (gpointer)format);
+		}
+		write_entry(&ring[i].e, ring[i].args);
+		SLOT_SET(i, ring_tail + LOG_SLOTS);
+	}
+	n = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+	if(n > 0)
+	{
+		memset(&f, 0, sizeof(f));
+		f.type = LOG_REC_DROPPED;
+		f.level = LOG_WARN;
+		f.ns = time(NULL)*1000000000LL;
+		f.id = n;
+		write_entry(&f, NULL);
+	}
+	fflush(logfile);
+}
+
+static void *flusher_run(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&flusher_lock);
+	while(!flusher_stop)
+	{
+		pthread_mutex_unlock(&flusher_lock);
+		drain();
+		pthread_mutex_lock(&flusher_lock);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_FLUSH_MS*1000000L;
+		if(ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		// the signal of a producer may be missed, never by more than this
+		if(!flusher_stop)
+			pthread_cond_timedwait(&flusher_wake, &flusher_lock, &ts);
+	}
+	pthread_mutex_unlock(&flusher_lock);
+	drain();
+	return NULL;
+}
+
+/* Starts the flusher, in vfs_init(): FUSE forks after main() and a
+ * thread started before would be left in the parent.  Messages logged
+ * until then wait in the ring.
+ */
+void log_start(void)
+{
+	if(logfile == NULL || flusher_running)
+		return;
+	formats = g_hash_table_new(g_direct_hash, g_direct_equal);
+	if(pthread_create(&flusher, NULL, flusher_run, NULL) != 0)
+	{
+		fprintf(stderr, "log_start: cannot start the flusher\n");
+		return;
+	}
+	flusher_running = 1;
+}
+
+/* Stops the flusher once the ring is written out */
+void log_stop(void)
+{
+	if(!flusher_running)
+		return;
+	pthread_mutex_lock(&flusher_lock);
+	flusher_stop = 1;
+	pthread_cond_signal(&flusher_wake);
+	pthread_mutex_unlock(&flusher_lock);
+	pthread_join(flusher, NULL);
+	flusher_running = 0;
+	g_hash_table_destroy(formats);
+	formats = NULL;
+}
+
 // struct fuse_file_info keeps information about files (surprise!).
 // This dumps all the information in a struct fuse_file_info.  The struct
 // definition, and comments, come from /usr/include/fuse/fuse_common.h
 // Duplicated here for convenience.
 void log_fi (struct fuse_file_info *fi)
 {
+    if (!log_enabled(LOG_DEBUG))
+	return;
+
     /** Open flags.  Available in open() and release() */
     //	int flags;
 	log_struct(fi, flags, 0x%08x, );
@@ -88,6 +461,9 @@ void log_fi (struct fuse_file_info *fi)
 // <bits/stat.h>; this is indirectly included from <fcntl.h>
 void log_stat(struct stat *si)
 {
+    if (!log_enabled(LOG_DEBUG))
+	return;
+
     //  dev_t     st_dev;     /* ID of device containing file */
 	log_struct(si, st_dev, %lld, );
 	
@@ -131,6 +507,9 @@ void log_stat(struct stat *si)
 
 void log_statvfs(struct statvfs *sv)
 {
+    if (!log_enabled(LOG_DEBUG))
+	return;
+
     //  unsigned long  f_bsize;    /* file system block size */
 	log_struct(sv, f_bsize, %ld, );
 	
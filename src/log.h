@@ -2,15 +2,93 @@
 #define _LOG_H_
 #include <stdio.h>
 
+/* Levels, most severe first.  A message is kept if its level is at most
+ * LOG_COMPILE_LEVEL, fixed at build time (-DLOG_COMPILE_LEVEL=LOG_INFO
+ * leaves no trace of the debug messages in the binary), and at most
+ * log_level, set at mount time from RVFS_LOG_LEVEL.
+ */
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_LEVEL_DEFAULT LOG_INFO
+
+extern int log_level;
+
+#define log_enabled(level) ((level) <= LOG_COMPILE_LEVEL && (level) <= log_level)
+
+/* The arguments are only evaluated if the message is kept */
+#define log_at(level, ...) \
+  ((void)(log_enabled(level) && (log_write((level), __VA_ARGS__), 1)))
+
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_msg(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
 //  macro to log fields in structs.
 #define log_struct(st, field, format, typecast) \
   log_msg("    " #field " = " #format "\n", typecast st->field)
 
+/* Classes of printf arguments, shared with log_decode */
+#define LOG_ARG_NONE 0
+#define LOG_ARG_INT 1		/* int and smaller */
+#define LOG_ARG_LONG 2		/* long */
+#define LOG_ARG_LLONG 3		/* long long, intmax_t */
+#define LOG_ARG_SIZE 4		/* size_t, ptrdiff_t */
+#define LOG_ARG_DOUBLE 5
+#define LOG_ARG_LDOUBLE 6
+#define LOG_ARG_STRING 7
+#define LOG_ARG_PTR 8
+
+/* Binary log file: LOG_MAGIC, then records each made of a LogEntry and
+ * len bytes of payload:
+ *
+ *	LOG_REC_FORMAT	id is the address of a format string, the payload
+ *			its text; comes before the first event using it
+ *	LOG_REC_EVENT	a message, id its format, the payload its arguments
+ *			packed in order (see log.c)
+ *	LOG_REC_DROPPED	id messages were lost to a full ring
+ */
+#define LOG_MAGIC "RVL1"
+#define LOG_REC_FORMAT 'F'
+#define LOG_REC_EVENT 'E'
+#define LOG_REC_DROPPED 'D'
+
+#define LOG_FLAG_TRUNCATED 1	/* arguments did not all fit */
+
+typedef struct _log_entry{
+
+	unsigned char type;
+	unsigned char level;
+	unsigned char flags;
+	unsigned char pad;
+	unsigned int len;
+	int tid;
+	int pad2;
+	long long ns;		/* CLOCK_REALTIME */
+	unsigned long long id;
+}LogEntry;
+
+struct fuse_file_info;
+struct stat;
+struct statvfs;
+struct utimbuf;
+
 FILE *log_open(void);
+void log_start(void);
+void log_stop(void);
+void log_write(int level, const char *format, ...);
+const char *log_spec(const char *p, int *stars, int *cls);
+int log_level_parse(const char *s);
+
 void log_fi (struct fuse_file_info *fi);
 void log_stat(struct stat *si);
 void log_statvfs(struct statvfs *sv);
 void log_utime(struct utimbuf *buf);
-
-void log_msg(const char *format, ...);
 #endif
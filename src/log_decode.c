@@ -0,0 +1,256 @@
+/* log_decode.c
+ * Renders the binary vfs.log of a mount as text
+ *
+ * Usage: log_decode [-l <level>] [vfs.log]
+ *
+ * Prints one line per message:
+ *
+ *	<date> <time>.<microseconds> <level> <thread> <message>
+ *
+ * with the message formatted from the format and arguments the mount
+ * recorded (see log.h).  -l keeps the messages up to <level>, one of
+ * error, warn, info or debug.  The file may be decoded while the mount
+ * is still writing it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "log.h"
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+/* Takes len bytes of the arguments at *p, data ending at end
+ * Returns 0 if they are not there
+ */
+static int take(const char **p, const char *end, void *v, size_t len)
+{
+	if(*p + len > end)
+		return 0;
+	memcpy(v, *p, len);
+	*p += len;
+	return 1;
+}
+
+/* Appends to out the conversion from spec to spec_end of the format,
+ * fed with the packed arguments at *p
+ * Returns 0 if they ran out
+ */
+static int convert(GString *out, const char *spec, const char *spec_end, int stars, int cls, const char **p, const char *end)
+{
+	GString *f = g_string_new("%");
+	const char *c;
+	int w[2] = {0, 0}, i, v, ok = 1;
+	unsigned long long u = 0;
+	unsigned short len;
+	double d = 0;
+	void *ptr;
+	char *s;
+
+	// the length modifier is rewritten for the type read back
+	for(c = spec; c < spec_end - 1; c++)
+		if(strchr("hlLqjzt", *c) == NULL)
+			g_string_append_c(f, *c);
+	if(cls == LOG_ARG_LONG || cls == LOG_ARG_LLONG || cls == LOG_ARG_SIZE)
+		g_string_append(f, "ll");
+	g_string_append_c(f, *c);
+
+	for(i = 0; ok && i < stars; i++)
+		ok = take(p, end, &w[i], sizeof(int));
+	switch(ok ? cls : LOG_ARG_NONE)
+	{
+	case LOG_ARG_INT:
+		if((ok = take(p, end, &v, sizeof(v))))
+		{
+			if(stars == 0)
+				g_string_append_printf(out, f->str, v);
+			else if(stars == 1)
+				g_string_append_printf(out, f->str, w[0], v);
+			else
+				g_string_append_printf(out, f->str, w[0], w[1], v);
+		}
+		break;
+	case LOG_ARG_LONG: case LOG_ARG_LLONG: case LOG_ARG_SIZE:
+		if((ok = take(p, end, &u, sizeof(u))))
+		{
+			if(stars == 0)
+				g_string_append_printf(out, f->str, u);
+			else if(stars == 1)
+				g_string_append_printf(out, f->str, w[0], u);
+			else
+				g_string_append_printf(out, f->str, w[0], w[1], u);
+		}
+		break;
+	case LOG_ARG_DOUBLE: case LOG_ARG_LDOUBLE:
+		if((ok = take(p, end, &d, sizeof(d))))
+		{
+			if(stars == 0)
+				g_string_append_printf(out, f->str, d);
+			else if(stars == 1)
+				g_string_append_printf(out, f->str, w[0], d);
+			else
+				g_string_append_printf(out, f->str, w[0], w[1], d);
+		}
+		break;
+	case LOG_ARG_STRING:
+		if((ok = take(p, end, &len, sizeof(len)) && *p + len <= end))
+		{
+			s = g_strndup(*p, len);
+			*p += len;
+			if(stars == 0)
+				g_string_append_printf(out, f->str, s);
+			else if(stars == 1)
+				g_string_append_printf(out, f->str, w[0], s);
+			else
+				g_string_append_printf(out, f->str, w[0], w[1], s);
+			g_free(s);
+		}
+		break;
+	case LOG_ARG_PTR:
+		if((ok = take(p, end, &u, sizeof(u))))
+		{
+			// %n is not written back, nor a wide string read
+			ptr = (void *)(unsigned long)u;
+			g_string_append_printf(out, "%p", ptr);
+		}
+		break;
+	default:
+		ok = ok && cls == LOG_ARG_NONE;
+		if(ok)
+			g_string_append_len(out, spec - 1, spec_end - spec + 1);
+	}
+	g_string_free(f, TRUE);
+	return ok;
+}
+
+/* Formats the message of an event, its arguments at args */
+static void render(GString *out, const char *format, const char *args, unsigned int len, int truncated)
+{
+	const char *p = format, *q, *spec, *a = args, *end = args + len;
+	int stars, cls;
+
+	while((q = strchr(p, '%')) != NULL)
+	{
+		g_string_append_len(out, p, q - p);
+		spec = q + 1;
+		if(*spec == '%')
+		{
+			g_string_append_c(out, '%');
+			p = spec + 1;
+			continue;
+		}
+		p = log_spec(spec, &stars, &cls);
+		if(!convert(out, spec, p, stars, cls, &a, end))
+		{
+			g_string_append(out, "...");
+			truncated = 1;
+			p = "";
+			break;
+		}
+	}
+	g_string_append(out, p);
+	if(truncated)
+		g_string_append(out, " [truncated]");
+}
+
+static void print_line(long long ns, int level, int tid, GString *msg)
+{
+	char when[32];
+	time_t sec = ns/1000000000LL;
+	struct tm tm;
+	size_t b = 0, e = msg->len;
+
+	// messages carry their own newlines, one line each here
+	while(b < e && msg->str[b] == '\n')
+		b++;
+	while(e > b && msg->str[e - 1] == '\n')
+		e--;
+	localtime_r(&sec, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s.%06lld %-5s %d %.*s\n", when, (ns%1000000000LL)/1000, level_names[level <= LOG_DEBUG ? level : LOG_DEBUG],
+		tid, (int)(e - b), msg->str + b);
+}
+
+int main(int argc, char *argv[])
+{
+	GHashTable *formats = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+	int opt, level = LOG_DEBUG, bad = 0;
+	const char *path = "vfs.log", *format;
+	GString *msg = g_string_new(NULL);
+	char magic[4], *payload = NULL;
+	gint64 *key;
+	LogEntry e;
+	FILE *f;
+
+	while((opt = getopt(argc, argv, "l:")) != -1)
+	{
+		if(opt != 'l' || (level = log_level_parse(optarg)) < 0)
+		{
+			fprintf(stderr, "Usage: log_decode [-l error|warn|info|debug] [vfs.log]\n");
+			return 1;
+		}
+	}
+	if(optind < argc)
+		path = argv[optind];
+	f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+	if(f == NULL)
+	{
+		perror(path);
+		return 1;
+	}
+	if(fread(magic, 1, 4, f) != 4 || memcmp(magic, LOG_MAGIC, 4) != 0)
+	{
+		fprintf(stderr, "%s is not an RVFS log\n", path);
+		return 1;
+	}
+
+	while(fread(&e, sizeof(e), 1, f) == 1)
+	{
+		payload = (char *)realloc(payload, e.len + 1);
+		if(fread(payload, 1, e.len, f) != e.len)
+			break;
+		payload[e.len] = '\0';
+		if(e.type == LOG_REC_FORMAT)
+		{
+			key = g_new(gint64, 1);
+			*key = e.id;
+			g_hash_table_replace(formats, key, g_strdup(payload));
+		}
+		else if(e.type == LOG_REC_DROPPED)
+		{
+			if(e.level > level)
+				continue;
+			g_string_printf(msg, "%llu messages dropped, the ring was full", e.id);
+			print_line(e.ns, e.level, 0, msg);
+		}
+		else if(e.type == LOG_REC_EVENT)
+		{
+			if(e.level > level)
+				continue;
+			format = (const char *)g_hash_table_lookup(formats, &e.id);
+			g_string_truncate(msg, 0);
+			if(format == NULL)
+			{
+				g_string_printf(msg, "(unknown format %llx)", e.id);
+				bad++;
+			}
+			else
+				render(msg, format, payload, e.len, e.flags & LOG_FLAG_TRUNCATED);
+			print_line(e.ns, e.level, e.tid, msg);
+		}
+		else
+		{
+			fprintf(stderr, "%s: unknown record type %d, stopping\n", path, e.type);
+			bad++;
+			break;
+		}
+	}
+	free(payload);
+	g_string_free(msg, TRUE);
+	g_hash_table_destroy(formats);
+	return bad != 0;
+}
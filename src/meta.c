@@ -0,0 +1,380 @@
+/* meta.c
+ * Per-file version metadata kept for the life of the mount
+ *
+ * Versioning operations used to rebuild the .ver paths of a file in
+ * construct_file_data(), nine PATH_MAX buffers filled with strcat, and
+ * to parse its heads file again each time they needed the present head.
+ * Both are now loaded on first use and kept:
+ *
+ * - the paths of a file, built once into one block that is never freed,
+ *   so a file_data can point into it (up to META_MAX_FILES files, then
+ *   built per call as before)
+ * - the heads of a file, checked against a stat() of the heads file so
+ *   that a change made behind our back is reloaded.  heads_commit()
+ *   updates them and writes the file back whole through a rename, so a
+ *   crash leaves either the old or the new heads, or hands the write to
+ *   the transaction of the journal (see wal.c).  Code that writes a
+ *   heads file itself calls heads_changed().
+ *
+ * The tree files stay mapped by tree_file.c and the OBJ_MD reference
+ * counts indexed by obj_md.c for the same lifetime.  The objects and
+ * OBJ_MD paths are those of the store of the mount, see store.c.
+ */
+
+#define _GNU_SOURCE
+#include "params.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "vfs.h"
+#include "log.h"
+
+#define META_MAX_FILES 65536
+
+typedef struct _head_entry{
+
+	char name[MAX_BNAME];	/* branch, "B_<timestamp>" */
+	int offset;		/* of its latest version in the tree */
+}HeadEntry;
+
+typedef struct _heads{
+
+	HeadEntry *e;		/* e[0] is the present head, then the branches */
+	int n;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+}Heads;
+
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *paths;	/* file path -> file_data with its strings */
+static GHashTable *heads;	/* heads file path -> Heads */
+
+/* ----- Paths ----- */
+
+static void build_paths(const char *filepath, file_data *file)
+{
+	split_file_path(filepath, file->name, file->dir_path);
+	snprintf(file->ver_dir_path, PATH_MAX, "%s%s", file->dir_path, VER_DIR);
+	// objects are kept once for the whole mount, see store.c
+	snprintf(file->objects_dir_path, PATH_MAX, "%s/%s%s", BB_DATA->rootdir, VER_DIR, STORE_FOLDER);
+	snprintf(file->tree_file_path, PATH_MAX, "%s%s%s.tree", file->ver_dir_path, TREES_FOLDER, file->name);
+	snprintf(file->heads_file_path, PATH_MAX, "%s%s%s.head", file->ver_dir_path, HEADS_FOLDER, file->name);
+	snprintf(file->OBJ_MD_file_path, PATH_MAX, "%s/%s%s", BB_DATA->rootdir, VER_DIR, STORE_MD);
+	snprintf(file->md_data_file_path, PATH_MAX, "%s%s%s.md", file->ver_dir_path, MD_DATA_FOLDER, file->name);
+}
+
+static char *put(char **p, const char *s)
+{
+	char *ret = strcpy(*p, s);
+
+	*p += strlen(s) + 1;
+	return ret;
+}
+
+/* Copies the paths of file into one block, for the cache */
+static file_data *pack_paths(file_data *file)
+{
+	file_data *packed;
+	char *p;
+
+	packed = (file_data *)calloc(1, sizeof(file_data) + strlen(file->name) + strlen(file->dir_path)
+		+ strlen(file->ver_dir_path) + strlen(file->objects_dir_path) + strlen(file->tree_file_path)
+		+ strlen(file->heads_file_path) + strlen(file->OBJ_MD_file_path) + strlen(file->md_data_file_path) + 8);
+	p = (char *)(packed + 1);
+	packed->name = put(&p, file->name);
+	packed->dir_path = put(&p, file->dir_path);
+	packed->ver_dir_path = put(&p, file->ver_dir_path);
+	packed->objects_dir_path = put(&p, file->objects_dir_path);
+	packed->tree_file_path = put(&p, file->tree_file_path);
+	packed->heads_file_path = put(&p, file->heads_file_path);
+	packed->OBJ_MD_file_path = put(&p, file->OBJ_MD_file_path);
+	packed->md_data_file_path = put(&p, file->md_data_file_path);
+	return packed;
+}
+
+/* Fills the paths of file for filepath.  The strings belong to the
+ * cache and must not be written to.
+ */
+void meta_paths(const char *filepath, file_data *file)
+{
+	file_data *cached, tmp;
+
+	pthread_mutex_lock(&meta_lock);
+	if(paths == NULL)
+		paths = g_hash_table_new(g_str_hash, g_str_equal);
+	cached = (file_data *)g_hash_table_lookup(paths, filepath);
+	if(cached == NULL && g_hash_table_size(paths) < META_MAX_FILES)
+	{
+		init_file_data(&tmp);
+		build_paths(filepath, &tmp);
+		cached = pack_paths(&tmp);
+		free_file_data(&tmp);
+		g_hash_table_insert(paths, strdup(filepath), cached);
+	}
+	pthread_mutex_unlock(&meta_lock);
+
+	if(cached != NULL)
+		*file = *cached;
+	else
+	{
+		init_file_data(file);
+		build_paths(filepath, file);
+	}
+	file->path = filepath;
+	file->content_path = filepath;
+	file->content_hash = NULL;
+	file->dirty = NULL;
+	file->chunks = NULL;
+}
+
+/* ----- Heads ----- */
+
+static void free_heads(Heads *h)
+{
+	free(h->e);
+	free(h);
+}
+
+static int same_file(Heads *h, struct stat *st)
+{
+	return h->dev == st->st_dev && h->ino == st->st_ino && h->size == st->st_size
+		&& h->mtime.tv_sec == st->st_mtim.tv_sec && h->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void stamp(Heads *h, struct stat *st)
+{
+	h->dev = st->st_dev;
+	h->ino = st->st_ino;
+	h->size = st->st_size;
+	h->mtime = st->st_mtim;
+}
+
+/* Heads of heads_path, read from the file if not cached or changed.
+ * NULL if there is no heads file.  Called with meta_lock held.
+ */
+static Heads *get_heads(const char *heads_path)
+{
+	char name[MAX_BNAME];
+	struct stat st;
+	Heads *h;
+	FILE *f;
+	int off, size = 0;
+
+	if(heads == NULL)
+		heads = g_hash_table_new_full(g_str_hash, g_str_equal, free, (GDestroyNotify)free_heads);
+	if(stat(heads_path, &st) < 0)
+	{
+		g_hash_table_remove(heads, heads_path);
+		return NULL;
+	}
+	h = (Heads *)g_hash_table_lookup(heads, heads_path);
+	if(h != NULL && same_file(h, &st))
+		return h;
+
+	f = fopen(heads_path, "r");
+	if(f == NULL)
+		return NULL;
+	if(g_hash_table_size(heads) >= META_MAX_FILES)
+		g_hash_table_remove_all(heads);
+	h = (Heads *)calloc(1, sizeof(Heads));
+	while(fscanf(f, "%254s %d", name, &off) == 2)
+	{
+		if(h->n == size)
+		{
+			size = size ? 2*size : 8;
+			h->e = (HeadEntry *)realloc(h->e, size*sizeof(HeadEntry));
+		}
+		strcpy(h->e[h->n].name, name);
+		h->e[h->n++].offset = off;
+	}
+	fclose(f);
+	stamp(h, &st);
+	g_hash_table_replace(heads, strdup(heads_path), h);
+	return h;
+}
+
+/* Offset of the present head, its branch name in name if not NULL
+ * Returns -1 if the file has no version yet
+ */
+int heads_present(const char *heads_path, char *name)
+{
+	Heads *h;
+	int off = -1;
+
+	pthread_mutex_lock(&meta_lock);
+	h = get_heads(heads_path);
+	if(h != NULL && h->n > 0)
+	{
+		off = h->e[0].offset;
+		if(name != NULL)
+			strcpy(name, h->e[0].name);
+	}
+	pthread_mutex_unlock(&meta_lock);
+	return off;
+}
+
+/* Tells whether name is the head of one of the branches */
+int heads_has_branch(const char *heads_path, const char *name)
+{
+	Heads *h;
+	int i, ret = 0;
+
+	pthread_mutex_lock(&meta_lock);
+	h = get_heads(heads_path);
+	for(i = 1; h != NULL && i < h->n && !ret; i++)
+		ret = strcmp(h->e[i].name, name) == 0;
+	pthread_mutex_unlock(&meta_lock);
+	return ret;
+}
+
+/* Hands the len bytes of text, the new contents of heads_path, to the
+ * transaction of the journal of this thread
+ */
+static void defer_heads(const char *heads_path, const char *text, int len)
+{
+	size_t old_len = 0;
+	char *old;
+
+	old = map_file(heads_path, &old_len);
+	wal_defer(WAL_HEADS, heads_path, 0, old, old ? old_len : 0, text, len);
+	if(old != NULL)
+		unmap_file(old, old_len);
+}
+
+/* Writes h to heads_path through a rename, offsets padded so that
+ * write_to_head() can rewrite the first line in place.  In a
+ * transaction of the journal the write is left to wal_commit().
+ */
+static int write_heads(const char *heads_path, Heads *h)
+{
+	GString *s = g_string_new(NULL);
+	struct stat st;
+	int i, ret;
+
+	for(i = 0; i < h->n; i++)
+		g_string_append_printf(s, "%s %-10d\n", h->e[i].name, h->e[i].offset);
+	if(wal_active())
+	{
+		defer_heads(heads_path, s->str, s->len);
+		g_string_free(s, TRUE);
+		return 1;
+	}
+	ret = write_file(heads_path, s->str, s->len);
+	if(ret && stat(heads_path, &st) == 0)
+		stamp(h, &st);
+	g_string_free(s, TRUE);
+	return ret;
+}
+
+/* Brings heads_path to the len bytes at after if it still holds those
+ * at before, for the journal of wal.c
+ * Returns 1 if the file holds after, 0 if it was left alone
+ */
+int heads_redo(const char *heads_path, const char *before, int before_len, const char *after, int after_len)
+{
+	size_t len;
+	char *cur = map_file(heads_path, &len);
+	int is_before, is_after;
+
+	is_before = cur != NULL ? len == (size_t)before_len && memcmp(cur, before, len) == 0 : before_len == 0;
+	is_after = cur != NULL && len == (size_t)after_len && memcmp(cur, after, len) == 0;
+	if(cur != NULL)
+		unmap_file(cur, len);
+	if(is_after)
+		return 1;
+	if(!is_before || !write_file(heads_path, after, after_len))
+		return 0;
+	heads_changed(heads_path);
+	return 1;
+}
+
+/* Replaces heads_path with the len bytes of text, as a revert does,
+ * in the transaction of the journal if this thread has one open
+ * Returns 1 for success and 0 for failure
+ */
+int heads_replace(const char *heads_path, const char *text, int len)
+{
+	int ret;
+
+	if(wal_active())
+	{
+		defer_heads(heads_path, text, len);
+		return 1;
+	}
+	ret = write_file(heads_path, text, len);
+	heads_changed(heads_path);
+	return ret;
+}
+
+/* Makes the version at offset the present head and the head of branch
+ * name: the first version of a file, a version starting a new branch,
+ * or one extending the branch of the present head (which then moves
+ * to the end of the list, as name)
+ */
+void heads_commit(const char *heads_path, const char *name, int offset, int is_first_version, int is_creating_branch)
+{
+	HeadEntry e;
+	Heads *h;
+	int i, j;
+
+	pthread_mutex_lock(&meta_lock);
+	if(heads == NULL)
+		heads = g_hash_table_new_full(g_str_hash, g_str_equal, free, (GDestroyNotify)free_heads);
+	h = is_first_version ? NULL : get_heads(heads_path);
+	if(h == NULL)
+	{
+		h = (Heads *)calloc(1, sizeof(Heads));
+		g_hash_table_replace(heads, strdup(heads_path), h);
+	}
+	if(is_first_version)
+		h->n = 0;
+	if(!is_first_version && !is_creating_branch && h->n > 0)
+	{
+		/* the branch of the present head is extended */
+		for(i = j = 1; i < h->n; i++)
+			if(strcmp(h->e[i].name, h->e[0].name) != 0)
+				h->e[j++] = h->e[i];
+		h->n = j;
+	}
+	h->e = (HeadEntry *)realloc(h->e, (h->n + 2)*sizeof(HeadEntry));
+	memset(&e, 0, sizeof(e));
+	snprintf(e.name, sizeof(e.name), "%s", name);
+	e.offset = offset;
+	if(h->n == 0)
+		h->n = 1;
+	h->e[0] = e;
+	h->e[h->n++] = e;
+	if(!write_heads(heads_path, h))
+	{
+		log_error("heads_commit: cannot write %s\n", heads_path);
+		g_hash_table_remove(heads, heads_path);
+	}
+	pthread_mutex_unlock(&meta_lock);
+}
+
+/* The heads file was written by someone else, reload it on next use */
+void heads_changed(const char *heads_path)
+{
+	pthread_mutex_lock(&meta_lock);
+	if(heads != NULL)
+		g_hash_table_remove(heads, heads_path);
+	pthread_mutex_unlock(&meta_lock);
+}
+
+/* Drops what is cached of the versions of filepath, removed or renamed */
+void meta_forget(const char *filepath)
+{
+	file_data file;
+
+	meta_paths(filepath, &file);
+	heads_changed(file.heads_file_path);
+	tree_forget(file.tree_file_path);
+}
@@ -1,52 +1,255 @@
+/* obj_md.c
+ * Reference counts of the objects of the store (.ver/STORE_MD of the root,
+ * see store.c) and of the .ver/objects of directories versioned before it
+ *
+ * OBJ_MD is an append only journal of "<name> <refcount>" lines, the
+ * last line of a name giving its count.  The files written before the
+ * journal hold one line per hash and read the same way.  The counts of
+ * a directory are loaded into a hash table on first use, so a change
+ * costs a lookup and one appended line instead of a scan of the file.
+ * Lines are appended with a single write, those of a whole chunk list
+ * included, so a crash loses at most a torn last line, which the
+ * loader cuts off.
+ *
+ * Once the journal holds OBJMD_COMPACT_RATIO times more lines than
+ * live hashes it is rewritten with one line per hash, through a
+ * temporary file and a rename.
+ */
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <glib.h>
 #include "vfs.h"
 #include "log.h"
 #define printf log_msg
 #define INS 0
 #define DEL 1
-/* Updates the obj_md file
- * 1. After a revert
- * 2. Creation of a new version -- or a new branch creation
- */
 
-void update_objmd_file(char * s1,char * obj_md_path,int mode)
+#define OBJMD_COMPACT_MIN 256
+#define OBJMD_COMPACT_RATIO 2
+
+typedef struct _objmd_index{
+
+	GHashTable *refs;	/* hash -> reference count */
+	int lines;		/* lines in the journal */
+}ObjMdIndex;
+
+static pthread_mutex_t objmd_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *indexes;	/* OBJ_MD path -> ObjMdIndex */
+
+static void free_index(ObjMdIndex *idx)
 {
-	char * s = (char *)malloc(HASH_SHA1 * sizeof(char));
-	int tmp = 0;
-	int reference_count = 0;
-	int is_present = 0;
-	int pos  = 0;
-	FILE * f = fopen(obj_md_path,"r+");
-	
-	while(fscanf(f,"%s",s)!=-1)
+	GHashTableIter it;
+	gpointer key, value;
+
+	g_hash_table_iter_init(&it, idx->refs);
+	while(g_hash_table_iter_next(&it, &key, &value))
+		free(key);
+	g_hash_table_destroy(idx->refs);
+	free(idx);
+}
+
+/* Index of obj_md_path, read from the journal on first use.
+ * Called with objmd_lock held.
+ */
+static ObjMdIndex *get_index(const char *obj_md_path)
+{
+	char line[128], hash[OBJ_NAME_MAX];
+	ObjMdIndex *idx;
+	gpointer key, value;
+	long good = 0;
+	FILE *f;
+	int ref;
+
+	if(indexes == NULL)
+		indexes = g_hash_table_new(g_str_hash, g_str_equal);
+	idx = (ObjMdIndex *)g_hash_table_lookup(indexes, obj_md_path);
+	if(idx != NULL)
+		return idx;
+
+	idx = (ObjMdIndex *)calloc(1, sizeof(ObjMdIndex));
+	idx->refs = g_hash_table_new(g_str_hash, g_str_equal);
+	f = fopen(obj_md_path, "r");
+	while(f != NULL && fgets(line, sizeof(line), f) != NULL)
 	{
-		printf("Reading a hash\n");
-		
-//		if(!strcmp(s,ver->obj_hash))
-		if(!strcmp(s,s1))
+		if(strchr(line, '\n') == NULL)
+			break;
+		good = ftell(f);
+		idx->lines++;
+		if(sscanf(line, "%81s %d", hash, &ref) != 2)
+			continue;
+		if(g_hash_table_lookup_extended(idx->refs, hash, &key, &value))
 		{
-			printf("Same string found\n");
-			is_present = 1;
-			pos = ftell(f);
-			fscanf(f,"%d",&reference_count);
-			fseek(f,pos,SEEK_SET);
-			if(mode==INS)
-			fprintf(f," %d\n",reference_count+1);
-			else if(mode==DEL)
-				fprintf(f," %d\n",reference_count-1);
-				
-			fclose(f);
-			return;
+			g_hash_table_remove(idx->refs, hash);
+			free(key);
 		}
-		fscanf(f,"%d",&tmp);
-		is_present = 0;
+		if(ref > 0)
+			g_hash_table_insert(idx->refs, strdup(hash), GINT_TO_POINTER(ref));
 	}
-		fprintf(f,"%s %d\n",s1,reference_count+1);
+	if(f != NULL)
+	{
+		/* cut a torn last line, or the next append would extend it */
+		fseek(f, 0, SEEK_END);
+		if(ftell(f) > good)
+		{
+			printf("get_index: dropping a torn line at the end of %s\n", obj_md_path);
+			truncate(obj_md_path, good);
+		}
+		fclose(f);
+	}
+	g_hash_table_insert(indexes, strdup(obj_md_path), idx);
+	return idx;
+}
+
+/* Rewrites the journal with one line per live hash */
+static void compact(const char *obj_md_path, ObjMdIndex *idx)
+{
+	char tmp_path[PATH_MAX];
+	GHashTableIter it;
+	gpointer key, value;
+	FILE *f;
+
+	snprintf(tmp_path, PATH_MAX, "%s.compact", obj_md_path);
+	f = fopen(tmp_path, "w");
+	if(f == NULL)
+		return;
+	g_hash_table_iter_init(&it, idx->refs);
+	while(g_hash_table_iter_next(&it, &key, &value))
+		fprintf(f, "%s %d\n", (char *)key, GPOINTER_TO_INT(value));
+	if(fflush(f) != 0 || fdatasync(fileno(f)) != 0)
+	{
 		fclose(f);
-		return;		
+		unlink(tmp_path);
+		return;
+	}
+	fclose(f);
+	if(rename(tmp_path, obj_md_path) != 0)
+	{
+		unlink(tmp_path);
+		return;
+	}
+	printf("Compacted %s: %d lines -> %d\n", obj_md_path, idx->lines, g_hash_table_size(idx->refs));
+	idx->lines = g_hash_table_size(idx->refs);
 }
 
+/* Adds delta to the reference counts of the n hashes, with a single
+ * append to the journal.  counts, if not NULL, gets the new counts, an
+ * object whose count drops to 0 is unused.
+ */
+void objmd_ref_many(const char *obj_md_path, const char **hashes, int n, int delta, int *counts)
+{
+	long long start = stats_now();
+	ObjMdIndex *idx;
+	GString *lines = g_string_new(NULL);
+	gpointer key, value;
+	int i, fd, ref, failed = 0;
 
+	pthread_mutex_lock(&objmd_lock);
+	idx = get_index(obj_md_path);
+	for(i = 0; i < n; i++)
+	{
+		ref = 0;
+		if(g_hash_table_lookup_extended(idx->refs, hashes[i], &key, &value))
+		{
+			ref = GPOINTER_TO_INT(value);
+			g_hash_table_remove(idx->refs, hashes[i]);
+			free(key);
+		}
+		else if(delta < 0)
+			printf("objmd_ref: %s has no reference in %s\n", hashes[i], obj_md_path);
+		ref += delta;
+		if(ref > 0)
+			g_hash_table_insert(idx->refs, strdup(hashes[i]), GINT_TO_POINTER(ref));
+		else
+			ref = 0;
+		if(counts != NULL)
+			counts[i] = ref;
+		g_string_append_printf(lines, "%s %d\n", hashes[i], ref);
+	}
+
+	fd = open(obj_md_path, O_WRONLY|O_APPEND|O_CREAT, 0644);
+	if(fd < 0 || write(fd, lines->str, lines->len) != (ssize_t)lines->len)
+	{
+		printf("objmd_ref: cannot append to %s\n", obj_md_path);
+		failed = 1;
+	}
+	if(fd >= 0)
+		close(fd);
+	idx->lines += n;
+	g_string_free(lines, TRUE);
+
+	if(idx->lines > OBJMD_COMPACT_MIN && idx->lines > OBJMD_COMPACT_RATIO*(int)g_hash_table_size(idx->refs))
+		compact(obj_md_path, idx);
+	pthread_mutex_unlock(&objmd_lock);
+	stats_add(STAT_OBJMD, start, 0, failed);
+}
+
+/* Adds delta to the reference count of hash
+ * Returns the new count, an object whose count drops to 0 is unused
+ */
+int objmd_ref(const char *obj_md_path, const char *hash, int delta)
+{
+	int ref;
+
+	objmd_ref_many(obj_md_path, &hash, 1, delta, &ref);
+	return ref;
+}
+
+/* Returns the reference count of hash */
+int objmd_count(const char *obj_md_path, const char *hash)
+{
+	int ref;
+
+	pthread_mutex_lock(&objmd_lock);
+	ref = GPOINTER_TO_INT(g_hash_table_lookup(get_index(obj_md_path)->refs, hash));
+	pthread_mutex_unlock(&objmd_lock);
+	return ref;
+}
+
+/* Calls func(hash, count, data) for every referenced hash, with the
+ * counts locked
+ */
+void objmd_foreach(const char *obj_md_path, GHFunc func, gpointer data)
+{
+	pthread_mutex_lock(&objmd_lock);
+	g_hash_table_foreach(get_index(obj_md_path)->refs, func, data);
+	pthread_mutex_unlock(&objmd_lock);
+}
+
+/* Drops the index of obj_md_path, for when the file is removed or
+ * replaced behind objmd_ref(), or of every directory if NULL
+ */
+void objmd_forget(const char *obj_md_path)
+{
+	GHashTableIter it;
+	gpointer key, value;
+
+	pthread_mutex_lock(&objmd_lock);
+	if(indexes != NULL)
+	{
+		g_hash_table_iter_init(&it, indexes);
+		while(g_hash_table_iter_next(&it, &key, &value))
+		{
+			if(obj_md_path != NULL && strcmp((char *)key, obj_md_path) != 0)
+				continue;
+			free_index((ObjMdIndex *)value);
+			g_hash_table_iter_remove(&it);
+			free(key);
+		}
+	}
+	pthread_mutex_unlock(&objmd_lock);
+}
+
+/* Updates the obj_md file
+ * 1. After a revert
+ * 2. Creation of a new version -- or a new branch creation
+ */
+
+void update_objmd_file(char * s1,char * obj_md_path,int mode)
+{
+	objmd_ref(obj_md_path, s1, mode == INS ? 1 : -1);
+}
@@ -13,9 +13,63 @@
 // setlinebuf() later in consequence.
 #define _XOPEN_SOURCE 500
 #define MAX_LOG_LINE_SIZE 100
-#define TREE_LINE_SIZE 334
 #define MAX_HEAD_LINE_SIZE 25
 
+// Keyframe policy: a version is kept as a full object (LO) instead of
+// a patch (PO) once this many patches or this many bytes of patches
+// precede it, which bounds the work of any checkout.  0 disables a
+// limit.  RVFS_KEYFRAME_INTERVAL and RVFS_KEYFRAME_BYTES override them.
+#define KEYFRAME_INTERVAL 32
+#define KEYFRAME_BYTES (4*1024*1024)
+
+// Read only xattr reporting the longest patch chain of a file
+#define CHAIN_LENGTH_XATTR "user.rvfs.chain_length"
+
+// Reconstructed version cache: memory budget, then spilled to the
+// .ver/vcache folder of the mount root
+#define VCACHE_MEM_BYTES (32*1024*1024)
+#define VCACHE_DISK_BYTES (256*1024*1024)
+
+// Read only xattr with the hit/miss counters of the cache
+#define CACHE_STATS_XATTR "user.rvfs.cache_stats"
+
+// Threads committing released files in the background
+#define COMMIT_WORKERS 4
+
+// Text or binary: names matching these ':' separated globs are taken
+// as such, the others are judged on their first SNIFF_BYTES.
+// RVFS_TEXT_GLOBS and RVFS_BINARY_GLOBS override them.
+#define TEXT_GLOBS ""
+#define BINARY_GLOBS "*.o:*.so:*.a:*.gz:*.bz2:*.xz:*.zip:*.jar:*.png:*.jpg:*.jpeg:*.gif:*.pdf:*.mp3:*.mp4:*.iso"
+#define SNIFF_BYTES 8192
+#define SNIFF_CACHE_MAX 65536
+
+// Binary files, and text files of at least this many bytes, are cut
+// into chunks (see chunk.c) rather than diffed.  0 leaves text files
+// to the diffs.  RVFS_CHUNK_FILE_BYTES overrides it.
+#define CHUNK_FILE_BYTES (16*1024*1024)
+
+// Read only xattr telling whether a file is versioned as text, and why
+#define FILE_TYPE_XATTR "user.rvfs.type"
+
+// Read only xattr with the use of the object store and what sharing
+// identical objects between files saves
+#define STORE_STATS_XATTR "user.rvfs.store"
+
+// Background space reclamation (gc.c): once the mount has had no
+// request for GC_IDLE_SECONDS, the versions of files taking less than
+// GC_FILE_RATIO of the space of themselves and their versions, and of
+// directories whose versions take more than GC_DIR_BYTES, are thinned
+// at GC_RATE_BYTES of I/O a second.  0 leaves out a budget.
+// RVFS_GC_FILE_RATIO, RVFS_GC_DIR_BYTES and RVFS_GC_RATE_BYTES
+// override them.
+#define GC_IDLE_SECONDS 30
+#define GC_FILE_RATIO 0
+#define GC_DIR_BYTES 0
+#define GC_RATE_BYTES (4*1024*1024)
+
+// Read only xattr with the progress counters of the collector
+#define GC_STATS_XATTR "user.rvfs.gc"
 
 // maintain vfsfs state in here
 #include <limits.h>
@@ -23,7 +77,20 @@
 struct vfs_state {
     FILE *logfile;
     char *rootdir;
+    int keyframe_interval;
+    long keyframe_bytes;
+    long chunk_file_bytes;
+    float gc_file_ratio;
+    long gc_dir_bytes;
+    long gc_rate_bytes;
+    char *text_globs;
+    char *binary_globs;
+    int passthrough;	// RVFS_PASSTHROUGH: no versions, a baseline
+    char *stats_path;	// vfs.stats, absolute: FUSE moves to / when it forks
 };
-#define BB_DATA ((struct vfs_state *) fuse_get_context()->private_data)
+// Also kept in a global, as the commit workers are not FUSE threads
+// and cannot reach it through fuse_get_context()
+extern struct vfs_state *vfs_global;
+#define BB_DATA vfs_global
 
 #endif
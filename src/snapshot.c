@@ -0,0 +1,243 @@
+/* snapshot.c
+ * Directory level snapshots
+ *
+ * A snapshot versions every file below a directory as one
+ * transaction and records the version each file is at in a manifest,
+ * .ver/snapshots/<id> of the directory, one line per file:
+ *
+ *	<timestamp> <relative path>
+ *
+ * The id is the time of the snapshot, which is also the timestamp of
+ * the versions it creates.  Files written since their last version are
+ * versioned in place, without going through the commit queue; files
+ * never versioned are added.  Nothing is synced per file: the new
+ * versions are one transaction of the journal (see wal.c), committed
+ * with a single syncfs() once every file is walked, and the files
+ * versioned stay locked until then, so no release versions them again
+ * on top of metadata not yet in place.  The manifest is written after
+ * that, through a rename, so a manifest only ever names versions that
+ * are on disk.
+ *
+ * Checking a snapshot out checks out the version of every file it
+ * names.  Both are run from the control file, see control.c.
+ */
+
+#define _GNU_SOURCE
+#include "params.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "vfs.h"
+#include "log.h"
+
+#define SNAPSHOTS_FOLDER "snapshots/"
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct _snapshot_txn{
+
+	const char *root;	/* directory snapshot, no trailing '/' */
+	int timestamp;
+	FILE *manifest;
+	GSList *held;		/* locks of the files versioned, until the commit */
+	int files, versioned;
+}SnapshotTxn;
+
+/* Adds the present version of fpath to the manifest */
+static void manifest_add(SnapshotTxn *txn, const char *fpath)
+{
+	file_data data;
+	TreeMap *t;
+	TreeMd *rec;
+	int off;
+
+	meta_paths(fpath, &data);
+	off = heads_present(data.heads_file_path, NULL);
+	if(off < 0)
+		return;
+
+	t = tree_open(data.tree_file_path, 0);
+	rec = tree_at(t, off);
+	if(rec != NULL && rec->valid)
+	{
+		fprintf(txn->manifest, "%d %s\n", rec->timestamp, fpath + strlen(txn->root) + 1);
+		txn->files++;
+	}
+	tree_close(t);
+}
+
+/* Versions fpath if it changed since its last version, in the
+ * transaction of the snapshot, else adds it to the manifest
+ */
+static void snapshot_file(SnapshotTxn *txn, const char *fpath)
+{
+	FileChanges changes;
+	file_data data;
+	PathLock *l;
+	int written;
+
+	meta_paths(fpath, &data);
+	l = path_lock(fpath);
+	written = file_take_written(l, &changes);
+	if(written || heads_present(data.heads_file_path, NULL) < 0)
+	{
+		// a release queued since the walk began goes first, as its heads
+		// are only in place once the transaction commits
+		commit_flush();
+		commit_version(fpath, fpath, written ? &changes : NULL, txn->timestamp);
+		txn->held = g_slist_prepend(txn->held, l);
+		txn->versioned++;
+	}
+	else
+	{
+		manifest_add(txn, fpath);
+		path_unlock(l);
+	}
+	dirty_free(&changes.dirty);
+}
+
+/* Adds a file versioned by the snapshot to the manifest and unlocks it */
+static void snapshot_held(gpointer data, gpointer user_data)
+{
+	PathLock *l = (PathLock *)data;
+
+	manifest_add((SnapshotTxn *)user_data, l->path);
+	path_unlock(l);
+}
+
+static void snapshot_walk(SnapshotTxn *txn, const char *dir)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	d = opendir(dir);
+	if(d == NULL)
+		return;
+	while((de = readdir(d)) != NULL)
+	{
+		if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 || strcmp(de->d_name, ".ver") == 0)
+			continue;
+		snprintf(path, PATH_MAX, "%s/%s", dir, de->d_name);
+		if(lstat(path, &st) != 0)
+			continue;
+		if(S_ISDIR(st.st_mode))
+			snapshot_walk(txn, path);
+		else if(S_ISREG(st.st_mode))
+			snapshot_file(txn, path);
+	}
+	closedir(d);
+}
+
+static void manifest_path(char *path, const char *dir, int id)
+{
+	snprintf(path, PATH_MAX, "%s/%s%s%d", dir, VER_DIR, SNAPSHOTS_FOLDER, id);
+}
+
+/* Snapshots every file below dir, a full path
+ * Returns the id of the snapshot or -errno
+ */
+int snapshot_create(const char *dir)
+{
+	char path[PATH_MAX], tmp_path[PATH_MAX];
+	SnapshotTxn txn;
+	struct stat st;
+	int fd, id;
+
+	if(stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+		return -ENOTDIR;
+	memset(&txn, 0, sizeof(txn));
+	txn.root = dir;
+
+	pthread_mutex_lock(&snapshot_lock);
+	// versions released before the snapshot belong to it
+	commit_flush();
+	snprintf(path, PATH_MAX, "%s/%s%s", dir, VER_DIR, SNAPSHOTS_FOLDER);
+	mkdir(path, (mode_t)0755);
+	for(id = (int) time(NULL); manifest_path(path, dir, id), access(path, F_OK) == 0; id++)
+		;
+	txn.timestamp = id;
+	snprintf(tmp_path, PATH_MAX, "%s.tmp", path);
+	txn.manifest = fopen(tmp_path, "w");
+	if(txn.manifest == NULL)
+	{
+		pthread_mutex_unlock(&snapshot_lock);
+		return -errno;
+	}
+
+	wal_begin();
+	snapshot_walk(&txn, dir);
+	wal_commit();
+	g_slist_foreach(txn.held, snapshot_held, &txn);
+	g_slist_free(txn.held);
+
+	// the changes made in place since the journal was synced, then the manifest
+	fd = open(dir, O_RDONLY);
+	if(fd >= 0)
+	{
+		syncfs(fd);
+		close(fd);
+	}
+	if(fflush(txn.manifest) != 0 || fsync(fileno(txn.manifest)) != 0)
+	{
+		fclose(txn.manifest);
+		unlink(tmp_path);
+		pthread_mutex_unlock(&snapshot_lock);
+		return -EIO;
+	}
+	fclose(txn.manifest);
+	if(rename(tmp_path, path) != 0)
+	{
+		unlink(tmp_path);
+		pthread_mutex_unlock(&snapshot_lock);
+		return -errno;
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+	log_info("snapshot_create: %s is snapshot %d, %d files, %d new versions\n", dir, id, txn.files, txn.versioned);
+	return id;
+}
+
+/* Checks out every file of snapshot id of dir, a full path
+ * Returns the number of files checked out or -errno
+ */
+int snapshot_checkout(const char *dir, int id)
+{
+	char path[PATH_MAX], line[PATH_MAX + 32], name[PATH_MAX], fpath[PATH_MAX];
+	PathLock *vlock;
+	FILE *f;
+	int ts, n = 0, failed = 0;
+
+	manifest_path(path, dir, id);
+	f = fopen(path, "r");
+	if(f == NULL)
+		return -ENOENT;
+	pthread_mutex_lock(&snapshot_lock);
+	commit_flush();
+	while(fgets(line, sizeof(line), f) != NULL)
+	{
+		line[strcspn(line, "\n")] = '\0';
+		if(sscanf(line, "%d %[^\n]", &ts, name) != 2)
+			continue;
+		snprintf(fpath, PATH_MAX, "%s/%s", dir, name);
+		vlock = dir_lock(fpath);
+		if(report_checkout(fpath, ts))
+			n++;
+		else
+			failed++;
+		path_unlock(vlock);
+	}
+	fclose(f);
+	pthread_mutex_unlock(&snapshot_lock);
+	log_info("snapshot_checkout: snapshot %d of %s, %d files checked out, %d failed\n", id, dir, n, failed);
+	return failed ? -EIO : n;
+}
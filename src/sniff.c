@@ -0,0 +1,185 @@
+/* sniff.c
+ * Tells text files, which are versioned, from binary ones, which are not
+ *
+ * This used to run "file -b -i" through system() on every release.  The
+ * verdict is now taken, in order, from:
+ *
+ * - the name of the file, matched against the ':' separated globs of
+ *   binary_globs and text_globs (RVFS_BINARY_GLOBS, RVFS_TEXT_GLOBS)
+ * - the first block written through vfs_write() since the last release,
+ *   see sniff_write()
+ * - the verdict of the last release of the same inode, when the first
+ *   SNIFF_BYTES of the file have not been written since
+ * - the first SNIFF_BYTES of the file, read back
+ *
+ * Content is text when it has no NUL byte and few control characters,
+ * which is what file(1) calls text for ASCII, UTF-8 and ISO-8859 files.
+ * Empty files are not text, as with file(1).
+ */
+
+#include "params.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "vfs.h"
+#include "log.h"
+
+#define ODD_RATIO 32	/* text has under one odd control character in this many bytes */
+
+static pthread_mutex_t sniff_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *verdicts;	/* "<dev>:<ino>" -> SNIFF_* */
+
+/* Verdict on up to SNIFF_BYTES of content */
+int sniff_data(const char *buf, size_t len)
+{
+	size_t i, odd = 0;
+	unsigned char c;
+
+	if(len == 0)
+		return SNIFF_BINARY;
+	if(len > SNIFF_BYTES)
+		len = SNIFF_BYTES;
+	for(i = 0; i < len; i++)
+	{
+		c = (unsigned char)buf[i];
+		if(c == '\0')
+			return SNIFF_BINARY;
+		if((c < 0x20 && !strchr("\t\n\r\f\b\033", c)) || c == 0x7f)
+			odd++;
+	}
+	return odd*ODD_RATIO > len ? SNIFF_BINARY : SNIFF_TEXT;
+}
+
+/* Verdict on a file after a write, given the one before.  A write at 0
+ * is sniffed, one continuing the previous write keeps the verdict, and
+ * any other landing in the first SNIFF_BYTES leaves it unknown.
+ */
+int sniff_write(int sniff, const char *buf, size_t size, off_t offset, int in_order)
+{
+	if(offset == 0)
+		return sniff_data(buf, size);
+	if(offset < SNIFF_BYTES && !in_order)
+		return SNIFF_UNKNOWN;
+	return sniff;
+}
+
+/* Returns the glob of the ':' separated list globs that name matches */
+static int match_globs(const char *globs, const char *name, char *glob, size_t glob_size)
+{
+	const char *p = globs, *end;
+	char pat[PATH_MAX];
+	int len;
+
+	while(p != NULL && *p != '\0')
+	{
+		end = strchr(p, ':');
+		len = end ? end - p : (int)strlen(p);
+		if(len > 0 && len < PATH_MAX)
+		{
+			memcpy(pat, p, len);
+			pat[len] = '\0';
+			if(fnmatch(pat, name, 0) == 0)
+			{
+				snprintf(glob, glob_size, "%s", pat);
+				return 1;
+			}
+		}
+		p = end ? end + 1 : NULL;
+	}
+	return 0;
+}
+
+/* Tells whether dirty touches the first SNIFF_BYTES of the file */
+static int head_written(const DirtyMap *dirty)
+{
+	return dirty == NULL || (dirty->n > 0 && dirty->r[0].start < SNIFF_BYTES);
+}
+
+static int sniff_file(const char *fpath)
+{
+	char buf[SNIFF_BYTES];
+	ssize_t n;
+	int fd;
+
+	fd = open(fpath, O_RDONLY);
+	if(fd < 0)
+		return SNIFF_BINARY;
+	n = pread(fd, buf, sizeof(buf), 0);
+	close(fd);
+	return sniff_data(buf, n > 0 ? n : 0);
+}
+
+/* Decides whether fpath is versioned as text.  sniff is the verdict on
+ * the first block written since its last release, dirty the ranges
+ * written since, NULL if unknown.  why, if not NULL, gets the verdict
+ * and where it comes from.
+ * Returns 1 for text and 0 for binary
+ */
+int classify_file(const char *fpath, int sniff, const DirtyMap *dirty, char *why, size_t why_size)
+{
+	const char *name = strrchr(fpath, '/');
+	const char *source = "content";
+	char glob[PATH_MAX], key[64];
+	struct stat st;
+	gpointer cached = NULL;
+
+	name = name ? name + 1 : fpath;
+	if(match_globs(BB_DATA->binary_globs, name, glob, sizeof(glob)))
+	{
+		if(why != NULL)
+			snprintf(why, why_size, "binary name %s", glob);
+		return 0;
+	}
+	if(match_globs(BB_DATA->text_globs, name, glob, sizeof(glob)))
+	{
+		if(why != NULL)
+			snprintf(why, why_size, "text name %s", glob);
+		return 1;
+	}
+
+	if(stat(fpath, &st) != 0)
+	{
+		if(why != NULL)
+			snprintf(why, why_size, "binary missing");
+		return 0;
+	}
+	snprintf(key, sizeof(key), "%lx:%lx", (unsigned long)st.st_dev, (unsigned long)st.st_ino);
+	pthread_mutex_lock(&sniff_lock);
+	if(verdicts == NULL)
+		verdicts = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+	if(sniff == SNIFF_UNKNOWN && !head_written(dirty))
+		cached = g_hash_table_lookup(verdicts, key);
+	pthread_mutex_unlock(&sniff_lock);
+
+	if(cached != NULL)
+	{
+		sniff = GPOINTER_TO_INT(cached);
+		source = "cached";
+	}
+	else if(sniff == SNIFF_UNKNOWN)
+		sniff = sniff_file(fpath);
+
+	pthread_mutex_lock(&sniff_lock);
+	if(g_hash_table_size(verdicts) >= SNIFF_CACHE_MAX)
+		g_hash_table_remove_all(verdicts);
+	g_hash_table_replace(verdicts, strdup(key), GINT_TO_POINTER(sniff));
+	pthread_mutex_unlock(&sniff_lock);
+
+	if(why != NULL)
+		snprintf(why, why_size, "%s %s", sniff == SNIFF_TEXT ? "text" : "binary", source);
+	return sniff == SNIFF_TEXT;
+}
+
+/* Classifies fpath with nothing known about its last writes */
+int is_text_file(const char *fpath)
+{
+	return classify_file(fpath, SNIFF_UNKNOWN, NULL, NULL, 0);
+}
@@ -0,0 +1,184 @@
+/* stats.c
+ * Latency histograms and counters of the operations of the mount
+ *
+ * Every FUSE operation, and every stage of making a version (hashing,
+ * chunking, diffing, compressing, updating the tree, heads and obj_md
+ * files), counts its calls, failures and bytes, and the time it took
+ * in a histogram.  The buckets are log-linear, as in HdrHistogram: 16
+ * to every power of 2, so a percentile is off by at most 1/16th.  The
+ * counters are updated with atomic adds, the threads of the mount never
+ * wait on each other for them.
+ *
+ * /.rvfs/stats reads them as text, one line per operation that ran:
+ *
+ *	<op> <count> <errors> <bytes> <mean> <p50> <p90> <p99> <p99.9> <max>
+ *
+ * times in microseconds.  They are written to vfs.stats, next to
+ * vfs.log, on unmount.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include "vfs.h"
+#include "log.h"
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 48	/* up to 78 hours in ns */
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1)*STATS_SUB)
+
+typedef struct _op_stats{
+
+	unsigned long count;
+	unsigned long errors;
+	unsigned long long bytes;
+	unsigned long long sum_ns;
+	unsigned long long max_ns;
+	unsigned long buckets[STATS_BUCKETS];
+}OpStats;
+
+/* In the order of the STAT_ numbers of vfs.h */
+static const char *stats_names[STAT_COUNT] = {
+	"getattr", "readlink", "mknod", "mkdir", "unlink", "rmdir", "symlink",
+	"rename", "link", "chmod", "chown", "truncate", "utime", "open",
+	"read", "write", "read_buf", "write_buf", "statfs", "flush",
+	"release", "fsync", "setxattr", "getxattr", "listxattr",
+	"removexattr", "opendir", "readdir", "releasedir", "fsyncdir",
+	"access", "create", "ftruncate", "fgetattr",
+	"version", "hash", "chunk", "diff", "patch", "compress",
+	"decompress", "tree", "heads", "objmd"
+};
+
+static OpStats ops[STAT_COUNT];
+
+long long stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static int bucket(unsigned long long ns)
+{
+	int bits;
+
+	if(ns < STATS_SUB)
+		return ns;
+	bits = 63 - __builtin_clzll(ns);
+	if(bits >= STATS_MAX_BITS)
+		return STATS_BUCKETS - 1;
+	return (bits - STATS_SUB_BITS + 1)*STATS_SUB + ((ns >> (bits - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+/* Middle of the values falling in bucket i */
+static unsigned long long bucket_value(int i)
+{
+	int bits = i/STATS_SUB + STATS_SUB_BITS - 1, sub = i%STATS_SUB;
+
+	if(i < STATS_SUB)
+		return i;
+	return ((2ULL*(STATS_SUB + sub) + 1) << (bits - STATS_SUB_BITS)) / 2;
+}
+
+/* Counts a call of op begun at start (see stats_now()) that moved bytes
+ * and failed or not
+ */
+void stats_add(int op, long long start, long long bytes, int failed)
+{
+	unsigned long long ns = stats_now() - start, max;
+	OpStats *s = &ops[op];
+
+	__atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+	if(failed)
+		__atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+	if(bytes > 0)
+		__atomic_fetch_add(&s->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->sum_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->buckets[bucket(ns)], 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+	while(ns > max && !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void stats_reset(void)
+{
+	memset(ops, 0, sizeof(ops));
+}
+
+/* Value under which a share q of the counts in b fall, n in all, in
+ * microseconds.  It is never past the largest, max.
+ */
+static double percentile(const unsigned long *b, unsigned long n, unsigned long long max, double q)
+{
+	unsigned long seen = 0, rank = (unsigned long)(q*n + 0.5);
+	int i;
+
+	if(rank == 0)
+		rank = 1;
+	for(i = 0; i < STATS_BUCKETS; i++)
+	{
+		seen += b[i];
+		if(seen >= rank)
+			return MIN(bucket_value(i), max)/1000.0;
+	}
+	return 0;
+}
+
+/* The stats as text, see the top of the file, in a malloc'd buffer of
+ * *len bytes
+ */
+char *stats_text(size_t *len)
+{
+	GString *s = g_string_new(NULL);
+	unsigned long b[STATS_BUCKETS];
+	OpStats o;
+	int i, j;
+
+	g_string_append_printf(s, "%-12s %10s %8s %14s %10s %10s %10s %10s %10s %10s\n", "# op", "count", "errors",
+		"bytes", "mean_us", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+	for(i = 0; i < STAT_COUNT; i++)
+	{
+		// a copy, counts may move on while it is read
+		o.count = __atomic_load_n(&ops[i].count, __ATOMIC_RELAXED);
+		if(o.count == 0)
+			continue;
+		o.errors = __atomic_load_n(&ops[i].errors, __ATOMIC_RELAXED);
+		o.bytes = __atomic_load_n(&ops[i].bytes, __ATOMIC_RELAXED);
+		o.sum_ns = __atomic_load_n(&ops[i].sum_ns, __ATOMIC_RELAXED);
+		o.max_ns = __atomic_load_n(&ops[i].max_ns, __ATOMIC_RELAXED);
+		o.count = 0;
+		for(j = 0; j < STATS_BUCKETS; j++)
+		{
+			b[j] = __atomic_load_n(&ops[i].buckets[j], __ATOMIC_RELAXED);
+			o.count += b[j];
+		}
+		if(o.count == 0)
+			continue;
+		g_string_append_printf(s, "%-12s %10lu %8lu %14llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", stats_names[i],
+			o.count, o.errors, o.bytes, o.sum_ns/1000.0/o.count, percentile(b, o.count, o.max_ns, 0.5),
+			percentile(b, o.count, o.max_ns, 0.9), percentile(b, o.count, o.max_ns, 0.99),
+			percentile(b, o.count, o.max_ns, 0.999), o.max_ns/1000.0);
+	}
+	*len = s->len;
+	return g_string_free(s, FALSE);
+}
+
+/* Writes the stats to path, on unmount
+ * Returns 1 for success and 0 for failure
+ */
+int stats_save(const char *path)
+{
+	size_t len;
+	char *text = stats_text(&len);
+	int ret = write_file(path, text, len);
+
+	if(!ret)
+		log_warn("stats_save: cannot write %s\n", path);
+	free(text);
+	return ret;
+}
@@ -0,0 +1,449 @@
+/* store.c
+ * The object store of the mount, .ver/store and .ver/STORE_MD of the
+ * root directory
+ *
+ * Objects are named by what they hold, so identical contents are
+ * stored once whichever files and directories they were saved in:
+ *
+ *	<hash>		the full contents of a version (LO)
+ *	<hash>.<child>	the patch rebuilding version <hash> from version
+ *			<child> (PO)
+ *
+ * A patch is named after both ends since the same version can be a
+ * full object of one file and a patch of another.  Every reference
+ * from a tree record is counted in STORE_MD (see obj_md.c): store_put()
+ * writes an object only if it is not there yet and takes a reference,
+ * store_drop() gives it back and removes the object with the last one.
+ * Both hold a lock picked by the name, so an object is never removed
+ * under a put of the same contents.
+ *
+ * A version cut into chunks (see chunk.c) is stored as a chunk list
+ * under its name.  Its chunks are objects of their own, each counted
+ * once per chunk list holding it, so the counts of a list are taken
+ * when it is first stored and given back when its last reference goes.
+ * The counts of all the chunks of a list change with one write to
+ * STORE_MD; a chunk is only written, or removed, under its own lock.
+ *
+ * A crash can leave an object that no reference was taken for, or the
+ * scratch file of a write; store_sweep() removes them once they are old
+ * enough to be no put under way.
+ *
+ * Directories versioned before the store have their objects in their
+ * own .ver/objects, a version named by its hash whether full or patch,
+ * counted in their own OBJ_MD, the root directory included: the store
+ * has a folder and counts of its own so that an old patch there is
+ * never taken for the full object of the same hash.  store_path() and
+ * store_drop() fall back to those, so old versions stay readable and
+ * are freed where they are.  As they only look in the directory of the file, a file
+ * renamed to another directory takes its objects into the store of the
+ * mount first (store_migrate()).
+ */
+
+#include "params.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "vfs.h"
+#include "log.h"
+
+#define STORE_LOCKS 64
+
+static pthread_mutex_t store_locks[STORE_LOCKS];
+static pthread_once_t store_once = PTHREAD_ONCE_INIT;
+
+static void init_locks(void)
+{
+	int i;
+
+	for(i = 0; i < STORE_LOCKS; i++)
+		pthread_mutex_init(&store_locks[i], NULL);
+}
+
+static pthread_mutex_t *name_lock(const char *name)
+{
+	pthread_once(&store_once, init_locks);
+	return &store_locks[g_str_hash(name) % STORE_LOCKS];
+}
+
+static void obj_name(char *name, const char *hash, const char *child)
+{
+	if(child != NULL)
+		snprintf(name, OBJ_NAME_MAX, "%s.%s", hash, child);
+	else
+		snprintf(name, OBJ_NAME_MAX, "%s", hash);
+}
+
+/* Object of a version of file, in the directory store of file */
+static int legacy_path(char *path, const file_data *file, const char *hash)
+{
+	snprintf(path, PATH_MAX, "%s%s%s", file->ver_dir_path, OBJECTS_FOLDER, hash);
+	return access(path, F_OK) == 0;
+}
+
+/* Path of the full object of version hash, or of its patch against
+ * version child if child is not NULL
+ */
+void store_path(char *path, const file_data *file, const char *hash, const char *child)
+{
+	char name[OBJ_NAME_MAX], old[PATH_MAX];
+
+	obj_name(name, hash, child);
+	snprintf(path, PATH_MAX, "%s%s", file->objects_dir_path, name);
+	if(access(path, F_OK) != 0 && legacy_path(old, file, hash))
+		strcpy(path, old);
+}
+
+/* Stores src_path as the object of version hash (against child, see
+ * store_path()) unless it is stored already, and takes a reference
+ * Returns 1 for success and 0 for failure
+ */
+int store_put(const file_data *file, const char *src_path, const char *hash, const char *child)
+{
+	char name[OBJ_NAME_MAX], path[PATH_MAX];
+	pthread_mutex_t *lock;
+	int ret = 1;
+
+	obj_name(name, hash, child);
+	snprintf(path, PATH_MAX, "%s%s", file->objects_dir_path, name);
+	lock = name_lock(name);
+	pthread_mutex_lock(lock);
+	if(access(path, F_OK) != 0)
+		ret = store_object(src_path, path);
+	else
+		log_msg("store_put: %s is stored already\n", name);
+	if(ret)
+		objmd_ref(file->OBJ_MD_file_path, name, 1);
+	pthread_mutex_unlock(lock);
+	return ret;
+}
+
+/* Gives back the references chunk list l holds, and removes the chunks
+ * left without any.  A chunk taken again in the meantime is kept.
+ */
+static void drop_chunks(const file_data *file, const ChunkList *l)
+{
+	char path[PATH_MAX];
+	const char **names = (const char **)malloc((l->n + 1)*sizeof(char *));
+	int *counts = (int *)malloc((l->n + 1)*sizeof(int));
+	pthread_mutex_t *lock;
+	int i;
+
+	for(i = 0; i < l->n; i++)
+		names[i] = l->c[i].hash;
+	objmd_ref_many(file->OBJ_MD_file_path, names, l->n, -1, counts);
+	for(i = 0; i < l->n; i++)
+	{
+		if(counts[i] > 0)
+			continue;
+		lock = name_lock(names[i]);
+		pthread_mutex_lock(lock);
+		if(objmd_count(file->OBJ_MD_file_path, names[i]) == 0)
+		{
+			snprintf(path, PATH_MAX, "%s%s", file->objects_dir_path, names[i]);
+			unlink(path);
+		}
+		pthread_mutex_unlock(lock);
+	}
+	free(names);
+	free(counts);
+}
+
+/* Stores version hash of file as the chunk list l, the chunks that are
+ * not stored yet being read from the contents of file, unless it is
+ * stored already, and takes a reference
+ * Returns 1 for success and 0 for failure
+ */
+int store_put_chunks(const file_data *file, const ChunkList *l, const char *hash)
+{
+	char path[PATH_MAX], chunk[PATH_MAX];
+	const char **names;
+	pthread_mutex_t *lock;
+	size_t size;
+	char *data;
+	int i, ret = 1, stored = 0;
+
+	snprintf(path, PATH_MAX, "%s%s", file->objects_dir_path, hash);
+	lock = name_lock(hash);
+	pthread_mutex_lock(lock);
+	if(access(path, F_OK) == 0)
+	{
+		objmd_ref(file->OBJ_MD_file_path, hash, 1);
+		pthread_mutex_unlock(lock);
+		log_msg("store_put_chunks: %s is stored already\n", hash);
+		return 1;
+	}
+	pthread_mutex_unlock(lock);
+
+	// the chunks are counted first, so none of them goes while they are checked
+	data = map_file(file->content_path, &size);
+	if(data == NULL || (long long)size != l->total)
+	{
+		log_error("store_put_chunks: %s changed under the chunking\n", file->content_path);
+		if(data != NULL)
+			unmap_file(data, size);
+		return 0;
+	}
+	names = (const char **)malloc((l->n + 1)*sizeof(char *));
+	for(i = 0; i < l->n; i++)
+		names[i] = l->c[i].hash;
+	objmd_ref_many(file->OBJ_MD_file_path, names, l->n, 1, NULL);
+	for(i = 0; ret && i < l->n; i++)
+	{
+		lock = name_lock(names[i]);
+		pthread_mutex_lock(lock);
+		snprintf(chunk, PATH_MAX, "%s%s", file->objects_dir_path, names[i]);
+		if(access(chunk, F_OK) != 0)
+		{
+			ret = store_object_mem(data + l->c[i].offset, l->c[i].len, chunk);
+			stored++;
+		}
+		pthread_mutex_unlock(lock);
+	}
+	unmap_file(data, size);
+	free(names);
+
+	lock = name_lock(hash);
+	pthread_mutex_lock(lock);
+	if(ret && access(path, F_OK) == 0)
+		ret = 2;	// stored by another file meanwhile
+	else if(ret)
+		ret = chunk_list_write(path, l);
+	if(ret)
+		objmd_ref(file->OBJ_MD_file_path, hash, 1);
+	pthread_mutex_unlock(lock);
+	if(ret != 1)
+		drop_chunks(file, l);
+	log_msg("store_put_chunks: %s, %d chunks, %d new\n", hash, l->n, stored);
+	return ret != 0;
+}
+
+/* Drops a reference to the object of version hash (against child, see
+ * store_path()), and the object itself once it was the last one
+ */
+void store_drop(const file_data *file, const char *hash, const char *child)
+{
+	char name[OBJ_NAME_MAX], path[PATH_MAX], obj_md_path[PATH_MAX];
+	pthread_mutex_t *lock;
+	ChunkList l;
+	int chunked = 0;
+
+	// not before the metadata that stops referencing it is in place
+	if(wal_defer_drop(file, hash, child))
+		return;
+	obj_name(name, hash, child);
+	lock = name_lock(name);
+	pthread_mutex_lock(lock);
+	if(objmd_count(file->OBJ_MD_file_path, name) > 0)
+	{
+		snprintf(path, PATH_MAX, "%s%s", file->objects_dir_path, name);
+		if(objmd_ref(file->OBJ_MD_file_path, name, -1) == 0)
+		{
+			chunked = child == NULL && chunk_list_read(path, &l);
+			unlink(path);
+		}
+	}
+	else if(legacy_path(path, file, hash))
+	{
+		snprintf(obj_md_path, PATH_MAX, "%s%s", file->ver_dir_path, OBJ_MD);
+		if(objmd_ref(obj_md_path, hash, -1) == 0)
+			unlink(path);
+	}
+	pthread_mutex_unlock(lock);
+	if(chunked)
+	{
+		drop_chunks(file, &l);
+		chunk_list_free(&l);
+	}
+}
+
+/* Moves the objects the versions of file have in its directory store
+ * to the store of the mount, with their references.  An object other
+ * files of the directory still reference is linked rather than moved.
+ * Returns the number of objects moved
+ */
+int store_migrate(const file_data *file)
+{
+	char name[OBJ_NAME_MAX], path[PATH_MAX], old[PATH_MAX], obj_md_path[PATH_MAX];
+	pthread_mutex_t *lock;
+	TreeMd *rec, *child;
+	TreeMap *t;
+	int i, n = 0;
+
+	t = tree_open(file->tree_file_path, 0);
+	snprintf(obj_md_path, PATH_MAX, "%s%s", file->ver_dir_path, OBJ_MD);
+	for(i = 0; t != NULL && i < tree_count(t); i++)
+	{
+		rec = &t->rec[i];
+		if(!rec->valid || !legacy_path(old, file, rec->obj_hash))
+			continue;
+		child = rec->file_type == PO ? tree_patch_child(t, TREE_OFFSET(i)) : NULL;
+		obj_name(name, rec->obj_hash, child != NULL ? child->obj_hash : NULL);
+		snprintf(path, PATH_MAX, "%s%s", file->objects_dir_path, name);
+		lock = name_lock(name);
+		pthread_mutex_lock(lock);
+		// the same contents may be in the store already, from another file
+		if(access(path, F_OK) == 0 || link(old, path) == 0)
+		{
+			objmd_ref(file->OBJ_MD_file_path, name, 1);
+			if(objmd_ref(obj_md_path, rec->obj_hash, -1) == 0)
+				unlink(old);
+			n++;
+		}
+		else
+			log_warn("store_migrate: cannot move %s to %s\n", old, path);
+		pthread_mutex_unlock(lock);
+	}
+	tree_close(t);
+	if(n > 0)
+		log_info("store_migrate: %s, %d objects moved to the store\n", file->path, n);
+	return n;
+}
+
+/* Tells whether name is that of an object, "<hash>" or "<hash>.<child>" */
+static int is_object_name(const char *name)
+{
+	size_t len = strlen(name), n = HASH_SHA1 - 1;
+
+	if(len != n && (len != 2*n + 1 || name[n] != '.'))
+		return 0;
+	return strspn(name, "0123456789abcdef") == n && (len == n || strspn(name + n + 1, "0123456789abcdef") == n);
+}
+
+/* Removes name from the store if it is an object without references or
+ * a scratch file, and was last written more than grace seconds ago.  The
+ * chunks of a chunk list removed so are given back, a list not counted
+ * yet or not removed yet holding theirs.
+ * Returns the bytes removed, 0 if name was kept
+ */
+long store_sweep(const char *name, int grace)
+{
+	char path[PATH_MAX], objects_dir_path[PATH_MAX], obj_md_path[PATH_MAX];
+	pthread_mutex_t *lock;
+	file_data root;
+	struct stat st;
+	ChunkList l;
+	long ret = 0;
+	int chunked = 0;
+
+	snprintf(objects_dir_path, PATH_MAX, "%s/%s%s", BB_DATA->rootdir, VER_DIR, STORE_FOLDER);
+	snprintf(obj_md_path, PATH_MAX, "%s/%s%s", BB_DATA->rootdir, VER_DIR, STORE_MD);
+	snprintf(path, PATH_MAX, "%s%s", objects_dir_path, name);
+	if(lstat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_mtime > time(NULL) - grace)
+		return 0;
+	if(!is_object_name(name))
+	{
+		log_msg("store_sweep: scratch file %s\n", name);
+		return unlink(path) == 0 ? st.st_size : 0;
+	}
+	lock = name_lock(name);
+	pthread_mutex_lock(lock);
+	if(objmd_count(obj_md_path, name) == 0)
+	{
+		chunked = strchr(name, '.') == NULL && chunk_list_read(path, &l);
+		if(unlink(path) == 0)
+			ret = st.st_size;
+		else if(chunked)
+		{
+			chunk_list_free(&l);
+			chunked = 0;
+		}
+	}
+	pthread_mutex_unlock(lock);
+	if(chunked)
+	{
+		memset(&root, 0, sizeof(root));
+		root.objects_dir_path = objects_dir_path;
+		root.OBJ_MD_file_path = obj_md_path;
+		drop_chunks(&root, &l);
+		chunk_list_free(&l);
+	}
+	if(ret)
+		log_info("store_sweep: %s had no references, %ld bytes\n", name, ret);
+	return ret;
+}
+
+static long share(const char *obj_md_path, const char *name, const char *path)
+{
+	struct stat st;
+	int refs;
+
+	if(stat(path, &st) != 0)
+		return 0;
+	refs = objmd_count(obj_md_path, name);
+	return refs > 1 ? st.st_size / refs : st.st_size;
+}
+
+/* Size on disk of the object of version hash (against child) divided
+ * by the references to it, what it costs one of them.  The chunks of a
+ * chunk list are charged the same way.
+ */
+long store_share(const file_data *file, const char *hash, const char *child)
+{
+	char name[OBJ_NAME_MAX], path[PATH_MAX], chunk[PATH_MAX];
+	long size, chunks = 0;
+	ChunkList l;
+	int i, refs;
+
+	obj_name(name, hash, child);
+	store_path(path, file, hash, child);
+	size = share(file->OBJ_MD_file_path, name, path);
+	if(child == NULL && chunk_list_read(path, &l))
+	{
+		for(i = 0; i < l.n; i++)
+		{
+			chunk_path(chunk, path, &l.c[i]);
+			chunks += share(file->OBJ_MD_file_path, l.c[i].hash, chunk);
+		}
+		chunk_list_free(&l);
+		refs = objmd_count(file->OBJ_MD_file_path, name);
+		size += refs > 1 ? chunks / refs : chunks;
+	}
+	return size;
+}
+
+typedef struct _store_usage{
+
+	const char *objects_dir_path;
+	long objects;
+	long long stored, referenced;
+}StoreUsage;
+
+static void add_usage(gpointer key, gpointer value, gpointer data)
+{
+	StoreUsage *u = (StoreUsage *)data;
+	char path[PATH_MAX];
+	struct stat st;
+
+	snprintf(path, PATH_MAX, "%s%s", u->objects_dir_path, (char *)key);
+	if(stat(path, &st) != 0)
+		return;
+	u->objects++;
+	u->stored += st.st_size;
+	u->referenced += (long long)st.st_size * GPOINTER_TO_INT(value);
+}
+
+/* Writes the use of the store as "objects <n> stored <bytes> referenced
+ * <bytes> saved <bytes>", referenced being what the objects would take
+ * stored once per reference
+ * Returns the length of the string
+ */
+int store_stats(char *buf, size_t size)
+{
+	char obj_md_path[PATH_MAX], objects_dir_path[PATH_MAX];
+	StoreUsage u;
+
+	snprintf(objects_dir_path, PATH_MAX, "%s/%s%s", BB_DATA->rootdir, VER_DIR, STORE_FOLDER);
+	snprintf(obj_md_path, PATH_MAX, "%s/%s%s", BB_DATA->rootdir, VER_DIR, STORE_MD);
+	memset(&u, 0, sizeof(u));
+	u.objects_dir_path = objects_dir_path;
+	objmd_foreach(obj_md_path, add_usage, &u);
+	return snprintf(buf, size, "objects %ld stored %lld referenced %lld saved %lld",
+		u.objects, u.stored, u.referenced, u.referenced - u.stored);
+}
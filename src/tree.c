@@ -13,13 +13,18 @@
 int isJunction(file_data *file,int offset) //prevent this data structure from being edited.
 {
 
-   FILE *fp_tree, *fp_head;
-   fp_tree=fopen(file->tree_file_path,"r");
+   FILE *fp_head;
+   TreeMap *t;
+   TreeMd *rec;
+   t=tree_open(file->tree_file_path,0);
    fp_head=fopen(file->heads_file_path,"r");
 
-   if(fp_tree==NULL || fp_head==NULL) //do check if file exists.
+   if(t==NULL || fp_head==NULL) //do check if file exists.
    {
    	printf("ERROR: tree or head file does not exist");
+	tree_close(t);
+	if(fp_head!=NULL)
+		fclose(fp_head);
 	return -1;// return -1 if file is not opened.
    }
 
@@ -28,32 +33,24 @@ int isJunction(file_data *file,int offset) //prevent this data structure from be
    int current_offset;
    fscanf(fp_head,"%s %d",current_timestamp1, &current_offset);
    char *current_timestamp=(char *)malloc(15*sizeof(char));
-   int tmp_int;
-   int parent_offset;
-   char *tmp_char=(char *)malloc(255*sizeof(char));
           
 	while (fscanf(fp_head,"%s %d",current_timestamp, &current_offset) != EOF )
 	{
-        	//move into the tree file
-		do{
-			fseek(fp_tree,current_offset,SEEK_SET);
-		
-			fscanf(fp_tree,"%d", &tmp_int);
-			fscanf(fp_tree,"%d", &tmp_int);
-			fscanf(fp_tree,"%d", &tmp_int);
-			fscanf(fp_tree,"%s", tmp_char);
-			fscanf(fp_tree,"%s", tmp_char);
-			fscanf(fp_tree,"%d", &tmp_int);
-			fscanf(fp_tree,"%d", &parent_offset);
-			if(parent_offset==offset && strcmp(current_timestamp, current_timestamp1)!=0) // if we find it even once then it means it is a junction.
+        	//walk up the tree
+		for(rec=tree_at(t,current_offset); rec!=NULL; rec=tree_at(t,rec->parent))
+		{
+			if(rec->parent==offset && strcmp(current_timestamp, current_timestamp1)!=0) // if we find it even once then it means it is a junction.
+			{
+				tree_close(t);
+				fclose(fp_head);
 	  			return 1;
-		
-			current_offset = parent_offset;  // move to the parent
-		
-		}while(parent_offset != -1);
+			}
+			if(rec->parent == -1)
+				break;
+		}
 
    	}
-   	fclose(fp_tree);
+   	tree_close(t);
    	fclose(fp_head);
 	return 0;	
 }
@@ -61,128 +58,208 @@ int isJunction(file_data *file,int offset) //prevent this data structure from be
 /* Updates tree file
  * Scenario:
  * 1. Creation of new version: Appends the version metadata
+ *    and turns the parent into a PO, unless it starts a branch or
+ *    is kept as a keyframe (keep_parent_lo)
  */
 
-/*void update_tree_data(file_data *file,TreeMd *ver,int is_creating_branch,int is_first_version) 
+int get_file_size(char *fpath)
 {
-	//*************Add spaces to TreeMd fields
+	int size;
+	struct stat st;
+	stat(fpath, &st);
+	size = st.st_size;
 	
-	char * diff_lc = (char * )malloc(15 * sizeof(char));
-	char * parent = (char * )malloc(10 * sizeof(char));
-	printf("Adding Spaces\n");
-//	addspaces(ver->obj_hash,41);
-//	printf("obj_hash : %s\n",ver->obj_hash);
-	sprintf(diff_lc,"%d",ver->diff_count);
-	addspaces(diff_lc,10);
-//	ver->obj_hash = addspaces(ver->obj_hash,40);
-	addspaces(ver->tag,255);
-	itoa(ver->parent,parent);
-//	sprintf(parent,"%d",ver->parent);
-	addspaces(parent,10);
+	//log_msg("\nfile size of %s = %d\n",fpath,size);
+	return size;
+
+}
+
+void update_tree_data(file_data *file,TreeMd *ver,int keep_parent_lo,int is_first_version) 
+{
+	long long start = stats_now();
+	int failed = 0;
 	printf("Tag : %s\n",ver->tag);
-	printf("Parent : %s\n",parent);
-	printf("Diif Line Count : %s\n",diff_lc);
+	printf("Parent : %d\n",ver->parent);
 	printf("obj_hash : %s\n",ver->obj_hash);
 	
-	//******************************************
-	if(!is_creating_branch)
+	if(!keep_parent_lo)
 	{
-	//	if(!is_first_version)
-		{	
-			int a;
-			printf(" Making lo tp po\n");
-			FILE * f = fopen(file->tree_file_path,"r+");
-			fseek(f,ver->parent,SEEK_SET);
-			fscanf(f,"%d",&a);
-			printf("First scanned : %d\n",a);
-			fscanf(f,"%d",&a);
-			printf("First scanned : %d\n",a);
-			fprintf(f," 1");
-			fclose(f);
+		/* The parent's object now holds the diff to this version */
+		TreeMd parent;
+		char * diff_path = (char *)malloc(PATH_MAX * sizeof(char));
+		printf(" Making lo tp po\n");
+		if(tree_read(file->tree_file_path,ver->parent,&parent))
+		{
+			store_path(diff_path,file,parent.obj_hash,ver->obj_hash);
+			parent.file_type = PO;
+			parent.diff_count = get_file_size(diff_path);
+			printf("Diff size : %d\n",parent.diff_count);
+			tree_write(file->tree_file_path,ver->parent,&parent);
 		}
-		
+		free(diff_path);
+	}
+	if(tree_append(file->tree_file_path,ver) < 0)
+	{
+		printf("ERROR: cannot append version to %s\n",file->tree_file_path);
+		failed = 1;
 	}
-	FILE * file_tree = fopen(file->tree_file_path,"a");
-	fprintf(file_tree,"%d %d %d %s %s %s %s\n",ver->valid,ver->timestamp,ver->file_type,ver->obj_hash,ver->tag,diff_lc,parent);
-//	fprintf(file_tree,"%d %d %d %s %s %d %d\n",ver->valid,ver->timestamp,ver->file_type,ver->obj_hash,ver->tag,ver->diff_count,ver->parent);
-	fclose(file_tree);
+	stats_add(STAT_TREE,start,0,failed);
 }
-*/
 
-int get_file_size(char *fpath)
+/* Keyframe policy
+ * Tells whether the parent of a new version has to stay a loose
+ * object.  It does once the run of patch objects below it reaches
+ * interval, or their diffs add up to bytes, so no version is more
+ * than interval patches away from a full copy.
+ */
+int is_keyframe_due(file_data *file,int parent_off,int interval,long bytes)
 {
-	int size;
-	struct stat st;
-	stat(fpath, &st);
-	size = st.st_size;
+	TreeMap *t = tree_open(file->tree_file_path,0);
+	TreeMd *rec = tree_at(t,parent_off);
+	long size = 0;
+	int run = 0;
 	
-	//log_msg("\nfile size of %s = %d\n",fpath,size);
-	return size;
+	while(rec != NULL && rec->parent != -1)
+	{
+		rec = tree_at(t,rec->parent);
+		if(rec == NULL || rec->file_type != PO)
+			break;
+		run++;
+		size += rec->diff_count;
+	}
+	tree_close(t);
+	printf("Patch run below %d : %d patches, %ld bytes\n",parent_off,run,size);
+	return (interval > 0 && run >= interval) || (bytes > 0 && size >= bytes);
+}
+
+/* Rebuilds the version at to_off in memory, walking down from from_off
+ * (a head, or any version above to_off).  Patching starts at the last
+ * loose object on the way, or at a cached version below it, so the
+ * work is bounded by the keyframe policy rather than by the distance
+ * from the head.  The result goes into the version cache.
+ * Returns the malloc'd version, its size in *size, or NULL on failure
+ */
+char *build_version_mem(TreeMap *t,const file_data *file,int from_off,int to_off,size_t *size)
+{
+	char obj_path[PATH_MAX];
+	TreeMd *rec = tree_at(t,from_off);
+	TreeMd **path = NULL;
+	const char **hashes;
+	char *data;
+	int off = from_off, n = 0, alloc = 0, start, i;
+	
+	/* path[0] is the last loose object, path[n-1] the version */
+	while(rec != NULL && rec->valid)
+	{
+		if(rec->file_type == LO)
+			n = 0;
+		if(n == alloc)
+		{
+			alloc = alloc ? 2*alloc : 32;
+			path = (TreeMd **)realloc(path,alloc*sizeof(TreeMd *));
+		}
+		path[n++] = rec;
+		if(off == to_off || rec->parent == -1)
+			break;
+		off = rec->parent;
+		rec = tree_at(t,off);
+	}
+	if(rec == NULL || !rec->valid || off != to_off)
+	{
+		printf("ERROR: %d is not below %d in the tree\n",to_off,from_off);
+		free(path);
+		return NULL;
+	}
+	
+	hashes = (const char **)malloc(n*sizeof(char *));
+	for(i = 0; i < n; i++)
+		hashes[i] = path[n-1-i]->obj_hash;
+	data = vcache_lookup(hashes,n,&i,size);
+	free(hashes);
+	if(data != NULL)
+		start = n-1-i;
+	else
+	{
+		start = 0;
+		store_path(obj_path,file,path[0]->obj_hash,NULL);
+		data = load_object_mem(obj_path,size);
+	}
+	/* each patch rebuilds a version from the one patched before it */
+	for(i = start + 1; i < n && data != NULL; i++)
+	{
+		store_path(obj_path,file,path[i]->obj_hash,path[i-1]->obj_hash);
+		data = restore_object_mem(obj_path,data,size,path[i]->file_type);
+	}
+	if(data != NULL && n-1-start > 0)
+		vcache_put(path[n-1]->obj_hash,data,*size);
+	if(data != NULL)
+		printf("Rebuilt %d with %d patches, %d of %d cached\n",to_off,n-1-start,start,n-1);
+	free(path);
+	return data;
+}
 
+/* Rebuilds the version at to_off into target_path, see build_version_mem()
+ * Returns 0 for success or -1 on failure
+ */
+int build_version(TreeMap *t,const file_data *file,int from_off,int to_off,const char *target_path)
+{
+	size_t size;
+	char *data = build_version_mem(t,file,from_off,to_off,&size);
+	int ret;
+	
+	if(data == NULL)
+		return -1;
+	ret = write_file(target_path,data,size) ? 0 : -1;
+	free(data);
+	return ret;
 }
 
-void update_tree_data(file_data *file,TreeMd *ver,int is_creating_branch,int is_first_version) 
+/* The version the patch of the PO at off was made against: its first
+ * child, as a version is turned into a PO by its first child and kept
+ * whole from then on once it is checked out to start another branch
+ * Returns the record of the child or NULL
+ */
+TreeMd *tree_patch_child(TreeMap *t,int off)
 {
-	//*************Add spaces to TreeMd fields
+	int i, n = tree_count(t);
 	
-	char * diff_lc = (char * )malloc(15 * sizeof(char));
-	char * parent = (char * )malloc(10 * sizeof(char));
-	printf("Adding Spaces\n");
-//	addspaces(ver->obj_hash,41);
-//	printf("obj_hash : %s\n",ver->obj_hash);
-	sprintf(diff_lc,"%d",ver->diff_count);
-	addspaces(diff_lc,10);
-//	ver->obj_hash = addspaces(ver->obj_hash,40);
-	addspaces(ver->tag,MAX_TAG);
-	itoa(ver->parent,parent);
-//	sprintf(parent,"%d",ver->parent);
-	addspaces(parent,10);
-	printf("Tag : %s\n",ver->tag);
-	printf("Parent : %s\n",parent);
-	printf("Diif Line Count : %s\n",diff_lc);
-	printf("obj_hash : %s\n",ver->obj_hash);
+	for(i = (off - TREE_FIRST_OFFSET) / (int)sizeof(TreeMd) + 1; i < n; i++)
+		if(t->rec[i].valid && t->rec[i].parent == off)
+			return &t->rec[i];
+	return NULL;
+}
+
+/* Longest run of patches needed to rebuild any version of the file,
+ * i.e. the worst case cost of a checkout
+ * Returns -1 if the file has no tree
+ */
+int tree_chain_length(const char *tree_file_path)
+{
+	TreeMap *t = tree_open(tree_file_path,0);
+	int *cost, i, p, n, max = 0;
 	
-	//******************************************
-	if(!is_creating_branch)
+	if(t == NULL)
+		return -1;
+	n = tree_count(t);
+	cost = (int *)calloc(n + 1,sizeof(int));
+	
+	/* children are always appended after their parent */
+	for(i = n-1; i >= 0; i--)
 	{
-	//	if(!is_first_version)
-		{	
-			int a,size;
-			char * diff_size = (char *)malloc(20 * sizeof(char));
-			char * tmp_str = (char *)malloc(300 * sizeof(char));
-			char * diff_path = (char *)malloc(PATH_MAX * sizeof(char));
-			printf(" Making lo tp po\n");
-			FILE * f = fopen(file->tree_file_path,"r+");
-			fseek(f,ver->parent,SEEK_SET);
-			fscanf(f,"%d",&a);
-			printf("First scanned : %d\n",a);
-			fscanf(f,"%d",&a);
-			printf("Second scanned : %d\n",a);
-			fprintf(f," 1");
-			fscanf(f,"%s",tmp_str);
-			printf("fourth scanned : %s\n",tmp_str);
-			sprintf(diff_path,"%s%s",file->objects_dir_path,tmp_str);
-			fscanf(f,"%s",tmp_str);
-		//	if(strlen(tmp_str) < MAX_TAG)
-		//	addspaces(tmp_str,MAX_TAG);
-		//	fprintf(f,"%s
-			fseek(f,MAX_TAG - strlen(tmp_str),SEEK_CUR);
-			printf("fifth scanned : %s\n",tmp_str);
-			
-			//**********Get diff file size*********************************//
-			printf("Getting diff file size\n");
-			size = get_file_size(diff_path);
-			sprintf(diff_size,"%d",size);
-			addspaces(diff_size,10);
-			fprintf(f," %s",diff_size);
-			fclose(f);
-		}
-		
+		TreeMd *rec = &t->rec[i];
+		if(!rec->valid)
+			continue;
+		if(rec->file_type == LO)
+			cost[i] = 0;
+		if(cost[i] > max)
+			max = cost[i];
+		p = (rec->parent - TREE_FIRST_OFFSET) / (int)sizeof(TreeMd);
+		if(rec->parent != -1 && p >= 0 && p < i && t->rec[p].file_type == PO && cost[i] + 1 > cost[p])
+			cost[p] = cost[i] + 1;
 	}
-	FILE * file_tree = fopen(file->tree_file_path,"a");
-	fprintf(file_tree,"%d %d %d %s %s %s %s\n",ver->valid,ver->timestamp,ver->file_type,ver->obj_hash,ver->tag,diff_lc,parent);
-//	fprintf(file_tree,"%d %d %d %s %s %d %d\n",ver->valid,ver->timestamp,ver->file_type,ver->obj_hash,ver->tag,ver->diff_count,ver->parent);
-	fclose(file_tree);
+	free(cost);
+	tree_close(t);
+	return max;
 }
 
 /* Constructs the Tree Metadata
@@ -190,7 +267,7 @@ void update_tree_data(file_data *file,TreeMd *ver,int is_creating_branch,int is_
  */
 TreeMd * construct_version_data(file_data * file,int is_first_version) 
 {
-	TreeMd *ver = (TreeMd *) malloc(sizeof(version_data));
+	TreeMd *ver = (TreeMd *) malloc(sizeof(TreeMd));
 	
 	// version number
 //	if(!does_exist( file->ver_dir_path )) {
@@ -209,7 +286,13 @@ TreeMd * construct_version_data(file_data * file,int is_first_version)
 	}
 	
 	ver->valid = 1;
-	find_SHA(file->path,ver->obj_hash);
+	// hashed as it was written, or read again; named by its list if chunked
+	if(file->chunks != NULL)
+		chunk_list_hash(file->chunks,ver->obj_hash);
+	else if(file->content_hash != NULL && file->content_hash[0] != '\0')
+		strcpy(ver->obj_hash, file->content_hash);
+	else
+		find_SHA(file->content_path,ver->obj_hash);
 	
 	// tag ---- TODO
 	strcpy(ver->tag, "_");
@@ -0,0 +1,495 @@
+/* tree_file.c
+ * On-disk layout of .ver/trees/<file>.tree
+ *
+ * A tree file is a TreeHeader followed by fixed size TreeMd records,
+ * appended in the order the versions were created.  Every record
+ * carries a crc32 of its fields so that a torn or stray write is
+ * reported instead of being followed.  Records are addressed by their
+ * byte offset (see TREE_OFFSET), which is what the heads file and the
+ * parent fields store, so walking a branch is a chain of lookups in
+ * the mapped file.
+ *
+ * Read only maps are cached for the life of the mount and shared by
+ * every open of the same file, which only costs a stat() to check that
+ * the file is still the one mapped: an append grows the file and gets
+ * it a new map, writes in place show through the shared mapping.
+ *
+ * Records are written and appended through tree_redo(), which the
+ * journal of wal.c also replays.
+ *
+ * Text trees written before this format are converted by tree_upgrade.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <glib.h>
+
+#include "vfs.h"
+#include "log.h"
+
+#define TREE_CACHE_MAX 1024
+
+typedef struct _tree_cached{
+
+	TreeMap *t;
+	dev_t dev;
+	ino_t ino;
+}TreeCached;
+
+static pthread_mutex_t maps_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *maps;	/* tree file path -> TreeCached */
+
+static unsigned int tree_checksum(TreeMd *rec)
+{
+	return crc32(0L, (const Bytef *)rec, offsetof(TreeMd, checksum));
+}
+
+static int is_tree_header(TreeHeader *hdr)
+{
+	return memcmp(hdr->magic, TREE_MAGIC, sizeof(hdr->magic)) == 0;
+}
+
+/* Copies ver into a zeroed record so that unused bytes of the
+ * strings do not end up in the file (or in the checksum)
+ */
+static void tree_pack(TreeMd *rec, TreeMd *ver)
+{
+	memset(rec, 0, sizeof(TreeMd));
+	rec->valid = ver->valid;
+	strncpy(rec->obj_hash, ver->obj_hash, HASH_SHA1 - 1);
+	strncpy(rec->tag, ver->tag, MAX_TAG - 1);
+	rec->diff_count = ver->diff_count;
+	rec->timestamp = ver->timestamp;
+	rec->file_type = ver->file_type;
+	rec->parent = ver->parent;
+	tree_seal(rec);
+}
+
+/* Recomputes the checksum of a record after it was edited in place */
+void tree_seal(TreeMd *rec)
+{
+	rec->checksum = tree_checksum(rec);
+}
+
+/* Maps a tree file, st gets what fstat() said of it */
+static TreeMap *map_tree(const char *tree_file_path, int writable, struct stat *st)
+{
+	TreeMap *t;
+	TreeHeader *hdr;
+	char *base;
+	int fd, max;
+
+	fd = open(tree_file_path, writable ? O_RDWR : O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, st) < 0 || st->st_size < (off_t)sizeof(TreeHeader))
+	{
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, st->st_size, writable ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED)
+		return NULL;
+
+	hdr = (TreeHeader *)base;
+	if(!is_tree_header(hdr))
+	{
+		log_error("tree_open: %s is not a binary tree file, run tree_upgrade\n", tree_file_path);
+		munmap(base, st->st_size);
+		return NULL;
+	}
+	if(hdr->version != TREE_FORMAT_VERSION || hdr->record_size != (int)sizeof(TreeMd))
+	{
+		log_msg("tree_open: %s has format %d with %d byte records, expected %d with %d\n",
+			tree_file_path, hdr->version, hdr->record_size, TREE_FORMAT_VERSION, (int)sizeof(TreeMd));
+		munmap(base, st->st_size);
+		return NULL;
+	}
+
+	t = (TreeMap *)calloc(1, sizeof(TreeMap));
+	t->base = base;
+	t->len = st->st_size;
+	t->hdr = hdr;
+	t->rec = (TreeMd *)(base + sizeof(TreeHeader));
+
+	/* an append that died before the header was updated leaves a
+	 * record past count, one that died half way a short tail
+	 */
+	max = (st->st_size - sizeof(TreeHeader)) / sizeof(TreeMd);
+	if(hdr->count > max)
+	{
+		log_error("tree_open: %s is truncated, %d of %d records present\n", tree_file_path, max, hdr->count);
+		if(writable)
+			hdr->count = max;
+	}
+	return t;
+}
+
+static void unmap_tree(TreeMap *t)
+{
+	munmap(t->base, t->len);
+	free(t);
+}
+
+/* Takes a map out of the cache, it goes once its last open is closed.
+ * Called with maps_lock held.
+ */
+static void uncache(TreeCached *c)
+{
+	c->t->cached = 0;
+	if(c->t->refs == 0)
+		unmap_tree(c->t);
+	free(c);
+}
+
+static gboolean uncache_all(gpointer key, gpointer value, gpointer data)
+{
+	free(key);
+	uncache((TreeCached *)value);
+	return TRUE;
+}
+
+/* Maps a tree file, read only or writable (MAP_SHARED, so edits
+ * through the map go to the file).  Read only maps come from the cache.
+ * Returns NULL if the file is missing, empty or not a binary tree
+ */
+TreeMap *tree_open(const char *tree_file_path, int writable)
+{
+	struct stat st;
+	TreeCached *c;
+	TreeMap *t;
+	gpointer key;
+
+	if(writable)
+		return map_tree(tree_file_path, 1, &st);
+
+	if(stat(tree_file_path, &st) < 0)
+		return NULL;
+	pthread_mutex_lock(&maps_lock);
+	if(maps == NULL)
+		maps = g_hash_table_new(g_str_hash, g_str_equal);
+	c = (TreeCached *)g_hash_table_lookup(maps, tree_file_path);
+	if(c != NULL && c->dev == st.st_dev && c->ino == st.st_ino && c->t->len == (size_t)st.st_size)
+	{
+		c->t->refs++;
+		pthread_mutex_unlock(&maps_lock);
+		return c->t;
+	}
+	pthread_mutex_unlock(&maps_lock);
+
+	t = map_tree(tree_file_path, 0, &st);
+	if(t == NULL)
+		return NULL;
+	t->shared = 1;
+	t->refs = 1;
+	t->cached = 1;
+
+	pthread_mutex_lock(&maps_lock);
+	if(g_hash_table_lookup_extended(maps, tree_file_path, &key, (gpointer *)&c))
+	{
+		g_hash_table_remove(maps, tree_file_path);
+		free(key);
+		uncache(c);
+	}
+	else if(g_hash_table_size(maps) >= TREE_CACHE_MAX)
+		g_hash_table_foreach_remove(maps, uncache_all, NULL);
+	c = (TreeCached *)malloc(sizeof(TreeCached));
+	c->t = t;
+	c->dev = st.st_dev;
+	c->ino = st.st_ino;
+	g_hash_table_insert(maps, strdup(tree_file_path), c);
+	pthread_mutex_unlock(&maps_lock);
+	return t;
+}
+
+void tree_close(TreeMap *t)
+{
+	if(t == NULL)
+		return;
+	if(!t->shared)
+	{
+		unmap_tree(t);
+		return;
+	}
+	pthread_mutex_lock(&maps_lock);
+	if(--t->refs == 0 && !t->cached)
+		unmap_tree(t);
+	pthread_mutex_unlock(&maps_lock);
+}
+
+/* Drops the cached map of a tree file that is removed or renamed */
+void tree_forget(const char *tree_file_path)
+{
+	TreeCached *c;
+	gpointer key;
+
+	pthread_mutex_lock(&maps_lock);
+	if(maps != NULL && g_hash_table_lookup_extended(maps, tree_file_path, &key, (gpointer *)&c))
+	{
+		g_hash_table_remove(maps, tree_file_path);
+		free(key);
+		uncache(c);
+	}
+	pthread_mutex_unlock(&maps_lock);
+}
+
+/* Number of records that are actually present in the map */
+int tree_count(TreeMap *t)
+{
+	int max = (t->len - sizeof(TreeHeader)) / sizeof(TreeMd);
+	return t->hdr->count < max ? t->hdr->count : max;
+}
+
+/* Returns the record at a byte offset, or NULL if the offset does not
+ * address a record or the record fails its checksum
+ */
+TreeMd *tree_at(TreeMap *t, int offset)
+{
+	TreeMd *rec;
+	int i;
+
+	if(t == NULL || offset < TREE_FIRST_OFFSET || (offset - TREE_FIRST_OFFSET) % sizeof(TreeMd))
+	{
+		log_error("tree_at: %d is not a record offset\n", offset);
+		return NULL;
+	}
+	i = (offset - TREE_FIRST_OFFSET) / sizeof(TreeMd);
+	if(i >= tree_count(t))
+	{
+		log_msg("tree_at: record %d past the end of the tree\n", i);
+		return NULL;
+	}
+	rec = &t->rec[i];
+	if(rec->checksum != tree_checksum(rec))
+	{
+		log_error("tree_at: checksum mismatch in record %d\n", i);
+		return NULL;
+	}
+	return rec;
+}
+
+/* Looks a version up by its timestamp, through a binary search while
+ * the records are in timestamp order.  Of several versions created in
+ * the same second the first valid one is returned.
+ * Returns the offset of the record or -1
+ */
+int tree_find_timestamp(TreeMap *t, int timestamp)
+{
+	int lo = 0, hi, mid, i, n;
+
+	if(t == NULL)
+		return -1;
+	n = tree_count(t);
+	hi = n;
+	if(t->hdr->sorted)
+	{
+		while(lo < hi)
+		{
+			mid = (lo + hi) / 2;
+			if(t->rec[mid].timestamp < timestamp)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+	}
+	for(i = lo; i < n; i++)
+	{
+		if(t->hdr->sorted && t->rec[i].timestamp != timestamp)
+			break;
+		if(t->rec[i].timestamp == timestamp && t->rec[i].valid && tree_at(t, TREE_OFFSET(i)))
+			return TREE_OFFSET(i);
+	}
+	return -1;
+}
+
+/* Copies the record at offset into ver
+ * Returns 1 for success and 0 for failure
+ */
+int tree_read(const char *tree_file_path, int offset, TreeMd *ver)
+{
+	TreeMap *t = tree_open(tree_file_path, 0);
+	TreeMd *rec = tree_at(t, offset);
+
+	if(rec != NULL)
+		memcpy(ver, rec, sizeof(TreeMd));
+	tree_close(t);
+	return rec != NULL;
+}
+
+/* Makes a change of the tree file, as journaled by wal.c: overwrites
+ * the record at offset if it still holds before (or is torn), or
+ * appends a record there if the file ends at offset, with after
+ * Returns 1 if the file holds after, 0 if it was left alone
+ */
+int tree_redo(const char *tree_file_path, int type, int offset, const TreeMd *before, const TreeMd *after)
+{
+	TreeHeader hdr;
+	TreeMd cur, last;
+	int fd, index, ret = 0;
+
+	fd = open(tree_file_path, type == WAL_TREE_APPEND ? O_RDWR|O_CREAT : O_RDWR, 0644);
+	if(fd < 0)
+		return 0;
+	if(pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) && type == WAL_TREE_APPEND)
+	{
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, TREE_MAGIC, sizeof(hdr.magic));
+		hdr.version = TREE_FORMAT_VERSION;
+		hdr.record_size = sizeof(TreeMd);
+		hdr.sorted = 1;
+	}
+	index = (offset - TREE_FIRST_OFFSET) / (int)sizeof(TreeMd);
+	if(!is_tree_header(&hdr) || offset < TREE_FIRST_OFFSET || (offset - TREE_FIRST_OFFSET) % sizeof(TreeMd) != 0)
+		;
+	else if(type == WAL_TREE_WRITE)
+	{
+		if(index < hdr.count && pread(fd, &cur, sizeof(cur), offset) == sizeof(cur))
+		{
+			if(memcmp(&cur, after, sizeof(cur)) == 0)
+				ret = 1;
+			else if(before == NULL || memcmp(&cur, before, sizeof(cur)) == 0 || cur.checksum != tree_checksum(&cur))
+				ret = pwrite(fd, after, sizeof(*after), offset) == sizeof(*after);
+		}
+	}
+	else if(index < hdr.count)
+		ret = pread(fd, &cur, sizeof(cur), offset) == sizeof(cur) && memcmp(&cur, after, sizeof(cur)) == 0;
+	else if(index == hdr.count)
+	{
+		/* the record is written before the header counts it */
+		if(hdr.count > 0 && pread(fd, &last, sizeof(last), TREE_OFFSET(hdr.count - 1)) == sizeof(last)
+			&& last.timestamp > after->timestamp)
+			hdr.sorted = 0;
+		if(pwrite(fd, after, sizeof(*after), offset) == sizeof(*after))
+		{
+			hdr.count++;
+			ret = pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+		}
+	}
+	close(fd);
+	return ret;
+}
+
+/* Overwrites the record at offset with ver
+ * Returns 1 for success and 0 for failure
+ */
+int tree_write(const char *tree_file_path, int offset, TreeMd *ver)
+{
+	TreeHeader hdr;
+	TreeMd rec, old;
+	int fd, ret = 0;
+
+	fd = open(tree_file_path, O_RDONLY);
+	if(fd < 0)
+		return 0;
+	if(pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && is_tree_header(&hdr)
+		&& offset >= TREE_FIRST_OFFSET && offset < TREE_OFFSET(hdr.count)
+		&& (offset - TREE_FIRST_OFFSET) % sizeof(TreeMd) == 0
+		&& pread(fd, &old, sizeof(old), offset) == sizeof(old))
+	{
+		tree_pack(&rec, ver);
+		ret = 1;
+	}
+	close(fd);
+	if(ret && !wal_defer(WAL_TREE_WRITE, tree_file_path, offset, &old, sizeof(old), &rec, sizeof(rec)))
+		ret = tree_redo(tree_file_path, WAL_TREE_WRITE, offset, NULL, &rec);
+	if(!ret)
+		log_error("tree_write: cannot write record at %d of %s\n", offset, tree_file_path);
+	return ret;
+}
+
+/* Appends ver as a new record, creating the file if needed.
+ * Returns the offset of the new record or -1
+ */
+int tree_append(const char *tree_file_path, TreeMd *ver)
+{
+	TreeHeader hdr;
+	TreeMd rec;
+	int fd, offset = TREE_FIRST_OFFSET;
+
+	fd = open(tree_file_path, O_RDONLY);
+	if(fd >= 0)
+	{
+		if(pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr))
+		{
+			if(!is_tree_header(&hdr))
+			{
+				log_error("tree_append: %s is not a binary tree file, run tree_upgrade\n", tree_file_path);
+				close(fd);
+				return -1;
+			}
+			offset = TREE_OFFSET(hdr.count);
+		}
+		close(fd);
+	}
+
+	tree_pack(&rec, ver);
+	if(wal_defer(WAL_TREE_APPEND, tree_file_path, offset, NULL, 0, &rec, sizeof(rec)))
+		return offset;
+	return tree_redo(tree_file_path, WAL_TREE_APPEND, offset, NULL, &rec) ? offset : -1;
+}
+
+/* Offset the next appended record will get */
+int tree_next_offset(const char *tree_file_path)
+{
+	TreeHeader hdr;
+	int fd, offset = TREE_FIRST_OFFSET;
+
+	fd = open(tree_file_path, O_RDONLY);
+	if(fd < 0)
+		return offset;
+	if(pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && is_tree_header(&hdr))
+		offset = TREE_OFFSET(hdr.count);
+	close(fd);
+	return offset;
+}
+
+/* Tells whether a tree file still is in the old text format */
+int tree_is_text(const char *tree_file_path)
+{
+	TreeHeader hdr;
+	int fd, ret;
+
+	fd = open(tree_file_path, O_RDONLY);
+	if(fd < 0)
+		return 0;
+	ret = read(fd, &hdr, sizeof(hdr));
+	close(fd);
+	return ret > 0 && (ret < (int)sizeof(hdr) || !is_tree_header(&hdr));
+}
+
+/* Writes the tree as text for the timeline GUI, one line per record:
+ * <valid> <timestamp> <lo=0/po> <hash> <tag> <diff_count> <parent_offset> <offset>
+ */
+int tree_export_text(const char *tree_file_path, const char *text_path)
+{
+	TreeMap *t = tree_open(tree_file_path, 0);
+	FILE *f;
+	int i, n;
+
+	f = fopen(text_path, "w");
+	if(f == NULL)
+	{
+		tree_close(t);
+		return 0;
+	}
+	n = t ? tree_count(t) : 0;
+	for(i = 0; i < n; i++)
+	{
+		TreeMd *rec = &t->rec[i];
+		fprintf(f, "%d %d %d %s %s %d %d %d\n", rec->valid && tree_at(t, TREE_OFFSET(i)) != NULL,
+			rec->timestamp, rec->file_type, rec->obj_hash, rec->tag[0] ? rec->tag : "_",
+			rec->diff_count, rec->parent, TREE_OFFSET(i));
+	}
+	fclose(f);
+	tree_close(t);
+	return 1;
+}
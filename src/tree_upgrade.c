@@ -0,0 +1,224 @@
+/* tree_upgrade.c
+ * Converts the text tree files of an RVFS root directory to the
+ * binary format of tree_file.c
+ *
+ * Usage: tree_upgrade </path/to/rootdir/>
+ *
+ * Every .ver/trees/<file>.tree still in the old space padded text
+ * format is rewritten record by record.  Text trees were addressed by
+ * the byte offset of a line, so the parent fields and the offsets in
+ * .ver/heads/<file>.head are translated to the new record offsets.
+ * Trees that are already binary are left alone, so the tool can be
+ * run again safely.  Run it while the file system is not mounted.
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <ftw.h>
+
+#include "vfs.h"
+
+#define LINE_MAX_SIZE 1024
+
+static int upgraded, failed;
+
+/* tree_file.c logs through log.c, which needs a mount: every message
+ * goes straight to stderr instead
+ */
+int log_level = LOG_DEBUG;
+
+void log_write(int level, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+}
+
+/* Nor is there a journal: the records are written in place */
+int wal_defer(int type, const char *path, int offset, const void *before, int before_len, const void *after, int after_len)
+{
+	return 0;
+}
+
+typedef struct _old_record{
+
+	long old_offset;
+	TreeMd ver;
+}OldRecord;
+
+static int map_offset(OldRecord *recs, int n, long old_offset)
+{
+	int i;
+	if(old_offset == -1)
+		return -1;
+	for(i = 0; i < n; i++)
+		if(recs[i].old_offset == old_offset)
+			return TREE_OFFSET(i);
+	return -2;
+}
+
+static int upgrade_heads(const char *heads_path, OldRecord *recs, int n)
+{
+	char tmp_path[PATH_MAX], b_name[LINE_MAX_SIZE];
+	FILE *in, *out;
+	long off;
+	int new_off;
+
+	in = fopen(heads_path, "r");
+	if(in == NULL)
+		return 1;
+	snprintf(tmp_path, PATH_MAX, "%s.upgrade", heads_path);
+	out = fopen(tmp_path, "w");
+	if(out == NULL)
+	{
+		fclose(in);
+		return 0;
+	}
+	while(fscanf(in, "%1023s %ld", b_name, &off) == 2)
+	{
+		new_off = map_offset(recs, n, off);
+		if(new_off == -2)
+		{
+			fprintf(stderr, "%s: %s points at %ld, which is no record\n", heads_path, b_name, off);
+			new_off = -1;
+		}
+		fprintf(out, "%s %-10d\n", b_name, new_off);
+	}
+	fclose(in);
+	if(fclose(out) != 0 || rename(tmp_path, heads_path) != 0)
+	{
+		unlink(tmp_path);
+		return 0;
+	}
+	return 1;
+}
+
+/* Converts one text tree and its heads file */
+static int upgrade_tree(const char *ver_dir, const char *name)
+{
+	char tree_path[PATH_MAX], heads_path[PATH_MAX], tmp_path[PATH_MAX];
+	char line[LINE_MAX_SIZE];
+	OldRecord *recs = NULL;
+	int n = 0, size = 0, i, parent;
+	long parent_off;
+	FILE *f;
+
+	snprintf(tree_path, PATH_MAX, "%s/%s%s.tree", ver_dir, TREES_FOLDER, name);
+	snprintf(heads_path, PATH_MAX, "%s/%s%s.head", ver_dir, HEADS_FOLDER, name);
+	snprintf(tmp_path, PATH_MAX, "%s.upgrade", tree_path);
+
+	f = fopen(tree_path, "r");
+	if(f == NULL)
+		return 0;
+	for(;;)
+	{
+		long pos = ftell(f);
+		TreeMd *ver;
+		if(fgets(line, LINE_MAX_SIZE, f) == NULL)
+			break;
+		if(n == size)
+		{
+			size = size ? 2*size : 64;
+			recs = (OldRecord *)realloc(recs, size*sizeof(OldRecord));
+		}
+		ver = &recs[n].ver;
+		memset(ver, 0, sizeof(TreeMd));
+		if(sscanf(line, "%d %d %d %40s %254s %d %ld", &ver->valid, &ver->timestamp, &ver->file_type,
+			ver->obj_hash, ver->tag, &ver->diff_count, &parent_off) != 7)
+			continue;
+		recs[n].old_offset = pos;
+		ver->parent = parent_off;
+		n++;
+	}
+	fclose(f);
+
+	unlink(tmp_path);
+	for(i = 0; i < n; i++)
+	{
+		parent = map_offset(recs, n, recs[i].ver.parent);
+		if(parent == -2)
+		{
+			fprintf(stderr, "%s: record %d has no parent at %d\n", tree_path, i, recs[i].ver.parent);
+			parent = -1;
+		}
+		recs[i].ver.parent = parent;
+		if(tree_append(tmp_path, &recs[i].ver) != TREE_OFFSET(i))
+		{
+			unlink(tmp_path);
+			free(recs);
+			return 0;
+		}
+	}
+	if(n == 0)
+	{
+		free(recs);
+		return 0;
+	}
+
+	/* heads first: a failure there leaves the text tree in place */
+	if(!upgrade_heads(heads_path, recs, n) || rename(tmp_path, tree_path) != 0)
+	{
+		unlink(tmp_path);
+		free(recs);
+		return 0;
+	}
+	printf("%s: %d versions\n", tree_path, n);
+	free(recs);
+	return 1;
+}
+
+static int visit(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	char trees_dir[PATH_MAX], tree_path[PATH_MAX], name[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+
+	if(flag != FTW_D || strcmp(path + ftw->base, ".ver") != 0)
+		return 0;
+	snprintf(trees_dir, PATH_MAX, "%s/%s", path, TREES_FOLDER);
+	d = opendir(trees_dir);
+	if(d == NULL)
+		return 0;
+	while((de = readdir(d)) != NULL)
+	{
+		size_t len = strlen(de->d_name);
+		if(len <= 5 || strcmp(de->d_name + len - 5, ".tree") != 0)
+			continue;
+		snprintf(tree_path, PATH_MAX, "%s%s", trees_dir, de->d_name);
+		if(!tree_is_text(tree_path))
+			continue;
+		snprintf(name, PATH_MAX, "%.*s", (int)(len - 5), de->d_name);
+		if(upgrade_tree(path, name))
+			upgraded++;
+		else
+		{
+			fprintf(stderr, "%s: upgrade failed\n", tree_path);
+			failed++;
+		}
+	}
+	closedir(d);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc != 2)
+	{
+		fprintf(stderr, "Usage: tree_upgrade </path/to/rootdir/>\n");
+		return 1;
+	}
+	if(nftw(argv[1], visit, 16, FTW_PHYS) != 0)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	printf("%d tree files upgraded, %d failed\n", upgraded, failed);
+	return failed != 0;
+}
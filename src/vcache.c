@@ -0,0 +1,271 @@
+/* vcache.c
+ * Cache of reconstructed versions
+ *
+ * Rebuilding an old version means inflating a full object and applying
+ * every patch between it and the version, and the timeline GUI and
+ * switchBranch do that again on every click.  Rebuilt versions are kept
+ * here, keyed by their object hash.  That is a hash of the contents,
+ * so an entry never goes stale and may serve any file.
+ * build_version_mem() starts from the cached version closest to its target.
+ *
+ * Entries are held in memory up to VCACHE_MEM_BYTES.  The least
+ * recently used ones are then spilled to the .ver/vcache folder of the
+ * mount root, which is trimmed back to VCACHE_DISK_BYTES the same way.
+ * The folder is the mount's own and only its owner may enter it, and a
+ * spilled file is hashed again before it is trusted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "params.h"
+#include "vfs.h"
+#include "log.h"
+
+typedef struct _vcache_entry {
+
+	char hash[HASH_SHA1];
+	char sum[HASH_SHA1];	/* hash of data when it was spilled */
+	char *data;		/* NULL once spilled to disk */
+	size_t size;
+	GList *link;		/* in mem_lru or disk_lru, most recent first */
+}VcacheEntry;
+
+static pthread_mutex_t vcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *entries;
+static GQueue mem_lru = G_QUEUE_INIT, disk_lru = G_QUEUE_INIT;
+static size_t mem_bytes, disk_bytes;
+static long hits, misses;
+static char vcache_dir[PATH_MAX];
+
+static void disk_path(char *path, const char *hash)
+{
+	snprintf(path, PATH_MAX, "%s%s", vcache_dir, hash);
+}
+
+/* Object hashes are not all hashes of the version they name (chunk
+ * lists are not), so spilled data is checked against its own hash
+ */
+static void data_sum(const char *data, size_t size, char sum[HASH_SHA1])
+{
+	GChecksum *cs = hash_new();
+
+	g_checksum_update(cs, (const guchar *)data, size);
+	hash_string(cs, sum);
+	g_checksum_free(cs);
+}
+
+/* Spilled files of an earlier mount are not indexed, drop them */
+static void vcache_init(void)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+
+	entries = g_hash_table_new(g_str_hash, g_str_equal);
+	snprintf(vcache_dir, PATH_MAX, "%s/%s%s", BB_DATA->rootdir, VER_DIR, VCACHE_FOLDER);
+	mkdir(vcache_dir, (mode_t)0700);
+	chmod(vcache_dir, (mode_t)0700);
+	d = opendir(vcache_dir);
+	if(d == NULL)
+		return;
+	while((de = readdir(d)) != NULL)
+	{
+		if(de->d_name[0] == '.')
+			continue;
+		disk_path(path, de->d_name);
+		unlink(path);
+	}
+	closedir(d);
+}
+
+static void drop_entry(VcacheEntry *e)
+{
+	char path[PATH_MAX];
+
+	g_hash_table_remove(entries, e->hash);
+	if(e->data != NULL)
+	{
+		g_queue_delete_link(&mem_lru, e->link);
+		mem_bytes -= e->size;
+		free(e->data);
+	}
+	else
+	{
+		g_queue_delete_link(&disk_lru, e->link);
+		disk_bytes -= e->size;
+		disk_path(path, e->hash);
+		unlink(path);
+	}
+	free(e);
+}
+
+/* Moves the least recently used entries out of memory, and off the
+ * disk, until both tiers are within their budgets
+ */
+static void trim(void)
+{
+	char path[PATH_MAX];
+	VcacheEntry *e;
+
+	while(mem_bytes > VCACHE_MEM_BYTES && mem_lru.tail != NULL)
+	{
+		e = (VcacheEntry *)mem_lru.tail->data;
+		disk_path(path, e->hash);
+		data_sum(e->data, e->size, e->sum);
+		if(e->size > VCACHE_DISK_BYTES || !write_file(path, e->data, e->size))
+		{
+			drop_entry(e);
+			continue;
+		}
+		g_queue_delete_link(&mem_lru, e->link);
+		mem_bytes -= e->size;
+		free(e->data);
+		e->data = NULL;
+		g_queue_push_head(&disk_lru, e);
+		e->link = disk_lru.head;
+		disk_bytes += e->size;
+	}
+	while(disk_bytes > VCACHE_DISK_BYTES && disk_lru.tail != NULL)
+		drop_entry((VcacheEntry *)disk_lru.tail->data);
+}
+
+/* Brings a spilled entry back into memory
+ * Returns 0 if its file is gone or no longer holds what was spilled
+ */
+static int promote(VcacheEntry *e)
+{
+	char path[PATH_MAX];
+	char sum[HASH_SHA1];
+	size_t len;
+	char *map;
+
+	disk_path(path, e->hash);
+	map = map_file(path, &len);
+	if(map != NULL && len == e->size)
+		data_sum(map, len, sum);
+	if(map == NULL || len != e->size || strcmp(sum, e->sum) != 0)
+	{
+		if(map != NULL)
+			unmap_file(map, len);
+		drop_entry(e);
+		return 0;
+	}
+	e->data = (char *)malloc(len + 1);
+	memcpy(e->data, map, len);
+	unmap_file(map, len);
+	unlink(path);
+	g_queue_delete_link(&disk_lru, e->link);
+	disk_bytes -= e->size;
+	g_queue_push_head(&mem_lru, e);
+	e->link = mem_lru.head;
+	mem_bytes += e->size;
+	return 1;
+}
+
+static void touch(VcacheEntry *e)
+{
+	g_queue_unlink(&mem_lru, e->link);
+	g_queue_push_head_link(&mem_lru, e->link);
+}
+
+/* Copies out the first of n versions (ordered closest to the wanted
+ * one first) that is in the cache, its index in *index.  Counts one
+ * hit or miss.
+ * Returns a malloc'd copy of the version, its size in *size, or NULL
+ */
+char *vcache_lookup(const char **hashes, int n, int *index, size_t *size)
+{
+	VcacheEntry *e = NULL;
+	char *ret = NULL;
+	int i;
+
+	pthread_mutex_lock(&vcache_lock);
+	if(entries == NULL)
+		vcache_init();
+	for(i = 0; i < n && ret == NULL; i++)
+	{
+		e = (VcacheEntry *)g_hash_table_lookup(entries, hashes[i]);
+		if(e == NULL || (e->data == NULL && !promote(e)))
+			continue;
+		touch(e);
+		ret = (char *)malloc(e->size + 1);
+		memcpy(ret, e->data, e->size);
+		ret[e->size] = '\0';
+		*size = e->size;
+		*index = i;
+	}
+	if(ret != NULL)
+		hits++;
+	else
+		misses++;
+	trim();
+	pthread_mutex_unlock(&vcache_lock);
+	return ret;
+}
+
+/* Adds a copy of the version in data, whose object hash is hash */
+void vcache_put(const char *hash, const char *data, size_t size)
+{
+	VcacheEntry *e;
+
+	pthread_mutex_lock(&vcache_lock);
+	if(entries == NULL)
+		vcache_init();
+	e = (VcacheEntry *)g_hash_table_lookup(entries, hash);
+	if(e != NULL || size > VCACHE_MEM_BYTES)
+	{
+		if(e != NULL && e->data != NULL)
+			touch(e);
+		pthread_mutex_unlock(&vcache_lock);
+		return;
+	}
+	e = (VcacheEntry *)malloc(sizeof(VcacheEntry));
+	strncpy(e->hash, hash, HASH_SHA1 - 1);
+	e->hash[HASH_SHA1 - 1] = '\0';
+	e->data = (char *)malloc(size + 1);
+	memcpy(e->data, data, size);
+	e->size = size;
+	g_hash_table_insert(entries, e->hash, e);
+	g_queue_push_head(&mem_lru, e);
+	e->link = mem_lru.head;
+	mem_bytes += size;
+	trim();
+	pthread_mutex_unlock(&vcache_lock);
+}
+
+/* Tells whether the version whose object hash is hash is cached, and
+ * its size in *size
+ */
+int vcache_size(const char *hash, size_t *size)
+{
+	VcacheEntry *e = NULL;
+
+	pthread_mutex_lock(&vcache_lock);
+	if(entries != NULL)
+		e = (VcacheEntry *)g_hash_table_lookup(entries, hash);
+	if(e != NULL)
+		*size = e->size;
+	pthread_mutex_unlock(&vcache_lock);
+	return e != NULL;
+}
+
+/* Writes the counters as "hits <n> misses <n> memory <bytes> disk <bytes>"
+ * Returns the length of the string
+ */
+int vcache_stats(char *buf, size_t size)
+{
+	int ret;
+
+	pthread_mutex_lock(&vcache_lock);
+	ret = snprintf(buf, size, "hits %ld misses %ld memory %lu disk %lu",
+		hits, misses, (unsigned long)mem_bytes, (unsigned long)disk_bytes);
+	pthread_mutex_unlock(&vcache_lock);
+	return ret;
+}
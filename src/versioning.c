@@ -6,6 +6,7 @@
 #include <string.h>
 #include <time.h>
 #include <fuse.h>
+#include <sys/stat.h>
 
 #include "vfs.h"
 #include "fuse_wrapper.h"
@@ -24,128 +25,13 @@
 
 int report_checkout(char * filepath, int req_tp);
 
-int remove_from_everything(file_data * file, char * hash)
+/* Drops the object of a version, its patch against child if it is a
+ * PO, and the object itself once it was the last reference
+ */
+int remove_from_everything(file_data * file, TreeMd * rec, const char * child)
 {
-	FILE * fp = fopen(file->OBJ_MD_file_path, "r+");
-	/*GHashTable * ht = readHTfromFile(fp, 1);
-	fclose(fp);
-	int i =1;
-	g_hash_table_foreach(ht,iterate1, &i);
-	char * hash1 = NULL;
-	int ref = 0;
-	char ** hashp = &hash1; 
-	int * refp = &ref;
-	
-	gboolean pointer_ref_ct = g_hash_table_lookup_extended(ht, (gconstpointer)hash, (gpointer*)hashp, (gpointer*)refp);
-	if(!pointer_ref_ct)
-	{
-		printf("ERROR: there is no entry of this object %s in OBJ_MD file", hash);
-		return 0;
-	} 
-	printf("\n============== %s\t%d===============\n", hash1, ref);
-	//printf("=========ref pointer= %d", *pointer_ref_ct);
-	*/
-	//int ref_ct = *pointer_ref_ct;
-	
-	char * hash1 = (char *)malloc(50*sizeof(char));
-	char * new_str = (char *)malloc(10000*sizeof(char));
-	char * temp = (char *)malloc(60*sizeof(char));
-	int ref;
-	int flag = 0;
-	int pos = ftell(fp);
-	fscanf(fp, "%s %s", hash1, temp);
-	
-	while(strcmp(hash, hash1)!=0)
-	{
-		pos = ftell(fp);
-		if(flag==0)
-			strcpy(new_str, hash1);
-		else
-	 	strcat(new_str, hash1);
-		strcat(new_str, " ");
-		if(flag==0)
-			strcat(new_str, temp);
-		else
-		{
-			char * tmper = (char *)malloc(5*sizeof(char));
-			itoa(ref, tmper);
-			strcat(new_str, tmper);
-		}
-		strcat(new_str, "\n");
-		flag++;
-		if(fscanf(fp, "%s %d", hash1, &ref)==EOF)
-		{
-			printf("IMPOSSIBLE\n");
-			return 0;
-		}	
-	}
-	printf("===============done%d\n", ref);
-	if(ref==1)
-	{
-		printf("==========CAME HERE\n");
-		//if()
-		while(fscanf(fp, "%s %s", hash1, temp)!=EOF);
-		{
-			printf("%s %s\n", hash1, temp);
-			if(strcmp(hash, hash1)!=0)
-			{
-				if(flag==0)
-					strcpy(new_str, hash1);
-				else
-				 	strcat(new_str, hash1);
-				strcat(new_str, " ");
-				strcat(new_str, temp);
-				strcat(new_str, "\n");
-				printf("%s\n", new_str);
-				flag++;
-			}
-			printf("=============================aaaaaaaaaaiiilaaaaaaaaaaaaaaaaaaaaaaaa============\n");
-		}
-		printf("=============================aaaaaaaaaaiiilaaaaaaaaaaaaaaaaaaaaaaaa============\n");
-		fclose(fp);
-		printf("========%s\n", file->OBJ_MD_file_path);
-		fp = fopen(file->OBJ_MD_file_path, "w");
-		fprintf(fp, "%s", new_str);
-		printf("%s", new_str);
-		fclose(fp);
-		printf("=============================aaaaaaaaaaiiilaaaaaaaaaaaaaaaaaaaaaaaa============\n");
-		char * obj_path = (char *)malloc(PATH_MAX*sizeof(char));
-		strcpy(obj_path, file->objects_dir_path);
-		strcat(obj_path, hash);
-		printf("============removing:: %s\n", obj_path);
-		remove(obj_path);
-		printf("=============================aaaaaaaaaaiiilaaaaaaaaaaaaaaaaaaaaaaaa============\n");
-		return 1;
-	}
-	fseek(fp, pos, SEEK_SET);
-	ref--;
-	fscanf(fp, "%s", hash1);
-	fprintf(fp, " %d\n", ref);
-	//fseek()
-	/*char * hash1 = (char *)malloc(50*sizeof(char));
-	int ref;
-	GHashTable * ht = g_hash_table_new(g_str_hash, g_str_equal);
-	while(fscanf(fp, "%s %d", hash1, &ref)!=EOF)
-		g_hash_table_insert(hash, hash1, "1");
-	fclose(fp);
-	printf("There are %d keys in the hash\n", g_hash_table_size(hash));
-	printf("The capital of Texas is %d\n", g_hash_table_lookup(hash, hash));
-	*/
-	/*if(ref_ct==1)
-	{
-		g_hash_table_remove(ht, (gconstpointer)hash);		
-		char * obj_path = (char *)malloc(PATH_MAX*sizeof(char));
-		strcpy(obj_path, file->objects_dir_path);
-		strcat(obj_path, hash);
-		remove(obj_path);
-		return 1;
-	}
-	ref_ct--;
-	g_hash_table_replace(ht, (gpointer)hash, &ref_ct);
-	fp = fopen(file->OBJ_MD_file_path, "w");
-	writeHTtoFile(ht, fp);
-	*/fclose(fp);
-	printf("\n=================EXITING FROM REMOVE FROM EVERYTHING==========\n");
+	printf("============removing:: %s\n", rec->obj_hash);
+	store_drop(file, rec->obj_hash, rec->file_type == PO ? child : NULL);
 	return 1;
 }
 
@@ -154,94 +40,67 @@ int search_tp_tree(file_data * file, int off, int req_tp)
 {
 	printf("==================================================");
 	printf("\n%d %d", off, req_tp);
-	FILE * fp = fopen(file->tree_file_path, "r");
-	if(fp==NULL)
+	TreeMap * t = tree_open(file->tree_file_path, 0);
+	if(t==NULL)
 	{
 		printf("ERROR: TREE FILE DOESNOT EXIST\n");                                   //display as a error message
 		return -1;
 	}
-	fseek(fp, off, SEEK_SET);
-	int valid;
-	int lp, diff_ct, p_off = off;
-	fscanf(fp, "%d", &valid);
-	if(valid==0)
+	int p_off = off;
+	char child[HASH_SHA1] = "";
+	TreeMd * rec = tree_at(t, off);
+	if(rec==NULL || rec->valid==0)
 	{
 		printf("ERROR: no record of latest head in tree.");
+		tree_close(t);
 		return -1;
 	}
-	char * temp_object = (char *)malloc(PATH_MAX*sizeof(char));
-	strcpy(temp_object, file->objects_dir_path);
-	char * curr_object = (char *)malloc(PATH_MAX*sizeof(char));
-	strcpy(curr_object, file->objects_dir_path);
-	int ctp;
-	char * has = (char *)malloc(50*sizeof(char));
-	fscanf(fp, "%d %d %s", &ctp, &lp, has);
-	printf("\n===================================aaaaaaaaaaaaaaaaaeeeeeeee==========================\n%s", has);
-	strcat(temp_object, "copy");
-	strcat(curr_object, has);
-	
-	char *hash = (char*)malloc(40*sizeof(char));
-	char *tag = (char*)malloc(255*sizeof(char));
-	
-	// create new file with filepath temp_object and copy 
-	decompress(curr_object);	
-	copy(curr_object, temp_object);	
-	compress(curr_object);
-	printf("\ncheck1 %d %d===================\n", ctp, req_tp);	
-	while(ctp!=req_tp)
+	printf("\ncheck1 %d %d===================\n", rec->timestamp, req_tp);	
+	while(rec->timestamp!=req_tp)
 	{
-		fscanf(fp, "%s %d %d", tag, &diff_ct, &p_off);
-		printf("\n %s | %d | %d ||||||||||||||\n", tag, diff_ct, p_off);
+		p_off = rec->parent;
+		strcpy(child, rec->obj_hash);
+		printf("\n %s | %d | %d ||||||||||||||\n", rec->tag, rec->diff_count, p_off);
 		if(p_off==-1)
-			return -1;
-		fseek(fp, p_off, SEEK_SET);
-		fscanf(fp, "%d", &valid);
-		if(valid==0)
 		{
-			printf("ERROR: no record of latest head in tree.");
+			tree_close(t);
 			return -1;
 		}
-		
-		fscanf(fp, "%d %d %s", &ctp, &lp, hash);
-		int i = strlen(curr_object) - 1;
-		while(curr_object[i]!='/')
-			i--;
-		curr_object[i+1] = '\0';
-		strcat(curr_object, hash);
-			
-		decompress(curr_object);
-		// check if the node is a loose object or not. if loose then dont take diff and store this object as the current ver and if not patch this po to previous object........................................
-		if(lp==0)
-		{
-			// make this loose object the current object
-			
-			copy(curr_object, temp_object);
-			
-		}
-		else
+		rec = tree_at(t, p_off);
+		if(rec==NULL || rec->valid==0)
 		{
-			// patch this pach object with current object and  uodate to current object
-			
-			patch(temp_object, curr_object);
-			
+			printf("ERROR: no record of latest head in tree.");
+			tree_close(t);
+			return -1;
 		}
-		compress(curr_object);
-		printf("\t\t%d", ctp);
 	}
-	fclose(fp);
+	char * temp_object = (char *)malloc(PATH_MAX*sizeof(char));
+	make_scratch(temp_object, file->objects_dir_path, "copy");
+	
+	// patch from the nearest keyframe above the version, not from the head
+	if(build_version(t, file, off, p_off, temp_object) < 0)
+	{
+		printf("ERROR: cannot rebuild version %d\n", req_tp);
+		delete(temp_object);
+		tree_close(t);
+		return -1;
+	}
 	printf("\n========================================\ncopy %s ----- to-----%s\n========================================", temp_object, file->path);
 	copy(temp_object, file->path);
-	decompress(curr_object);
-	copy(temp_object, curr_object);
+	// kept whole from now on, its patch against the child we came from
+	// goes once the tree says so
+	if(rec->file_type == PO)
+	{
+		TreeMd lo = *rec;
+		lo.file_type = LO;
+		store_put(file, temp_object, rec->obj_hash, NULL);
+		wal_begin();
+		tree_write(file->tree_file_path, p_off, &lo);
+		store_drop(file, rec->obj_hash, child);
+		wal_commit();
+	}
 	delete(temp_object);
-	compress(curr_object);
-	fp = fopen(file->tree_file_path, "r+");
-	fseek(fp, p_off, SEEK_SET);
-	int garbage;
-	fscanf(fp, "%d", &garbage);
-	fscanf(fp, "%d", &garbage);
-	fprintf(fp, " 0");
-	fclose(fp);
+	tree_close(t);
 	return p_off;
 }
 
@@ -265,6 +124,7 @@ int write_to_head(char * heads_file_path, int tp, int off)
 	fprintf(fp, "%s ", b_name);
 	fprintf(fp, "%s\n", addspaces(str_off, 10));
 	fclose(fp);
+	heads_changed(heads_file_path);
 	return 1;
 }
 
@@ -318,7 +178,7 @@ int get_tp_from_head(char * filepath, int tp)          //returns the offset if v
 void update_sizemd_file(file_data *file, int timestamp)
 {
 	int md_size = calc_md_size(file);
-	int file_size = calc_file_size(file->path);
+	int file_size = calc_file_size(file->content_path);
 	float ratio = file_size/(float)(md_size+file_size);
 	log_msg("file size: %d ----- metadata size: %d totalsize = %d\n",file_size,md_size,md_size+file_size);
 	FILE *fp;
@@ -329,85 +189,18 @@ void update_sizemd_file(file_data *file, int timestamp)
 
 
 /* Creates a version on report file release
- * It calls to update the TREE, HEADS and OBJ_MD
+ * It calls to update the TREE, HEADS and OBJ_MD, as one transaction of
+ * the journal
  */
-void compress(char *obj_file){
-
-	
-	///* Assuming that the file is available */
-
-	char mv_obj[255], command[400];;
-	char * filename = (char *)malloc(PATH_MAX * sizeof(char));
-	char * dirpath = (char *)malloc(PATH_MAX * sizeof(char));
-	split_file_path(obj_file,filename,dirpath);
-	strcpy(mv_obj, filename);
-	strcat(mv_obj, ".tmp");
-
-	/* Now compress */
-
-	sprintf(command, "cd %s ; mv %s %s; tar -czvf %s %s; rm %s",dirpath,filename, mv_obj,filename, mv_obj, mv_obj);
-	log_msg("Compressing: %s\n", command);
-	system(command);
-
-	/* Log that you compressed the file */
-
-	log_msg("Compressed the Obj File: %s\n", obj_file);
-
-}
-
-/* De-Compresses a given filename using the gzipped format */
-void decompress(char *obj_file){
-	
-	/* Assuming that the file is available */
-
-	char mv_obj[255], command[400];;
-	char * filename = (char *)malloc(PATH_MAX * sizeof(char));
-	char * dirpath = (char *)malloc(PATH_MAX * sizeof(char));
-	split_file_path(obj_file,filename,dirpath);
-
-	strcpy(mv_obj, filename);
-	strcat(mv_obj, ".tmp");
-
-	/* Now compress */
-
-	sprintf(command, "cd %s; tar -xzvf %s; rm %s; mv %s %s;", dirpath, filename, filename,  mv_obj, filename);
-	log_msg("DeCompressing: %s\n", command);
-	system(command);
-
-	/* Log that you compressed the file */
-
-	log_msg("De-Compressed the Obj File: %s\n", obj_file);
-}
 void create_version(file_data * file,TreeMd * ver,int is_first_version) 
 {
-	int off;
-	//Constructing new version path
-	char * new_current_ver = (char *) malloc((strlen(file->objects_dir_path)+50)*sizeof(char));
-	sprintf(new_current_ver,"%s%s",file->objects_dir_path,ver->obj_hash);
-	int is_creating_branch =  1;
-	char * epoch = (char*)malloc(20*sizeof(char));
-	char * tmp_epoch = (char*)malloc(20*sizeof(char));
-	FILE * f = fopen(file->heads_file_path,"r");
-	fscanf(f,"%s",epoch);
-	fscanf(f,"%d",&off);
-	//	fclose(f);
-//	-------------------------------------------------------------------------------------------------------------------------
-	
-	while(fscanf(f,"%s %d",tmp_epoch,&off) != EOF)
-	{
-		if(strcmp(tmp_epoch,epoch) == 0)
-		{
-			is_creating_branch = 0;	
-		}
-	}
-	
-	
-	
-//	--------------------------------------------------------------------------------------------------------------------------------------------
-/*	f = fopen(file->heads_file_path,"r");
-	GHashTable *ght = g_hash_table_new(g_str_hash,g_str_equal);
-	ght = readHTfromFile(f,2);*/
-	fclose(f);
+	long long start = stats_now();
+	int is_creating_branch = 1;
+	char epoch[MAX_BNAME];
+	wal_begin();
+	// a new branch starts unless the present head is the head of a branch
+	if(heads_present(file->heads_file_path, epoch) >= 0 && heads_has_branch(file->heads_file_path, epoch))
+		is_creating_branch = 0;
 	if(is_creating_branch)
 		printf("=====================CREATING A NEW BRANCH========================================\n");
 	else
@@ -422,65 +215,63 @@ void create_version(file_data * file,TreeMd * ver,int is_first_version)
 		printf("\n000000000000000000000000000 CREATING A NEW BRANCH0000000000000000000000\n");
 		is_creating_branch = 1;
 	}*/
-	if((is_first_version)||(is_creating_branch))
+	int is_keyframe = 0;
+	if(file->chunks != NULL)
+	{
+		// no diff either, the chunks it shares with the parent are stored once
+		is_keyframe = 1;
+		store_put_chunks(file,file->chunks,ver->obj_hash);
+	}
+	else if((is_first_version)||(is_creating_branch))
 	{
 		
-		copy(file->path,new_current_ver);
-		printf("Compressing %s\n",new_current_ver);	
-		compress(new_current_ver);
+		store_put(file,file->content_path,ver->obj_hash,NULL);
 			
 	}
+	else if(is_keyframe_due(file,ver->parent,BB_DATA->keyframe_interval,BB_DATA->keyframe_bytes))
+	{
+		// the parent keeps its full object, no diff is taken
+		printf("Keeping %d as a keyframe\n",ver->parent);
+		is_keyframe = 1;
+		store_put(file,file->content_path,ver->obj_hash,NULL);
+	}
 	else
 	{
 		char * old_ver_source = (char *)malloc(50 * sizeof(char));
 		old_ver_source = get_hash_from_offset(ver->parent,file->tree_file_path);
 	
 		//Construct temp file to store previous version lo
-		char * old_current_ver_dest = (char *) malloc( (strlen(file->objects_dir_path)+5) * sizeof(char) );
-		sprintf(old_current_ver_dest,"%s%s",file->objects_dir_path,"old");
-	
+		char * old_current_ver_dest = (char *) malloc(PATH_MAX * sizeof(char));
+		make_scratch(old_current_ver_dest,file->objects_dir_path,"old");
 	
+		//Construct temp file to store the diff before it is stored as an object
+		char * diff_tmp_path = (char *) malloc(PATH_MAX * sizeof(char));
+		make_scratch(diff_tmp_path,file->objects_dir_path,"diff");
 	
-		//
-		char * diff_path = (char *) malloc((strlen(file->objects_dir_path)+50) * sizeof(char));
-		sprintf(diff_path,"%s%s",file->objects_dir_path,old_ver_source);
+		//Full object of the parent, kept from now on as a patch against this version
+		char * old_ver_path = (char *) malloc(PATH_MAX * sizeof(char));
+		store_path(old_ver_path,file,old_ver_source,NULL);
 
 		#ifdef DEBUG
 			printf("\told_current_ver_source: %s\n",old_ver_source);
 			printf("\told_current_ver_dest: %s\n",old_current_ver_dest);
-			printf("\tnew_current_ver: %s\n",new_current_ver);
+			printf("\tnew_current_ver: %s\n",ver->obj_hash);
 		#endif
 
-			printf("DeCompressing %s\n",diff_path);	
-			decompress(diff_path);
-		//	move(old_current_ver_source,old_current_ver_dest);
-			move(diff_path,old_current_ver_dest);
+			load_object(old_ver_path,old_current_ver_dest);
+			store_put(file,file->content_path,ver->obj_hash,NULL);
 		
-	
-			copy(file->path,new_current_ver);
-	
-			#ifdef DEBUG
-				char *command1 = (char *) malloc(2000 * sizeof(char));
-				strcpy(command1,"cat ");
-				strcat(command1,old_current_ver_dest);
-				printf("\n\n---------------\n");
-				system(command1);
-				printf("---------------\n");
-
-				char *command2 = (char *) malloc(2000 * sizeof(char));
-				strcpy(command2,"cat ");
-				strcat(command2,new_current_ver);
-				printf("\n\n---------------\n");
-				system(command2);
-				printf("---------------\n");
-			#endif
-		
-			diff(new_current_ver,old_current_ver_dest,diff_path);
+			// only the ranges written since the last release are compared,
+			// the rest is checked to match the parent
+			if(file->dirty != NULL)
+				delta_create_ranges(file->content_path,old_current_ver_dest,diff_tmp_path,file->dirty->r,file->dirty->n);
+			else
+				diff(file->content_path,old_current_ver_dest,diff_tmp_path);
 			rem(old_current_ver_dest);
-			printf("Compressing %s\n",diff_path);	
-			compress(diff_path);
-			printf("Compressing %s\n",new_current_ver);
-			compress(new_current_ver);	
+			store_put(file,diff_tmp_path,old_ver_source,ver->obj_hash);
+			store_drop(file,old_ver_source,NULL);
+			rem(diff_tmp_path);
+			free(old_ver_path);
 	/*		
 			char ver_list_path[PATH_MAX];
 			strcpy(ver_list_path,file->ver_dir_path);
@@ -489,14 +280,6 @@ void create_version(file_data * file,TreeMd * ver,int is_first_version)
 			fprintf(list,"%s\n",diff_path);
 			fclose(list);
 	*/
-			#ifdef DEBUG
-				char *command3 = (char *) malloc(2000 * sizeof(char));
-				strcpy(command3,"cat ");
-				strcat(command3,old_current_ver_dest);
-				printf("\n\n---------------\n");
-				system(command3);
-				printf("---------------\n");
-			#endif
 
 		// update the current version number in the current_ver_number file
 	/*	FILE *current_ver_number = fopen(file->current_ver_number_path,"w");
@@ -507,9 +290,10 @@ void create_version(file_data * file,TreeMd * ver,int is_first_version)
 //	add_spaces_to_version_data(TreeMd * ver);
 //	update_tree_data(file,ver);
 	update_heads_file(file,ver,is_first_version,is_creating_branch);
-	update_tree_data(file,ver,is_creating_branch,is_first_version);
-	update_objmd_file(ver->obj_hash,file->OBJ_MD_file_path,0);
+	update_tree_data(file,ver,is_creating_branch || is_keyframe,is_first_version);
+	wal_commit();
 	update_sizemd_file(file,ver->timestamp);	
+	stats_add(STAT_VERSION,start,0,0);
 }
 // constructs version data
 
@@ -526,58 +310,28 @@ void init_file_data(file_data * file) {
 	file->md_data_file_path = (char *) malloc(PATH_MAX*sizeof(char));
 }
 
+/* frees the paths of a file_data filled by init_file_data */
+void free_file_data(file_data * file) {
+	free(file->name);
+	free(file->dir_path);
+	free(file->ver_dir_path);
+	free(file->objects_dir_path);
+	free(file->tree_file_path);
+	free(file->heads_file_path);
+	free(file->OBJ_MD_file_path);
+	free(file->md_data_file_path);
+}
+
 /* Constructs the paths of:
  * tree
  * heads
  * OBJ_MD
- * returns the data structure
+ * returns the data structure, its paths shared with the cache of meta.c
  */
  
 file_data * construct_file_data(const char * filepath) {
 	file_data *file = (file_data *) malloc(sizeof(file_data));
-	init_file_data(file);
-	
-	file->path = filepath;
-	split_file_path(filepath,file->name,file->dir_path);
-	
-	// version directory path
-	strcpy(file->ver_dir_path,file->dir_path);
-	strcat(file->ver_dir_path,VER_DIR);
-	//strcat(file->ver_dir_path,file->name);
-	//strcat(file->ver_dir_path,"/");
-	#ifdef DEBUG
-		//printf("\n\t[versioning/construct_file_data] %s\n",file->ver_dir_path);
-	#endif
-	
-	// objects folder path
-	strcpy(file->objects_dir_path,file->ver_dir_path);
-	strcat(file->objects_dir_path,OBJECTS_FOLDER);
-	#ifdef DEBUG
-		//printf("\n%s\n,file->objects_dir_path);
-	#endif
-	
-	// tree file path
-	strcpy(file->tree_file_path, file->ver_dir_path);
-	strcat(file->tree_file_path, TREES_FOLDER);
-	strcat(file->tree_file_path, file->name);
-	strcat(file->tree_file_path, ".tree");
-	
-	// head file path
-	strcpy(file->heads_file_path, file->ver_dir_path);
-	strcat(file->heads_file_path, HEADS_FOLDER);
-	strcat(file->heads_file_path, file->name);
-	strcat(file->heads_file_path, ".head");
-	
-	// OBJ_MD file path
-	strcpy(file->OBJ_MD_file_path,file->ver_dir_path);
-	strcat(file->OBJ_MD_file_path,"OBJ_MD");
-	
-	// md_data file path
-	strcpy(file->md_data_file_path,file->ver_dir_path);
-	strcat(file->md_data_file_path,MD_DATA_FOLDER);
-	strcat(file->md_data_file_path,file->name);
-	strcat(file->md_data_file_path,".md");
-	
+	meta_paths(filepath, file);
 	return file;
 }
 
@@ -587,19 +341,72 @@ int report_release(const char * filepath) {
 	#ifdef DEBUG
 		printf ("\n[versioning] received 'report_release for %s'\n", filepath);
 	#endif
+	return commit_version(filepath, filepath, NULL, (int) time(NULL));
+}
+
+/* Tells whether the contents of filepath are versioned in chunks:
+ * binary files, and text files of at least chunk_file_bytes
+ */
+static int versioned_in_chunks(const char * filepath, const char * content_path, const FileChanges * changes)
+{
+	struct stat st;
+	
+	if(!classify_file(filepath, changes != NULL ? changes->sniff : SNIFF_UNKNOWN, changes != NULL ? &changes->dirty : NULL, NULL, 0))
+		return 1;
+	return BB_DATA->chunk_file_bytes > 0 && stat(content_path, &st) == 0 && st.st_size >= BB_DATA->chunk_file_bytes;
+}
+
+/* Cuts the contents of file into l, keeping the chunks of the version
+ * at parent_off where nothing was written if it is chunked too
+ * Returns 1 for success and 0 for failure
+ */
+static int chunk_version(file_data * file, int parent_off, ChunkList * l)
+{
+	char path[PATH_MAX];
+	ChunkList parent;
+	TreeMd rec;
+	int has_parent = 0, ret;
+	
+	if(parent_off >= 0 && tree_read(file->tree_file_path, parent_off, &rec) && rec.file_type == LO)
+	{
+		store_path(path, file, rec.obj_hash, NULL);
+		has_parent = chunk_list_read(path, &parent);
+	}
+	ret = chunk_file(file->content_path, has_parent ? &parent : NULL, file->dirty, l);
+	if(has_parent)
+		chunk_list_free(&parent);
+	return ret;
+}
+
+/* Creates a version of filepath from the contents of content_path,
+ * stamped with timestamp.  The commit workers pass the snapshot taken
+ * on release, as the file may have been written again since.
+ * changes, if not NULL, tells what was written since the previous
+ * release: with the object hash of the contents content_path need not be
+ * hashed, and the delta of the parent only compares the written ranges,
+ * as chunking only reads them.
+ */
+int commit_version(const char * filepath, const char * content_path, const FileChanges * changes, int timestamp) {
 	int is_first_version = 0;
 	// construct file data (i.e., path, name, directory path, version directory path, version log path, current version path, etc.)
 	#ifdef DEBUG
 		printf ("\n[versioning] constructing file data for %s...\n", filepath);
 	#endif
-	file_data *file = construct_file_data(filepath);
+	file_data data, *file = &data;
+	meta_paths(filepath, file);
+	file->content_path = content_path;
+	if(changes != NULL)
+	{
+		file->content_hash = changes->hash;
+		file->dirty = &changes->dirty;
+	}
+	// the .ver of the directory is shared by all its files
+	PathLock *vlock = dir_lock(filepath);
 	#ifdef DEBUG
 		print_file_data(file);
 		
 	#endif
-	FILE * f = fopen(file->heads_file_path,"a");
-	
-	if(!ftell(f))
+	if(heads_present(file->heads_file_path, NULL) < 0)
 	{
 		printf("Checking if first version\n");
 		is_first_version = 1;
@@ -608,22 +415,54 @@ int report_release(const char * filepath) {
 		#endif
 	}
 	
-	fclose(f);
+	// binary and large files are cut into chunks, named by their list
+	ChunkList chunks;
+	if(versioned_in_chunks(filepath, content_path, changes))
+	{
+		if(!chunk_version(file, is_first_version ? -1 : heads_present(file->heads_file_path, NULL), &chunks))
+		{
+			printf("Cannot read %s, no new version\n",content_path);
+			path_unlock(vlock);
+			return 0;
+		}
+		file->chunks = &chunks;
+	}
+	
 	// construct latest version structure
 	#ifdef DEBUG
 		printf ("\n[versioning] constructing latest version data for %s...\n", filepath);
 	#endif
 	TreeMd *latest_version = construct_version_data(file,is_first_version);
+	latest_version->timestamp = timestamp;
 	#ifdef DEBUG
 		//print_version_data(latest_version);
 	#endif
 	
+	// written back as they were, e.g. a save without changes
+	if(!is_first_version)
+	{
+		char * head_hash = get_hash_from_offset(latest_version->parent,file->tree_file_path);
+		int unchanged = strcmp(head_hash,latest_version->obj_hash) == 0;
+		free(head_hash);
+		if(unchanged)
+		{
+			printf("%s has not changed since its head, no new version\n",filepath);
+			if(file->chunks != NULL)
+				chunk_list_free(&chunks);
+			path_unlock(vlock);
+			return 0;
+		}
+	}
+	
 	// create the new version itself
 	#ifdef DEBUG
 	printf ("\n[versioning] creating new version for %s...\n", filepath);
 	#endif
 	
 	create_version(file,latest_version,is_first_version);
+	if(file->chunks != NULL)
+		chunk_list_free(&chunks);
+	path_unlock(vlock);
 	
 	#ifdef DEBUG
 //		printf ("[versioning] created new version for file %s\n\n", filepath);
@@ -668,12 +507,9 @@ int report_checkout(char * filepath, int req_tp)
 		char * hash_target = (char *)malloc(50*sizeof(char));
 		hash_target = get_hash_from_offset(off, file->tree_file_path);	
 		char * target_file_path = (char *)malloc(PATH_MAX*sizeof(char));
-		strcpy(target_file_path, file->objects_dir_path);
-		strcat(target_file_path, hash_target);
+		store_path(target_file_path, file, hash_target, NULL);
 		//copy the target_file_type to filepath.
-		decompress(target_file_path);
-		copy(target_file_path, file->path);
-		compress(target_file_path);
+		load_object(target_file_path, file->path);
 		
 		return 1;
 	}
@@ -769,112 +605,102 @@ int revert_to_version(char * filepath, int req_tp)                     // return
 		report_checkout(filepath, atoi(c_tp));
 	
 	char * temp_object = (char *)malloc(PATH_MAX*sizeof(char));
-	strcpy(temp_object, file->objects_dir_path);
 	char * curr_object = (char *)malloc(PATH_MAX*sizeof(char));
-	strcpy(curr_object, file->objects_dir_path);
+	char child[HASH_SHA1] = "";
+	TreeMd edit;
+	GString * heads;
 	
-	int valid, tp, lp, diff_ct, p_off;
-	char * hash = (char *)malloc(50*sizeof(char));
-	char * tag = (char *)malloc(255*sizeof(char));
-	
-	FILE * fpt = fopen(file->tree_file_path, "r+");
+	TreeMap * t = tree_open(file->tree_file_path, 0);
+	TreeMd * rec = tree_at(t, TREE_FIRST_OFFSET);
 	char * root_bname = (char *)malloc(15*sizeof(char));
 	strcpy(root_bname, "B_");
-	fscanf(fpt, "%d", &valid);
-	if(valid==0)
+	if(rec==NULL || rec->valid==0)
 	{
 		printf("ERROR: no record of latest head in tree.");
+		tree_close(t);
 		return 0;
 	}
 	
-	fscanf(fpt, "%d %d %s %s %d %d", &tp, &lp, hash, tag, &diff_ct, &p_off);
 	char * tmper = (char *)malloc(15*sizeof(char));
-	itoa(tp, tmper);
+	itoa(rec->timestamp, tmper);
 	strcat(root_bname, tmper);
 	log_msg("==================%s=========\n", root_bname);
-	fseek(fpt, off, SEEK_SET);
 	
-	fscanf(fpt, "%d", &valid);
-	if(valid==0)
+	rec = tree_at(t, off);
+	if(rec==NULL || rec->valid==0)
 	{
 		printf("ERROR: no record of latest head in tree.");
+		tree_close(t);
 		return 0;
 	}
 	
-	fscanf(fpt, "%d %d %s %s %d %d", &tp, &lp, hash, tag, &diff_ct, &p_off);
-	if(tp==req_tp)
+	if(rec->timestamp==req_tp)
 	{
 		printf("ERROR: you cannot revert to where you are");                   // display as a error message
+		tree_close(t);
 		return 0;
 	}
 	
-	strcat(curr_object, hash);
-	strcat(temp_object, "copy");
-	decompress(curr_object);
-	copy(curr_object, temp_object);
-	compress(curr_object);
-	while(tp!=req_tp)
+	store_path(curr_object, file, rec->obj_hash, NULL);
+	make_scratch(temp_object, file->objects_dir_path, "copy");
+	load_object(curr_object, temp_object);
+	// the versions dropped and the new heads are one transaction of the
+	// journal, their objects go once it is in place
+	wal_begin();
+	while(rec->timestamp!=req_tp)
 	{
-		fseek(fpt, off, SEEK_SET);
-		fprintf(fpt, "0");
-		remove_from_everything(file, hash);                                // removes the current version objects file if ref_count=1 
-		off = p_off;
-		fseek(fpt, off, SEEK_SET);
-		fscanf(fpt, "%d", &valid);
-		if(valid==0)
+		edit = *rec;
+		edit.valid = 0;
+		tree_write(file->tree_file_path, off, &edit);
+		remove_from_everything(file, rec, child);                                // removes the current version objects file if ref_count=1 
+		strcpy(child, rec->obj_hash);
+		off = rec->parent;
+		rec = tree_at(t, off);
+		if(rec==NULL || rec->valid==0)
 		{
 			printf("ERROR: no record of parent version of the current version in tree.");
+			wal_commit();
+			tree_close(t);
 			return 0;
 		}
-		fscanf(fpt, "%d %d %s %s %d %d", &tp, &lp, hash, tag, &diff_ct, &p_off);
-		fclose(fpt);
-		if(isJunction(file, off)==1 && off!=0)
+		if(isJunction(file, off)==1 && off!=TREE_FIRST_OFFSET)
 		{
 			char * offs = (char *)malloc(15*sizeof(char));
 			itoa(off, offs);
-			fph = fopen(file->heads_file_path, "w");
-			fprintf(fph, "B_%d %s\n", tp, addspaces(offs, 10));
-			fprintf(fph, "%s", write);
-			fclose(fph);
+			heads = g_string_new(NULL);
+			g_string_append_printf(heads, "B_%d %s\n", rec->timestamp, addspaces(offs, 10));
+			g_string_append(heads, write);
+			heads_replace(file->heads_file_path, heads->str, heads->len);
+			g_string_free(heads, TRUE);
+			wal_commit();
+			tree_close(t);
 			report_checkout(filepath, req_tp);
 			return 1;
 		}
-		fpt = fopen(file->tree_file_path, "r+");
-		int i = strlen(curr_object);
-		while(curr_object[i]!='/')
-			i--;
-		curr_object[i+1] = '\0';
-		strcat(curr_object, hash);
-		decompress(curr_object);
-		if(lp==0)
-		{
-			
-			copy(curr_object, temp_object);
-			
-
-		}
-		else
-		{
-			
-			patch(temp_object, curr_object);
-			
-		}
+		store_path(curr_object, file, rec->obj_hash, rec->file_type == PO ? child : NULL);
+		restore_object(curr_object, temp_object, rec->file_type);
 	}
-	compress(curr_object);
 	copy(temp_object, filepath);
-	decompress(curr_object);
-	copy(temp_object, curr_object);
+	if(rec->file_type == PO)
+	{
+		store_put(file, temp_object, rec->obj_hash, NULL);
+		store_drop(file, rec->obj_hash, child);
+		edit = *rec;
+		edit.file_type = LO;
+		tree_write(file->tree_file_path, off, &edit);
+	}
 	delete(temp_object);
-	compress(curr_object);
-	fclose(fpt);
-	fph = fopen(file->heads_file_path, "w");
+	tree_close(t);
 	char * offs = (char *)malloc(15*sizeof(char));
 	itoa(off, offs);
 	log_msg("-----------%s----%s-----", root_bname, curr_bname);
-	fprintf(fph, "%s %s\n", curr_bname, addspaces(offs, 10));
+	heads = g_string_new(NULL);
+	g_string_append_printf(heads, "%s %s\n", curr_bname, addspaces(offs, 10));
 	if(strcmp(curr_bname, root_bname)!=0)
-		fprintf(fph, "%s %s\n", curr_bname, offs);
-	fprintf(fph, "%s", write);
-	fclose(fph);
+		g_string_append_printf(heads, "%s %s\n", curr_bname, offs);
+	g_string_append(heads, write);
+	heads_replace(file->heads_file_path, heads->str, heads->len);
+	g_string_free(heads, TRUE);
+	wal_commit();
 	return 1;
 }
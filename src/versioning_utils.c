@@ -113,31 +113,67 @@ int find_present_file_offset(char * filepath)
     strcpy(c,sum);
 } */
 
+/* Object hashes: SHA1 by default, RVFS_HASH=sha256 picks SHA256.
+ * Ids are kept to the 40 hex digits of a SHA1 so the tree records and
+ * OBJ_MD keep their layout, longer digests are cut to that.
+ */
+static GChecksumType hash_type = G_CHECKSUM_SHA1;
+
+/* Returns 1, or 0 if name is not a hash RVFS has (blake3 is not) */
+int hash_select(const char *name)
+{
+    if(g_ascii_strcasecmp(name, "sha1") == 0)
+        hash_type = G_CHECKSUM_SHA1;
+    else if(g_ascii_strcasecmp(name, "sha256") == 0)
+        hash_type = G_CHECKSUM_SHA256;
+    else
+        return 0;
+    return 1;
+}
+
+GChecksum *hash_new(void)
+{
+    return g_checksum_new( hash_type );
+}
+
+/* Writes the object id of the data fed to cs so far into c */
+void hash_string(GChecksum *cs, char c[41])
+{
+    strncpy(c, g_checksum_get_string( cs ), 40);
+    c[40] = '\0';
+}
+
+/* Hashes the whole file, for when its writes could not be hashed as
+ * they streamed by (see file_wrote()).  c is empty if it cannot be read.
+ */
 void find_SHA(const char * filepath, char c[41]) 
 { 
     GChecksum   *cs;
-    guchar       data[MAX_SIZE];
+    guchar      *data;
     gsize        size = 0;
     FILE        *input;
-    const gchar *sum;
-    
-    cs = g_checksum_new( G_CHECKSUM_MD5 );    
+    long long    start = stats_now(), total = 0;
     
+    c[0] = '\0';
     input = fopen( filepath, "rb" );
-    do
+    if( input == NULL )
+    {
+        stats_add( STAT_HASH, start, 0, 1 );
+        return;
+    }
+    data = (guchar *)malloc( MAX_SIZE );
+    cs = hash_new();
+    while( (size = fread((void *)data, sizeof(guchar), MAX_SIZE, input )) > 0 )
     {
-        size = fread((void *)data, sizeof(guchar), MAX_SIZE, input );
         g_checksum_update( cs, data, size );
-  
+        total += size;
     }
-    while( size == MAX_SIZE );
     fclose( input );
+    free( data );
 
-    sum = g_checksum_get_string( cs );    
-    strcpy(c,sum);
-
+    hash_string( cs, c );
     g_checksum_free( cs ); 
- 
+    stats_add( STAT_HASH, start, total, 0 );
 } 
 
 /* Returns the dirpath and file name from a file path
@@ -167,16 +203,11 @@ void split_file_path (const char * filepath, char *filename, char *dirpath){
  */
 char * get_hash_from_offset(int offset, char  * file_tree_path)
 {
-	FILE  * f = fopen(file_tree_path,"r");
-	int i;
-	char ch;
+	TreeMd ver;
 	char * hash = (char * )malloc(50 * sizeof(char));
-	fseek(f,offset,SEEK_SET);
-	fscanf(f,"%d",&i);
-	fscanf(f,"%d",&i);
-	fscanf(f,"%d",&i);
-	fscanf(f,"%c",&ch);
-	fscanf(f,"%s",hash);
+	hash[0] = '\0';
+	if(tree_read(file_tree_path,offset,&ver))
+		strcpy(hash,ver.obj_hash);
 	return hash;
 }
 
@@ -185,14 +216,7 @@ char * get_hash_from_offset(int offset, char  * file_tree_path)
  */
 int get_present_head_offset(char * filepath)
 {
-	int offset;
-	char * s = (char * )malloc(15 * sizeof(char));
-	FILE * heads_filepath = fopen(filepath,"r");
-	fscanf(heads_filepath,"%s",s);
-	fscanf(heads_filepath,"%d",&offset);
-	fclose(heads_filepath);
-	printf("I am returning offset :%d\n",offset);
-	return offset;
+	return heads_present(filepath, NULL);
 }
 
 
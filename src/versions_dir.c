@@ -0,0 +1,211 @@
+/* versions_dir.c
+ * Read only view of the versions of a file, without a checkout
+ *
+ * Every file has a directory "<file>@versions", not listed by readdir,
+ * holding one entry per version named by its timestamp:
+ *
+ *	cat notes.txt@versions/1346071234
+ *	diff notes.txt@versions/1346071234 notes.txt
+ *
+ * An entry is rebuilt in memory when it is first looked at and then
+ * served from the version cache, so any number of readers can look at
+ * old versions at once without touching the working file or the
+ * exchange files in /tmp/rvfs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "vfs.h"
+#include "log.h"
+
+/* Tells whether fpath is in the versions of a file: VERSIONS_DIR for
+ * "<file>@versions", VERSIONS_ENTRY for "<file>@versions/<timestamp>"
+ * (timestamp -1 if the name is not one), else VERSIONS_NONE.  file and
+ * timestamp may be NULL.
+ */
+int versions_path(const char *fpath, char *file, int *timestamp)
+{
+	const char *p = fpath, *name;
+	size_t len = strlen(VERSIONS_SUFFIX);
+	char *end;
+	long ts;
+
+	while((p = strstr(p, VERSIONS_SUFFIX)) != NULL && p[len] != '\0' && p[len] != '/')
+		p += len;
+	if(p == NULL || p == fpath || p[-1] == '/')
+		return VERSIONS_NONE;
+	if(file != NULL)
+		snprintf(file, PATH_MAX, "%.*s", (int)(p - fpath), fpath);
+	if(p[len] == '\0' || p[len + 1] == '\0')
+		return VERSIONS_DIR;
+
+	name = p + len + 1;
+	ts = strtol(name, &end, 10);
+	if(timestamp != NULL)
+		*timestamp = (*end != '\0' || end == name || ts < 0) ? -1 : (int)ts;
+	return VERSIONS_ENTRY;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Timestamps of the versions of file, oldest first, in a malloc'd
+ * array.  Returns how many, or -1 if the file has no versions.
+ */
+int versions_list(const char *file, int **timestamps)
+{
+	file_data data;
+	TreeMap *t;
+	int i, n = 0, count;
+
+	meta_paths(file, &data);
+	t = tree_open(data.tree_file_path, 0);
+	if(t == NULL)
+		return -1;
+	count = tree_count(t);
+	*timestamps = (int *)malloc((count + 1)*sizeof(int));
+	for(i = 0; i < count; i++)
+		if(t->rec[i].valid)
+			(*timestamps)[n++] = t->rec[i].timestamp;
+	tree_close(t);
+
+	qsort(*timestamps, n, sizeof(int), cmp_int);
+	for(i = 1, count = n ? 1 : 0; i < n; i++)
+		if((*timestamps)[i] != (*timestamps)[count - 1])
+			(*timestamps)[count++] = (*timestamps)[i];
+	return count;
+}
+
+/* Finds the latest version made at timestamp, and a loose object it
+ * can be rebuilt from: itself, or the first one appended after it
+ * with it among its ancestors.  Children are appended after their
+ * parent, so that walk only moves backwards.
+ * Returns the record of the version or NULL
+ */
+static TreeMd *find_version(TreeMap *t, int timestamp, int *from_off, int *to_off)
+{
+	int i, j, k = -1, n = tree_count(t);
+	TreeMd *rec;
+
+	for(i = n - 1; i >= 0 && k < 0; i--)
+		if(t->rec[i].valid && t->rec[i].timestamp == timestamp)
+			k = i;
+	if(k < 0)
+		return NULL;
+	*to_off = TREE_OFFSET(k);
+	*from_off = *to_off;
+	if(t->rec[k].file_type == LO)
+		return &t->rec[k];
+
+	for(i = k + 1; i < n; i++)
+	{
+		if(!t->rec[i].valid || t->rec[i].file_type != LO)
+			continue;
+		for(rec = &t->rec[i]; rec != NULL && rec->parent >= *to_off; rec = tree_at(t, rec->parent))
+		{
+			j = (rec->parent - TREE_FIRST_OFFSET) / (int)sizeof(TreeMd);
+			if(j == k)
+			{
+				*from_off = TREE_OFFSET(i);
+				return &t->rec[k];
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Rebuilds the version of file made at timestamp into memory, and
+ * puts it in the version cache
+ * Returns the malloc'd version, its size in *size, or NULL
+ */
+char *versions_read(const char *file, int timestamp, size_t *size)
+{
+	int from_off, to_off;
+	file_data data;
+	PathLock *vlock;
+	TreeMap *t;
+	TreeMd *rec;
+	char *ret = NULL;
+
+	meta_paths(file, &data);
+	vlock = dir_lock(file);
+	t = tree_open(data.tree_file_path, 0);
+	if(t != NULL && (rec = find_version(t, timestamp, &from_off, &to_off)) != NULL)
+	{
+		ret = build_version_mem(t, &data, from_off, to_off, size);
+		if(ret != NULL)
+			vcache_put(rec->obj_hash, ret, *size);
+	}
+	tree_close(t);
+	path_unlock(vlock);
+	return ret;
+}
+
+/* Size of the version of file made at timestamp, from the version
+ * cache if it is there
+ * Returns 0 for success or -ENOENT
+ */
+static int version_size(const char *file, int timestamp, size_t *size)
+{
+	int from_off, to_off, found = 0;
+	file_data data;
+	PathLock *vlock;
+	TreeMap *t;
+	TreeMd *rec;
+	char *buf;
+
+	meta_paths(file, &data);
+	vlock = dir_lock(file);
+	t = tree_open(data.tree_file_path, 0);
+	if(t != NULL && (rec = find_version(t, timestamp, &from_off, &to_off)) != NULL)
+		found = vcache_size(rec->obj_hash, size) ? 2 : 1;
+	tree_close(t);
+	path_unlock(vlock);
+	// versions_read() takes the lock again
+	if(found != 1)
+		return found ? 0 : -ENOENT;
+
+	buf = versions_read(file, timestamp, size);
+	if(buf == NULL)
+		return -ENOENT;
+	free(buf);
+	return 0;
+}
+
+/* Attributes of a path in the versions of a file, that of the file
+ * made read only.  An entry has the size of its version and the time
+ * it was made.
+ * Returns 0 for success or -errno
+ */
+int versions_stat(const char *fpath, struct stat *st)
+{
+	char file[PATH_MAX];
+	int timestamp = -1, ret;
+	size_t size;
+
+	ret = versions_path(fpath, file, &timestamp);
+	if(lstat(file, st) != 0)
+		return -ENOENT;
+	if(ret == VERSIONS_DIR)
+	{
+		st->st_mode = S_IFDIR | (st->st_mode & 0444) | ((st->st_mode & 0444) >> 2);
+		st->st_nlink = 2;
+		st->st_size = 0;
+		return 0;
+	}
+
+	if(timestamp < 0 || (ret = version_size(file, timestamp, &size)) != 0)
+		return -ENOENT;
+	st->st_mode = S_IFREG | (st->st_mode & 0444);
+	st->st_nlink = 1;
+	st->st_size = size;
+	st->st_blocks = (size + 511) / 512;
+	st->st_mtime = st->st_ctime = timestamp;
+	return 0;
+}
@@ -32,8 +32,27 @@
 VerInfo ver_info;
 int last_epoch = 0;
 
-// flag that takes value 0 when a file has not yet been written and 1 when the file has just been written
-int is_written = 0;
+struct vfs_state *vfs_global;
+
+// the magic path commands share the exchange files in /tmp/rvfs
+static pthread_mutex_t command_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A magic path command holds the command lock and the versioning lock
+ * of the file's directory, so that no commit rewrites its .ver meanwhile
+ */
+static PathLock *command_begin(const char *fpath)
+{
+    pthread_mutex_lock(&command_lock);
+    return dir_lock(fpath);
+}
+
+static void command_end(PathLock *l)
+{
+    if (l == NULL)
+	return;
+    path_unlock(l);
+    pthread_mutex_unlock(&command_lock);
+}
 
 // Report errors to logfile and give -errno to caller
 static int vfs_error(char *str)
@@ -62,6 +81,18 @@ static void vfs_fullpath(char fpath[PATH_MAX], const char *path)
 	    BB_DATA->rootdir, path, fpath);
 }
 
+// "<file>@versions" and what is in it are read only, see versions_dir.c
+static int in_versions(const char *path)
+{
+    return versions_path(path, NULL, NULL) != VERSIONS_NONE;
+}
+
+// read only paths that are not files of rootdir, see also control.c
+static int is_virtual(const char *path)
+{
+    return in_versions(path) || control_path(path) != CONTROL_NONE;
+}
+
 ///////////////////////////////////////////////////////////
  //Edit 
  char *get_actual_path(char* filepath)
@@ -93,25 +124,18 @@ static void vfs_fullpath(char fpath[PATH_MAX], const char *path)
 }
 /*Creates the file from the PO and nearest LO */
 
-int create_file_fromlo(char * file_tree_path, int d_off, int lo_off, char * obj_dir_path)         // returns 1 for success and 0 for no success
+int create_file_fromlo(file_data * file, int d_off, int lo_off)         // returns 1 for success and 0 for no success
 {
-	FILE * fp = fopen(file_tree_path, "r");
-	fseek(fp, lo_off, SEEK_SET);
-	int valid, off = lo_off;
-	fscanf(fp, "%d", &valid);
+	TreeMap * t = tree_open(file->tree_file_path, 0);
+	TreeMd * rec = tree_at(t, lo_off);
 	log_msg("[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[");
-	if(valid==0)
+	if(rec==NULL || rec->valid==0)
 	{
 		log_msg("ERROR1: NOT POSSIBLE.\n");
+		tree_close(t);
 		return 0;
 	}
 	
-	int tp, lp, diff_ct, p_off;
-	char * hash = (char *)malloc(50*sizeof(char));
-	char * tag = (char *)malloc(255*sizeof(char));
-	
-	fscanf(fp, "%d %d %s %s %d %d", &tp, &lp, hash, tag, &diff_ct, &p_off);
-	
 	char * temp_file = (char *)malloc(PATH_MAX*sizeof(char));
 	mkdir("/tmp/rvfs", (mode_t)0755);
 	FILE *ftemp;
@@ -121,45 +145,13 @@ int create_file_fromlo(char * file_tree_path, int d_off, int lo_off, char * obj_
 		strcpy(temp_file, "/tmp/rvfs/switch2");
 		fclose(ftemp);
 	}
-	//strcpy(temp_file, "/tmp/rvfs/switch");
-	char * curr_file = (char *)malloc(PATH_MAX*sizeof(char));
-	strcpy(curr_file, obj_dir_path);
-	
-	strcat(curr_file, hash);
-	
-	decompress(curr_file);
-	copy(curr_file, temp_file);
-	compress(curr_file);
-	//decompress(temp_file);
-//	delete(temp_file);
-	//move("/tmp/rvfs/*.tmp",temp_file);
-	
-	while(off!=d_off)
+	if(build_version(t, file, lo_off, d_off, temp_file) < 0)
 	{
-		log_msg("%------------------------------------%d",off);
-		off = p_off;
-		fseek(fp, off, SEEK_SET);
-		fscanf(fp, "%d", &valid);
-		if(valid==0)
-		{
-			printf("ERROR2: NOT POSSIBLE.\n");
-			return 0;
-		}
-		
-		fscanf(fp, "%d %d %s %s %d %d", &tp, &lp, hash, tag, &diff_ct, &p_off);
-		int i = strlen(curr_file);
-		while(curr_file[i]!='/')
-			i--;
-		curr_file[i+1] = '\0';
-		strcat(curr_file, hash);
-		decompress(curr_file);
-		if(lp==0)
-			copy(curr_file, temp_file);
-		else
-			patch(temp_file, curr_file);
-		compress(curr_file);
+		log_msg("ERROR2: NOT POSSIBLE.\n");
+		tree_close(t);
+		return 0;
 	}
-	fclose(fp);
+	tree_close(t);
 	log_msg("Exiting create_file_fromlo\n");
 	return 1;
 }
@@ -169,12 +161,11 @@ int create_file_fromlo(char * file_tree_path, int d_off, int lo_off, char * obj_
 int report_file_tag(char *filepath, int timestamp, char *tag)
 {
 	char *file = (char*)malloc(PATH_MAX*sizeof(char));
-	FILE *fp;
-	char *newtag = (char *)malloc(256*sizeof(char));
+	TreeMap *t;
+	TreeMd *rec, tagged;
+	int off;
 	
 	log_msg("assigned \n\n");
-	
-	newtag = addspaces(tag,255);
 
 	int len,len1=0;
 	len = strlen(filepath);
@@ -200,31 +191,23 @@ int report_file_tag(char *filepath, int timestamp, char *tag)
 	strcat(filepath,file);
 	strcat(filepath,".tree");
 	
-	fp = fopen(filepath,"r+");
-	
-	char *str = (char *)malloc(256*sizeof(char));
-	int tp;
-	int tmp;
-	while(fscanf(fp,"%s",str) != EOF)
+	t = tree_open(filepath,0);
+	off = tree_find_timestamp(t,timestamp);
+	rec = tree_at(t,off);
+	if(rec != NULL)
 	{
-		fscanf(fp,"%d",&tp);
-		fscanf(fp,"%d",&tmp);
-		fscanf(fp,"%s",str);
-		if(tp == timestamp)
-		{
-			//Write tag
-			//fseek(45);			// Move the file cursor to the starting char of tag
-			fprintf(fp," %s",newtag);	// Overwrite the tag with the new tag
-			break;
-		}
-		else
-			fscanf(fp,"%s",str);
-		
-		fscanf(fp,"%s",str);		//	 strings in the line
-		fscanf(fp,"%s",str);		//	not useful 
+		//Write tag, journaled like any other change of the tree
+		tagged = *rec;
+		memset(tagged.tag,0,MAX_TAG);
+		strncpy(tagged.tag,tag,MAX_TAG-1);	// Overwrite the tag with the new tag
+		wal_begin();
+		tree_write(filepath,off,&tagged);
+		wal_commit();
 	}
+	else
+		log_msg("report_file_tag: no version at %d\n",timestamp);
 	
-	fclose(fp); 
+	tree_close(t); 
 	
 	return 0;
 }
@@ -366,7 +349,7 @@ int report_file_tag(char *filepath, int timestamp, char *tag)
  	if(mode == 0)
  	{
  		if(fopen(fpath,"r")!=NULL)
-	 		cleanFile(fpath,ratio);
+	 		cleanFile(fpath,ratio,0,NULL);
  	}
  	return ret_file_path;
  }
@@ -419,27 +402,86 @@ char *switchBranch(char *path, int mode)
  	strcpy(ret_file_path,fpath);
  	if(mode == 0)
  	{
- 		char *file_tree_path = (char*)malloc(PATH_MAX*sizeof(char));
- 		char *obj_dir_path = (char*)malloc(PATH_MAX*sizeof(char));
- 		char *ver_dir_path = (char*)malloc(PATH_MAX*sizeof(char));
- 		char *filename = (char*)malloc(PATH_MAX*sizeof(char));
- 		get_file_name_new(ver_dir_path,filename,path_tmp);
- 		strcpy(obj_dir_path,ver_dir_path);
- 		strcat(obj_dir_path,"/objects/");
- 		
- 		strcpy(file_tree_path,ver_dir_path);
- 		strcat(file_tree_path,"/trees/");
- 		strcat(file_tree_path,filename);
- 		strcat(file_tree_path,".tree");
+ 		file_data file;
+ 		meta_paths(fpath,&file);
  		
- 		log_msg("file tree path ::: %s\n",file_tree_path);
- 		log_msg("obj dir path ::: %s\n",obj_dir_path);
- 		int ret = create_file_fromlo(file_tree_path,d_off_val,nearest_lo_off_val,obj_dir_path);
+ 		log_msg("file tree path ::: %s\n",file.tree_file_path);
+ 		log_msg("obj dir path ::: %s\n",file.objects_dir_path);
+ 		int ret = create_file_fromlo(&file,d_off_val,nearest_lo_off_val);
  		log_msg("Return Status : %d \n",ret); 
  	}
  	return ret_file_path;
 }
 
+/* An open version, rebuilt in memory and read from there: an entry of
+ * "<file>@versions", or the version at d_off of "file|d_off|lo_off"
+ * rebuilt from the loose object at lo_off
+ */
+typedef struct _version_handle{
+
+	char *data;
+	size_t size;
+}VersionHandle;
+
+static int open_version(const char *path, struct fuse_file_info *fi)
+{
+	char base[PATH_MAX], fpath[PATH_MAX];
+	const char *bar = strchr(path, '|');
+	int d_off, lo_off, timestamp;
+	VersionHandle *vh;
+	file_data file;
+	PathLock *vlock;
+	TreeMap *t;
+
+	vh = (VersionHandle *)calloc(1, sizeof(VersionHandle));
+	vfs_fullpath(fpath, path);
+	switch(versions_path(fpath, base, &timestamp))
+	{
+	case VERSIONS_DIR:
+		free(vh);
+		return -EISDIR;
+	case VERSIONS_ENTRY:
+		if(timestamp >= 0)
+			vh->data = versions_read(base, timestamp, &vh->size);
+		break;
+	default:
+		if(sscanf(bar, "|%d|%d", &d_off, &lo_off) != 2)
+			break;
+		snprintf(base, PATH_MAX, "%.*s", (int)(bar - path), path);
+		vfs_fullpath(fpath, base);
+		meta_paths(fpath, &file);
+		vlock = dir_lock(fpath);
+		t = tree_open(file.tree_file_path, 0);
+		if(t != NULL)
+			vh->data = build_version_mem(t, &file, lo_off, d_off, &vh->size);
+		tree_close(t);
+		path_unlock(vlock);
+		// its size is not the one getattr gave, of the working file
+		fi->direct_io = 1;
+	}
+	if(vh->data == NULL)
+	{
+		free(vh);
+		return -ENOENT;
+	}
+	fi->fh = (uintptr_t) vh;
+	return 0;
+}
+
+/* Tells whether the handle of an open path is a VersionHandle */
+static int is_version_open(const char *path, struct fuse_file_info *fi)
+{
+	return in_versions(path) || (strstr(path, "|") != NULL && (fi->flags & O_ACCMODE) == O_RDONLY);
+}
+
+static void close_version(struct fuse_file_info *fi)
+{
+	VersionHandle *vh = (VersionHandle *) (uintptr_t) fi->fh;
+
+	free(vh->data);
+	free(vh);
+}
+
 char *getMd(char *path, int mode)
  {
   char *path_tmp = (char*)malloc(PATH_MAX*sizeof(char));
@@ -475,37 +517,100 @@ char *getMd(char *path, int mode)
  	return ret_file_path;
  } 
 
+/* Tells which magic path command path is, or 0 for a plain name: one
+ * that exists, or whose suffix does not parse as the command's (so
+ * "c++" and "a+b.txt" are names, "a.txt+" asks for a.txt's metadata)
+ */
+static int command_path(const char *path, const char *fpath)
+{
+    char base[PATH_MAX];
+    const char *c, *p, *q;
+    struct stat st;
+    int a, b, n = 0, ok;
+    double r;
+
+    for(c = "#%@&^|+"; *c != '\0' && strchr(path, *c) == NULL; c++)
+	;
+    if(*c == '\0' || lstat(fpath, &st) == 0)
+	return 0;
+    // "file%ver%tag" and "file|d_off|lo_off" hold the character twice
+    q = strrchr(path, *c);
+    for(p = q; (*c == '%' || *c == '|') && p > path && (p == q || *p != *c); p--)
+	;
+    if(*p != *c)
+	return 0;
+    switch(*c)
+    {
+    case '#':
+	ok = strcmp(p, "#") == 0 || strcmp(p, "#~") == 0;
+	break;
+    case '%':
+	ok = sscanf(p, "%%%d%n", &a, &n) == 1 && p + n == q;
+	break;
+    case '@':
+    case '&':
+	ok = sscanf(p + 1, "%d%n", &a, &n) == 1 && p[1 + n] == '\0';
+	break;
+    case '^':
+	ok = sscanf(p + 1, "%lf%n", &r, &n) == 1 && p[1 + n] == '\0';
+	break;
+    case '|':
+	ok = sscanf(p, "|%d|%d%n", &a, &b, &n) == 2 && p[n] == '\0';
+	break;
+    default:
+	ok = p[1] == '\0';
+    }
+    if(!ok)
+	return 0;
+    snprintf(base, PATH_MAX, "%s%.*s", BB_DATA->rootdir, (int)(p - path), path);
+    return lstat(base, &st) == 0 ? *c : 0;
+}
+
 int vfs_getattr(const char *path, struct stat *statbuf)
 {
     //if(primary_rootver_exists() != 0)
     	//create_rootver();
     
-    int retstat = 0;
+    int retstat = 0, c;
     char fpath[PATH_MAX];	
+    PathLock *cmd = NULL;
     log_msg("\nvfs_getattr(path=\"%s\", statbuf=0x%08x)\n",
 	  path, statbuf);
+    gc_touch();
     if(strstr(path,".ver")!=NULL)   // Check to make sure ".ver" directories are not found
 		return -1;
     vfs_fullpath(fpath, path);
+    if (in_versions(path))
+	return versions_stat(fpath, statbuf);
+    if (control_path(path))
+	return control_stat(path, statbuf);
     /*if(strstr(path,"@")!=NULL)
     	get_actual_path(fpath);    
     */
-    if(strstr(path,"#")!=NULL)
+    // commands read the version metadata, let queued commits land first
+    c = command_path(path, fpath);
+    if(c != 0)
+    {
+    	commit_flush();
+    	cmd = command_begin(fpath);
+    }
+    if(c == '#')
     	retstat = lstat(list_versions(fpath,NORMAL),statbuf);
-    else if(strstr(path,"%")!=NULL)
+    else if(c == '%')
     	retstat = lstat(set_tags(fpath,NORMAL),statbuf);
-    else if(strstr(path,"@")!=NULL)
+    else if(c == '@')
     	retstat = lstat(checkout_to(fpath,NORMAL),statbuf);
-    else if(strstr(path,"&")!=NULL)
+    else if(c == '&')
     	retstat = lstat(revert_to(fpath,NORMAL),statbuf);
-    else if(strstr(path,"^")!=NULL)
+    else if(c == '^')
 	retstat = lstat(cleanDisc(fpath,NORMAL),statbuf);
-    else if(strstr(path,"|")!=NULL)
+    else if(c == '|')
 	retstat = lstat(switchBranch(path,NORMAL),statbuf);        
-	else if(strstr(path,"+")!=NULL)
+	else if(c == '+')
 	retstat = lstat(getMd(path,NORMAL),statbuf);
     else
     	retstat = lstat(fpath, statbuf);
+    command_end(cmd);
     if (retstat != 0)
 	retstat = vfs_error("vfs_getattr lstat");
     log_stat(statbuf);
@@ -557,6 +662,8 @@ int vfs_mknod(const char *path, mode_t mode, dev_t dev)
     log_msg("\nvfs_mknod(path=\"%s\", mode=0%3o, dev=%lld)\n",
 	  path, mode, dev);
     vfs_fullpath(fpath, path);
+    if (is_virtual(path))
+	return -EROFS;
     
     // On Linux this could just be 'mknod(path, mode, rdev)' but this
     //  is more portable
@@ -603,7 +710,7 @@ int vfs_mknod(const char *path, mode_t mode, dev_t dev)
 	
 	}*/
 
-/** Create a .ver directory and inside it create objects,trees,heads directory and also a file called OBJ_MD for every directory made */
+/** Create a .ver directory and inside it create trees,heads directory for every directory made, and the store directory and STORE_MD of the store in the root one */
 
 void vfs_mkverdir(const char *path, mode_t mode)
 {
@@ -621,7 +728,7 @@ void vfs_mkverdir(const char *path, mode_t mode)
 	vfs_fullpath(verpath_md_data, path);
 
 	strcat(verpath,"/.ver");
-    	strcat(verpath_object,"/.ver/objects");
+    	strcat(verpath_object,"/.ver/" STORE_FOLDER);
 	strcat(verpath_tree,"/.ver/trees");
 	strcat(verpath_head,"/.ver/heads");
 	strcat(verpath_md_data, "/.ver/md_data");
@@ -633,10 +740,14 @@ void vfs_mkverdir(const char *path, mode_t mode)
 		retstat = vfs_error("vfs_mkverdir verdir");
 	}
         
-	retstat = mkdir(verpath_object, mode);
-    	if(retstat < 0)
+	// objects are stored once for the mount, in the root .ver (store.c)
+	if(path[0] == '\0')
 	{
-		retstat = vfs_error("vfs_mkverdir verdir");
+		retstat = mkdir(verpath_object, mode);
+		if(retstat < 0 && errno != EEXIST)
+		{
+			retstat = vfs_error("vfs_mkverdir verdir");
+		}
 	}
 
 	retstat = mkdir(verpath_tree, mode);
@@ -657,11 +768,16 @@ void vfs_mkverdir(const char *path, mode_t mode)
 		retstat = vfs_error("vfs_mkverdir verdir");
 	}
     	
-    	strcat(verpath,"/OBJ_MD");
-    	FILE *f= fopen(verpath,"w");
-    	if(f==NULL)
-		log_msg("\nError opening file \n ");   
-		fclose(f);
+    	strcat(verpath,"/" STORE_MD);
+    	// the reference counts of the store live as long as it does
+    	if(path[0] == '\0')
+    	{
+    		FILE *f= fopen(verpath,"a");
+    		if(f==NULL)
+			log_msg("\nError opening file \n ");   
+		else
+			fclose(f);
+    	}
     	log_msg("\nvfs_mkdir(path=\"%s\", mode=0%3o)\n",verpath,mode);
 }
 
@@ -676,11 +792,14 @@ int vfs_mkdir(const char *path, mode_t mode)
     log_msg("\nvfs_mkdir(path=\"%s\", mode=0%3o)\n",
 	    path, mode);
     vfs_fullpath(fpath, path);
+    if (is_virtual(path))
+	return -EROFS;
     
     retstat = mkdir(fpath, mode);
     if (retstat < 0)
 	retstat = vfs_error("vfs_mkdir mkdir");
 	
+    if (!BB_DATA->passthrough)
 	vfs_mkverdir(path,mode);
     
     return retstat;
@@ -756,25 +875,26 @@ void remove_versions(const char *fpath)
 	file_objects_path = (char*)malloc(PATH_MAX*sizeof(char));
 	file_objmd_path = (char*)malloc(PATH_MAX*sizeof(char));
 	file_md_data_path = (char*)malloc(PATH_MAX*sizeof(char));
-	char filename[PATH_MAX]; 
-	get_file_name(fpath,filename);
+	char filename[PATH_MAX], ver_path[PATH_MAX]; 
+	// get_file_name() turns the path into that of the .ver of its directory
+	strcpy(ver_path,fpath);
+	get_file_name(ver_path,filename);
 	
-	log_msg("fpath = %s\n fname = %s",fpath,filename);
+	log_msg("fpath = %s\n fname = %s",ver_path,filename);
 	
-	strcpy(file_heads_path,fpath);	
-	strcpy(file_trees_path,fpath);	
-	strcpy(file_objects_path,fpath);	
-	strcpy(file_objmd_path,fpath);
-	strcpy(file_md_data_path,fpath);
+	strcpy(file_heads_path,ver_path);	
+	strcpy(file_trees_path,ver_path);	
+	strcpy(file_objects_path,ver_path);	
+	strcpy(file_objmd_path,ver_path);
+	strcpy(file_md_data_path,ver_path);
 	
 	strcat(file_heads_path,"/heads/");
 	strcat(file_trees_path,"/trees/");
 	strcat(file_objects_path,"/objects/");
 	strcat(file_objmd_path,"/OBJ_MD");
 	strcat(file_md_data_path,"/md_data/");
-	FILE *f;
 	/*
-	f = fopen(file_objmd_path,"r");	
+	FILE *f = fopen(file_objmd_path,"r");	
 	GHashTable *gHashTable = g_hash_table_new(g_str_hash,g_str_equal);
 	char *file_hash=(char*)malloc(41*sizeof(char));
 	int ref_count;
@@ -790,32 +910,20 @@ void remove_versions(const char *fpath)
 	strcat(file_trees_path,".tree");
 	strcat(file_md_data_path,filename);
 	strcat(file_md_data_path,".md");
-	char *str = (char*)malloc(PATH_MAX*sizeof(char));
-	
-	char *file_obj_path = (char*)malloc(PATH_MAX*sizeof(char));
-	f = fopen(file_trees_path,"r");
-	while(fscanf(f,"%s",str) != EOF)
+	file_data file;
+	meta_paths(fpath,&file);
+	TreeMap *t = tree_open(file_trees_path,0);
+	TreeMd *child;
+	int i;
+	for(i = 0; t != NULL && i < tree_count(t); i++)
 	{
-		fscanf(f,"%s",str);
-		fscanf(f,"%s",str);
-		fscanf(f,"%s",str);
-		strcpy(file_obj_path,file_objects_path);
-		strcat(file_obj_path,"/");
-		strcat(file_obj_path,str);
-		unlink(file_obj_path);
-		/*
-		ref_count = *((int*)g_hash_table_lookup(gHashTable,str));
-		ref_count = ref_count - 1; 
-		if(ref_count == 0)
-			g_hash_table_remove(gHashTable,str);
-		else
-			g_hash_table_replace(gHashTable,str,&ref_count);
-			*/
-		fscanf(f,"%s",str);
-		fscanf(f,"%s",str);
-		fscanf(f,"%s",str);		
+		// objects may be shared with other files, see store.c
+		if(!t->rec[i].valid)
+			continue;
+		child = t->rec[i].file_type == PO ? tree_patch_child(t,TREE_OFFSET(i)) : NULL;
+		store_drop(&file,t->rec[i].obj_hash,child != NULL ? child->obj_hash : NULL);
 	}
-	fclose(f);
+	tree_close(t);
 	unlink(file_heads_path);
 	unlink(file_trees_path);
 	unlink(file_md_data_path);
@@ -833,12 +941,25 @@ int vfs_unlink(const char *path)
     
     log_msg("vfs_unlink(path=\"%s\")\n",
 	    path);
+    PathLock *vlock;
+    
     vfs_fullpath(fpath, path);
+    if (is_virtual(path))
+	return -EROFS;
+    if (BB_DATA->passthrough)
+    {
+	retstat = unlink(fpath);
+	return retstat < 0 ? vfs_error("vfs_unlink unlink") : retstat;
+    }
+    commit_flush();
     
     retstat = unlink(fpath);
     if (retstat < 0)
 	retstat = vfs_error("vfs_unlink unlink");
+    vlock = dir_lock(fpath);
     remove_versions(fpath);
+    meta_forget(fpath);
+    path_unlock(vlock);
     return retstat;
 }
 
@@ -875,11 +996,13 @@ int remove_ver_dir(const char *fpath)
      	return -1;
      }
      
+     // only directories versioned before the store of the mount have
+     // objects of their own
      strcpy(objects_path,ver_dir_path);
      strcat(objects_path,"/objects");
      retstat = 0;
      retstat = rmdir(objects_path);
-     if(retstat<0)
+     if(retstat<0 && errno != ENOENT)
      {
      	log_msg("Error removing objects folder\n");
      	return -1;
@@ -897,9 +1020,10 @@ int remove_ver_dir(const char *fpath)
      
      strcpy(objmd_path,ver_dir_path);
      strcat(objmd_path,"/OBJ_MD");
+     objmd_forget(objmd_path);
      retstat = 0;
      retstat = unlink(objmd_path);
-     if(retstat<0)
+     if(retstat<0 && errno != ENOENT)
      {
      	log_msg("Error removing objmd\n");
      	return -1;
@@ -924,6 +1048,8 @@ int vfs_rmdir(const char *path)
     log_msg("vfs_rmdir(path=\"%s\")\n",
 	    path);
     vfs_fullpath(fpath, path);
+    if (is_virtual(path))
+	return -EROFS;
     
     retstat = rmdir(fpath);
     if (retstat < 0)
@@ -986,6 +1112,8 @@ int vfs_symlink(const char *path, const char *link)
 /* Rename all the versioning data of the file.
  *Takes as params the relative original and new path.
  *Renames oldpath.tree -> newpath.tree and oldpath.head -> newpath.head 
+ *The objects are shared through the store of the mount and not touched,
+ *but for those of a directory versioned before it (see store_migrate()).
  */ 
 
 int vfs_version_rename(const char *path, const char *newpath)
@@ -995,11 +1123,9 @@ int vfs_version_rename(const char *path, const char *newpath)
 	char fpath[PATH_MAX];
 	char fnewpath[PATH_MAX];
 	char treepath[PATH_MAX],headpath[PATH_MAX], newtreepath[PATH_MAX], newheadpath[PATH_MAX], dirpath[PATH_MAX];
-	char objpath[PATH_MAX],newobjpath[PATH_MAX];
-	char obj_md_path[PATH_MAX],newobj_md_path[PATH_MAX];
 	char md_data_path[PATH_MAX],newmd_data_path[PATH_MAX];
-	
-	FILE *fp;
+	char fullpath[PATH_MAX];
+	file_data file;
 	
 	log_msg("Rea---------------------------------------------------\n");
 	
@@ -1017,10 +1143,6 @@ int vfs_version_rename(const char *path, const char *newpath)
 	strcpy(newtreepath,fnewpath);
 	strcpy(headpath,fpath);
 	strcpy(newheadpath,fnewpath);
-	strcpy(objpath,fpath);
-	strcpy(newobjpath,fnewpath);
-	strcpy(obj_md_path,fpath);
-	strcpy(newobj_md_path,fnewpath);
 	strcpy(md_data_path,fpath);
 	strcpy(newmd_data_path,fnewpath);
 	
@@ -1030,10 +1152,6 @@ int vfs_version_rename(const char *path, const char *newpath)
 	strcat(newtreepath,"/trees/");
 	strcat(headpath,"/heads/");
 	strcat(newheadpath,"/heads/");
-	strcat(objpath,"/objects/");
-	strcat(newobjpath,"/objects/");
-	strcat(obj_md_path,"/OBJ_MD");
-	strcat(newobj_md_path,"/OBJ_MD");
 	strcat(md_data_path,"/md_data/");
 	strcat(newmd_data_path,"/md_data/");
 	
@@ -1055,44 +1173,15 @@ int vfs_version_rename(const char *path, const char *newpath)
 	strcat(md_data_path,".md");
 	strcat(newmd_data_path,".md");
 	
-	// Move the objects to the corresponding path
+	// The objects stay where they are, in the store of the mount.  Those
+	// still in the store of the old directory would not be found from
+	// the new one, they go to the store of the mount first.
 	if(strcmp(fpath,fnewpath) != 0)
 	{
-	fp = fopen(treepath, "r");
-	
-	char *str = (char *)malloc(256*sizeof(char));
-	char *hash = (char *)malloc(41*sizeof(char));
-	char hashobjpath[PATH_MAX],newhashobjpath[PATH_MAX];
-	int tp;
-	int tmp;
-	while(fscanf(fp,"%s",str) != EOF)
-	{
-		fscanf(fp,"%d",&tp);
-		fscanf(fp,"%d",&tmp);
-		
-		fscanf(fp,"%s",hash);
-		
-		// Move the corresponding file to the correct folder
-		
-		strcpy(hashobjpath, objpath);
-		strcpy(newhashobjpath, newobjpath);
-		strcat(hashobjpath, hash);
-		strcat(newhashobjpath, hash);
-		
-		rename(hashobjpath,newhashobjpath);
-		
-		fscanf(fp,"%s",str);
-		fscanf(fp,"%s",str);		
-		fscanf(fp,"%s",str);		//	not useful 
-		
-			/*update obj_md_file*/
-			update_objmd_file(hash,obj_md_path,DEL);
-			update_objmd_file(hash,newobj_md_path,INS);		
-		
-		}
-		fclose(fp);
+		vfs_fullpath(fullpath,path);
+		meta_paths(fullpath,&file);
+		store_migrate(&file);
 	}
-	 
 	
 	log_msg("\ntreepath = %s\nnew tree path = %s\nhead path = %s\nnew head path = %s\n",treepath,newtreepath,headpath,newheadpath);
 	
@@ -1113,20 +1202,42 @@ int vfs_rename(const char *path, const char *newpath)
     int retstat1 = 0;
     char fpath[PATH_MAX];
     char fnewpath[PATH_MAX];
+    PathLock *vlock, *vlock_new;
     
     log_msg("\nvfs_rename(fpath=\"%s\", newpath=\"%s\")\n",
         path, newpath);
     vfs_fullpath(fpath, path);
     vfs_fullpath(fnewpath, newpath);
+    if (is_virtual(path) || is_virtual(newpath))
+	return -EROFS;
+    if (BB_DATA->passthrough)
+    {
+	retstat = rename(fpath, fnewpath);
+	return retstat < 0 ? vfs_error("vfs_rename rename") : retstat;
+    }
+    commit_flush();
     
     retstat = rename(fpath, fnewpath);
     if (retstat < 0)
     retstat = vfs_error("vfs_rename rename");
+    // a file renamed while open is versioned on release at its new path;
+    // before the directory locks, which a release takes under its own
+    else
+    file_renamed(fpath, fnewpath);
     
+    dir_lock_pair(fpath, fnewpath, &vlock, &vlock_new);
     retstat1 = vfs_version_rename(path,newpath);
+    meta_forget(fpath);
+    meta_forget(fnewpath);
+    path_unlock(vlock_new);
+    path_unlock(vlock);
     
     if(retstat1 < 0)
+    {
     log_msg("\nRenaming a dir, not a file. Hence ../.ver/filename will not exist\n");
+    // the OBJ_MD paths below it changed
+    objmd_forget(NULL);
+    }
     
     return retstat;
 }
@@ -1142,6 +1253,8 @@ int vfs_link(const char *path, const char *newpath)
 	    path, newpath);
     vfs_fullpath(fpath, path);
     vfs_fullpath(fnewpath, newpath);
+    if (is_virtual(path) || is_virtual(newpath))
+	return -EROFS;
     
     retstat = link(fpath, fnewpath);
     if (retstat < 0)
@@ -1159,6 +1272,8 @@ int vfs_chmod(const char *path, mode_t mode)
     log_msg("\nvfs_chmod(fpath=\"%s\", mode=0%03o)\n",
 	    path, mode);
     vfs_fullpath(fpath, path);
+    if (is_virtual(path))
+	return -EROFS;
     
     retstat = chmod(fpath, mode);
     if (retstat < 0)
@@ -1177,6 +1292,8 @@ int vfs_chown(const char *path, uid_t uid, gid_t gid)
     log_msg("\nvfs_chown(path=\"%s\", uid=%d, gid=%d)\n",
 	    path, uid, gid);
     vfs_fullpath(fpath, path);
+    if (is_virtual(path))
+	return -EROFS;
     
     retstat = chown(fpath, uid, gid);
     if (retstat < 0)
@@ -1194,10 +1311,16 @@ int vfs_truncate(const char *path, off_t newsize)
     log_msg("\nvfs_truncate(path=\"%s\", newsize=%lld)\n",
 	    path, newsize);
     vfs_fullpath(fpath, path);
+    if (control_path(path) == CONTROL_CTL)
+	return 0;
+    if (is_virtual(path))
+	return -EROFS;
     
     retstat = truncate(fpath, newsize);
     if (retstat < 0)
 	vfs_error("vfs_truncate truncate");
+    else if (!BB_DATA->passthrough)
+	file_truncated(fpath, newsize);
     
     return retstat;
 }
@@ -1212,8 +1335,14 @@ int vfs_utime(const char *path, struct utimbuf *ubuf)
     log_msg("\nvfs_utime(path=\"%s\", ubuf=0x%08x)\n",
 	    path, ubuf);
     vfs_fullpath(fpath, path);
+    if (is_virtual(path))
+	return -EROFS;
     if(strstr(path,"%")!=NULL || strstr(path,"@")!=NULL || strstr(path,"&")!=NULL || strstr(path,"^")!=NULL || strstr(path,"|")!=NULL || strstr(path,"+")!=NULL)
+    {
+    	PathLock *cmd = command_begin(fpath);
     	set_tags(fpath,ABNORMAL);
+    	command_end(cmd);
+    }
     retstat = utime(fpath, ubuf);
     if (retstat < 0)
 	retstat = vfs_error("vfs_utime utime");
@@ -1239,7 +1368,29 @@ int vfs_open(const char *path, struct fuse_file_info *fi)
     
     log_msg("\nvfs_open(path\"%s\", fi=0x%08x)\n",
 	    path, fi);
+    gc_touch();
     vfs_fullpath(fpath, path);
+    if (in_versions(path) && (fi->flags & O_ACCMODE) != O_RDONLY)
+	return -EROFS;
+    if (is_version_open(path, fi))
+	return open_version(path, fi);
+    if (control_path(path) == CONTROL_DIR)
+	return -EISDIR;
+    if (control_path(path) == CONTROL_STATS)
+    {
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+	    return -EACCES;
+	fi->fh = (uintptr_t) control_open_stats();
+	fi->direct_io = 1;
+	return fi->fh ? 0 : -ENOMEM;
+    }
+    if (control_path(path) == CONTROL_CTL)
+    {
+	// replies are made as commands run, the size cannot be known
+	fi->fh = (uintptr_t) control_open();
+	fi->direct_io = 1;
+	return fi->fh ? 0 : -ENOMEM;
+    }
     if(strstr(path,"%")!=NULL || strstr(path,"@")!=NULL || strstr(path,"&")!=NULL || strstr(path,"^")!=NULL || strstr(path,"|")!=NULL || strstr(path,"+")!=NULL)
     {
     	//set_tags(fpath,ABNORMAL);
@@ -1247,7 +1398,9 @@ int vfs_open(const char *path, struct fuse_file_info *fi)
     }
     if(strstr(path,"#")!=NULL)
     {
+    	PathLock *cmd = command_begin(fpath);
     	list_versions(fpath,ABNORMAL);
+    	command_end(cmd);
     }
     
     fd = open(fpath, fi->flags);
@@ -1285,6 +1438,7 @@ int vfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
     
     log_msg("\nvfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 	    path, buf, size, offset, fi);
+    gc_touch();
     if(strstr(path,"#~"))
     	gui = 1;
     else if(strstr(path,"#"))
@@ -1293,6 +1447,10 @@ int vfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
     /*Check whether the call is from lsver/__guidata or a normal call*/
     if(strstr(path,"#"))
     {
+    	char fpath[PATH_MAX];
+    	PathLock *cmd;
+    	vfs_fullpath(fpath, path);
+    	cmd = command_begin(fpath);
     	log_msg("Reached to list versions command line\n");
     	/* Open the associated tree file */
 
@@ -1336,7 +1494,7 @@ int vfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
 		strcpy(temp,"/tmp/rvfs/");
 		strcat(temp,filename);
 		strcat(temp,".tree");
-		copy(fpath_tree, temp);
+		tree_export_text(fpath_tree, temp);
 	}
 	/*or from command line*/
 	else
@@ -1344,6 +1502,7 @@ int vfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
 		print_all_versions(fpath_head,fpath_tree);
 		/*TODO present the tree file nicely*/
 	}		
+	command_end(cmd);
 	
     	return 0;
     }
@@ -1351,6 +1510,19 @@ int vfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
     // no need to get fpath on this one, since I work from fi->fh not the path
     log_fi(fi);
     
+    if (control_path(path))
+	return control_read((void *) (uintptr_t) fi->fh, buf, size, offset);
+    if (is_version_open(path, fi))
+    {
+	VersionHandle *vh = (VersionHandle *) (uintptr_t) fi->fh;
+	if ((size_t) offset >= vh->size)
+	    return 0;
+	if (size > vh->size - offset)
+	    size = vh->size - offset;
+	memcpy(buf, vh->data + offset, size);
+	return size;
+    }
+    
     retstat = pread(fi->fh, buf, size, offset);
     if (retstat < 0)
 	retstat = vfs_error("vfs_read read");
@@ -1358,6 +1530,58 @@ int vfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
     return retstat;
 }
 
+/** Read data from an open file into a buffer of FUSE's choosing
+ *
+ * A file is not read here at all: the returned buffer names its file
+ * descriptor and FUSE splices the range to the kernel when it can.
+ * A version opened through "<file>@versions/<timestamp>" or
+ * "file|d_off|lo_off", and the control file, are copied into a buffer
+ * FUSE frees once it has sent it.
+ *
+ * Introduced in version 2.9
+ */
+int vfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *src;
+    int res;
+    
+    log_msg("\nvfs_read_buf(path=\"%s\", size=%d, offset=%lld, fi=0x%08x)\n",
+	    path, size, offset, fi);
+    gc_touch();
+    src = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+    if (src == NULL)
+	return -ENOMEM;
+    *src = FUSE_BUFVEC_INIT(size);
+    
+    if(strstr(path,"#"))
+    {
+	// the listing commands only have side effects
+	src->buf[0].size = 0;
+	*bufp = src;
+	return vfs_read(path, NULL, 0, offset, fi);
+    }
+    if (is_version_open(path, fi) || control_path(path))
+    {
+	src->buf[0].mem = malloc(size);
+	res = src->buf[0].mem == NULL ? -ENOMEM : vfs_read(path, (char *) src->buf[0].mem, size, offset, fi);
+	if (res < 0)
+	{
+	    free(src->buf[0].mem);
+	    free(src);
+	    return res;
+	}
+	src->buf[0].size = res;
+	*bufp = src;
+	return 0;
+    }
+    
+    src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    src->buf[0].fd = fi->fh;
+    src->buf[0].pos = offset;
+    *bufp = src;
+    return 0;
+}
+
 
 
 /** Write data to an open file
@@ -1374,23 +1598,108 @@ int vfs_write(const char *path, const char *buf, size_t size, off_t offset,
 	     struct fuse_file_info *fi)
 {
     int retstat = 0;
-    is_written = 1;
+    char fpath[PATH_MAX];
+    PathLock *l;
     
     log_msg("\nvfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 	    path, buf, size, offset, fi
 	    );
-    // no need to get fpath on this one, since I work from fi->fh not the path
+    gc_touch();
     log_fi(fi);
+    if (control_path(path))
+	return control_write((void *) (uintptr_t) fi->fh, buf, size);
+    // nothing is tracked for versions in a passthrough mount
+    if (BB_DATA->passthrough)
+    {
+	retstat = pwrite(fi->fh, buf, size, offset);
+	return retstat < 0 ? vfs_error("vfs_write pwrite") : retstat;
+    }
+    vfs_fullpath(fpath, path);
 	
+    // the lock of the file keeps its running hash in write order
+    l = path_lock(fpath);
     retstat = pwrite(fi->fh, buf, size, offset);
     if (retstat < 0)
 	retstat = vfs_error("vfs_write pwrite");
-    log_msg("Goiing..........................\n");
-    add_write_info(ver_info, path,size,offset);
+    else
+	file_wrote(l, buf, retstat, offset);
+    path_unlock(l);
     return retstat;
 }
 
 
+/** Write data to an open file from a buffer of FUSE's choosing
+ *
+ * The data may still be in the pipe it was spliced into.  It is
+ * spliced on to the file unless the running hash or the sniffer of
+ * file_lock.c need to see the bytes, in which case it is copied into
+ * memory first, as FUSE would do without this operation.
+ *
+ * Introduced in version 2.9
+ */
+int vfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(buf);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+    const char *data = NULL;
+    char fpath[PATH_MAX];
+    char *copy = NULL;
+    PathLock *l;
+    ssize_t res;
+    
+    log_msg("\nvfs_write_buf(path=\"%s\", size=%d, offset=%lld, fi=0x%08x)\n",
+	    path, size, offset, fi);
+    gc_touch();
+    if (control_path(path))
+    {
+	copy = (char *) malloc(size);
+	mem.buf[0].mem = copy;
+	res = copy == NULL ? -ENOMEM : fuse_buf_copy(&mem, buf, 0);
+	if (res >= 0)
+	    res = control_write((void *) (uintptr_t) fi->fh, copy, res);
+	free(copy);
+	return res;
+    }
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = fi->fh;
+    dst.buf[0].pos = offset;
+    if (BB_DATA->passthrough)
+	return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+    vfs_fullpath(fpath, path);
+    
+    l = path_lock(fpath);
+    if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+	data = (const char *) buf->buf[0].mem + buf->off;
+    else if (file_needs_data(l, offset))
+    {
+	copy = (char *) malloc(size);
+	mem.buf[0].mem = copy;
+	res = copy == NULL ? -ENOMEM : fuse_buf_copy(&mem, buf, 0);
+	if (res < 0)
+	{
+	    path_unlock(l);
+	    free(copy);
+	    return res;
+	}
+	size = res;
+	data = copy;
+	mem.buf[0].size = size;
+	buf = &mem;
+    }
+    
+    dst.buf[0].size = size;
+    res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+    if (res < 0)
+	log_msg("    ERROR vfs_write_buf: %s\n", strerror(-res));
+    else
+	file_wrote(l, data, res, offset);
+    path_unlock(l);
+    free(copy);
+    return res;
+}
+
+
 /** Get file system statistics
  *
  * The 'f_frsize', 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
@@ -1443,7 +1752,6 @@ int vfs_statfs(const char *path, struct statvfs *statv)
 int vfs_flush(const char *path, struct fuse_file_info *fi)
 {
     int retstat = 0;
-    //is_written = 1;
     log_msg("\nvfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
     // no need to get fpath on this one, since I work from fi->fh not the path
     log_fi(fi);
@@ -1468,8 +1776,18 @@ int vfs_flush(const char *path, struct fuse_file_info *fi)
  */
 int vfs_release(const char *path, struct fuse_file_info *fi)
 {
-    char file_check[500];
     int retstat = 0;
+    gc_touch();
+    if (is_version_open(path, fi))
+    {
+	close_version(fi);
+	return 0;
+    }
+    if (control_path(path))
+    {
+	control_release((void *) (uintptr_t) fi->fh);
+	return 0;
+    }
     if(strstr(path,"%")!=NULL || strstr(path,"@")!=NULL || strstr(path,"&")!=NULL || strstr(path,"#")!=NULL || strstr(path,"^")!=NULL || strstr(path,"|")!=NULL || strstr(path,"+")!=NULL)
     	return 0;
     
@@ -1480,19 +1798,24 @@ int vfs_release(const char *path, struct fuse_file_info *fi)
     // We need to close the file.  Had we allocated any resources
     // (buffers etc) we'd need to free them here as well.
     retstat = close(fi->fh);
+    if (BB_DATA->passthrough)
+	return retstat;
     
     //EDIT
     //Versioning
     char fpath[PATH_MAX];
+    FileChanges changes;
     vfs_fullpath(fpath,path);
 
-    /* An ugly hack to see if you have the text file or a binary */
-    sprintf(file_check, "if [ `file -b -i %s | cut -d \\/ -f 1` = 'text' ]; then exit 1; else exit 0; fi", fpath);
-    if(is_written && system(file_check))
+    // text files are snapshot and versioned by a commit worker, the
+    // snapshot taken before another write can make it differ from changes
+    PathLock *l = path_lock(fpath);
+    if(file_take_written(l, &changes))
     {
-    	version_file(ver_info, fpath);    
-    	is_written = 0;
+    	version_file(ver_info, fpath, &changes);    
     }
+    path_unlock(l);
+    dirty_free(&changes.dirty);
     return retstat;
 }
 
@@ -1510,6 +1833,8 @@ int vfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
     log_msg("\nvfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n",
 	    path, datasync, fi);
     log_fi(fi);
+    if (control_path(path))
+	return 0;
     
     if (datasync)
 	retstat = fdatasync(fi->fh);
@@ -1549,6 +1874,69 @@ int vfs_getxattr(const char *path, const char *name, char *value, size_t size)
 	    path, name, value, size);
     vfs_fullpath(fpath, path);
     
+    if (strcmp(name, CHAIN_LENGTH_XATTR) == 0) {
+	// longest patch chain a checkout of this file may have to apply
+	char num[16];
+	file_data file;
+	int chain;
+	meta_paths(fpath, &file);
+	chain = tree_chain_length(file.tree_file_path);
+	if (chain < 0)
+	    return -ENODATA;
+	retstat = sprintf(num, "%d", chain);
+	if (size == 0)
+	    return retstat;
+	if (size < (size_t)retstat)
+	    return -ERANGE;
+	memcpy(value, num, retstat);
+	return retstat;
+    }
+    if (strcmp(name, FILE_TYPE_XATTR) == 0) {
+	char why[PATH_MAX + 32];
+	struct stat st;
+	if (stat(fpath, &st) != 0)
+	    return -errno;
+	classify_file(fpath, SNIFF_UNKNOWN, NULL, why, sizeof(why));
+	retstat = strlen(why);
+	if (size == 0)
+	    return retstat;
+	if (size < (size_t)retstat)
+	    return -ERANGE;
+	memcpy(value, why, retstat);
+	return retstat;
+    }
+    if (strcmp(name, CACHE_STATS_XATTR) == 0) {
+	char stats[128];
+	retstat = vcache_stats(stats, sizeof(stats));
+	if (size == 0)
+	    return retstat;
+	if (size < (size_t)retstat)
+	    return -ERANGE;
+	memcpy(value, stats, retstat);
+	return retstat;
+    }
+    if (strcmp(name, STORE_STATS_XATTR) == 0) {
+	// of the whole mount, whatever path it is asked on
+	char stats[160];
+	retstat = store_stats(stats, sizeof(stats));
+	if (size == 0)
+	    return retstat;
+	if (size < (size_t)retstat)
+	    return -ERANGE;
+	memcpy(value, stats, retstat);
+	return retstat;
+    }
+    if (strcmp(name, GC_STATS_XATTR) == 0) {
+	char stats[160];
+	retstat = gc_stats(stats, sizeof(stats));
+	if (size == 0)
+	    return retstat;
+	if (size < (size_t)retstat)
+	    return -ERANGE;
+	memcpy(value, stats, retstat);
+	return retstat;
+    }
+    
     retstat = lgetxattr(fpath, name, value, size);
     if (retstat < 0)
 	retstat = vfs_error("vfs_getxattr lgetxattr");
@@ -1615,6 +2003,24 @@ int vfs_opendir(const char *path, struct fuse_file_info *fi)
 	  path, fi);
     vfs_fullpath(fpath, path);
     
+    // the versions of a file are listed from its tree, in readdir
+    if (in_versions(path))
+    {
+	struct stat st;
+	retstat = versions_stat(fpath, &st);
+	if (retstat == 0 && !S_ISDIR(st.st_mode))
+	    retstat = -ENOTDIR;
+	fi->fh = 0;
+	return retstat;
+    }
+    if (control_path(path) == CONTROL_CTL)
+	return -ENOTDIR;
+    if (control_path(path) == CONTROL_DIR)
+    {
+	fi->fh = 0;
+	return 0;
+    }
+    
     dp = opendir(fpath);
     if (dp == NULL)
 	retstat = vfs_error("vfs_opendir opendir");
@@ -1626,6 +2032,33 @@ int vfs_opendir(const char *path, struct fuse_file_info *fi)
     return retstat;
 }
 
+/* Lists "<file>@versions", a name per version */
+static int readdir_versions(const char *path, void *buf, fuse_fill_dir_t filler)
+{
+    char fpath[PATH_MAX], file[PATH_MAX], name[32];
+    int *timestamps, n, i;
+    
+    vfs_fullpath(fpath, path);
+    versions_path(fpath, file, NULL);
+    n = versions_list(file, &timestamps);
+    if (n < 0)
+    {
+	// a file without versions yet
+	n = 0;
+	timestamps = NULL;
+    }
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    for (i = 0; i < n; i++)
+    {
+	snprintf(name, sizeof(name), "%d", timestamps[i]);
+	if (filler(buf, name, NULL, 0) != 0)
+	    break;
+    }
+    free(timestamps);
+    return 0;
+}
+
 /** Read directory
  *
  * This supersedes the old getdir() interface.  New applications
@@ -1656,6 +2089,18 @@ int vfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
     
     log_msg("\nvfs_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n",
 	    path, buf, filler, offset, fi);
+    gc_touch();
+    if (in_versions(path))
+	return readdir_versions(path, buf, filler);
+    if (control_path(path))
+    {
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	filler(buf, "ctl", NULL, 0);
+	filler(buf, "stats", NULL, 0);
+	return 0;
+    }
+    
     // once again, no need for fullpath -- but note that I need to cast fi->fh
     dp = (DIR *) (uintptr_t) fi->fh;
 
@@ -1701,7 +2146,8 @@ int vfs_releasedir(const char *path, struct fuse_file_info *fi)
 	    path, fi);
     log_fi(fi);
     
-    closedir((DIR *) (uintptr_t) fi->fh);
+    if (!is_virtual(path))
+	closedir((DIR *) (uintptr_t) fi->fh);
     
     return retstat;
 }
@@ -1755,9 +2201,21 @@ void init_ver_info()
 // FUSE).
 void *vfs_init(struct fuse_conn_info *conn)
 {    
+    // the messages logged so far wait in the ring for the flusher
+    log_start();
     log_msg("\nvfs_init()\n");
-    vfs_mkverdir("",(mode_t)0755);
     init_ver_info();
+    // a passthrough mount keeps no versions to recover, commit or collect
+    if (!BB_DATA->passthrough)
+    {
+	vfs_mkverdir("",(mode_t)0755);
+	// versions a crash left half made are finished before any new one
+	wal_start();
+	commit_start();
+	gc_start();
+    }
+    // let read_buf and write_buf move file data through pipes
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
     return BB_DATA;
 }
 
@@ -1771,6 +2229,11 @@ void *vfs_init(struct fuse_conn_info *conn)
 void vfs_destroy(void *userdata)
 {
     log_msg("\nvfs_destroy(userdata=0x%08x)\n", userdata);
+    gc_stop();
+    commit_stop();
+    wal_stop();
+    stats_save(BB_DATA->stats_path);
+    log_stop();
 }
 
 /**
@@ -1792,6 +2255,22 @@ int vfs_access(const char *path, int mask)
     log_msg("\nvfs_access(path=\"%s\", mask=0%o)\n",
 	    path, mask);
     vfs_fullpath(fpath, path);
+    if (in_versions(path))
+    {
+	struct stat st;
+	if (mask & W_OK)
+	    return -EROFS;
+	return versions_stat(fpath, &st);
+    }
+    if (control_path(path))
+    {
+	struct stat st;
+	if ((mask & W_OK) && control_path(path) == CONTROL_DIR)
+	    return -EROFS;
+	if ((mask & W_OK) && control_path(path) == CONTROL_STATS)
+	    return -EACCES;
+	return control_stat(path, &st);
+    }
     if(strstr(path,"@")!=NULL)
     	get_actual_path(fpath);
     
@@ -1822,18 +2301,17 @@ int add_file_to_objects(const char* path){
 
 	vfs_fullpath(fpath,path);
 
-	guchar data[1024*1024]; 
-	gsize size = 0; 
-	FILE *input,*f; 
-	gchar *sum; 
+	char sum[HASH_SHA1];
+	FILE *f; 
 	log_msg("REACHED HRE\n");
 	
-	input = fopen( fpath, "rb" ); 
-	size = fread( (void *)data, sizeof( guchar ), 1024*1024, input ); 
-	fclose( input ); 
-
-	sum = g_compute_checksum_for_data( G_CHECKSUM_SHA1, data, size ); 
-	log_msg( "SHA1 Checksum for >> %s <<: %s\n", fpath, sum ); 
+	find_SHA(fpath, sum);
+	if(sum[0] == '\0')
+	{
+		free(file_objects_path);
+		return -1;
+	}
+	log_msg( "Object hash for >> %s <<: %s\n", fpath, sum ); 
 
 
 	get_log_file_name_new(fpath);
@@ -1969,6 +2447,8 @@ int vfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     log_msg("\nvfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n",
 	    path, mode, fi);
     vfs_fullpath(fpath, path);
+    if (is_virtual(path))
+	return -EROFS;
     
     fd = creat(fpath, mode);
     if (fd < 0)
@@ -1998,14 +2478,20 @@ int vfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 int vfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
 {
     int retstat = 0;
+    char fpath[PATH_MAX];
     
     log_msg("\nvfs_ftruncate(path=\"%s\", offset=%lld, fi=0x%08x)\n",
 	    path, offset, fi);
     log_fi(fi);
+    if (control_path(path))
+	return 0;
+    vfs_fullpath(fpath, path);
     
     retstat = ftruncate(fi->fh, offset);
     if (retstat < 0)
 	retstat = vfs_error("vfs_ftruncate ftruncate");
+    else if (!BB_DATA->passthrough)
+	file_truncated(fpath, offset);
     
     return retstat;
 }
@@ -2032,6 +2518,14 @@ int vfs_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *
     log_msg("\nvfs_fgetattr(path=\"%s\", statbuf=0x%08x, fi=0x%08x)\n",
 	    path, statbuf, fi);
     log_fi(fi);
+    if (in_versions(path))
+    {
+	char fpath[PATH_MAX];
+	vfs_fullpath(fpath, path);
+	return versions_stat(fpath, statbuf);
+    }
+    if (control_path(path))
+	return control_stat(path, statbuf);
     
     retstat = fstat(fi->fh, statbuf);
     if (retstat < 0)
@@ -2042,44 +2536,126 @@ int vfs_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *
     return retstat;
 }
 
+// Every operation is timed around the call, into the histograms of
+// stats.c.  bytes is what the call moved, ret holding its result.
+#define TIMED(op, id, params, args, bytes)	\
+static int timed_##op params			\
+{						\
+    long long start = stats_now();		\
+    int ret = vfs_##op args;			\
+    stats_add(id, start, bytes, ret < 0);	\
+    return ret;					\
+}
+
+TIMED(getattr, STAT_GETATTR, (const char *path, struct stat *statbuf),
+      (path, statbuf), 0)
+TIMED(readlink, STAT_READLINK, (const char *path, char *link, size_t size),
+      (path, link, size), 0)
+TIMED(mknod, STAT_MKNOD, (const char *path, mode_t mode, dev_t dev),
+      (path, mode, dev), 0)
+TIMED(mkdir, STAT_MKDIR, (const char *path, mode_t mode),
+      (path, mode), 0)
+TIMED(unlink, STAT_UNLINK, (const char *path),
+      (path), 0)
+TIMED(rmdir, STAT_RMDIR, (const char *path),
+      (path), 0)
+TIMED(symlink, STAT_SYMLINK, (const char *path, const char *link),
+      (path, link), 0)
+TIMED(rename, STAT_RENAME, (const char *path, const char *newpath),
+      (path, newpath), 0)
+TIMED(link, STAT_LINK, (const char *path, const char *newpath),
+      (path, newpath), 0)
+TIMED(chmod, STAT_CHMOD, (const char *path, mode_t mode),
+      (path, mode), 0)
+TIMED(chown, STAT_CHOWN, (const char *path, uid_t uid, gid_t gid),
+      (path, uid, gid), 0)
+TIMED(truncate, STAT_TRUNCATE, (const char *path, off_t newsize),
+      (path, newsize), 0)
+TIMED(utime, STAT_UTIME, (const char *path, struct utimbuf *ubuf),
+      (path, ubuf), 0)
+TIMED(open, STAT_OPEN, (const char *path, struct fuse_file_info *fi),
+      (path, fi), 0)
+TIMED(read, STAT_READ, (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+      (path, buf, size, offset, fi), ret)
+TIMED(write, STAT_WRITE, (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+      (path, buf, size, offset, fi), ret)
+TIMED(read_buf, STAT_READ_BUF, (const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi),
+      (path, bufp, size, offset, fi), ret < 0 ? 0 : (long long) fuse_buf_size(*bufp))
+TIMED(write_buf, STAT_WRITE_BUF, (const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi),
+      (path, buf, offset, fi), ret)
+TIMED(statfs, STAT_STATFS, (const char *path, struct statvfs *statv),
+      (path, statv), 0)
+TIMED(flush, STAT_FLUSH, (const char *path, struct fuse_file_info *fi),
+      (path, fi), 0)
+TIMED(release, STAT_RELEASE, (const char *path, struct fuse_file_info *fi),
+      (path, fi), 0)
+TIMED(fsync, STAT_FSYNC, (const char *path, int datasync, struct fuse_file_info *fi),
+      (path, datasync, fi), 0)
+TIMED(setxattr, STAT_SETXATTR, (const char *path, const char *name, const char *value, size_t size, int flags),
+      (path, name, value, size, flags), 0)
+TIMED(getxattr, STAT_GETXATTR, (const char *path, const char *name, char *value, size_t size),
+      (path, name, value, size), 0)
+TIMED(listxattr, STAT_LISTXATTR, (const char *path, char *list, size_t size),
+      (path, list, size), 0)
+TIMED(removexattr, STAT_REMOVEXATTR, (const char *path, const char *name),
+      (path, name), 0)
+TIMED(opendir, STAT_OPENDIR, (const char *path, struct fuse_file_info *fi),
+      (path, fi), 0)
+TIMED(readdir, STAT_READDIR, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi),
+      (path, buf, filler, offset, fi), 0)
+TIMED(releasedir, STAT_RELEASEDIR, (const char *path, struct fuse_file_info *fi),
+      (path, fi), 0)
+TIMED(fsyncdir, STAT_FSYNCDIR, (const char *path, int datasync, struct fuse_file_info *fi),
+      (path, datasync, fi), 0)
+TIMED(access, STAT_ACCESS, (const char *path, int mask),
+      (path, mask), 0)
+TIMED(create, STAT_CREATE, (const char *path, mode_t mode, struct fuse_file_info *fi),
+      (path, mode, fi), 0)
+TIMED(ftruncate, STAT_FTRUNCATE, (const char *path, off_t offset, struct fuse_file_info *fi),
+      (path, offset, fi), 0)
+TIMED(fgetattr, STAT_FGETATTR, (const char *path, struct stat *statbuf, struct fuse_file_info *fi),
+      (path, statbuf, fi), 0)
+
 struct fuse_operations vfs_oper = {
-  .getattr = vfs_getattr,
-  .readlink = vfs_readlink,
+  .getattr = timed_getattr,
+  .readlink = timed_readlink,
   // no .getdir -- that's deprecated
   .getdir = NULL,
-  .mknod = vfs_mknod,
-  .mkdir = vfs_mkdir,
-  .unlink = vfs_unlink,
-  .rmdir = vfs_rmdir,
-  .symlink = vfs_symlink,
-  .rename = vfs_rename,
-  .link = vfs_link,
-  .chmod = vfs_chmod,
-  .chown = vfs_chown,
-  .truncate = vfs_truncate,
-  .utime = vfs_utime,
-  .open = vfs_open,
-  .read = vfs_read,
-  .write = vfs_write,
+  .mknod = timed_mknod,
+  .mkdir = timed_mkdir,
+  .unlink = timed_unlink,
+  .rmdir = timed_rmdir,
+  .symlink = timed_symlink,
+  .rename = timed_rename,
+  .link = timed_link,
+  .chmod = timed_chmod,
+  .chown = timed_chown,
+  .truncate = timed_truncate,
+  .utime = timed_utime,
+  .open = timed_open,
+  .read = timed_read,
+  .write = timed_write,
+  .read_buf = timed_read_buf,
+  .write_buf = timed_write_buf,
   /** Just a placeholder, don't set */ // huh???
-  .statfs = vfs_statfs,
-  .flush = vfs_flush,
-  .release = vfs_release,
-  .fsync = vfs_fsync,
-  .setxattr = vfs_setxattr,
-  .getxattr = vfs_getxattr,
-  .listxattr = vfs_listxattr,
-  .removexattr = vfs_removexattr,
-  .opendir = vfs_opendir,
-  .readdir = vfs_readdir,
-  .releasedir = vfs_releasedir,
-  .fsyncdir = vfs_fsyncdir,
+  .statfs = timed_statfs,
+  .flush = timed_flush,
+  .release = timed_release,
+  .fsync = timed_fsync,
+  .setxattr = timed_setxattr,
+  .getxattr = timed_getxattr,
+  .listxattr = timed_listxattr,
+  .removexattr = timed_removexattr,
+  .opendir = timed_opendir,
+  .readdir = timed_readdir,
+  .releasedir = timed_releasedir,
+  .fsyncdir = timed_fsyncdir,
   .init = vfs_init,
   .destroy = vfs_destroy,
-  .access = vfs_access,
-  .create = vfs_create,
-  .ftruncate = vfs_ftruncate,
-  .fgetattr = vfs_fgetattr
+  .access = timed_access,
+  .create = timed_create,
+  .ftruncate = timed_ftruncate,
+  .fgetattr = timed_fgetattr
 };
 
 void vfs_usage()
@@ -2094,6 +2670,7 @@ int main(int argc, char *argv[])
     int i;
     int fuse_stat;
     struct vfs_state *vfs_data;
+    char *cwd;
 
     // vfsfs doesn't do any access checking on its own (the comment
     // blocks in fuse.h mention some of the functions that need
@@ -2114,8 +2691,13 @@ int main(int argc, char *argv[])
 	perror("main calloc");
 	abort();
     }
+    vfs_global = vfs_data;
     
     vfs_data->logfile = log_open();
+    // next to vfs.log, in the directory vfs was started from
+    cwd = g_get_current_dir();
+    vfs_data->stats_path = g_build_filename(cwd, "vfs.stats", NULL);
+    g_free(cwd);
     
     // libfuse is able to do most of the command line parsing; all I
     // need to do is to extract the rootdir; this will be the first
@@ -2130,6 +2712,33 @@ int main(int argc, char *argv[])
     if ((argc - i) != 2) vfs_usage();
     
     vfs_data->rootdir = realpath(argv[i], NULL);
+    
+    vfs_data->keyframe_interval = KEYFRAME_INTERVAL;
+    vfs_data->keyframe_bytes = KEYFRAME_BYTES;
+    if (getenv("RVFS_KEYFRAME_INTERVAL") != NULL)
+	vfs_data->keyframe_interval = atoi(getenv("RVFS_KEYFRAME_INTERVAL"));
+    if (getenv("RVFS_KEYFRAME_BYTES") != NULL)
+	vfs_data->keyframe_bytes = atol(getenv("RVFS_KEYFRAME_BYTES"));
+    vfs_data->chunk_file_bytes = CHUNK_FILE_BYTES;
+    if (getenv("RVFS_CHUNK_FILE_BYTES") != NULL)
+	vfs_data->chunk_file_bytes = atol(getenv("RVFS_CHUNK_FILE_BYTES"));
+    vfs_data->gc_file_ratio = GC_FILE_RATIO;
+    vfs_data->gc_dir_bytes = GC_DIR_BYTES;
+    vfs_data->gc_rate_bytes = GC_RATE_BYTES;
+    if (getenv("RVFS_GC_FILE_RATIO") != NULL)
+	vfs_data->gc_file_ratio = atof(getenv("RVFS_GC_FILE_RATIO"));
+    if (getenv("RVFS_GC_DIR_BYTES") != NULL)
+	vfs_data->gc_dir_bytes = atol(getenv("RVFS_GC_DIR_BYTES"));
+    if (getenv("RVFS_GC_RATE_BYTES") != NULL)
+	vfs_data->gc_rate_bytes = atol(getenv("RVFS_GC_RATE_BYTES"));
+    // an unknown hash is refused rather than swapped for another
+    if (getenv("RVFS_HASH") != NULL && !hash_select(getenv("RVFS_HASH"))) {
+	fprintf(stderr, "RVFS_HASH=%s is not supported, use sha1 or sha256\n", getenv("RVFS_HASH"));
+	return 1;
+    }
+    vfs_data->text_globs = getenv("RVFS_TEXT_GLOBS") ? getenv("RVFS_TEXT_GLOBS") : TEXT_GLOBS;
+    vfs_data->binary_globs = getenv("RVFS_BINARY_GLOBS") ? getenv("RVFS_BINARY_GLOBS") : BINARY_GLOBS;
+    vfs_data->passthrough = getenv("RVFS_PASSTHROUGH") != NULL && atoi(getenv("RVFS_PASSTHROUGH")) != 0;
 
     argv[i] = argv[i+1];
     argc--;
@@ -7,12 +7,15 @@
 
 #include<fuse.h>
 #include<glib.h>
+#include<pthread.h>
 
 #include "log.h"
 #include "fuse_wrapper.h"
+#include "delta.h"
 
 #define MAX_BLOCKS 100
 #define HASH_SHA1 41
+#define OBJ_NAME_MAX (2*HASH_SHA1)	/* "<hash>.<child>", see store.c */
 #define MAX_TAG 255
 #define MAX_BNAME MAX_TAG
 #define LO 0
@@ -25,7 +28,74 @@
 #define TREES_FOLDER "trees/"
 #define HEADS_FOLDER "heads/"
 #define OBJ_MD "OBJ_MD"
+#define STORE_FOLDER "store/"	/* objects of the mount, in the root .ver, see store.c */
+#define STORE_MD "STORE_MD"	/* their reference counts */
 #define MD_DATA_FOLDER "md_data/"
+#define SPOOL_FOLDER "spool/"
+#define VCACHE_FOLDER "vcache/"	/* spilled versions, see vcache.c */
+#define VERSIONS_SUFFIX "@versions"	/* "<file>@versions/<timestamp>", see versions_dir.c */
+
+#define VERSIONS_NONE 0
+#define VERSIONS_DIR 1
+#define VERSIONS_ENTRY 2
+
+#define CONTROL_DIR_PATH "/.rvfs"	/* control directory of the mount, see control.c */
+
+#define WAL_TREE_WRITE 1	/* changes journaled by wal.c */
+#define WAL_TREE_APPEND 2
+#define WAL_HEADS 3
+
+#define CONTROL_NONE 0
+#define CONTROL_DIR 1
+#define CONTROL_CTL 2
+#define CONTROL_STATS 3
+
+/* Operations timed by stats.c, the FUSE ones first */
+#define STAT_GETATTR 0
+#define STAT_READLINK 1
+#define STAT_MKNOD 2
+#define STAT_MKDIR 3
+#define STAT_UNLINK 4
+#define STAT_RMDIR 5
+#define STAT_SYMLINK 6
+#define STAT_RENAME 7
+#define STAT_LINK 8
+#define STAT_CHMOD 9
+#define STAT_CHOWN 10
+#define STAT_TRUNCATE 11
+#define STAT_UTIME 12
+#define STAT_OPEN 13
+#define STAT_READ 14
+#define STAT_WRITE 15
+#define STAT_READ_BUF 16
+#define STAT_WRITE_BUF 17
+#define STAT_STATFS 18
+#define STAT_FLUSH 19
+#define STAT_RELEASE 20
+#define STAT_FSYNC 21
+#define STAT_SETXATTR 22
+#define STAT_GETXATTR 23
+#define STAT_LISTXATTR 24
+#define STAT_REMOVEXATTR 25
+#define STAT_OPENDIR 26
+#define STAT_READDIR 27
+#define STAT_RELEASEDIR 28
+#define STAT_FSYNCDIR 29
+#define STAT_ACCESS 30
+#define STAT_CREATE 31
+#define STAT_FTRUNCATE 32
+#define STAT_FGETATTR 33
+#define STAT_VERSION 34		/* create_version() as a whole */
+#define STAT_HASH 35
+#define STAT_CHUNK 36
+#define STAT_DIFF 37
+#define STAT_PATCH 38
+#define STAT_COMPRESS 39
+#define STAT_DECOMPRESS 40
+#define STAT_TREE 41
+#define STAT_HEADS 42
+#define STAT_OBJMD 43
+#define STAT_COUNT 44
 
 /* Define the types of data that may be stored
  */
@@ -35,28 +105,59 @@
 /* These structures might elope once the new
  * versioning system is in place
  */
-// Information for a block
-
-typedef struct _block_info{
-	
-	int offset;
-	int size;
-}BlockInfo;
-
-// Encapsulates the write info
-typedef struct _write_info{
-	
-	char full_path[100];
-	GSList *b_info;
-}WriteInfo;
-	
 // Versioning info MASTER structure
 typedef struct _ver_info{
 	GSList *ll_wi;	/* Write info list */
 }VerInfo;
 
+// Lock and state kept per full path by file_lock.c
+typedef struct _path_lock{
+	char path[PATH_MAX];
+	pthread_mutex_t lock;
+	int users;	/* threads holding or waiting for lock */
+	DirtyMap dirty;	/* ranges written since its last release */
+	GChecksum *stream;	/* hash of the bytes written from offset 0 in order */
+	off_t stream_next;	/* offset the next in order write starts at */
+	int sniff;	/* SNIFF_* verdict on the first block written */
+}PathLock;
+
+// Text or binary, as told by sniff.c
+#define SNIFF_UNKNOWN 0
+#define SNIFF_TEXT 1
+#define SNIFF_BINARY 2
+
+// What changed in a file between two releases, see file_take_written()
+typedef struct _file_changes{
+	char hash[HASH_SHA1];	/* object hash of the contents, empty if unknown */
+	DirtyMap dirty;		/* ranges written or truncated away */
+	int sniff;		/* SNIFF_* verdict on the first block written, on the file once classified */
+}FileChanges;
+
+// A file cut into chunks by chunk.c, stored as a chunk list
+
+#define CHUNK_MAGIC "RVC1"
+
+typedef struct _chunk{
+	
+	char hash[HASH_SHA1];	/* object of the chunk */
+	long long offset;	/* in the file */
+	int len;
+}Chunk;
+
+typedef struct _chunk_list{
+	
+	Chunk *c;
+	int n;
+	int size;
+	long long total;	/* size of the file */
+}ChunkList;
+
 typedef struct file_data_ {
 	const char * path;	/* full file path */
+	const char * content_path;	/* contents to version, path or a snapshot of it */
+	const char * content_hash;	/* their object hash if known, else NULL */
+	const DirtyMap * dirty;	/* ranges written since the last version, NULL if unknown */
+	const ChunkList * chunks;	/* the contents cut into chunks, NULL if not versioned in chunks */
 	char * name;		/* file name */
 	
 	/* full path of the directory in which
@@ -87,8 +188,43 @@ typedef struct _tree_md{
 	int timestamp;
 	int file_type; /* LO/PO */
 	int parent;    /* Parent offset in the file */
+	unsigned int checksum;	/* crc32 of the fields above, kept last */
 }TreeMd;
 
+// Header of .ver/trees/file.tree, followed by fixed size TreeMd records
+
+#define TREE_MAGIC "RVT1"
+#define TREE_FORMAT_VERSION 1
+
+typedef struct _tree_header{
+	
+	char magic[4];
+	int version;
+	int record_size;	/* sizeof(TreeMd) when the file was written */
+	int count;		/* Number of records, valid or not */
+	int sorted;		/* 1 while the records are in timestamp order */
+	int reserved[3];
+}TreeHeader;
+
+/* Offsets stored in the heads file and in TreeMd.parent are byte
+ * offsets of records, so record i lives at TREE_OFFSET(i)
+ */
+#define TREE_OFFSET(i) ((int)(sizeof(TreeHeader) + (i)*sizeof(TreeMd)))
+#define TREE_FIRST_OFFSET TREE_OFFSET(0)
+
+// A tree file mapped into memory
+
+typedef struct _tree_map{
+	
+	char *base;
+	size_t len;
+	TreeHeader *hdr;
+	TreeMd *rec;		/* hdr->count records */
+	int shared;		/* read only map from the cache of tree_file.c */
+	int refs;		/* opens of a shared map not closed yet */
+	int cached;		/* shared map still in the cache */
+}TreeMap;
+
 // Structure to be written to .ver/OBJ_MD
 
 typedef struct _obj_md{
@@ -97,6 +233,19 @@ typedef struct _obj_md{
 	char obj_hash[HASH_SHA1];
 }ObjMd;
 
+// Header of every object stored in .ver/objects, followed by a zlib stream
+
+#define OBJ_MAGIC "RVO1"
+#define OBJ_FORMAT_VERSION 1
+
+typedef struct _obj_header{
+	
+	char magic[4];
+	int version;
+	long long raw_size;	/* Size of the object contents */
+	long long stored_size;	/* Size of the compressed stream */
+}ObjHeader;
+
 // Structure to be written to .ver/heads/file.heads
 
 typedef struct _heads_data{
@@ -105,32 +254,6 @@ typedef struct _heads_data{
 	char b_name[MAX_BNAME];
 }HeadsData;
 
-/* Data Structure used in the linked list of merging policy*/
-
-typedef struct node_mergedata_ {
-				int current_offset;			// Offset of node to be deleted/mergedata. Can be used as a pointer to it  
-				int child_offset;
-				int current_timestamp;
-				int child_timestamp;	
-				//int child_type;		// Type of child of node to be deleted/mergedata
-				int current_type;		// Type of node to be deleted/mergedata
-				int parent_type;		// Type of parent of node to be deleted/mergedata
-				float mergedata;		// #diff/delta(t)
-				int nearest_lo_offset;
-			} node_mergedata;
-
-/* type is defined as 
- * 1 = PO + untagged
- * 2 = PO + tagged
- * 3 = LO + untagged
- * 4 = LO + tagged
-*/ 
- 
-
-typedef struct node_head_list{
-		int offset;
-		} node_head_list;
-
 /* Deprecate them */
 typedef struct version
 {
@@ -160,10 +283,10 @@ char * addspaces(char *str, int size);
 /* Deprecate them */
 
 /* Function prototypes */
-gint GCompareWI(gconstpointer a, gconstpointer b);
-void add_write_info(VerInfo ver, const char* path,size_t size,off_t offset);
-void remove_write_info(VerInfo ver, const char *path);
-void version_file(VerInfo ver, const char *path);
+void dirty_add(DirtyMap *m, long long start, long long end);
+void dirty_free(DirtyMap *m);
+void version_file(VerInfo ver, const char *path, FileChanges *changes);
+int make_scratch(char *path, const char *dir, const char *name);
 char *get_log_file_name(char *filepath);
 char *get_log_file_name_new(char *filepath);
 char *get_file_name(char *filepath, char filename[PATH_MAX]);
@@ -174,37 +297,163 @@ void itoa(int n, char str[]);
 
 /* VFS Utils */
 void find_SHA(const char * filepath, char c[41]);
+int hash_select(const char *name);
+GChecksum *hash_new(void);
+void hash_string(GChecksum *cs, char c[41]);
 void split_file_path (const char * filepath, char *filename, char *dirpath);
 char * get_hash_from_offset(int offset, char  * file_tree_path);
 int get_present_head_offset(char * filepath);
 int get_current_offset();
 file_data * construct_file_data(const char * filepath);
+void init_file_data(file_data * file);
+void free_file_data(file_data * file);
 
 /* Debug functions */
 void print_file_data(file_data * file);
 
 /* Versioning specific constructs */
 int report_release(const char * filepath);
+int commit_version(const char * filepath, const char * content_path, const FileChanges * changes, int timestamp);
 void create_version(file_data * file,TreeMd * ver,int is_first_version);
 int report_checkout(char * filepath, int req_tp);
 int revert_to_version(char * filepath, int req_tp);
-void heads_in_else(char *filepath , char * current_epoch,int current_offset,char * tmp_filepath);
 
 /* Functions relevant to Tree file handling */
 
-void update_tree_data(file_data *file,TreeMd *ver,int is_creating_branch,int is_first_version);
+void update_tree_data(file_data *file,TreeMd *ver,int keep_parent_lo,int is_first_version);
 int isJunction(file_data *file,int offset);
+int is_keyframe_due(file_data *file,int parent_off,int interval,long bytes);
+char *build_version_mem(TreeMap *t,const file_data *file,int from_off,int to_off,size_t *size);
+int build_version(TreeMap *t,const file_data *file,int from_off,int to_off,const char *target_path);
+TreeMd *tree_patch_child(TreeMap *t,int off);
+int tree_chain_length(const char *tree_file_path);
 TreeMd * construct_version_data(file_data * file,int is_first_version);
 
+/* Binary tree file access (tree_file.c) */
+
+TreeMap *tree_open(const char *tree_file_path, int writable);
+void tree_close(TreeMap *t);
+void tree_forget(const char *tree_file_path);
+int tree_count(TreeMap *t);
+TreeMd *tree_at(TreeMap *t, int offset);
+void tree_seal(TreeMd *rec);
+int tree_find_timestamp(TreeMap *t, int timestamp);
+int tree_read(const char *tree_file_path, int offset, TreeMd *ver);
+int tree_write(const char *tree_file_path, int offset, TreeMd *ver);
+int tree_redo(const char *tree_file_path, int type, int offset, const TreeMd *before, const TreeMd *after);
+int tree_append(const char *tree_file_path, TreeMd *ver);
+int tree_next_offset(const char *tree_file_path);
+int tree_is_text(const char *tree_file_path);
+int tree_export_text(const char *tree_file_path, const char *text_path);
+
+/* Per-path locks and write flags (file_lock.c) */
+
+PathLock *path_lock(const char *path);
+void path_unlock(PathLock *l);
+PathLock *dir_lock(const char *fpath);
+void dir_lock_pair(const char *fpath_a, const char *fpath_b, PathLock **la, PathLock **lb);
+void file_wrote(PathLock *l, const char *buf, size_t size, off_t offset);
+int file_needs_data(PathLock *l, off_t offset);
+void file_truncated(const char *fpath, off_t size);
+void file_renamed(const char *from, const char *to);
+int file_take_written(PathLock *l, FileChanges *changes);
+
+/* Journal of the version metadata (wal.c) */
+
+void wal_start(void);
+void wal_stop(void);
+void wal_begin(void);
+int wal_active(void);
+int wal_defer(int type, const char *path, int offset, const void *before, int before_len, const void *after, int after_len);
+int wal_defer_drop(const file_data *file, const char *hash, const char *child);
+int wal_commit(void);
+
+/* Background space reclamation, gc.c */
+void gc_start(void);
+void gc_stop(void);
+void gc_touch(void);
+int gc_stats(char *buf, size_t size);
+
+/* Background commits of released files (commit_queue.c) */
+
+void commit_start(void);
+void commit_release(const char *fpath, FileChanges *changes);
+void commit_flush(void);
+void commit_stop(void);
+
+/* Text or binary classification (sniff.c) */
+
+int sniff_data(const char *buf, size_t len);
+int sniff_write(int sniff, const char *buf, size_t size, off_t offset, int in_order);
+int classify_file(const char *fpath, int sniff, const DirtyMap *dirty, char *why, size_t why_size);
+int is_text_file(const char *fpath);
+
+/* Cache of reconstructed versions (vcache.c) */
+
+char *vcache_lookup(const char **hashes, int n, int *index, size_t *size);
+void vcache_put(const char *hash, const char *data, size_t size);
+int vcache_size(const char *hash, size_t *size);
+int vcache_stats(char *buf, size_t size);
+
 /* Functions relevant to Heads file handling */
 
-void replaceTop(char *filepath, char *epoch, int off);
 int write_to_head(char * heads_file_path, int tp, int off);
 void update_heads_file(file_data  * file,TreeMd * ver,int is_first_version,int is_creating_branch);
 
+/* Functions relevant to the per-file metadata kept by meta.c */
+void meta_paths(const char *filepath, file_data *file);
+int heads_present(const char *heads_path, char *name);
+int heads_has_branch(const char *heads_path, const char *name);
+void heads_commit(const char *heads_path, const char *name, int offset, int is_first_version, int is_creating_branch);
+void heads_changed(const char *heads_path);
+int heads_redo(const char *heads_path, const char *before, int before_len, const char *after, int after_len);
+int heads_replace(const char *heads_path, const char *text, int len);
+void meta_forget(const char *filepath);
+
+/* Functions relevant to the read only view of versions, versions_dir.c */
+int versions_path(const char *fpath, char *file, int *timestamp);
+int versions_list(const char *file, int **timestamps);
+char *versions_read(const char *file, int timestamp, size_t *size);
+int versions_stat(const char *fpath, struct stat *st);
+
+/* Functions relevant to directory snapshots, snapshot.c */
+int snapshot_create(const char *dir);
+int snapshot_checkout(const char *dir, int id);
+
+/* Functions relevant to the control directory, control.c */
+int control_path(const char *path);
+int control_stat(const char *path, struct stat *st);
+void *control_open(void);
+void control_release(void *handle);
+int control_write(void *handle, const char *buf, size_t size);
+int control_read(void *handle, char *buf, size_t size, off_t offset);
+void *control_open_stats(void);
+
+/* Functions relevant to the latency histograms, stats.c */
+long long stats_now(void);
+void stats_add(int op, long long start, long long bytes, int failed);
+void stats_reset(void);
+char *stats_text(size_t *len);
+int stats_save(const char *path);
+
 /* Functions relevant to Obj_Md file handling */
 
 void update_objmd_file(char * s1,char * obj_md_path, int mode);
+int objmd_ref(const char *obj_md_path, const char *hash, int delta);
+void objmd_ref_many(const char *obj_md_path, const char **hashes, int n, int delta, int *counts);
+int objmd_count(const char *obj_md_path, const char *hash);
+void objmd_foreach(const char *obj_md_path, GHFunc func, gpointer data);
+void objmd_forget(const char *obj_md_path);
+
+/* Functions relevant to the object store of the mount, store.c */
+void store_path(char *path, const file_data *file, const char *hash, const char *child);
+int store_put(const file_data *file, const char *src_path, const char *hash, const char *child);
+int store_put_chunks(const file_data *file, const ChunkList *l, const char *hash);
+void store_drop(const file_data *file, const char *hash, const char *child);
+int store_migrate(const file_data *file);
+long store_share(const file_data *file, const char *hash, const char *child);
+int store_stats(char *buf, size_t size);
+long store_sweep(const char *name, int grace);
 
 /*Functions related to file cleanup*/
 
@@ -217,33 +466,31 @@ int calc_md_size(file_data * file);			/* Calculates the cumulative size of all m
 void compare_diff_vs_time(file_data *file);	
 
 
-/* Functions used in handling the linklist */
+/* Removing versions down to a ratio of file to version sizes, cleanup.c */
 
-int type(int,int);
-void print_iterator(gpointer item);
-void print_head_iterator(gpointer item);
-GSList *move_to_lo_iterator(int,FILE *, GSList *,GSList *);
-gint compare_node_mergedata(gconstpointer item1, gconstpointer item2);
-GSList* generate_ll(file_data*,GSList*);
-GSList* generate_ll_old(file_data*,GSList*);
-void cleanFile(char *filepath, double ratio);
-void cleanupfile(file_data *file,float reqdratio);
+int cleanupfile(file_data *file, float required_ratio, int limit, int (*go_on)(void), int dry_run, long *saved);
+int cleanFile(char *filepath, double ratio, int dry_run, long *saved);
 
 /* Functions for formatted output of versions*/
 void add_normal_time(int tp, char * pr);
 void print_full_branch(char * tree_file_path, int off);
 void print_all_versions(char *heads_file_path, char *tree_file_path);
 
-/* Functions used in merging/deleting versions */
-
-int getFileHashPath(int offset, char *full_hash_path, file_data *f1,int return_mode);
-
-GSList *merge_diff(node_mergedata *node,file_data *f,GSList *node_list);
-
-GSList *delete_diff(node_mergedata *node,file_data *file,GSList *node_list);
-
-int create_file_fromlo_cleanup(char * file_tree_path, int d_off, int lo_off, char * obj_dir_path, int mode);       // returns -1 for no success and offset of child for success
-
-/* Functions for compression / de-compression */
-void compress(char *obj_file);
-void decompress(char *obj_file);
+/* Functions relevant to content defined chunking, chunk.c */
+int chunk_file(const char *path, const ChunkList *parent, const DirtyMap *dirty, ChunkList *l);
+void chunk_list_free(ChunkList *l);
+void chunk_list_hash(const ChunkList *l, char hash[HASH_SHA1]);
+int chunk_list_write(const char *path, const ChunkList *l);
+int chunk_list_read(const char *path, ChunkList *l);
+int is_chunk_list(const char *obj_file);
+void chunk_path(char *path, const char *obj_file, const Chunk *c);
+char *chunk_load_mem(const char *obj_file, size_t *size);
+int chunk_load(const char *obj_file, const char *dest_path);
+
+/* Functions for compression / de-compression of objects */
+int store_object(const char *src_path, const char *obj_file);
+int store_object_mem(const char *data, size_t len, const char *obj_file);
+int load_object(const char *obj_file, const char *dest_path);
+char *load_object_mem(const char *obj_file, size_t *size);
+int restore_object(const char *obj_file, const char *target, int file_type);
+char *restore_object_mem(const char *obj_file, char *base, size_t *size, int file_type);
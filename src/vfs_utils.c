@@ -8,73 +8,86 @@
 #include "vfs.h"
 #include "log.h"
 
-//EDIT 
-gint GCompareWI(gconstpointer a, gconstpointer b)
+/* Adds [start, end) to the written ranges of a file, merged with the
+ * ranges it overlaps or touches.  The ranges are kept sorted, so finding
+ * the place of a write is a binary search, and the usual write after the
+ * previous one just extends the last range.
+ */
+void dirty_add(DirtyMap *m, long long start, long long end)
 {
-	WriteInfo *w1 = (WriteInfo *)a;
-	WriteInfo *w2 = (WriteInfo *)b;
-	
-	log_msg("in GCompare WI %s %s \n", w1->full_path, w2->full_path);
-	if(w1->full_path == NULL || w2->full_path == NULL)
-		return 0;
-	return strcmp((const char*)w1->full_path, (const char*)w2->full_path);	
-}
+    int lo = 0, hi = m->n, mid, j;
 
-//EDIT 
-void add_write_info(VerInfo ver_info, const char* path,size_t size,off_t offset)
-{
-    WriteInfo *w_tmp = (WriteInfo *)malloc(sizeof(WriteInfo));
-    strcpy(w_tmp->full_path, path);
-    w_tmp->b_info = g_slist_alloc();
-    BlockInfo *b_tmp = (BlockInfo*)malloc(sizeof(BlockInfo));
-    b_tmp->offset = offset;
-    b_tmp->size = size;    	
-	
-    WriteInfo *w_found = (WriteInfo*)(g_slist_find_custom(ver_info.ll_wi, (gconstpointer)w_tmp, GCompareWI)->data);
-       
-    if(w_found == NULL){
-    	log_msg("Starting to write\n");
-    	w_tmp->b_info = g_slist_insert(w_tmp->b_info,(gpointer)b_tmp,0);
-    	ver_info.ll_wi = g_slist_insert(ver_info.ll_wi,(gpointer)w_tmp,0);
-    	//WriteInfo *w_tmp2 = (WriteInfo*)(g_slist_find_custom(ver_info.ll_wi, (gconstpointer)w_tmp, GCompareWI)->data);
-    }  
-    else
+    if(end <= start)
+	return;
+    // first range ending at or after start
+    while(lo < hi)
+    {
+	mid = (lo + hi)/2;
+	if(m->r[mid].end < start)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    // ranges lo..j-1 overlap or touch [start, end)
+    for(j = lo; j < m->n && m->r[j].start <= end; j++)
+    {
+	if(m->r[j].start < start)
+	    start = m->r[j].start;
+	if(m->r[j].end > end)
+	    end = m->r[j].end;
+    }
+    if(j == lo)
+    {
+	if(m->n == m->size)
+	{
+	    m->size = m->size ? 2*m->size : 8;
+	    m->r = (DirtyRange *)realloc(m->r, m->size*sizeof(DirtyRange));
+	}
+	memmove(m->r + lo + 1, m->r + lo, (m->n - lo)*sizeof(DirtyRange));
+	m->n++;
+    }
+    else if(j > lo + 1)
     {
-        log_msg("Writing blocks\n");
-	w_found->b_info = g_slist_append(w_found->b_info,(gpointer)b_tmp);
+	memmove(m->r + lo + 1, m->r + j, (m->n - j)*sizeof(DirtyRange));
+	m->n -= j - lo - 1;
     }
+    m->r[lo].start = start;
+    m->r[lo].end = end;
 }
 
-//EDIT 
-/**
-  to remove the write info of a file
-  */
-void remove_write_info(VerInfo ver_info, const char *path)
+void dirty_free(DirtyMap *m)
 {
-    WriteInfo *w_tmp = (WriteInfo *)malloc(sizeof(WriteInfo));
-    strcpy(w_tmp->full_path, path);
-    w_tmp->b_info = (GSList*)g_slist_alloc();
-    WriteInfo *w_found = (g_slist_find_custom(ver_info.ll_wi, (gconstpointer)w_tmp, GCompareWI)->data);
-    free(w_tmp);
-    
-    if(w_found != NULL)
-    {
-    	log_msg("removing write info\n");
-    	g_slist_free(w_found->b_info);
-    	ver_info.ll_wi = g_slist_remove(ver_info.ll_wi,(gconstpointer)w_found);
-    }
+    free(m->r);
+    memset(m, 0, sizeof(DirtyMap));
 }
 
 
 //EDIT
 //Versioning
-void version_file(VerInfo ver_info, const char* path)
+void version_file(VerInfo ver_info, const char* path, FileChanges *changes)
 {
     //TODO
     //Call the versioning function here
-    log_msg("\n Calling Report Release\n");
-    report_release(path);
-    //remove_write_info(ver_info, path);
+    log_msg("\n Queueing commit\n");
+    commit_release(path, changes);
+}
+
+/* Creates a scratch file <dir><name>.XXXXXX of its own for one request
+ * and puts its path in path
+ * Returns 1 for success and 0 for failure
+ */
+int make_scratch(char *path, const char *dir, const char *name)
+{
+    int fd;
+    snprintf(path, PATH_MAX, "%s%s.XXXXXX", dir, name);
+    fd = mkstemp(path);
+    if (fd < 0)
+    {
+    	log_error("make_scratch: cannot create %s\n", path);
+    	return 0;
+    }
+    close(fd);
+    return 1;
 }
 
 char *get_log_file_name(char *filepath)
@@ -0,0 +1,392 @@
+/* wal.c
+ * Journal of the version metadata, .ver/wal of the root directory
+ *
+ * A new version changes a tree file (the parent turned into a patch,
+ * the new record appended) and a heads file, and drops the full object
+ * of the parent.  Between wal_begin() and wal_commit() those changes
+ * are held back: tree_write(), tree_append() and the heads writes of
+ * meta.c hand them to the transaction of the thread (wal_defer()), and
+ * store_drop() its drops (wal_defer_drop()).  wal_commit() then
+ *
+ * 1. appends the transaction to the journal as one record, a WalRecord
+ *    followed by its WalOps, each with the path it changes and the
+ *    bytes there before and after,
+ * 2. waits for a syncfs() started after the append, which also flushes
+ *    the objects of the version,
+ * 3. makes the changes in place, then the drops.
+ *
+ * Committers that append while a syncfs() runs share the next one, so
+ * concurrent commits cost one flush per round rather than one each.
+ * Transactions nest: a wal_begin() inside another only counts, and its
+ * wal_commit() leaves the changes to the outermost one, so a snapshot
+ * versioning many files journals them as one record.
+ *
+ * On mount the records of the journal are redone in order.  A change
+ * is only made where the file still holds the bytes from before it (or
+ * a torn tree record), so a record made in place already, or overtaken
+ * since, is left alone.  Drops are not journaled: a crash after the
+ * metadata only leaves the dropped objects referenced, which costs disk
+ * space but no history.  The journal is emptied once it is past
+ * WAL_CHECKPOINT_BYTES and every record in it is in place and synced.
+ */
+
+#define _GNU_SOURCE
+#include "params.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <glib.h>
+#include <zlib.h>
+
+#include "vfs.h"
+#include "log.h"
+
+#define WAL_FILE "wal"
+#define WAL_MAGIC "RVW1"
+#define WAL_CHECKPOINT_BYTES (4*1024*1024)
+
+typedef struct _wal_record{
+
+	char magic[4];
+	int len;		/* of the ops that follow */
+	unsigned int crc;	/* crc32 of the ops */
+	int ops;
+	long long seq;
+}WalRecord;
+
+typedef struct _wal_op{
+
+	int type;		/* WAL_TREE_WRITE, WAL_TREE_APPEND or WAL_HEADS */
+	int offset;		/* of the tree record */
+	int path_len;
+	int before_len;
+	int after_len;		/* followed by the path, before and after */
+}WalOp;
+
+typedef struct _wal_drop{
+
+	char hash[HASH_SHA1];
+	char child[HASH_SHA1];	/* empty for a full object */
+	char *objects_dir_path;
+	char *OBJ_MD_file_path;
+	char *ver_dir_path;
+}WalDrop;
+
+typedef struct _wal_txn{
+
+	GString *ops;
+	int count;
+	int depth;		/* wal_begin() calls inside the outermost one */
+	GSList *drops;
+}WalTxn;
+
+static __thread WalTxn *current;
+
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_synced = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wal_applied = PTHREAD_COND_INITIALIZER;
+static int wal_fd = -1;
+static long long appended, synced;	/* last record appended, last one synced */
+static long wal_size;
+static int syncing, checkpointing, in_flight;
+
+/* Makes the change of op, see the top of the file
+ * Returns 1 if the file holds the change, 0 if it was left alone
+ */
+static int redo(const WalOp *op, const char *path, const char *before, const char *after)
+{
+	if(op->type == WAL_HEADS)
+		return heads_redo(path, before, op->before_len, after, op->after_len);
+	if(op->after_len != sizeof(TreeMd) || (op->before_len != 0 && op->before_len != sizeof(TreeMd)))
+		return 0;
+	return tree_redo(path, op->type, op->offset, op->before_len ? (const TreeMd *)before : NULL, (const TreeMd *)after);
+}
+
+/* Redoes the n ops in the len bytes at p
+ * Returns the number of ops left alone
+ */
+static int redo_all(const char *p, int len, int n)
+{
+	const char *end = p + len;
+	char path[PATH_MAX];
+	WalOp op;
+	int skipped = 0;
+
+	while(n-- > 0 && p + sizeof(op) <= end)
+	{
+		memcpy(&op, p, sizeof(op));
+		p += sizeof(op);
+		if(op.path_len >= PATH_MAX || p + op.path_len + op.before_len + op.after_len > end)
+			return skipped + n + 1;
+		snprintf(path, PATH_MAX, "%.*s", op.path_len, p);
+		p += op.path_len;
+		if(!redo(&op, path, p, p + op.before_len))
+		{
+			log_warn("wal: left %s alone, it changed since\n", path);
+			skipped++;
+		}
+		p += op.before_len + op.after_len;
+	}
+	return skipped;
+}
+
+/* Redoes the records of the journal, then empties it */
+static void replay(void)
+{
+	WalRecord rec;
+	char *ops;
+	int records = 0, skipped = 0;
+
+	lseek(wal_fd, 0, SEEK_SET);
+	while(read(wal_fd, &rec, sizeof(rec)) == sizeof(rec) && memcmp(rec.magic, WAL_MAGIC, sizeof(rec.magic)) == 0
+		&& rec.len >= 0 && rec.len < (64 << 20))
+	{
+		ops = (char *)malloc(rec.len + 1);
+		if(read(wal_fd, ops, rec.len) != rec.len || crc32(0L, (const Bytef *)ops, rec.len) != rec.crc)
+		{
+			// torn by the crash, and never acknowledged
+			free(ops);
+			break;
+		}
+		skipped += redo_all(ops, rec.len, rec.ops);
+		free(ops);
+		records++;
+	}
+	if(records > 0)
+		log_info("wal: redid %d records, %d changes left alone\n", records, skipped);
+	syncfs(wal_fd);
+	if(ftruncate(wal_fd, 0) != 0)
+		log_error("wal: cannot empty the journal\n");
+	lseek(wal_fd, 0, SEEK_SET);
+	wal_size = 0;
+}
+
+/* Opens the journal and redoes what a crash left in it, on mount */
+void wal_start(void)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, PATH_MAX, "%s/%s%s", BB_DATA->rootdir, VER_DIR, WAL_FILE);
+	wal_fd = open(path, O_RDWR|O_CREAT|O_APPEND, 0644);
+	if(wal_fd < 0)
+	{
+		log_error("wal_start: cannot open %s, versions are not journaled\n", path);
+		return;
+	}
+	replay();
+}
+
+/* Empties the journal once every record is in place, on unmount */
+void wal_stop(void)
+{
+	if(wal_fd < 0)
+		return;
+	pthread_mutex_lock(&wal_lock);
+	while(in_flight > 0)
+		pthread_cond_wait(&wal_applied, &wal_lock);
+	syncfs(wal_fd);
+	if(ftruncate(wal_fd, 0) != 0)
+		log_error("wal_stop: cannot empty the journal\n");
+	close(wal_fd);
+	wal_fd = -1;
+	pthread_mutex_unlock(&wal_lock);
+}
+
+/* Starts holding back the metadata changes of this thread, or nests in
+ * the transaction it has open
+ */
+void wal_begin(void)
+{
+	if(wal_fd < 0)
+		return;
+	if(current != NULL)
+	{
+		current->depth++;
+		return;
+	}
+	current = (WalTxn *)calloc(1, sizeof(WalTxn));
+	current->ops = g_string_new(NULL);
+}
+
+/* Tells whether this thread has a transaction open */
+int wal_active(void)
+{
+	return current != NULL;
+}
+
+/* Adds a change of path to the transaction of this thread
+ * Returns 1 if it was taken, 0 if there is none and the caller makes
+ * the change itself
+ */
+int wal_defer(int type, const char *path, int offset, const void *before, int before_len, const void *after, int after_len)
+{
+	WalOp op;
+
+	if(current == NULL)
+		return 0;
+	memset(&op, 0, sizeof(op));
+	op.type = type;
+	op.offset = offset;
+	op.path_len = strlen(path);
+	op.before_len = before_len;
+	op.after_len = after_len;
+	g_string_append_len(current->ops, (const gchar *)&op, sizeof(op));
+	g_string_append_len(current->ops, path, op.path_len);
+	g_string_append_len(current->ops, (const gchar *)before, before_len);
+	g_string_append_len(current->ops, (const gchar *)after, after_len);
+	current->count++;
+	return 1;
+}
+
+/* Holds a store_drop() back until the transaction of this thread is in
+ * place
+ * Returns 1 if it was taken, 0 if there is no transaction
+ */
+int wal_defer_drop(const file_data *file, const char *hash, const char *child)
+{
+	WalDrop *d;
+
+	if(current == NULL)
+		return 0;
+	d = (WalDrop *)calloc(1, sizeof(WalDrop));
+	strcpy(d->hash, hash);
+	if(child != NULL)
+		strcpy(d->child, child);
+	d->objects_dir_path = strdup(file->objects_dir_path);
+	d->OBJ_MD_file_path = strdup(file->OBJ_MD_file_path);
+	d->ver_dir_path = strdup(file->ver_dir_path);
+	current->drops = g_slist_append(current->drops, d);
+	return 1;
+}
+
+/* Empties the journal, with wal_lock held and no new record coming */
+static void checkpoint(void)
+{
+	checkpointing = 1;
+	while(in_flight > 0)
+		pthread_cond_wait(&wal_applied, &wal_lock);
+	syncfs(wal_fd);
+	if(ftruncate(wal_fd, 0) == 0)
+	{
+		log_msg("wal: checkpoint after %ld bytes\n", wal_size);
+		wal_size = 0;
+	}
+	checkpointing = 0;
+	pthread_cond_broadcast(&wal_applied);
+}
+
+/* Appends rec and its ops, and waits until they are on disk
+ * Returns 1 for success and 0 for failure
+ */
+static int append(WalRecord *rec, const char *ops)
+{
+	char *buf = (char *)malloc(sizeof(*rec) + rec->len);
+	long long target;
+	ssize_t n;
+
+	pthread_mutex_lock(&wal_lock);
+	while(checkpointing)
+		pthread_cond_wait(&wal_applied, &wal_lock);
+	rec->seq = ++appended;
+	memcpy(buf, rec, sizeof(*rec));
+	memcpy(buf + sizeof(*rec), ops, rec->len);
+	n = write(wal_fd, buf, sizeof(*rec) + rec->len);
+	free(buf);
+	if(n != (ssize_t)(sizeof(*rec) + rec->len))
+	{
+		pthread_mutex_unlock(&wal_lock);
+		log_error("wal: cannot append record %lld\n", rec->seq);
+		return 0;
+	}
+	wal_size += n;
+	in_flight++;
+
+	// group commit: one syncfs() for every record appended before it starts
+	while(synced < rec->seq)
+	{
+		if(syncing)
+		{
+			pthread_cond_wait(&wal_synced, &wal_lock);
+			continue;
+		}
+		syncing = 1;
+		target = appended;
+		pthread_mutex_unlock(&wal_lock);
+		syncfs(wal_fd);
+		pthread_mutex_lock(&wal_lock);
+		synced = target;
+		syncing = 0;
+		pthread_cond_broadcast(&wal_synced);
+	}
+	pthread_mutex_unlock(&wal_lock);
+	return 1;
+}
+
+static void drop(gpointer data, gpointer unused)
+{
+	WalDrop *d = (WalDrop *)data;
+	file_data file;
+
+	memset(&file, 0, sizeof(file));
+	file.objects_dir_path = d->objects_dir_path;
+	file.OBJ_MD_file_path = d->OBJ_MD_file_path;
+	file.ver_dir_path = d->ver_dir_path;
+	store_drop(&file, d->hash, d->child[0] ? d->child : NULL);
+	free(d->objects_dir_path);
+	free(d->OBJ_MD_file_path);
+	free(d->ver_dir_path);
+	free(d);
+}
+
+/* Journals the changes held back since the outermost wal_begin(), then
+ * makes them and the drops.  An inner wal_commit() only closes its
+ * wal_begin().
+ * Returns 1 for success and 0 for failure
+ */
+int wal_commit(void)
+{
+	WalTxn *txn = current;
+	WalRecord rec;
+	int ret = 1, skipped;
+
+	if(txn == NULL)
+		return 1;
+	if(txn->depth > 0)
+	{
+		txn->depth--;
+		return 1;
+	}
+	current = NULL;
+	if(txn->count > 0)
+	{
+		memset(&rec, 0, sizeof(rec));
+		memcpy(rec.magic, WAL_MAGIC, sizeof(rec.magic));
+		rec.len = txn->ops->len;
+		rec.ops = txn->count;
+		rec.crc = crc32(0L, (const Bytef *)txn->ops->str, rec.len);
+		// not journaled, the changes are made all the same
+		if(!append(&rec, txn->ops->str))
+			ret = 0;
+		skipped = redo_all(txn->ops->str, rec.len, rec.ops);
+		if(skipped > 0)
+			log_warn("wal_commit: %d changes could not be made\n", skipped);
+		if(ret)
+		{
+			pthread_mutex_lock(&wal_lock);
+			in_flight--;
+			pthread_cond_broadcast(&wal_applied);
+			if(wal_size > WAL_CHECKPOINT_BYTES && !checkpointing)
+				checkpoint();
+			pthread_mutex_unlock(&wal_lock);
+		}
+	}
+	g_slist_foreach(txn->drops, drop, NULL);
+	g_slist_free(txn->drops);
+	g_string_free(txn->ops, TRUE);
+	free(txn);
+	return ret;
+}
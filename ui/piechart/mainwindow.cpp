@@ -1,11 +1,14 @@
 #include <QtGui>
 #include <cstdlib>
+#include <cstring>
+#include <sys/xattr.h>
 
 #include "pieview.h"
 #include "mainwindow.h"
 //FileChooser *f3;
 MainWindow::MainWindow(QString mountdir)
 {
+	QString mountpath = mountdir;
 	QString rootdir = mountdir.replace("mountdir", "rootdir");
 	//qDebug() << "rootdir: " << rootdir;
 	//qDebug() << "mountdir: " << mountdir_path.replace("mountdir", "rootdir");
@@ -42,7 +45,12 @@ MainWindow::MainWindow(QString mountdir)
 
 	openFile(":/Charts/qtdata.cht");
 
-	setWindowTitle(tr("Chart"));
+	// space the object store saved by keeping identical versions once
+	dedup_saved_space = dedupSaved(mountpath);
+	if (dedup_saved_space > 0)
+		setWindowTitle(tr("Chart - %1 kB saved by deduplication").arg(dedup_saved_space));
+	else
+		setWindowTitle(tr("Chart"));
 }
 
 void MainWindow::setupModel()
@@ -191,6 +199,18 @@ quint64 MainWindow::vfsDataSpace(QString rootdir) {
 	return usage;
 }
 
+quint64 MainWindow::dedupSaved(QString mountdir) {
+	char out[160];
+	ssize_t len = getxattr(mountdir.toLatin1().data(), "user.rvfs.store", out, sizeof(out)-1);
+	if (len < 0)
+		return 0;
+	out[len] = '\0';
+	qDebug() << "store: " << out;
+	
+	const char *saved = strstr(out, "saved ");
+	return saved != NULL ? strtoull(saved + 6, NULL, 10)/1024 : 0;
+}
+
 QString MainWindow::diskSpace(QString rootdir) {
 	char cmd[500];
 	sprintf(cmd, "cd %s; df .| sed '/Filesystem/d'", rootdir.toLatin1().data());
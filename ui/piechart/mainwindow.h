@@ -25,9 +25,10 @@ private slots:
 private:
     void setupModel();
     void setupViews();
-    quint64 vfs_space, vfs_data_space, vfs_metadata_space, disk_free_space, disk_used_space, disk_ext_used_space;
+    quint64 vfs_space, vfs_data_space, vfs_metadata_space, disk_free_space, disk_used_space, disk_ext_used_space, dedup_saved_space;
     quint64 vfsSpace(QString rootdir);
     quint64 vfsDataSpace(QString rootdir);
+    quint64 dedupSaved(QString mountdir);
     QString diskSpace(QString rootdir); 
     //QPushButton *but;
     //FileChooser *f2;
@@ -553,7 +553,7 @@ void GraphWindow::updateRange(int, int) {
 }
 
 void GraphWindow::readFromFile(const QString &path) {
-	// storage format: <valid> <timestamp> <lo=0/po> <hash> <tag> <diff_lc> <parent_offset>
+	// storage format: <valid> <timestamp> <lo=0/po> <hash> <tag> <diff_lc> <parent_offset> <offset>
 	points = new QList<Point *>;
 	maxX = 0;
 	int branchCount = 1;
@@ -577,6 +577,7 @@ void GraphWindow::readFromFile(const QString &path) {
 			
 			int counter = 0;
 			int invalidCount = 0;
+			QHash<int, int> indexOfOffset;
 			
 			do {
 				line = treeStream.readLine();
@@ -591,7 +592,8 @@ void GraphWindow::readFromFile(const QString &path) {
 					qreal radius = POINT_DEFAULT_RADIUS;
 					QString parentString = pieces.value(6);
 					int parentOffset = parentString.toInt();
-					int parentIndex = parentOffset/326;
+					int parentIndex = indexOfOffset.value(parentOffset);
+					int offset = pieces.value(7).toInt();
 					QString tagText = (pieces.value(4)=="_")?(""):(pieces.value(4));
 					QString tooltipText = tagText;
 					int lopo = pieces.value(2).toInt();
@@ -602,6 +604,8 @@ void GraphWindow::readFromFile(const QString &path) {
 						}
 					}
 					
+					indexOfOffset.insert(offset, counter);
+					
 					if(!valid) {
 						invalidCount++;
 						counter++;
@@ -624,7 +628,7 @@ void GraphWindow::readFromFile(const QString &path) {
 						if(LEFT_MARGIN+x > maxX)
 							maxX = LEFT_MARGIN+x;
 						
-						p->setData(POINT_OFFSET_INDEX, 326*counter);
+						p->setData(POINT_OFFSET_INDEX, offset);
 						p->setInvalidCount(invalidCount);
 						p->setValidity(valid);
 						
@@ -665,7 +669,7 @@ void GraphWindow::readFromFile(const QString &path) {
 						
 						points->append(child);
 						
-						child->setData(POINT_OFFSET_INDEX, 326*counter);
+						child->setData(POINT_OFFSET_INDEX, offset);
 						child->setInvalidCount(invalidCount);
 						child->setValidity(valid);
 						